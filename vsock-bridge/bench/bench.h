@@ -0,0 +1,70 @@
+#pragma once
+
+#include <dispatcher.h>
+#include <endpoint.h>
+#include <epoll_poller.h>
+#include <iothread.h>
+#include <listener.h>
+#include <logger.h>
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace vsockbench
+{
+    using Clock = std::chrono::steady_clock;
+
+    struct Benchmark
+    {
+        const char* _name;
+        const char* _description;
+        std::function<void()> _run;
+    };
+
+    std::vector<Benchmark>& registry();
+
+    struct BenchmarkRegistration
+    {
+        BenchmarkRegistration(const char* name, const char* description, std::function<void()> run)
+        {
+            registry().push_back({name, description, std::move(run)});
+        }
+    };
+
+#define VSOCK_BENCHMARK(id, name, description) \
+    static void id(); \
+    static vsockbench::BenchmarkRegistration id##_registration{name, description, id}; \
+    static void id()
+
+    inline double secondsSince(Clock::time_point start)
+    {
+        return std::chrono::duration<double>(Clock::now() - start).count();
+    }
+
+    inline void report(const std::string& benchmark, const std::string& metric, double value, const char* unit)
+    {
+        std::cout << benchmark << "  " << metric << ": " << value << " " << unit << std::endl;
+    }
+
+    // Blocking helpers for the client/backend side of a benchmark.
+    bool writeAll(int fd, const void* data, size_t len);
+    bool readAll(int fd, void* data, size_t len);
+    int connectTo(const vsockio::Endpoint& ep);
+
+    // Backend that echoes everything back on every accepted connection.
+    // The listening socket and its threads live until the process exits.
+    void startEchoServer(const vsockio::Endpoint& ep);
+
+    // In-process bridge with its own worker pool, relaying listenEp -> connectEp.
+    // Like the echo server it runs until the process exits.
+    void startBridge(std::unique_ptr<vsockio::Endpoint> listenEp, std::unique_ptr<vsockio::Endpoint> connectEp, size_t numWorkers = 1, const vsockio::BusyPollOptions& busyPoll = {}, const vsockio::ServiceOptions& options = {});
+}
@@ -0,0 +1,79 @@
+#include "bench.h"
+
+#include <atomic>
+
+using namespace vsockio;
+using namespace vsockbench;
+
+namespace
+{
+    constexpr size_t BULK_BYTES = 256 * 1024 * 1024;
+    constexpr size_t BULK_CHUNK = 64 * 1024;
+
+    std::atomic<uint64_t> ioCalls{0};
+
+    // Counts every read and write (plain or vectored) the bridge makes, including the ones that find nothing to do.
+    void countSocketCalls()
+    {
+        auto read = SocketImpl::singleton->read;
+        auto write = SocketImpl::singleton->write;
+        SocketImpl::singleton->read = [read](int fd, void* buf, int len) { ioCalls.fetch_add(1, std::memory_order_relaxed); return read(fd, buf, len); };
+        SocketImpl::singleton->write = [write](int fd, void* buf, int len) { ioCalls.fetch_add(1, std::memory_order_relaxed); return write(fd, buf, len); };
+        auto readv = SocketImpl::singleton->readv;
+        auto writev = SocketImpl::singleton->writev;
+        SocketImpl::singleton->readv = [readv](int fd, const iovec* iov, int count) { ioCalls.fetch_add(1, std::memory_order_relaxed); return readv(fd, iov, count); };
+        SocketImpl::singleton->writev = [writev](int fd, const iovec* iov, int count) { ioCalls.fetch_add(1, std::memory_order_relaxed); return writev(fd, iov, count); };
+    }
+
+    void measure(const std::string& name, const Endpoint& clientEp)
+    {
+        const int fd = connectTo(clientEp);
+        if (fd < 0)
+        {
+            std::cerr << name << ": cannot connect to " << clientEp.describe() << std::endl;
+            return;
+        }
+
+        const uint64_t callsBefore = ioCalls.load();
+        const auto start = Clock::now();
+        std::thread writer([fd] {
+            std::vector<uint8_t> chunk(BULK_CHUNK, 'y');
+            for (size_t sent = 0; sent < BULK_BYTES; sent += chunk.size())
+            {
+                if (!writeAll(fd, chunk.data(), chunk.size())) break;
+            }
+        });
+
+        std::vector<uint8_t> chunk(BULK_CHUNK);
+        size_t received = 0;
+        while (received < BULK_BYTES)
+        {
+            const ssize_t n = ::read(fd, chunk.data(), chunk.size());
+            if (n <= 0) break;
+            received += n;
+        }
+        writer.join();
+        const double seconds = secondsSince(start);
+        const uint64_t calls = ioCalls.load() - callsBefore;
+        close(fd);
+
+        // each byte is relayed twice, client -> backend and back
+        const double relayedMiB = 2.0 * received / (1024 * 1024);
+        report(name, "echo throughput", received / seconds / (1024 * 1024), "MiB/s");
+        report(name, "read/write calls per MiB relayed", calls / relayedMiB, "");
+    }
+}
+
+VSOCK_BENCHMARK(benchBufferSizing, "buffer-sizing", "bulk transfer with fixed 4k buffers vs adaptive size classes")
+{
+    countSocketCalls();
+    startEchoServer(TCP4Endpoint("127.0.0.1", 23421));
+
+    ServiceOptions fixed;
+    fixed._buffers = BufferLimits::fromBytes(4096, 4096);
+    startBridge(std::make_unique<TCP4Endpoint>("127.0.0.1", 23420), std::make_unique<TCP4Endpoint>("127.0.0.1", 23421), 1, {}, fixed);
+    measure("fixed 4k", TCP4Endpoint("127.0.0.1", 23420));
+
+    startBridge(std::make_unique<TCP4Endpoint>("127.0.0.1", 23422), std::make_unique<TCP4Endpoint>("127.0.0.1", 23421));
+    measure("adaptive 2k-256k", TCP4Endpoint("127.0.0.1", 23422));
+}
@@ -0,0 +1,64 @@
+#include "bench.h"
+
+#include <metrics.h>
+
+#include <algorithm>
+
+using namespace vsockio;
+using namespace vsockbench;
+
+namespace
+{
+    constexpr int ROUNDS = 20000;
+    constexpr size_t MESSAGE_SIZE = 64;
+
+    // Ping-pong with a think time between requests, like a client doing some work per response.
+    void measure(const std::string& name, const Endpoint& clientEp, std::chrono::microseconds thinkTime)
+    {
+        const int fd = connectTo(clientEp);
+        if (fd < 0)
+        {
+            std::cerr << name << ": cannot connect to " << clientEp.describe() << std::endl;
+            return;
+        }
+
+        Counter& spinNs = Metrics::instance->counter("iothread.0.spin_ns");
+        const uint64_t spinBefore = spinNs.value();
+        const auto begin = Clock::now();
+
+        std::vector<uint8_t> msg(MESSAGE_SIZE, 'x');
+        std::vector<double> samples;
+        samples.reserve(ROUNDS);
+        for (int i = 0; i < ROUNDS; i++)
+        {
+            const auto start = Clock::now();
+            if (!writeAll(fd, msg.data(), msg.size()) || !readAll(fd, msg.data(), msg.size())) break;
+            samples.push_back(secondsSince(start) * 1e6);
+
+            const auto thinkUntil = Clock::now() + thinkTime;
+            while (Clock::now() < thinkUntil) {}
+        }
+        close(fd);
+
+        std::sort(samples.begin(), samples.end());
+        if (!samples.empty())
+        {
+            report(name, "round trip p50", samples[samples.size() / 2], "us");
+            report(name, "round trip p99", samples[samples.size() * 99 / 100], "us");
+        }
+        report(name, "worker time spent spinning", (spinNs.value() - spinBefore) / 1e9 / secondsSince(begin) * 100, "%");
+    }
+}
+
+VSOCK_BENCHMARK(benchBusyPoll, "busy-poll", "round trip latency and spin cost with and without adaptive busy polling")
+{
+    startEchoServer(TCP4Endpoint("127.0.0.1", 23411));
+
+    startBridge(std::make_unique<TCP4Endpoint>("127.0.0.1", 23410), std::make_unique<TCP4Endpoint>("127.0.0.1", 23411));
+    measure("blocking", TCP4Endpoint("127.0.0.1", 23410), std::chrono::microseconds(20));
+
+    BusyPollOptions busyPoll;
+    busyPoll._maxSpinUs = 200;
+    startBridge(std::make_unique<TCP4Endpoint>("127.0.0.1", 23412), std::make_unique<TCP4Endpoint>("127.0.0.1", 23411), 1, busyPoll);
+    measure("busy-poll 200us", TCP4Endpoint("127.0.0.1", 23412), std::chrono::microseconds(20));
+}
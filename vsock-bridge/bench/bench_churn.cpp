@@ -0,0 +1,76 @@
+#include "bench.h"
+
+#include <algorithm>
+
+using namespace vsockio;
+using namespace vsockbench;
+
+namespace
+{
+    constexpr int CONNECTIONS = 20000;
+
+    // Backend that serves one connection at a time: echo a byte, then wait for the client to hang up.
+    // Serving inline keeps thread creation out of the measured setup and teardown cost.
+    void startSerialEchoServer(const Endpoint& ep)
+    {
+        const int fd = ep.getSocket();
+        const auto addrAndLen = ep.getAddress();
+        if (bind(fd, addrAndLen.first, addrAndLen.second) != 0 || listen(fd, 1024) != 0)
+        {
+            std::cerr << "cannot listen on " << ep.describe() << std::endl;
+            exit(1);
+        }
+
+        std::thread([fd] {
+            for (;;)
+            {
+                const int clientFd = accept(fd, nullptr, nullptr);
+                if (clientFd < 0) continue;
+                char c;
+                if (::read(clientFd, &c, 1) == 1 && writeAll(clientFd, &c, 1))
+                {
+                    while (::read(clientFd, &c, 1) > 0) {}
+                }
+                close(clientFd);
+            }
+        }).detach();
+    }
+}
+
+VSOCK_BENCHMARK(benchChurn, "churn", "connection setup and teardown through the bridge")
+{
+    const UnixEndpoint backendEp("@vsock-bench-churn-backend");
+    const UnixEndpoint bridgeEp("@vsock-bench-churn");
+    startSerialEchoServer(backendEp);
+    // new channels are picked up between polls; spinning keeps the worker's poll timeout out of the numbers
+    BusyPollOptions busyPoll;
+    busyPoll._maxSpinUs = 1000;
+    startBridge(std::make_unique<UnixEndpoint>(bridgeEp), std::make_unique<UnixEndpoint>(backendEp), 1, busyPoll);
+
+    std::vector<double> samples;
+    samples.reserve(CONNECTIONS);
+    const auto start = Clock::now();
+    for (int i = 0; i < CONNECTIONS; i++)
+    {
+        const auto connectionStart = Clock::now();
+        const int fd = connectTo(bridgeEp);
+        char c = 'x';
+        if (fd < 0 || !writeAll(fd, &c, 1) || !readAll(fd, &c, 1))
+        {
+            std::cerr << "churn: connection " << i << " failed" << std::endl;
+            if (fd >= 0) close(fd);
+            break;
+        }
+        close(fd);
+        samples.push_back(secondsSince(connectionStart) * 1e6);
+    }
+    const double seconds = secondsSince(start);
+
+    std::sort(samples.begin(), samples.end());
+    if (!samples.empty())
+    {
+        report("churn", "connections per second", samples.size() / seconds, "");
+        report("churn", "connect/exchange/close p50", samples[samples.size() / 2], "us");
+        report("churn", "connect/exchange/close p99", samples[samples.size() * 99 / 100], "us");
+    }
+}
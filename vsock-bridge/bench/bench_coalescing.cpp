@@ -0,0 +1,128 @@
+#include "bench.h"
+
+#include <metrics.h>
+#include <service.h>
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+using namespace vsockio;
+using namespace vsockbench;
+
+namespace
+{
+    constexpr int MESSAGES = 200000;
+    constexpr size_t MESSAGE_SIZE = 32;
+    constexpr int PING_PONG_ROUNDS = 20000;
+
+    // TCP segments sent by the whole machine so far (the OutSegs column of /proc/net/snmp).
+    uint64_t tcpSegmentsSent()
+    {
+        std::ifstream snmp("/proc/net/snmp");
+        std::string header, values;
+        while (std::getline(snmp, header) && std::getline(snmp, values))
+        {
+            if (header.compare(0, 4, "Tcp:") != 0) continue;
+            std::istringstream names(header), numbers(values);
+            std::string name, number;
+            while (names >> name && numbers >> number)
+            {
+                if (name == "OutSegs") return std::stoull(number);
+            }
+        }
+        return 0;
+    }
+
+    uint64_t serviceCount(const std::string& service, const char* call)
+    {
+        const Counter* counter = Metrics::instance->findCounter("service." + service + ".syscalls." + call + ".ok");
+        return counter != nullptr ? counter->value() : 0;
+    }
+
+    void measure(const std::string& name, uint16_t port)
+    {
+        const TCP4Endpoint clientEp("127.0.0.1", port);
+        const std::string service = "bench-" + clientEp.describe();
+
+        {
+            // a client streaming small messages one write at a time, e.g. log lines or telemetry
+            const int fd = connectTo(clientEp);
+            if (fd < 0)
+            {
+                std::cerr << name << ": cannot connect to " << clientEp.describe() << std::endl;
+                return;
+            }
+
+            const uint64_t segmentsBefore = tcpSegmentsSent();
+            const uint64_t writesBefore = serviceCount(service, "write");
+            const auto start = Clock::now();
+            std::thread writer([fd] {
+                std::vector<uint8_t> msg(MESSAGE_SIZE, 'x');
+                for (int i = 0; i < MESSAGES; i++)
+                {
+                    if (!writeAll(fd, msg.data(), msg.size())) break;
+                }
+            });
+
+            std::vector<uint8_t> buf(64 * 1024);
+            size_t received = 0;
+            while (received < MESSAGES * MESSAGE_SIZE)
+            {
+                const ssize_t n = ::read(fd, buf.data(), buf.size());
+                if (n <= 0) break;
+                received += n;
+            }
+            const double seconds = secondsSince(start);
+            writer.join();
+            close(fd);
+            // the service counts a channel's syscalls once it has closed
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+            report(name, "small message throughput", received / MESSAGE_SIZE / seconds / 1000, "k messages/s");
+            report(name, "tcp segments per 1000 messages", (tcpSegmentsSent() - segmentsBefore) * 1000.0 / MESSAGES, "");
+            report(name, "bridge writes per 1000 messages", (serviceCount(service, "write") - writesBefore) * 1000.0 / MESSAGES, "");
+        }
+
+        {
+            // what it costs a request/response client
+            const int fd = connectTo(clientEp);
+            if (fd < 0) return;
+
+            std::vector<uint8_t> msg(MESSAGE_SIZE, 'x');
+            std::vector<double> samples;
+            samples.reserve(PING_PONG_ROUNDS);
+            for (int i = 0; i < PING_PONG_ROUNDS; i++)
+            {
+                const auto start = Clock::now();
+                if (!writeAll(fd, msg.data(), msg.size()) || !readAll(fd, msg.data(), msg.size())) break;
+                samples.push_back(secondsSince(start) * 1e6);
+            }
+            close(fd);
+
+            std::sort(samples.begin(), samples.end());
+            if (!samples.empty())
+            {
+                report(name, "round trip p50", samples[samples.size() / 2], "us");
+                report(name, "round trip p99", samples[samples.size() * 99 / 100], "us");
+            }
+        }
+    }
+}
+
+VSOCK_BENCHMARK(benchCoalescing, "coalescing", "small message streams and round trips through a tcp bridge in latency vs throughput write mode")
+{
+    startEchoServer(TCP4Endpoint("127.0.0.1", 23461));
+
+    startBridge(std::make_unique<TCP4Endpoint>("127.0.0.1", 23460), std::make_unique<TCP4Endpoint>("127.0.0.1", 23461));
+    measure("latency mode", 23460);
+
+    ServiceOptions options;
+    options._coalesceWrites = true;
+    startBridge(std::make_unique<TCP4Endpoint>("127.0.0.1", 23462), std::make_unique<TCP4Endpoint>("127.0.0.1", 23461), 1, {}, options);
+    measure("throughput mode", 23462);
+
+    options._coalesceDelay = std::chrono::microseconds(500);
+    startBridge(std::make_unique<TCP4Endpoint>("127.0.0.1", 23463), std::make_unique<TCP4Endpoint>("127.0.0.1", 23461), 1, {}, options);
+    measure("throughput mode, 500us delay", 23463);
+}
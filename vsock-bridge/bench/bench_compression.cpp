@@ -0,0 +1,138 @@
+#include "bench.h"
+
+#include <random>
+
+#include <sys/resource.h>
+
+using namespace vsockio;
+using namespace vsockbench;
+
+namespace
+{
+    constexpr size_t BULK_BYTES = 64 * 1024 * 1024;
+    constexpr size_t BULK_CHUNK = 64 * 1024;
+    constexpr size_t PATTERN_SIZE = 1024 * 1024;
+
+    struct Payload
+    {
+        const char* _name;
+        std::vector<uint8_t> _pattern;
+    };
+
+    std::vector<uint8_t> randomBytes(size_t size, std::mt19937& rng)
+    {
+        std::vector<uint8_t> data(size);
+        for (auto& b : data) b = static_cast<uint8_t>(rng());
+        return data;
+    }
+
+    std::vector<uint8_t> json(size_t size, std::mt19937& rng)
+    {
+        std::string text;
+        while (text.size() < size)
+        {
+            text += "{\"advertising_id\":\"" + std::to_string(rng()) + "\",\"bucket_id\":\"b" + std::to_string(rng() % 1000) + "\",\"status\":\"success\"},";
+        }
+        return std::vector<uint8_t>(text.begin(), text.begin() + size);
+    }
+
+    std::vector<Payload> payloads()
+    {
+        std::mt19937 rng(7);
+        std::vector<Payload> result;
+        result.push_back({"random", randomBytes(PATTERN_SIZE, rng)});
+
+        // alternating 4k runs of random bytes and json, about half compressible
+        std::vector<uint8_t> mixed;
+        while (mixed.size() < PATTERN_SIZE)
+        {
+            const auto run = mixed.size() / 4096 % 2 == 0 ? randomBytes(4096, rng) : json(4096, rng);
+            mixed.insert(mixed.end(), run.begin(), run.end());
+        }
+        result.push_back({"mixed", std::move(mixed)});
+
+        result.push_back({"json", json(PATTERN_SIZE, rng)});
+        result.push_back({"zeros", std::vector<uint8_t>(PATTERN_SIZE, 0)});
+        return result;
+    }
+
+    double cpuSeconds()
+    {
+        rusage usage{};
+        getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+    }
+
+    void measure(const std::string& name, const Endpoint& clientEp, const Payload& payload, const Counter* wireBytes)
+    {
+        const int fd = connectTo(clientEp);
+        if (fd < 0)
+        {
+            std::cerr << name << ": cannot connect to " << clientEp.describe() << std::endl;
+            return;
+        }
+
+        const uint64_t wireBefore = wireBytes != nullptr ? wireBytes->value() : 0;
+        const double cpuBefore = cpuSeconds();
+        const auto start = Clock::now();
+        std::thread writer([fd, &payload] {
+            for (size_t sent = 0; sent < BULK_BYTES; sent += BULK_CHUNK)
+            {
+                if (!writeAll(fd, payload._pattern.data() + sent % PATTERN_SIZE, BULK_CHUNK)) break;
+            }
+        });
+
+        std::vector<uint8_t> chunk(BULK_CHUNK);
+        size_t received = 0;
+        while (received < BULK_BYTES)
+        {
+            const ssize_t n = ::read(fd, chunk.data(), chunk.size());
+            if (n <= 0) break;
+            received += n;
+        }
+        writer.join();
+        const double seconds = secondsSince(start);
+        const double cpu = cpuSeconds() - cpuBefore;
+        close(fd);
+
+        // client, echo server and both bridges share the process; the difference to "off" is the transform
+        const std::string label = name + " " + payload._name;
+        report(label, "echo throughput", received / seconds / (1024 * 1024), "MiB/s");
+        report(label, "process cpu per GiB echoed", cpu / (static_cast<double>(received) / (1024 * 1024 * 1024)), "s");
+        if (wireBytes != nullptr)
+        {
+            // counted on the request direction, the echo comes back just as compressed
+            report(label, "link bytes per payload byte", static_cast<double>(wireBytes->value() - wireBefore) / received, "");
+        }
+    }
+
+    // outer bridge compressing towards inner bridge decompressing towards the echo server, as two bridges on either side of vsock would
+    const Counter* startBridgePair(uint16_t outerPort, uint16_t innerPort, uint16_t echoPort, bool compress)
+    {
+        ServiceOptions outer;
+        ServiceOptions inner;
+        if (compress)
+        {
+            outer._compress = CompressSide::Connect;
+            inner._compress = CompressSide::Listen;
+        }
+        auto outerEp = std::make_unique<TCP4Endpoint>("127.0.0.1", outerPort);
+        const std::string outerName = "bench-" + outerEp->describe();
+        startBridge(std::move(outerEp), std::make_unique<TCP4Endpoint>("127.0.0.1", innerPort), 1, {}, outer);
+        startBridge(std::make_unique<TCP4Endpoint>("127.0.0.1", innerPort), std::make_unique<TCP4Endpoint>("127.0.0.1", echoPort), 1, {}, inner);
+        return compress ? &Metrics::instance->counter("service." + outerName + ".compress.out_bytes") : nullptr;
+    }
+}
+
+VSOCK_BENCHMARK(benchCompression, "compression", "echo throughput, cpu and link bytes through a compressing bridge pair at several compressibilities")
+{
+    startEchoServer(TCP4Endpoint("127.0.0.1", 23431));
+    startBridgePair(23432, 23433, 23431, false);
+    const Counter* compressed = startBridgePair(23434, 23435, 23431, true);
+
+    for (const auto& payload : payloads())
+    {
+        measure("off", TCP4Endpoint("127.0.0.1", 23432), payload, nullptr);
+        measure("lz4", TCP4Endpoint("127.0.0.1", 23434), payload, compressed);
+    }
+}
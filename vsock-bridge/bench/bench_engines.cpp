@@ -0,0 +1,137 @@
+#include "bench.h"
+
+#include <coro_engine.h>
+
+#include <algorithm>
+#include <future>
+
+using namespace vsockio;
+using namespace vsockbench;
+
+namespace
+{
+    constexpr int PINGS = 5000;
+    constexpr int STREAMS = 4;
+    constexpr size_t BYTES_PER_STREAM = 64 * 1024 * 1024;
+    constexpr size_t CHUNK = 64 * 1024;
+    constexpr int IDLE_CHANNELS = 1000;
+
+    const char* engineName(ChannelEngine engine)
+    {
+        return engine == ChannelEngine::Coroutine ? "coroutine" : "state machine";
+    }
+
+    void measureThroughput(const std::string& mode, const UnixEndpoint& ep)
+    {
+        const auto start = Clock::now();
+        std::vector<std::thread> streams;
+        std::atomic<size_t> received = 0;
+        for (int i = 0; i < STREAMS; i++)
+        {
+            streams.emplace_back([&ep, &received] {
+                const int fd = connectTo(ep);
+                if (fd < 0) return;
+                std::thread writer([fd] {
+                    std::vector<uint8_t> chunk(CHUNK, 'y');
+                    for (size_t sent = 0; sent < BYTES_PER_STREAM; sent += chunk.size())
+                    {
+                        if (!writeAll(fd, chunk.data(), chunk.size())) break;
+                    }
+                });
+                std::vector<uint8_t> chunk(CHUNK);
+                for (size_t n = 0; n < BYTES_PER_STREAM; )
+                {
+                    const ssize_t r = ::read(fd, chunk.data(), chunk.size());
+                    if (r <= 0) break;
+                    n += r;
+                    received += r;
+                }
+                writer.join();
+                close(fd);
+            });
+        }
+        for (auto& t : streams) t.join();
+        report("engines", mode + " echo throughput", received / secondsSince(start) / (1024 * 1024), "MiB/s");
+    }
+
+    void measureRoundTrip(const std::string& mode, const UnixEndpoint& ep)
+    {
+        const int fd = connectTo(ep);
+        std::vector<double> samples;
+        for (int i = 0; i < PINGS && fd >= 0; i++)
+        {
+            const auto start = Clock::now();
+            char c = 'p';
+            if (!writeAll(fd, &c, 1) || !readAll(fd, &c, 1)) break;
+            samples.push_back(secondsSince(start) * 1e6);
+        }
+        if (fd >= 0) close(fd);
+
+        std::sort(samples.begin(), samples.end());
+        if (!samples.empty())
+        {
+            report("engines", mode + " round trip p50", samples[samples.size() / 2], "us");
+        }
+    }
+
+    // Bytes of coroutine frames alive on the thread, read on the thread itself since the pool is per thread.
+    size_t frameBytes(IOThread& thread)
+    {
+        std::promise<size_t> bytes;
+        thread.post([&bytes] { bytes.set_value(FramePool::local().inUseBytes()); });
+        return bytes.get_future().get();
+    }
+
+    void measureIdleMemory(const std::string& mode, ChannelEngine engine, IOThread& thread, ServiceContext& service, const UnixEndpoint& ep)
+    {
+        const size_t framesBefore = frameBytes(thread);
+        std::vector<int> clients;
+        for (int i = 0; i < IDLE_CHANNELS; i++)
+        {
+            char c = 'x';
+            const int fd = connectTo(ep);
+            if (fd < 0 || !writeAll(fd, &c, 1) || !readAll(fd, &c, 1)) break;
+            clients.push_back(fd);
+        }
+        while (service._admission.channels() != static_cast<int64_t>(clients.size()))
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+
+        // buffers are handed back by idle channels of both engines, what remains is the channel and its frames
+        const size_t channelBytes = engine == ChannelEngine::Coroutine ? Slab<CoroChannel>::SLOT_SIZE : Slab<DirectChannel>::SLOT_SIZE;
+        const double frames = double(frameBytes(thread) - framesBefore) / clients.size();
+        report("engines", mode + " memory per idle channel (channel object + coroutine frames)", channelBytes + frames, "bytes");
+        report("engines", mode + " buffer memory in use", Metrics::instance->gauge("service." + service._name + ".buffered_bytes").value(), "bytes");
+
+        for (int fd : clients) close(fd);
+        while (service._admission.channels() != 0)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+}
+
+VSOCK_BENCHMARK(benchEngines, "engines", "state machine vs coroutine channels: echo throughput, round trip and memory per idle channel")
+{
+    const UnixEndpoint backendEp("@vsock-bench-engines-backend");
+    startEchoServer(backendEp);
+    auto* pollerFactory = new EpollPollerFactory(256);
+
+    size_t nextThreadId = 400;
+    for (const auto engine : {ChannelEngine::StateMachine, ChannelEngine::Coroutine})
+    {
+        const std::string mode = engineName(engine);
+        auto* pool = new IOThreadPool(1, *pollerFactory, {}, nextThreadId++);
+        ServiceOptions options;
+        options._engine = engine;
+        auto* service = new ServiceContext("bench-engines-" + std::to_string(nextThreadId), options);
+        const UnixEndpoint ep("@vsock-bench-engines-" + std::to_string(nextThreadId));
+        auto* listener = new Listener(std::make_unique<UnixEndpoint>(ep), std::make_unique<UnixEndpoint>(backendEp), *new Dispatcher(*pool), *service);
+        std::thread(&Listener::run, listener).detach();
+
+        measureThroughput(mode, ep);
+        measureRoundTrip(mode, ep);
+        measureIdleMemory(mode, engine, pool->thread(0), *service, ep);
+    }
+}
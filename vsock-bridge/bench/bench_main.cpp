@@ -0,0 +1,142 @@
+#include "bench.h"
+
+#include <cerrno>
+#include <cstring>
+
+using namespace vsockio;
+
+namespace vsockbench
+{
+    std::vector<Benchmark>& registry()
+    {
+        static std::vector<Benchmark> benchmarks;
+        return benchmarks;
+    }
+
+    bool writeAll(int fd, const void* data, size_t len)
+    {
+        const auto* p = static_cast<const uint8_t*>(data);
+        while (len > 0)
+        {
+            const ssize_t n = ::write(fd, p, len);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            p += n;
+            len -= n;
+        }
+        return true;
+    }
+
+    bool readAll(int fd, void* data, size_t len)
+    {
+        auto* p = static_cast<uint8_t*>(data);
+        while (len > 0)
+        {
+            const ssize_t n = ::read(fd, p, len);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            p += n;
+            len -= n;
+        }
+        return true;
+    }
+
+    int connectTo(const Endpoint& ep)
+    {
+        // the listener thread may not have called listen() yet, so retry for a little while
+        for (int attempt = 0; attempt < 100; attempt++)
+        {
+            const int fd = ep.getSocket();
+            if (fd < 0) return -1;
+            const auto addrAndLen = ep.getAddress();
+            if (connect(fd, addrAndLen.first, addrAndLen.second) == 0)
+            {
+                if (addrAndLen.first->sa_family == AF_INET)
+                {
+                    IOControl::setTcpNoDelay(fd);
+                }
+                return fd;
+            }
+            close(fd);
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        return -1;
+    }
+
+    void startEchoServer(const Endpoint& ep)
+    {
+        const int fd = ep.getSocket();
+        const int enable = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+        const auto addrAndLen = ep.getAddress();
+        if (addrAndLen.first->sa_family == AF_UNIX)
+        {
+            const auto* unixAddress = reinterpret_cast<const sockaddr_un*>(addrAndLen.first);
+            if (unixAddress->sun_path[0] != '\0') unlink(unixAddress->sun_path);
+        }
+        if (bind(fd, addrAndLen.first, addrAndLen.second) != 0 || listen(fd, 128) != 0)
+        {
+            std::cerr << "echo server failed on " << ep.describe() << ": " << strerror(errno) << std::endl;
+            exit(1);
+        }
+
+        std::thread([fd] {
+            for (;;)
+            {
+                const int clientFd = accept(fd, nullptr, nullptr);
+                if (clientFd < 0) continue;
+                std::thread([clientFd] {
+                    std::vector<uint8_t> buf(64 * 1024);
+                    for (;;)
+                    {
+                        const ssize_t n = ::read(clientFd, buf.data(), buf.size());
+                        if (n <= 0 || !writeAll(clientFd, buf.data(), n)) break;
+                    }
+                    close(clientFd);
+                }).detach();
+            }
+        }).detach();
+    }
+
+    void startBridge(std::unique_ptr<Endpoint> listenEp, std::unique_ptr<Endpoint> connectEp, size_t numWorkers, const BusyPollOptions& busyPoll, const ServiceOptions& options)
+    {
+        auto* pollerFactory = new EpollPollerFactory(256);
+        auto* threadPool = new IOThreadPool(numWorkers, *pollerFactory, busyPoll);
+        auto* dispatcher = new Dispatcher(*threadPool);
+        auto* service = new ServiceContext("bench-" + listenEp->describe(), options);
+        auto* listener = new Listener(std::move(listenEp), std::move(connectEp), *dispatcher, *service);
+        std::thread(&Listener::run, listener).detach();
+    }
+}
+
+using namespace vsockbench;
+
+int main(int argc, char* argv[])
+{
+    Logger::instance->setMinLevel(Logger::ERROR);
+    Logger::instance->setStreamProvider(new StdoutLogger());
+
+    if (argc > 1 && strcmp(argv[1], "--list") == 0)
+    {
+        for (const auto& b : registry())
+        {
+            std::cout << b._name << "  " << b._description << std::endl;
+        }
+        return 0;
+    }
+
+    for (const auto& b : registry())
+    {
+        bool selected = argc == 1;
+        for (int i = 1; i < argc; i++)
+        {
+            selected = selected || strcmp(argv[i], b._name) == 0;
+        }
+        if (!selected) continue;
+
+        std::cout << "== " << b._name << ": " << b._description << std::endl;
+        b._run();
+    }
+
+    return 0;
+}
@@ -0,0 +1,90 @@
+#include "bench.h"
+
+#include <metrics.h>
+
+#include <fstream>
+
+using namespace vsockio;
+using namespace vsockbench;
+
+namespace
+{
+    constexpr int CONNECTIONS = 2000;
+    constexpr size_t MESSAGE_SIZE = 64;
+
+    long residentBytes()
+    {
+        long pages = 0, resident = 0;
+        std::ifstream("/proc/self/statm") >> pages >> resident;
+        return resident * sysconf(_SC_PAGESIZE);
+    }
+
+    // Backend that accepts connections and holds them open without reading.
+    void startHoldServer(const Endpoint& ep)
+    {
+        const int fd = ep.getSocket();
+        const auto addrAndLen = ep.getAddress();
+        if (bind(fd, addrAndLen.first, addrAndLen.second) != 0 || listen(fd, 1024) != 0)
+        {
+            std::cerr << "cannot listen on " << ep.describe() << std::endl;
+            exit(1);
+        }
+
+        std::thread([fd] {
+            for (;;)
+            {
+                accept(fd, nullptr, nullptr);
+            }
+        }).detach();
+    }
+
+    bool waitForGauge(Gauge& gauge, int64_t value)
+    {
+        for (int i = 0; i < 1000 && gauge.value() != value; i++)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        return gauge.value() == value;
+    }
+}
+
+VSOCK_BENCHMARK(benchIdleMemory, "idle-memory", "resident memory per idle channel after some traffic")
+{
+    const UnixEndpoint backendEp("@vsock-bench-hold");
+    const UnixEndpoint bridgeEp("@vsock-bench-idle");
+    startHoldServer(backendEp);
+    startBridge(std::make_unique<UnixEndpoint>(bridgeEp), std::make_unique<UnixEndpoint>(backendEp));
+
+    Gauge& channels = Metrics::instance->gauge("service.bench-" + bridgeEp.describe() + ".channels");
+    Gauge& bufferBytes = Metrics::instance->gauge("buffers.in_use_bytes");
+    const long before = residentBytes();
+
+    std::vector<int> clients;
+    std::vector<uint8_t> msg(MESSAGE_SIZE, 'x');
+    for (int i = 0; i < CONNECTIONS; i++)
+    {
+        const int fd = connectTo(bridgeEp);
+        if (fd < 0 || !writeAll(fd, msg.data(), msg.size()))
+        {
+            std::cerr << "idle-memory: connection " << i << " failed" << std::endl;
+            break;
+        }
+        clients.push_back(fd);
+    }
+
+    // the backend never reads, the messages sit in its socket buffers and the channels go idle
+    if (!waitForGauge(channels, clients.size()) || !waitForGauge(bufferBytes, 0))
+    {
+        std::cerr << "idle-memory: channels did not settle" << std::endl;
+    }
+
+    report("idle-memory", "channels", clients.size(), "");
+    report("idle-memory", "resident memory per idle channel", double(residentBytes() - before) / clients.size(), "bytes");
+    report("idle-memory", "buffer memory in use", bufferBytes.value(), "bytes");
+    report("idle-memory", "buffer memory mapped", Metrics::instance->gauge("buffers.mapped_bytes").value(), "bytes");
+
+    for (int fd : clients)
+    {
+        close(fd);
+    }
+}
@@ -0,0 +1,125 @@
+#include "bench.h"
+
+#include <algorithm>
+#include <atomic>
+
+using namespace vsockio;
+using namespace vsockbench;
+
+namespace
+{
+    constexpr int PINGS = 5000;
+    constexpr int BULK_STREAMS = 4;
+    constexpr size_t BULK_CHUNK = 256 * 1024;
+
+    void startListener(Dispatcher& dispatcher, const std::string& name, const UnixEndpoint& listenEp, const UnixEndpoint& connectEp, Priority priority = Priority::Normal)
+    {
+        ServiceOptions options;
+        options._priority = priority;
+        auto* service = new ServiceContext(name, options);
+        auto* listener = new Listener(std::make_unique<UnixEndpoint>(listenEp), std::make_unique<UnixEndpoint>(connectEp), dispatcher, *service);
+        std::thread(&Listener::run, listener).detach();
+    }
+
+    // Echo streams that keep the bulk service's workers busy until stop is set.
+    std::vector<std::thread> startBulkTraffic(const UnixEndpoint& ep, std::atomic<bool>& stop)
+    {
+        std::vector<std::thread> streams;
+        for (int i = 0; i < BULK_STREAMS; i++)
+        {
+            streams.emplace_back([&ep, &stop] {
+                const int fd = connectTo(ep);
+                std::vector<uint8_t> chunk(BULK_CHUNK, 'b');
+                while (fd >= 0 && !stop.load() && writeAll(fd, chunk.data(), chunk.size()) && readAll(fd, chunk.data(), chunk.size())) {}
+                if (fd >= 0) close(fd);
+            });
+        }
+        return streams;
+    }
+
+    void measure(const char* benchmark, const char* mode, const UnixEndpoint& bulkEp, const UnixEndpoint& latencyEp)
+    {
+        std::atomic<bool> stop = false;
+        auto bulk = startBulkTraffic(bulkEp, stop);
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+        const int fd = connectTo(latencyEp);
+        std::vector<double> samples;
+        samples.reserve(PINGS);
+        for (int i = 0; i < PINGS && fd >= 0; i++)
+        {
+            const auto start = Clock::now();
+            char c = 'p';
+            if (!writeAll(fd, &c, 1) || !readAll(fd, &c, 1)) break;
+            samples.push_back(secondsSince(start) * 1e6);
+        }
+        if (fd >= 0) close(fd);
+
+        stop = true;
+        for (auto& t : bulk) t.join();
+
+        std::sort(samples.begin(), samples.end());
+        if (!samples.empty())
+        {
+            report(benchmark, std::string(mode) + " ping p50", samples[samples.size() / 2], "us");
+            report(benchmark, std::string(mode) + " ping p99", samples[samples.size() * 99 / 100], "us");
+        }
+    }
+}
+
+VSOCK_BENCHMARK(benchPoolIsolation, "pool-isolation", "round trip latency of one service while another one relays bulk traffic")
+{
+    const UnixEndpoint backendEp("@vsock-bench-pools-backend");
+    startEchoServer(backendEp);
+    auto* pollerFactory = new EpollPollerFactory(256);
+
+    {
+        // both services on the same worker
+        auto* pool = new IOThreadPool(1, *pollerFactory, {}, 100);
+        auto* dispatcher = new Dispatcher(*pool);
+        const UnixEndpoint bulkEp("@vsock-bench-pools-shared-bulk");
+        const UnixEndpoint latencyEp("@vsock-bench-pools-shared-latency");
+        startListener(*dispatcher, "bench-shared-bulk", bulkEp, backendEp);
+        startListener(*dispatcher, "bench-shared-latency", latencyEp, backendEp);
+        measure("pool-isolation", "shared pool", bulkEp, latencyEp);
+    }
+
+    {
+        // one worker per service
+        auto* bulkPool = new IOThreadPool(1, *pollerFactory, {}, 200);
+        auto* latencyPool = new IOThreadPool(1, *pollerFactory, {}, 201);
+        const UnixEndpoint bulkEp("@vsock-bench-pools-dedicated-bulk");
+        const UnixEndpoint latencyEp("@vsock-bench-pools-dedicated-latency");
+        startListener(*new Dispatcher(*bulkPool), "bench-dedicated-bulk", bulkEp, backendEp);
+        startListener(*new Dispatcher(*latencyPool), "bench-dedicated-latency", latencyEp, backendEp);
+        measure("pool-isolation", "dedicated pools", bulkEp, latencyEp);
+    }
+}
+
+VSOCK_BENCHMARK(benchPriority, "priority", "round trip latency of a high priority service sharing its worker with bulk traffic")
+{
+    const UnixEndpoint backendEp("@vsock-bench-priority-backend");
+    startEchoServer(backendEp);
+    auto* pollerFactory = new EpollPollerFactory(256);
+
+    const std::pair<Priority, Priority> modes[] = {{Priority::Normal, Priority::Normal}, {Priority::High, Priority::Low}};
+    size_t nextThreadId = 300;
+    for (const auto& [latencyPriority, bulkPriority] : modes)
+    {
+        const std::string suffix = std::string(priorityName(latencyPriority)) + "-" + priorityName(bulkPriority);
+        auto* dispatcher = new Dispatcher(*new IOThreadPool(1, *pollerFactory, {}, nextThreadId++));
+        const UnixEndpoint bulkEp("@vsock-bench-priority-bulk-" + suffix);
+        const UnixEndpoint latencyEp("@vsock-bench-priority-latency-" + suffix);
+        startListener(*dispatcher, "bench-priority-bulk-" + suffix, bulkEp, backendEp, bulkPriority);
+        startListener(*dispatcher, "bench-priority-latency-" + suffix, latencyEp, backendEp, latencyPriority);
+        const std::string mode = std::string(priorityName(latencyPriority)) + " vs " + priorityName(bulkPriority) + " bulk";
+        measure("priority", mode.c_str(), bulkEp, latencyEp);
+
+        for (const auto priority : {latencyPriority, bulkPriority})
+        {
+            const std::string name = "iothread." + std::to_string(nextThreadId - 1) + ".ready_wait_us." + priorityName(priority);
+            report("priority", mode + ", " + priorityName(priority) + " class ready wait p99", Metrics::instance->histogram(name).quantile(0.99), "us");
+            if (latencyPriority == bulkPriority) break;
+        }
+    }
+}
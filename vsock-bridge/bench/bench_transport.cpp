@@ -0,0 +1,82 @@
+#include "bench.h"
+
+#include <algorithm>
+
+using namespace vsockio;
+using namespace vsockbench;
+
+namespace
+{
+    constexpr int PING_PONG_ROUNDS = 20000;
+    constexpr size_t PING_PONG_SIZE = 64;
+    constexpr size_t BULK_BYTES = 256 * 1024 * 1024;
+    constexpr size_t BULK_CHUNK = 64 * 1024;
+
+    void measure(const std::string& name, const Endpoint& clientEp)
+    {
+        {
+            const int fd = connectTo(clientEp);
+            if (fd < 0)
+            {
+                std::cerr << name << ": cannot connect to " << clientEp.describe() << std::endl;
+                return;
+            }
+
+            std::vector<uint8_t> msg(PING_PONG_SIZE, 'x');
+            std::vector<double> samples;
+            samples.reserve(PING_PONG_ROUNDS);
+            for (int i = 0; i < PING_PONG_ROUNDS; i++)
+            {
+                const auto start = Clock::now();
+                if (!writeAll(fd, msg.data(), msg.size()) || !readAll(fd, msg.data(), msg.size())) break;
+                samples.push_back(secondsSince(start) * 1e6);
+            }
+            close(fd);
+
+            std::sort(samples.begin(), samples.end());
+            if (!samples.empty())
+            {
+                report(name, "round trip p50", samples[samples.size() / 2], "us");
+                report(name, "round trip p99", samples[samples.size() * 99 / 100], "us");
+            }
+        }
+
+        {
+            const int fd = connectTo(clientEp);
+            if (fd < 0) return;
+
+            const auto start = Clock::now();
+            std::thread writer([fd] {
+                std::vector<uint8_t> chunk(BULK_CHUNK, 'y');
+                for (size_t sent = 0; sent < BULK_BYTES; sent += chunk.size())
+                {
+                    if (!writeAll(fd, chunk.data(), chunk.size())) break;
+                }
+            });
+
+            std::vector<uint8_t> chunk(BULK_CHUNK);
+            size_t received = 0;
+            while (received < BULK_BYTES)
+            {
+                const ssize_t n = ::read(fd, chunk.data(), chunk.size());
+                if (n <= 0) break;
+                received += n;
+            }
+            writer.join();
+            close(fd);
+
+            report(name, "echo throughput", received / secondsSince(start) / (1024 * 1024), "MiB/s");
+        }
+    }
+}
+
+VSOCK_BENCHMARK(benchUnixVsTcp, "unix-vs-tcp", "bridge relay over tcp loopback vs unix domain sockets")
+{
+    startEchoServer(TCP4Endpoint("127.0.0.1", 23401));
+    startBridge(std::make_unique<TCP4Endpoint>("127.0.0.1", 23400), std::make_unique<TCP4Endpoint>("127.0.0.1", 23401));
+    measure("tcp->tcp", TCP4Endpoint("127.0.0.1", 23400));
+
+    startEchoServer(UnixEndpoint("@vsock-bench-echo"));
+    startBridge(std::make_unique<UnixEndpoint>("@vsock-bench-bridge"), std::make_unique<UnixEndpoint>("@vsock-bench-echo"));
+    measure("unix->unix", UnixEndpoint("@vsock-bench-bridge"));
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "listener.h"
+#include "metrics.h"
+#include "poller.h"
+
+#include <chrono>
+#include <memory>
+#include <vector>
+
+namespace vsockio
+{
+    // Serves any number of listen sockets from one thread: the sockets are non-blocking and
+    // registered with a poller, and a listener whose clients were deferred (by admission, a paused
+    // service or accept errors) is retried when its deadline passes rather than on the next event.
+    class Acceptor
+    {
+    public:
+        explicit Acceptor(PollerFactory& pollerFactory);
+
+        Acceptor(const Acceptor&) = delete;
+        Acceptor& operator=(const Acceptor&) = delete;
+
+        // Starts listening and serves the listener from the next runOnce(). It must outlive the acceptor.
+        void add(Listener& listener);
+
+        void run();
+
+        // Waits up to maxWait for clients (less if a deferred listener is due), then serves every
+        // listener that has some.
+        void runOnce(std::chrono::milliseconds maxWait);
+
+        size_t listeners() const { return _listeners.size(); }
+
+    private:
+        // How long the poller may block: until the earliest deferred listener is due, capped at maxWait.
+        int pollTimeout(Listener::Clock::time_point now, std::chrono::milliseconds maxWait) const;
+
+        std::unique_ptr<Poller> _poller;
+        std::vector<VsbEvent> _events;
+        std::vector<Listener*> _listeners;
+        Counter& _wakeups;
+    };
+}
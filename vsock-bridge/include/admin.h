@@ -0,0 +1,66 @@
+#pragma once
+
+#include "iothread.h"
+#include "service.h"
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace vsockio
+{
+    // Serves operator commands on a local Unix domain socket, one command per line:
+    //
+    //   channels            channels of each IO thread with their state and byte counts
+    //   services            state and open channels of each service
+    //   stats               all metrics
+    //   syscalls            syscall counts and syscalls per KB relayed of each IO thread and service
+    //   log-level [n]       show or change the minimum log level
+    //   pause <service>     stop accepting, new clients wait in the listen backlog
+    //   resume <service>    accept again after pause or drain
+    //   drain <service>     refuse new clients, open channels run to completion
+    //
+    // Commands run on the admin thread. Channel listings are gathered by tasks posted to each
+    // IO thread; the admin thread waits for the answers (with a timeout), the IO threads never wait.
+    class AdminServer
+    {
+    public:
+        static constexpr std::chrono::seconds IOTHREAD_TIMEOUT{1};
+        static constexpr std::chrono::seconds CLIENT_TIMEOUT{5};
+        static constexpr size_t MAX_COMMAND_LENGTH = 1024;
+
+        AdminServer(std::vector<const IOThreadPool*> pools, std::vector<ServiceContext*> services)
+            : _pools(std::move(pools)), _services(std::move(services)) {}
+
+        AdminServer(const AdminServer&) = delete;
+        AdminServer& operator=(const AdminServer&) = delete;
+
+        ~AdminServer() { stop(); }
+
+        // Listens on path (a leading '@' selects the abstract namespace), returns false if that fails.
+        bool start(const std::string& path);
+        void stop();
+
+        // Runs one command line and returns the reply, which always ends with a newline.
+        std::string execute(const std::string& command);
+
+    private:
+        void run();
+        void serve(int clientFd);
+        std::string listChannels();
+        std::string listServices() const;
+        std::string listSyscalls() const;
+        std::string setLogLevel(const std::string& argument);
+        std::string setServiceState(const std::string& command, const std::string& name, ServiceContext::State state);
+        ServiceContext* findService(const std::string& name) const;
+
+        const std::vector<const IOThreadPool*> _pools;
+        const std::vector<ServiceContext*> _services;
+        int _fd = -1;
+        std::string _path;
+        std::atomic<bool> _stopFlag = false;
+        std::thread _thr;
+    };
+}
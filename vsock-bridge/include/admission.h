@@ -0,0 +1,78 @@
+#pragma once
+
+#include "metrics.h"
+#include "token_bucket.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace vsockio
+{
+    struct AdmissionLimits
+    {
+        enum class OverloadAction : uint8_t
+        {
+            Pause,  // stop accepting, clients wait in the kernel backlog
+            Reject, // accept and close straight away
+        };
+
+        uint32_t _maxChannels = 0;      // 0 = unlimited
+        uint32_t _resumeChannels = 0;   // low watermark, 0 = 90% of _maxChannels
+        uint32_t _maxAcceptRate = 0;    // new connections per second, 0 = unlimited
+        uint32_t _maxLoopLagMs = 0;     // IOThread loop lag that triggers shedding, 0 = disabled
+        OverloadAction _overloadAction = OverloadAction::Pause;
+    };
+
+    // Decides whether a listener may take another connection.
+    //
+    // Once the channel cap or the loop lag threshold is hit the controller keeps shedding
+    // until the number of channels drops to the low watermark and the lag is back under half
+    // the threshold, so it does not flap around the limit.
+    class AdmissionControl
+    {
+    public:
+        using Clock = std::chrono::steady_clock;
+
+        enum class Decision : uint8_t
+        {
+            Admit,
+            Overloaded,
+            RateLimited,
+        };
+
+        AdmissionControl(const std::string& name, const AdmissionLimits& limits);
+
+        Decision check(Clock::time_point now, std::chrono::microseconds loopLag);
+
+        // Gives back the accept rate token of an admitted connection that a later check turned away
+        // or that was not there to accept.
+        void refund() { if (_acceptRate) _acceptRate->refund(1); }
+
+        // How long a paused listener should wait before checking again.
+        Clock::duration retryDelay(Decision decision, Clock::time_point now) const;
+
+        void onChannelOpened() { _channels.add(); }
+        void onChannelClosed() { _channels.sub(); }
+
+        int64_t channels() const { return _channels.value(); }
+        bool shedding() const { return _shedding.load(std::memory_order_relaxed); }
+        const AdmissionLimits& limits() const { return _limits; }
+
+        static constexpr std::chrono::milliseconds OVERLOAD_RETRY_INTERVAL{5};
+
+    private:
+        bool overloaded(int64_t channels, std::chrono::microseconds loopLag) const;
+        bool recovered(int64_t channels, std::chrono::microseconds loopLag) const;
+
+        const std::string _name;
+        const AdmissionLimits _limits;
+        const uint32_t _resumeChannels;
+        std::unique_ptr<TokenBucket> _acceptRate;
+        std::atomic<bool> _shedding{false};
+        Gauge& _channels;
+        Counter& _overloadEvents;
+    };
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include "iothread.h"
+#include "metrics.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace vsockio
+{
+    // CPU quota of the cgroup mounted at cgroupRoot, in CPUs: cpu.max on cgroup v2, cpu.cfs_quota_us
+    // over cpu.cfs_period_us on v1. Empty if there is no quota.
+    std::optional<double> cgroupCpuQuota(const std::string& cgroupRoot);
+
+    // CPUs this process may run on, capped by its cgroup's quota rounded up. At least 1.
+    size_t availableCpus(const std::string& cgroupRoot = "/sys/fs/cgroup");
+
+    // Share of time each thread of a pool spent handling events between two samples.
+    class PoolLoad
+    {
+    public:
+        explicit PoolLoad(const IOThreadPool& pool);
+
+        // One entry per thread started so far, in pool order.
+        std::vector<double> sample(std::chrono::steady_clock::time_point now);
+
+    private:
+        const IOThreadPool& _pool;
+        std::vector<uint64_t> _lastBusyNs;
+        std::chrono::steady_clock::time_point _lastSample;
+    };
+
+    struct ScalingOptions
+    {
+        std::chrono::milliseconds _interval{1000};
+        // average share of time the active workers spend handling events
+        double _growAbove = 0.75;
+        // the same, as it would be with one worker fewer
+        double _shrinkBelow = 0.5;
+        // consecutive samples past a threshold before acting, shrinking being the more patient
+        int _growAfter = 2;
+        int _shrinkAfter = 10;
+    };
+
+    // Grows a pool while its workers are busy and shrinks it while they are not, within the
+    // pool's 1..maxSize threads. Workers taken out keep relaying their channels until those close.
+    class PoolScaler
+    {
+    public:
+        PoolScaler(IOThreadPool& pool, const ScalingOptions& options = {});
+
+        PoolScaler(const PoolScaler&) = delete;
+        PoolScaler& operator=(const PoolScaler&) = delete;
+
+        ~PoolScaler();
+
+        // Samples every interval on a thread of its own.
+        void start();
+
+        // Takes a sample, grows or shrinks the pool if it is due. Returns the change in active workers.
+        int sample(std::chrono::steady_clock::time_point now);
+
+    private:
+        IOThreadPool& _pool;
+        const ScalingOptions _options;
+        PoolLoad _load;
+        int _busySamples = 0;
+        int _idleSamples = 0;
+        Gauge& _activeWorkers;
+        Counter& _grown;
+        Counter& _shrunk;
+        std::mutex _stopLock;
+        std::condition_variable _stopSignal;
+        bool _stop = false;
+        std::thread _thr;
+    };
+}
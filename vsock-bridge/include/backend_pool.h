@@ -0,0 +1,53 @@
+#pragma once
+
+#include "metrics.h"
+#include "socket.h"
+
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace vsockio
+{
+    // Idle backend connections of an http service, shared by the IO threads running its channels.
+    //
+    // A channel takes a connection when its client starts a request and hands it back once the
+    // response is complete and both sides asked for keep-alive, so many client connections reuse
+    // a few long lived backend connections. Connections are handed out most recently used first,
+    // the ones least likely to have been closed by the backend in the meantime.
+    class BackendPool
+    {
+    public:
+        using Connect = std::function<PendingSocket()>;
+
+        BackendPool(const std::string& name, uint32_t maxIdle, Connect connect);
+
+        BackendPool(const BackendPool&) = delete;
+        BackendPool& operator=(const BackendPool&) = delete;
+
+        // An idle connection still open at the backend, or a new one (possibly still connecting).
+        // Empty if a new connection could not be made.
+        PendingSocket acquire();
+
+        // Keeps a connection for reuse, or closes it if the pool is full.
+        void release(PendingSocket&& socket);
+
+        size_t idle() const;
+
+    private:
+        // False if the backend closed the connection or sent something nobody asked for.
+        static bool stillIdle(int fd);
+
+        const uint32_t _maxIdle;
+        const Connect _connect;
+        mutable std::mutex _mutex;
+        std::vector<PendingSocket> _idle;
+        Counter& _connects;
+        Counter& _reused;
+        Counter& _released;
+        Counter& _discarded;
+        Gauge& _idleGauge;
+    };
+}
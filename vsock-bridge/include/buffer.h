@@ -1,64 +1,250 @@
 #pragma once
 
-#include <array>
+#include "buffer_pool.h"
+#include "memory_budget.h"
+
+#include <algorithm>
 #include <cassert>
 #include <cstdint>
 
+#include <sys/uio.h>
+
 namespace vsockio
 {
+	// Bounds for adaptive buffer sizing, as BufferPool size classes.
+	struct BufferLimits
+	{
+		// Start at the default minimum socket send buffer size on Linux.
+		static constexpr int INITIAL_SIZE = 4096;
+
+		int _minClass = 0;
+		int _maxClass = BufferPool::NUM_SIZE_CLASSES - 1;
+
+		static BufferLimits fromBytes(size_t minBytes, size_t maxBytes)
+		{
+			BufferLimits limits;
+			if (minBytes != 0) limits._minClass = BufferPool::classFor(minBytes);
+			if (maxBytes != 0) limits._maxClass = BufferPool::classFor(maxBytes);
+			limits._maxClass = std::max(limits._minClass, limits._maxClass);
+			return limits;
+		}
+
+		int initialClass() const
+		{
+			return std::clamp(BufferPool::classFor(INITIAL_SIZE), _minClass, _maxClass);
+		}
+	};
+
+	// Ring buffer over a block borrowed from the thread's BufferPool. Unallocated buffers are empty and
+	// have no capacity; acquire() before producing and release() once the data has been consumed.
+	//
+	// Free space and queued data each span at most two segments (before and after the wrap-around),
+	// which sockets fill and drain with readv/writev, so a partial write never holds up the next read.
+	//
+	// The fill level peak tells how well a block fit its traffic: blocks that filled up make the next
+	// one bigger, blocks mostly left unused make it smaller. Idle buffers hold no block, so the size
+	// only matters once traffic resumes.
+	//
+	// Blocks are charged to the buffer's MemoryBudget, if any. When the preferred size does not fit,
+	// smaller classes down to the minimum are tried before giving up, unless the caller needs the
+	// block to make progress, in which case the smallest block may overdraw the budget.
 	struct Buffer
 	{
-        // Use the default minimum socket send buffer size on Linux.
-        static constexpr int BUFFER_SIZE = 4096;
-        std::array<std::uint8_t, BUFFER_SIZE> _data;
-        std::uint8_t* _head = _data.data();
-        std::uint8_t* _tail = _data.data();
+        enum class AcquireResult
+        {
+            Acquired,
+            OverBudget,
+            OutOfMemory,
+        };
+
+        std::uint8_t* _data = nullptr;
+        MemoryBudget* _budget = nullptr;
+        std::uint32_t _head = 0;
+        std::uint32_t _size = 0;
+        std::uint32_t _peak = 0;
+        std::uint8_t _sizeClass;
+        std::uint8_t _minClass;
+        std::uint8_t _maxClass;
+
+        explicit Buffer(const BufferLimits& limits = {})
+        {
+            setLimits(limits);
+        }
+
+        Buffer(const Buffer&) = delete;
+        Buffer& operator=(const Buffer&) = delete;
+
+        ~Buffer()
+        {
+            release();
+        }
+
+        // Applies to the next block acquired.
+        void setLimits(const BufferLimits& limits)
+        {
+            _minClass = limits._minClass;
+            _maxClass = limits._maxClass;
+            if (!allocated())
+            {
+                _sizeClass = limits.initialClass();
+            }
+        }
+
+        // Applies to the next block acquired.
+        void setBudget(MemoryBudget* budget)
+        {
+            assert(!allocated());
+            _budget = budget;
+        }
+
+        bool allocated() const
+        {
+            return _data != nullptr;
+        }
+
+        int capacity() const
+        {
+            return BufferPool::classSize(_sizeClass);
+        }
+
+        AcquireResult acquire(bool overdraw = false)
+        {
+            assert(!allocated());
+            if (_budget != nullptr && !reserve())
+            {
+                if (!overdraw)
+                {
+                    _budget->onWait();
+                    return AcquireResult::OverBudget;
+                }
+                _sizeClass = _minClass;
+                _budget->forceReserve(capacity());
+            }
+
+            _data = BufferPool::local().acquire(_sizeClass);
+            _head = _size = _peak = 0;
+            if (!allocated())
+            {
+                if (_budget != nullptr) _budget->release(capacity());
+                return AcquireResult::OutOfMemory;
+            }
+            return AcquireResult::Acquired;
+        }
+
+        void release()
+        {
+            if (allocated())
+            {
+                BufferPool::local().release(_data, _sizeClass);
+                if (_budget != nullptr) _budget->release(capacity());
+                _data = nullptr;
+
+                if (_peak == static_cast<std::uint32_t>(capacity()) && _sizeClass < _maxClass)
+                {
+                    ++_sizeClass;
+                }
+                else if (_peak != 0 && _peak <= static_cast<std::uint32_t>(capacity() / 4) && _sizeClass > _minClass)
+                {
+                    --_sizeClass;
+                }
+            }
+            _head = _size = _peak = 0;
+        }
 
         std::uint8_t* head() const
         {
-            return _head;
+            return _data + _head;
         }
 
 		std::uint8_t* tail() const
 		{
-			return _tail;
+			return _data + wrap(_head + _size);
 		}
 
         bool hasRemainingCapacity() const
         {
-            return _tail < _data.end();
+            return remainingCapacity() > 0;
         }
 
 		int remainingCapacity() const
 		{
-			return _data.end() - _tail;
+			return allocated() ? capacity() - _size : 0;
 		}
 
         int remainingDataSize() const
         {
-            return _tail - _head;
+            return _size;
+        }
+
+        // Free space to read into, at most maxBytes of it. Returns the number of segments used.
+        int freeSegments(iovec (&segments)[2], int maxBytes) const
+        {
+            const std::uint32_t tailOffset = wrap(_head + _size);
+            const std::uint32_t free = std::min<std::uint32_t>(remainingCapacity(), maxBytes);
+            return split(tailOffset, free, segments);
+        }
+
+        // Queued data to write out. Returns the number of segments used.
+        int dataSegments(iovec (&segments)[2]) const
+        {
+            return split(_head, _size, segments);
         }
 
 		void produce(int size)
 		{
             assert(remainingCapacity() >= size);
-            _tail += size;
+            _size += size;
+            _peak = std::max(_peak, _size);
 		}
 
 		void consume(int size)
 		{
             assert(remainingDataSize() >= size);
-			_head += size;
+			_size -= size;
+			// rewind once empty so the next read gets one contiguous segment
+			_head = _size == 0 ? 0 : wrap(_head + size);
 		}
 
         void reset()
         {
-            _head = _tail = _data.data();
+            _head = _size = 0;
         }
 
 		bool consumed() const
 		{
-			return _head >= _tail;
+			return _size == 0;
 		}
+
+    private:
+        bool reserve()
+        {
+            for (int sizeClass = _sizeClass; sizeClass >= _minClass; --sizeClass)
+            {
+                if (_budget->tryReserve(BufferPool::classSize(sizeClass)))
+                {
+                    _sizeClass = sizeClass;
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        std::uint32_t wrap(std::uint32_t offset) const
+        {
+            // capacities are powers of two
+            return offset & (capacity() - 1);
+        }
+
+        int split(std::uint32_t offset, std::uint32_t length, iovec (&segments)[2]) const
+        {
+            const std::uint32_t first = std::min<std::uint32_t>(length, capacity() - offset);
+            segments[0] = {_data + offset, first};
+            if (first == length)
+            {
+                return 1;
+            }
+            segments[1] = {_data, length - first};
+            return 2;
+        }
 	};
 }
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "metrics.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace vsockio
+{
+    // Per-thread pool of IO buffer blocks in power of two size classes, carved out of large mmap'd arenas.
+    //
+    // Sockets borrow a block only while data is in flight and give it back once drained, so idle
+    // channels hold no buffer memory. Blocks must be released on the thread that acquired them;
+    // a channel is only ever touched by the IOThread that owns it, which guarantees this.
+    class BufferPool
+    {
+    public:
+        static constexpr size_t MIN_BLOCK_SIZE = 2 * 1024;
+        static constexpr int NUM_SIZE_CLASSES = 8; // 2 KiB .. 256 KiB
+        static constexpr size_t MAX_BLOCK_SIZE = MIN_BLOCK_SIZE << (NUM_SIZE_CLASSES - 1);
+        static constexpr size_t ARENA_SIZE = 2 * 1024 * 1024;
+
+        static constexpr size_t classSize(int sizeClass) { return MIN_BLOCK_SIZE << sizeClass; }
+
+        // Smallest class holding at least `bytes`, capped at the largest class.
+        static constexpr int classFor(size_t bytes)
+        {
+            int sizeClass = 0;
+            while (sizeClass < NUM_SIZE_CLASSES - 1 && classSize(sizeClass) < bytes) ++sizeClass;
+            return sizeClass;
+        }
+
+        static BufferPool& local();
+
+        // Back new arenas with explicit huge pages when available. Falls back to regular pages
+        // (with transparent huge pages requested) if none are reserved.
+        static void setUseHugePages(bool enable);
+
+        BufferPool();
+        ~BufferPool();
+
+        BufferPool(const BufferPool&) = delete;
+        BufferPool& operator=(const BufferPool&) = delete;
+
+        // A block of classSize(sizeClass) bytes, or nullptr if no memory could be mapped.
+        std::uint8_t* acquire(int sizeClass);
+        void release(std::uint8_t* block, int sizeClass);
+
+        size_t blocksInUse() const { return _blocksInUse; }
+        size_t bytesInUse() const { return _bytesInUse; }
+        size_t arenaBytes() const { return _arenas.size() * ARENA_SIZE; }
+
+    private:
+        struct FreeBlock
+        {
+            FreeBlock* _next;
+        };
+
+        void push(std::uint8_t* block, int sizeClass);
+        bool addArena();
+
+        std::array<FreeBlock*, NUM_SIZE_CLASSES> _free{};
+        // untouched part of the newest arena; blocks are carved on demand so unused pages are never faulted in
+        std::uint8_t* _next = nullptr;
+        std::uint8_t* _end = nullptr;
+        std::vector<void*> _arenas;
+        size_t _blocksInUse = 0;
+        size_t _bytesInUse = 0;
+        Gauge& _inUseBytes;
+        Gauge& _mappedBytes;
+    };
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+
+namespace vsockio
+{
+    struct BusyPollOptions
+    {
+        uint32_t _maxSpinUs = 0;        // longest non-blocking poll window after activity, 0 = disabled
+        uint32_t _socketBusyPollUs = 0; // SO_BUSY_POLL for channel sockets, 0 = not set
+
+        bool enabled() const { return _maxSpinUs != 0; }
+    };
+
+    // Decides whether an IOThread keeps polling without blocking after some activity.
+    //
+    // Spinning only pays off when the next event arrives within the window, so the window follows
+    // the smoothed gap between polls that returned events: about twice the typical gap, between a
+    // quarter of the maximum and the maximum, and closed while events are further apart than the maximum.
+    class AdaptiveSpin
+    {
+    public:
+        using Clock = std::chrono::steady_clock;
+
+        explicit AdaptiveSpin(std::chrono::microseconds maxWindow)
+            : _maxWindow(maxWindow)
+            , _window(maxWindow)
+            , _averageGap(0)
+        {
+        }
+
+        bool enabled() const { return _maxWindow.count() != 0; }
+
+        void onActivity(Clock::time_point now)
+        {
+            if (_lastActivity != Clock::time_point())
+            {
+                // cap samples so one long idle period does not keep the window closed for long
+                const auto gap = std::min<Clock::duration>(now - _lastActivity, _maxWindow * 4);
+                _averageGap += (gap - _averageGap) / 4;
+                updateWindow();
+            }
+            _lastActivity = now;
+        }
+
+        bool shouldSpin(Clock::time_point now) const
+        {
+            return _window.count() != 0 && now - _lastActivity < _window;
+        }
+
+        std::chrono::microseconds window() const { return std::chrono::duration_cast<std::chrono::microseconds>(_window); }
+
+    private:
+        void updateWindow()
+        {
+            if (_averageGap > _maxWindow)
+            {
+                _window = Clock::duration(0);
+            }
+            else
+            {
+                _window = std::clamp<Clock::duration>(_averageGap * 2, _maxWindow / 4, _maxWindow);
+            }
+        }
+
+        const Clock::duration _maxWindow;
+        Clock::duration _window;
+        Clock::duration _averageGap;
+        Clock::time_point _lastActivity;
+    };
+}
@@ -1,16 +1,22 @@
 #pragma once
 
 #include "eventdef.h"
+#include "http.h"
 #include "logger.h"
+#include "service.h"
 #include "socket.h"
 #include "threading.h"
 
+#include <algorithm>
+#include <chrono>
 #include <forward_list>
 #include <memory>
 
 namespace vsockio
 {
     struct DirectChannel;
+    struct CoroSocket;
+    struct MuxSocket;
     class IOThread;
 
 	struct ChannelHandle
@@ -18,6 +24,10 @@ namespace vsockio
         DirectChannel* _channel;
         int _id;
 		int _fd;
+		// set instead of _channel for sockets of coroutine channels, see coro_engine.h
+		CoroSocket* _coroutine = nullptr;
+		// set instead of _channel for sockets of multiplexed tunnels and their streams, see mux.h
+		MuxSocket* _mux = nullptr;
 
 		ChannelHandle(DirectChannel* channel, int id, int fd)
 			: _channel(channel), _id(id), _fd(fd) {}
@@ -29,39 +39,173 @@ namespace vsockio
 
 		int _id;
 
-		std::unique_ptr<Socket> _a;
-		std::unique_ptr<Socket> _b;
+		// declared before the sockets so it outlives them, they count their last calls while closing
+		SyscallCounts _syscalls;
+		// compressing services only: what is read from a and from b passes through these; they
+		// outlive the sockets too, which look at each other's held back output while closing
+		std::unique_ptr<StreamTransform> _aTransform;
+		std::unique_ptr<StreamTransform> _bTransform;
+		Socket _a;
+		Socket _b;
 		ChannelHandle _ha;
 		ChannelHandle _hb;
+		ServiceContext* _service;
+		std::unique_ptr<Shaper> _shaper;
+		std::chrono::steady_clock::time_point _parkedUntil;
+		// when the channel was queued for IO on its thread, default = not queued
+		std::chrono::steady_clock::time_point _readySince;
+		const Priority _priority;
+		ChannelTimeline _timeline;
+		// http services only: the backend connection is taken from the service's pool per exchange
+		std::unique_ptr<HttpSession> _http;
+		// bytesRelayed() when the channel's thread last weighed it for moving to another thread
+		uint64_t _rebalanceMark = 0;
 		
-		DirectChannel(int id, std::unique_ptr<Socket> a, std::unique_ptr<Socket> b)
+		DirectChannel(int id, int aFd, SocketImpl& aImpl, int bFd, SocketImpl& bImpl, ServiceContext* service = nullptr)
 			: _id(id)
-			, _a(std::move(a))
-			, _b(std::move(b))
-			, _ha(this, _id, _a->fd())
-			, _hb(this, _id, _b->fd())
+			, _aTransform(service != nullptr ? service->createTransform(/*readsFromListenSide:*/ true) : nullptr)
+			, _bTransform(service != nullptr ? service->createTransform(/*readsFromListenSide:*/ false) : nullptr)
+			, _a(aFd, aImpl)
+			, _b(bFd, bImpl)
+			, _ha(this, _id, _a.fd())
+			, _hb(this, _id, _b.fd())
+			, _service(service)
+			, _shaper(service != nullptr ? service->createShaper() : nullptr)
+			, _priority(service != nullptr ? service->_options._priority : Priority::Normal)
+			, _http(service != nullptr && service->_options._http ? std::make_unique<HttpSession>() : nullptr)
+		{
+			_a.setPeer(&_b);
+			_b.setPeer(&_a);
+			_a.setShaper(_shaper.get());
+			_b.setShaper(_shaper.get());
+			_a.setSyscallCounters(&_syscalls, nullptr);
+			_b.setSyscallCounters(&_syscalls, nullptr);
+			if (service != nullptr)
+			{
+				_a.setBufferLimits(service->_options._buffers);
+				_b.setBufferLimits(service->_options._buffers);
+				_a.setBufferBudget(&service->_bufferBudget);
+				_b.setBufferBudget(&service->_bufferBudget);
+			}
+			_a.setTransform(_aTransform.get());
+			_b.setTransform(_bTransform.get());
+			if (service != nullptr && service->_options._coalesceWrites)
+			{
+				_a.setCoalescing(true, service->_options._coalesceDelay);
+				_b.setCoalescing(true, service->_options._coalesceDelay);
+			}
+			if (_http != nullptr)
+			{
+				_a.setObserver(&_http->_requests);
+				_b.setObserver(&_http->_responses);
+			}
+		}
 
+		~DirectChannel()
 		{
-			_a->setPeer(_b.get());
-			_b->setPeer(_a.get());
+			if (_service != nullptr)
+			{
+				_timeline._closed = ChannelTimeline::Clock::now();
+				_service->onChannelClosed(_timeline, _syscalls, bytesRelayed());
+			}
 		}
 
         void performIO();
+        void updateTimeline();
+        void attachBackend();
+        void releaseBackend();
+
+        // Also counts the channel's syscalls in the IO thread's totals.
+        void setThreadSyscalls(SyscallCounters* thread)
+        {
+            _a.setSyscallCounters(&_syscalls, thread);
+            _b.setSyscallCounters(&_syscalls, thread);
+        }
+
+        uint64_t bytesRelayed() const
+        {
+            return _a.bytesRead() + _b.bytesRead();
+        }
 
         bool canReadWriteMore() const
         {
-            return _a->canReadWriteMore() || _b->canReadWriteMore();
+            return _a.canReadWriteMore() || _b.canReadWriteMore();
         }
 
 		bool canBeTerminated() const
 		{
-			return _a->closed() && _b->closed();
+			return _a.closed() && _b.closed();
 		}
 
-        Socket& getSocket(int fd) const
+        // How often reads waiting for buffer memory are retried; other channels free it at any time.
+        static constexpr std::chrono::milliseconds BUFFER_RETRY_INTERVAL{1};
+
+        // Some input is waiting for rate limit tokens or buffer memory; the channel should be retried after throttleDelay().
+        bool throttled() const
+        {
+            return _a.throttled() || _b.throttled() || _a.waitingForBuffer() || _b.waitingForBuffer();
+        }
+
+        std::chrono::steady_clock::duration throttleDelay(std::chrono::steady_clock::time_point now) const
+        {
+            std::chrono::steady_clock::duration delay{0};
+            if (_shaper != nullptr && (_a.throttled() || _b.throttled()))
+            {
+                delay = _shaper->waitTime(now);
+            }
+            if (_a.waitingForBuffer() || _b.waitingForBuffer())
+            {
+                delay = std::max<std::chrono::steady_clock::duration>(delay, BUFFER_RETRY_INTERVAL);
+            }
+            return delay;
+        }
+
+        // What the channel is doing, as listed on the admin socket.
+        const char* state() const
+        {
+            if (_http != nullptr && !_b.attached() && !_b.closed()) return "idle";
+            if (!_b.connected()) return "connecting";
+            if (_a.closed() || _b.closed()) return "closing";
+            if (_a.waitingForBuffer() || _b.waitingForBuffer()) return "waiting-for-buffer";
+            if (_a.throttled() || _b.throttled()) return "throttled";
+            return "open";
+        }
+
+        // Writes what throughput mode held back until the end of the IO thread's loop iteration.
+        void flushHeldBack()
+        {
+            _a.writeOutput();
+            _b.writeOutput();
+        }
+
+        // When the channel must be served again to write data held back by throughput mode, default = never.
+        std::chrono::steady_clock::time_point flushDue() const
+        {
+            const auto a = _a.flushDue();
+            const auto b = _b.flushDue();
+            if (a == std::chrono::steady_clock::time_point()) return b;
+            if (b == std::chrono::steady_clock::time_point()) return a;
+            return std::min(a, b);
+        }
+
+        bool parked() const
+        {
+            return _parkedUntil != std::chrono::steady_clock::time_point();
+        }
+
+        // Whether the channel can move to another thread: it holds no buffer blocks (they belong to
+        // its thread's pool), is open and waits on no timer, so all that moves is its registration.
+        bool canMigrate() const
+        {
+            const bool idleHttp = _http != nullptr && !_b.attached() && !_b.closed();
+            const bool open = _b.connected() && !_a.closed() && !_b.closed() && !throttled();
+            return (idleHttp || open) && !parked() && !_a.holdsBuffer() && !_b.holdsBuffer();
+        }
+
+        Socket& getSocket(int fd)
         {
-            if (fd == _a->fd()) return *_a;
-            if (fd == _b->fd()) return *_b;
+            if (fd == _a.fd()) return _a;
+            if (fd == _b.fd()) return _b;
             throw std::runtime_error("unexpected fd for channel");
         }
 	};
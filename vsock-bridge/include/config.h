@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cstdint>
+#include <optional>
 #include <string>
 #include <vector>
 
@@ -10,6 +11,9 @@ namespace vsockproxy
 	{
 		UNKNOWN = 0,
 		DIRECT_PROXY,
+		HTTP_PROXY,     // HTTP/1.1 aware, backend connections are pooled between keep-alive exchanges
+		MUX_CLIENT,     // carries its clients as streams over a few tunnels to a mux server
+		MUX_SERVER,     // accepts tunnels from a mux client, connects each stream to the backend
 	};
 
 	enum class EndpointScheme : uint8_t
@@ -17,6 +21,7 @@ namespace vsockproxy
 		UNKNOWN = 0,
 		VSOCK,
 		TCP4,
+		UNIX,
 	};
 
 	struct EndpointConfig
@@ -24,6 +29,7 @@ namespace vsockproxy
 		EndpointScheme _scheme = EndpointScheme::UNKNOWN;
 		std::string _address;
 		uint16_t _port = 0;
+		uint16_t _portCount = 1; // a range like 9000-9099 starts at _port
 	};
 
 	struct ServiceDescription
@@ -32,9 +38,44 @@ namespace vsockproxy
 		ServiceType _type = ServiceType::UNKNOWN;
 		EndpointConfig _listenEndpoint;
 		EndpointConfig _connectEndpoint;
+		uint32_t _resolveTtlSeconds = 30;
+
+		// admission control, 0 = unlimited
+		uint32_t _maxChannels = 0;
+		uint32_t _resumeChannels = 0;
+		uint32_t _maxAcceptRate = 0;
+		uint32_t _maxLoopLagMs = 0;
+		bool _rejectWhenOverloaded = false;
+
+		// traffic shaping in bytes per second, 0 = unlimited
+		uint64_t _rateLimit = 0;
+		uint64_t _connectionRateLimit = 0;
+		uint64_t _rateLimitBurst = 0;
+
+		// IO buffer size bounds in bytes, 0 = default (2k and 256k)
+		uint64_t _bufferMin = 0;
+		uint64_t _bufferMax = 0;
+		uint64_t _maxBufferedBytes = 0; // 0 = unlimited
+
+		// dedicated worker pool, 0 workers and no cpus = use the shared pool
+		uint32_t _workers = 0;   // 0 with cpus set = one worker per CPU
+		std::vector<int> _cpus;  // CPUs the pool's workers may run on, empty = any
+
+		uint8_t _priority = 1; // scheduling class on shared workers: 0 = high, 1 = normal, 2 = low
+		uint32_t _timingSampleRate = 0; // log the lifecycle timeline of one in this many channels, 0 = none
+		bool _coroutineEngine = false; // relay on the coroutine engine, only in builds with VSOCK_COROUTINES
+		uint32_t _maxIdleBackends = 16; // http services: idle backend connections kept for reuse
+		uint32_t _muxWindow = 256 * 1024; // mux services: bytes a stream may have in flight in each direction
+		uint32_t _muxMaxStreams = 1024; // mux services: streams open at a time on one tunnel
+		uint8_t _compress = 0; // side carrying a compressed stream: 0 = none, 1 = listen, 2 = connect
+		bool _coalesceWrites = false; // write-mode: throughput, merge small writes into fewer packets
+		uint32_t _coalesceDelayUs = 0; // throughput mode: how long writes are held, 0 = until the end of the worker's loop iteration
 	};
 
 	std::vector<ServiceDescription> loadConfig(const std::string& filepath);
 
 	std::string describe(const ServiceDescription& sd);
+
+	// Byte size with an optional binary suffix, e.g. 512, 64k, 10M, 1g.
+	std::optional<uint64_t> parseSize(const std::string& s);
 }
\ No newline at end of file
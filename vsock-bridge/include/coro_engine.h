@@ -0,0 +1,277 @@
+#pragma once
+
+#if !defined(VSOCK_COROUTINES)
+#error "the coroutine engine needs a build with -DVSOCK_COROUTINES=ON"
+#endif
+
+#include "buffer.h"
+#include "channel.h"
+#include "poller.h"
+#include "service.h"
+#include "shaper.h"
+#include "slab.h"
+#include "socket.h"
+#include "syscall_stats.h"
+#include "timeline.h"
+
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <ostream>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace vsockio
+{
+    // Free lists of coroutine frames in 64 byte size classes. Frames are created and destroyed on
+    // their IO thread, so every thread has its own pool and, once warmed up, opening a channel
+    // does not touch the global allocator. Larger frames go to the global allocator.
+    class FramePool
+    {
+    public:
+        static constexpr size_t GRANULE = 64;
+        static constexpr size_t MAX_POOLED_SIZE = 2048;
+
+        static FramePool& local();
+
+        FramePool() = default;
+        FramePool(const FramePool&) = delete;
+        FramePool& operator=(const FramePool&) = delete;
+        ~FramePool();
+
+        void* allocate(size_t size);
+        void deallocate(void* frame, size_t size);
+
+        // Bytes of frames currently alive, rounded up to their size class.
+        size_t inUseBytes() const { return _inUseBytes; }
+
+    private:
+        static size_t sizeClass(size_t size) { return (size + GRANULE - 1) / GRANULE; }
+
+        std::vector<void*> _free[MAX_POOLED_SIZE / GRANULE + 1];
+        size_t _inUseBytes = 0;
+    };
+
+    // A coroutine that starts suspended and stays suspended when it finishes, so its owner decides
+    // when it runs (by scheduling it) and when its frame goes away.
+    class CoroTask
+    {
+    public:
+        struct promise_type
+        {
+            CoroTask get_return_object() { return CoroTask(std::coroutine_handle<promise_type>::from_promise(*this)); }
+            std::suspend_always initial_suspend() noexcept { return {}; }
+            std::suspend_always final_suspend() noexcept { return {}; }
+            void return_void() {}
+            void unhandled_exception();
+
+            static void* operator new(size_t size) { return FramePool::local().allocate(size); }
+            static void operator delete(void* frame, size_t size) { FramePool::local().deallocate(frame, size); }
+        };
+
+        CoroTask() = default;
+        CoroTask(CoroTask&& other) noexcept : _handle(std::exchange(other._handle, {})) {}
+        CoroTask& operator=(CoroTask&& other) noexcept
+        {
+            if (this != &other)
+            {
+                reset();
+                _handle = std::exchange(other._handle, {});
+            }
+            return *this;
+        }
+        ~CoroTask() { reset(); }
+
+        std::coroutine_handle<> handle() const { return _handle; }
+        explicit operator bool() const { return static_cast<bool>(_handle); }
+
+        void reset()
+        {
+            if (_handle)
+            {
+                _handle.destroy();
+                _handle = {};
+            }
+        }
+
+    private:
+        explicit CoroTask(std::coroutine_handle<promise_type> handle) : _handle(handle) {}
+
+        std::coroutine_handle<promise_type> _handle;
+    };
+
+    struct CoroChannel;
+    class CoroEngine;
+
+    // One side of a coroutine channel. Readiness is edge-triggered: a flag is set by a poller event
+    // and cleared when a call returns EAGAIN, and the coroutine awaiting it is resumed on the event.
+    struct CoroSocket
+    {
+        CoroSocket(int fd, bool connected, CoroChannel& channel)
+            : _fd(fd)
+            , _connected(connected)
+            , _readable(connected)
+            , _writable(connected)
+            , _channel(channel)
+            , _handle(nullptr, 0, fd)
+        {
+            _handle._coroutine = this;
+        }
+
+        struct Readiness
+        {
+            bool& _ready;
+            std::coroutine_handle<>& _waiter;
+
+            bool await_ready() const noexcept { return _ready; }
+            void await_suspend(std::coroutine_handle<> handle) noexcept { _waiter = handle; }
+            void await_resume() const noexcept {}
+        };
+
+        Readiness readable() { return {_readable, _readWaiter}; }
+        Readiness writable() { return {_writable, _writeWaiter}; }
+
+        const int _fd;
+        bool _connected;
+        bool _readable;
+        bool _writable;
+        bool _closed = false;
+        uint64_t _bytesRead = 0;
+        std::coroutine_handle<> _readWaiter;
+        std::coroutine_handle<> _writeWaiter;
+        CoroChannel& _channel;
+        ChannelHandle _handle;  // registered with the poller, points back here
+    };
+
+    // A channel relayed by coroutines: one that waits for the backend connection, then one per direction.
+    struct CoroChannel
+    {
+        CoroChannel(int id, int aFd, bool aConnected, int bFd, bool bConnected, ServiceContext* service)
+            : _id(id)
+            , _service(service)
+            , _shaper(service != nullptr ? service->createShaper() : nullptr)
+            , _a(aFd, aConnected, *this)
+            , _b(bFd, bConnected, *this)
+        {
+            if (service != nullptr)
+            {
+                _aToB.setLimits(service->_options._buffers);
+                _bToA.setLimits(service->_options._buffers);
+                _aToB.setBudget(&service->_bufferBudget);
+                _bToA.setBudget(&service->_bufferBudget);
+            }
+        }
+
+        const char* state() const
+        {
+            if (!_b._connected) return "connecting";
+            if (_closing) return "closing";
+            return "open";
+        }
+
+        uint64_t bytesRelayed() const { return _a._bytesRead + _b._bytesRead; }
+
+        const int _id;
+        ServiceContext* const _service;
+        std::unique_ptr<Shaper> _shaper;
+        ChannelTimeline _timeline;
+        SyscallCounts _syscalls;
+        CoroSocket _a;
+        CoroSocket _b;
+        Buffer _aToB;   // read from a, written to b
+        Buffer _bToA;
+        CoroTask _open;
+        CoroTask _aToBTask;
+        CoroTask _bToATask;
+        bool _closing = false;
+    };
+
+    // Runs the coroutine channels of one IO thread. The thread routes poller events for their sockets
+    // here and calls run() and cleanup() once per loop iteration; everything happens on that thread.
+    //
+    // Rate limits and buffer budgets apply as with the state machine channels. Priority classes do
+    // not: coroutine channels are resumed in the order their sockets became ready.
+    class CoroEngine
+    {
+    public:
+        using Clock = std::chrono::steady_clock;
+
+        // A direction hands the thread to other ready coroutines after relaying this much in one go.
+        static constexpr uint64_t YIELD_BYTES = 256 * 1024;
+
+        CoroEngine(size_t threadId, Poller& poller, SocketImpl& impl, SyscallCounters& threadSyscalls)
+            : _threadId(threadId), _poller(poller), _impl(impl), _threadSyscalls(threadSyscalls) {}
+
+        CoroEngine(const CoroEngine&) = delete;
+        CoroEngine& operator=(const CoroEngine&) = delete;
+
+        ~CoroEngine();
+
+        void addChannel(int id, PendingSocket&& a, PendingSocket&& b, ServiceContext* service, const ChannelTimeline& timeline);
+
+        void onEvent(CoroSocket* socket, IOEvent flags);
+
+        // Some coroutine can run right away, so the thread should not block in poll.
+        bool hasWork(Clock::time_point now) const
+        {
+            return !_ready.empty() || (!_timers.empty() && _timers.begin()->first <= now);
+        }
+
+        // Resumes the coroutines that are ready, including those whose timer expired.
+        void run();
+
+        // Closes channels that finished during run().
+        void cleanup();
+
+        void describeChannels(std::ostream& os) const;
+
+        size_t channels() const { return _channels.size(); }
+
+    private:
+        struct Sleep
+        {
+            CoroEngine& _engine;
+            Clock::time_point _until;
+
+            bool await_ready() const noexcept { return false; }
+            void await_suspend(std::coroutine_handle<> handle) { _engine._timers.emplace(_until, handle); }
+            void await_resume() const noexcept {}
+        };
+
+        // Goes to the back of the run queue, unless nothing else is waiting to run.
+        struct Yield
+        {
+            CoroEngine& _engine;
+
+            bool await_ready() const noexcept { return _engine._ready.empty(); }
+            void await_suspend(std::coroutine_handle<> handle) { _engine._ready.push_back(handle); }
+            void await_resume() const noexcept {}
+        };
+
+        Sleep sleepFor(Clock::duration duration) { return {*this, Clock::now() + duration}; }
+        Yield yield() { return {*this}; }
+
+        CoroTask open(CoroChannel& channel);
+        CoroTask relay(CoroChannel& channel, CoroSocket& from, CoroSocket& to, Buffer& buffer);
+
+        void record(CoroChannel& channel, Syscall syscall, SyscallOutcome outcome);
+        static SyscallOutcome outcomeOf(int err);
+        void close(CoroChannel& channel);
+        void closeSocket(CoroChannel& channel, CoroSocket& socket);
+        void destroy(CoroChannel* channel);
+        void cancel(std::coroutine_handle<> handle);
+
+        const size_t _threadId;
+        Poller& _poller;
+        SocketImpl& _impl;
+        SyscallCounters& _threadSyscalls;
+        Slab<CoroChannel> _slab;
+        std::unordered_set<CoroChannel*> _channels;
+        std::vector<CoroChannel*> _closing;
+        std::deque<std::coroutine_handle<>> _ready;
+        std::multimap<Clock::time_point, std::coroutine_handle<>> _timers;
+    };
+}
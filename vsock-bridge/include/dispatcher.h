@@ -10,9 +10,14 @@ namespace vsockio
     public:
         explicit Dispatcher(const IOThreadPool& threadPool) : _threadPool(threadPool) {}
 
-        void addChannel(std::unique_ptr<Socket>&& ap, std::unique_ptr<Socket>&& bp)
+        void addChannel(PendingSocket&& a, PendingSocket&& b, ServiceContext* service, const ChannelTimeline& timeline = {}, int incomingCpu = -1)
         {
-            _threadPool.addChannel(std::move(ap), std::move(bp));
+            _threadPool.addChannel(std::move(a), std::move(b), service, timeline, incomingCpu);
+        }
+
+        std::chrono::microseconds loopLag() const
+        {
+            return _threadPool.loopLag();
         }
 
     private:
@@ -1,12 +1,18 @@
 #pragma once
 
+#include <algorithm>
+#include <cstddef>
+#include <memory>
 #include <string>
 
+#include "resolver.h"
+
 #include <arpa/inet.h>
 #include <linux/vm_sockets.h>
 #include <netinet/in.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 
 namespace vsockio
 {
@@ -18,6 +24,9 @@ namespace vsockio
 		virtual std::pair<sockaddr*, socklen_t> getWritableAddress() = 0;
 		virtual std::string describe() const = 0;
 		virtual std::unique_ptr<Endpoint> clone() const = 0;
+		virtual bool resolved() const { return true; }
+		// Moves a rotating endpoint on to the address for its next connection; getAddress() does not.
+		virtual void nextAddress() const {}
 	};
 
 	struct TCP4Endpoint : public Endpoint
@@ -70,6 +79,63 @@ namespace vsockio
 		uint16_t _port;
 	};
 
+	// TCP connect endpoint addressed by hostname. Addresses come from the Resolver,
+	// successive connections rotate through all addresses of the current set.
+	struct TCP4HostnameEndpoint : public Endpoint
+	{
+		explicit TCP4HostnameEndpoint(std::shared_ptr<Resolver::Entry> entry) : _entry(std::move(entry))
+		{
+			memset(&_saddr, 0, sizeof(_saddr));
+			_saddr.sin_family = AF_INET;
+			_saddr.sin_port = htons(_entry->_port);
+		}
+
+		int getSocket() const override
+		{
+			return socket(AF_INET, SOCK_STREAM, 0);
+		}
+
+		std::pair<const sockaddr*, socklen_t> getAddress() const override
+		{
+			const auto addresses = _entry->addresses();
+			if (!addresses->empty())
+			{
+				_saddr = (*addresses)[_next % addresses->size()];
+			}
+			return std::make_pair((sockaddr*)&_saddr, sizeof(_saddr));
+		}
+
+		void nextAddress() const override
+		{
+			_next++;
+		}
+
+		std::pair<sockaddr*, socklen_t> getWritableAddress() override
+		{
+			_saddr.sin_family = AF_INET;
+			return std::make_pair((sockaddr*)&_saddr, sizeof(_saddr));
+		}
+
+		std::string describe() const override
+		{
+			return "tcp4://" + _entry->_hostname + ":" + std::to_string(_entry->_port);
+		}
+
+		std::unique_ptr<Endpoint> clone() const override
+		{
+			return std::unique_ptr<Endpoint>(new TCP4HostnameEndpoint(_entry));
+		}
+
+		bool resolved() const override
+		{
+			return !_entry->addresses()->empty();
+		}
+
+		std::shared_ptr<Resolver::Entry> _entry;
+		mutable sockaddr_in _saddr;
+		mutable size_t _next = 0;
+	};
+
 	struct VSockEndpoint : public Endpoint
 	{
 		VSockEndpoint(int cid, int port) : _cid(cid), _port(port)
@@ -111,4 +177,60 @@ namespace vsockio
 		uint16_t _port;
 	};
 
+	struct UnixEndpoint : public Endpoint
+	{
+		// A leading '@' selects the Linux abstract namespace (no filesystem entry).
+		explicit UnixEndpoint(const std::string& path) : _path(path)
+		{
+			memset(&_saddr, 0, sizeof(_saddr));
+			_saddr.sun_family = AF_UNIX;
+			const size_t len = std::min(_path.size(), sizeof(_saddr.sun_path) - 1);
+			memcpy(_saddr.sun_path, _path.data(), len);
+			if (isAbstract())
+			{
+				_saddr.sun_path[0] = '\0';
+				_addrLen = offsetof(sockaddr_un, sun_path) + len;
+			}
+			else
+			{
+				_addrLen = offsetof(sockaddr_un, sun_path) + len + 1;
+			}
+		}
+
+		int getSocket() const override
+		{
+			return socket(AF_UNIX, SOCK_STREAM, 0);
+		}
+
+		std::pair<const sockaddr*, socklen_t> getAddress() const override
+		{
+			return std::make_pair((sockaddr*)&_saddr, _addrLen);
+		}
+
+		std::pair<sockaddr*, socklen_t> getWritableAddress() override
+		{
+			_saddr.sun_family = AF_UNIX;
+			return std::make_pair((sockaddr*)&_saddr, sizeof(_saddr));
+		}
+
+		std::string describe() const override
+		{
+			return "unix://" + _path;
+		}
+
+		std::unique_ptr<Endpoint> clone() const override
+		{
+			return std::unique_ptr<Endpoint>(new UnixEndpoint(_path));
+		}
+
+		bool isAbstract() const
+		{
+			return !_path.empty() && _path[0] == '@';
+		}
+
+		sockaddr_un _saddr;
+		socklen_t _addrLen;
+		std::string _path;
+	};
+
 }
\ No newline at end of file
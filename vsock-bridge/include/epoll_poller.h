@@ -43,14 +43,16 @@ namespace vsockio
 			return true;
 		}
 
-		void remove(int fd) override
+		bool remove(int fd) override
 		{
 			epoll_event ev;
 			if (epoll_ctl(_epollFd, EPOLL_CTL_DEL, fd, &ev) != 0)
 			{
 				const int err = errno;
 				Logger::instance->Log(Logger::ERROR, "epoll_ctl failed to delete fd=", fd, ": ", strerror(err));
+				return false;
 			}
+			return true;
 		}
 
 		int poll(VsbEvent* outEvents, int timeout) override
@@ -0,0 +1,119 @@
+#pragma once
+
+#include "socket.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+
+namespace vsockio
+{
+    // Follows the message framing of one direction of an HTTP/1.1 connection as bytes go by,
+    // without copying them: start line and headers are scanned line by line, bodies are skipped
+    // by Content-Length or chunk sizes. Only what is needed to find message boundaries and
+    // whether the connection may be reused is looked at.
+    //
+    // Anything the framer cannot follow (upgrades, CONNECT, bodies delimited by close, malformed
+    // input) makes it opaque: it stops looking and the connection is never reused.
+    class HttpFramer : public StreamObserver
+    {
+    public:
+        enum class Kind
+        {
+            Request,
+            Response,
+        };
+
+        static constexpr size_t MAX_HEADER_BYTES = 64 * 1024;
+
+        // Response framers need to know which requests were HEAD requests, as their responses have no body:
+        // the request framer of the same connection appends one entry per request, the response framer takes them.
+        HttpFramer(Kind kind, std::deque<bool>& headRequests)
+            : _kind(kind), _headRequests(headRequests) {}
+
+        void feed(const uint8_t* data, size_t len);
+
+        void onData(const uint8_t* data, size_t len) override { feed(data, len); }
+
+        // Messages completed so far, interim (1xx) responses not included.
+        uint64_t messages() const { return _messages; }
+
+        // Between messages, with no partial message seen.
+        bool atBoundary() const { return _state == State::StartLine && _line.empty(); }
+
+        // The last completed message leaves the connection open for another one.
+        bool keepAlive() const { return _keepAlive; }
+
+        bool opaque() const { return _state == State::Opaque; }
+
+    private:
+        enum class State
+        {
+            StartLine,
+            Headers,
+            Body,           // _remaining bytes of a Content-Length body
+            ChunkSize,
+            ChunkData,      // _remaining bytes of the current chunk
+            ChunkDataEnd,   // CRLF after the chunk data
+            Trailers,
+            Opaque,
+        };
+
+        // Returns the bytes consumed, at most len.
+        size_t scanLine(const uint8_t* data, size_t len);
+        void onLine();
+        void onStartLine();
+        void onHeader();
+        void onHeadersDone();
+        void onMessageDone();
+        void resetMessage();
+        void becomeOpaque() { _state = State::Opaque; _line.clear(); }
+
+        const Kind _kind;
+        std::deque<bool>& _headRequests;
+        State _state = State::StartLine;
+        std::string _line;          // partial line carried over between feeds
+        std::string_view _current;  // the complete line being looked at, CR LF removed
+        size_t _headerBytes = 0;
+        uint64_t _remaining = 0;
+        uint64_t _messages = 0;
+        bool _keepAlive = false;
+
+        // the message being parsed
+        bool _http11 = false;
+        bool _head = false;             // request: HEAD; response: answers a HEAD request
+        int _status = 0;
+        bool _hasContentLength = false;
+        uint64_t _contentLength = 0;
+        bool _chunked = false;
+        bool _connectionClose = false;
+        bool _connectionKeepAlive = false;
+    };
+
+    // Request and response framing of one client connection, used to tell when the backend
+    // connection is idle and may go back to the service's pool.
+    struct HttpSession
+    {
+        HttpSession()
+            : _requests(HttpFramer::Kind::Request, _headRequests)
+            , _responses(HttpFramer::Kind::Response, _headRequests) {}
+
+        HttpSession(const HttpSession&) = delete;
+        HttpSession& operator=(const HttpSession&) = delete;
+
+        // Every request has been answered in full and both sides asked to keep the connection.
+        bool backendIdle() const
+        {
+            return !_requests.opaque() && !_responses.opaque()
+                && _requests.atBoundary() && _responses.atBoundary()
+                && _responses.messages() != 0 && _responses.messages() == _requests.messages()
+                && _requests.keepAlive() && _responses.keepAlive();
+        }
+
+        std::deque<bool> _headRequests;
+        HttpFramer _requests;
+        HttpFramer _responses;
+    };
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "logger.h"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <sys/fcntl.h>
+#include <sys/socket.h>
+
+namespace vsockio
+{
+	struct IOControl {
+		static bool setNonBlocking(int fd) {
+			const int flags = fcntl(fd, F_GETFL, 0);
+			if (flags == -1) {
+				const int err = errno;
+				Logger::instance->Log(Logger::ERROR, "fcntl error: ", strerror(err));
+				return false;
+			}
+			if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+				const int err = errno;
+				Logger::instance->Log(Logger::ERROR, "fcntl error: ", strerror(err));
+				return false;
+			}
+			return true;
+		}
+
+		static int setBlocking(int fd) {
+			const int flags = fcntl(fd, F_GETFL, 0);
+			if (flags == -1) {
+				int err = errno;
+				Logger::instance->Log(Logger::ERROR, "fcntl error: ", strerror(err));
+				return false;
+			}
+			if (fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) == -1) {
+				int err = errno;
+				Logger::instance->Log(Logger::ERROR, "fcntl error: ", strerror(err));
+				return false;
+			}
+			return true;
+		}
+
+        static bool setTcpNoDelay(int fd) {
+            int enable = 1;
+            if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable)) < 0)
+            {
+                const int err = errno;
+                Logger::instance->Log(Logger::ERROR, "setsockopt error: ", strerror(err));
+                return false;
+            }
+            return true;
+        }
+
+        // Lets the kernel busy poll the device queue for up to `us` microseconds on blocking reads and polls.
+        // Raising it above net.core.busy_read requires CAP_NET_ADMIN.
+        static bool setBusyPoll(int fd, int us) {
+            if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &us, sizeof(us)) < 0)
+            {
+                const int err = errno;
+                Logger::instance->Log(Logger::DEBUG, "setsockopt SO_BUSY_POLL error (fd=", fd, "): ", strerror(err));
+                return false;
+            }
+            return true;
+        }
+	};
+}
@@ -1,12 +1,28 @@
 #pragma once
 
+#include "busy_poll.h"
 #include "channel.h"
+#if defined(VSOCK_COROUTINES)
+#include "coro_engine.h"
+#endif
+#include "metrics.h"
+#include "mux.h"
+#include "placement.h"
 #include "poller.h"
+#include "ready_queues.h"
+#include "slab.h"
 #include "socket.h"
+#include "syscall_stats.h"
 #include "threading.h"
 
+#include <algorithm>
 #include <atomic>
+#include <chrono>
 #include <functional>
+#include <mutex>
+#include <ostream>
+#include <set>
+#include <string>
 #include <thread>
 #include <unordered_map>
 #include <unordered_set>
@@ -17,15 +33,35 @@ namespace vsockio
     class IOThread
     {
     public:
-        explicit IOThread(size_t threadId, PollerFactory& pollerFactory)
+        IOThread(size_t threadId, PollerFactory& pollerFactory, const BusyPollOptions& busyPoll = {})
             : _id(threadId)
+            , _busyPoll(busyPoll)
+            , _spin(std::chrono::microseconds(busyPoll._maxSpinUs))
+            , _busyNs(Metrics::instance->counter("iothread." + std::to_string(threadId) + ".busy_ns"))
+            , _spinNs(Metrics::instance->counter("iothread." + std::to_string(threadId) + ".spin_ns"))
+            , _idleNs(Metrics::instance->counter("iothread." + std::to_string(threadId) + ".idle_ns"))
+            , _spinWindowUs(Metrics::instance->gauge("iothread." + std::to_string(threadId) + ".spin_window_us"))
+            , _migratedIn(Metrics::instance->counter("iothread." + std::to_string(threadId) + ".migrated_in"))
+            , _migratedOut(Metrics::instance->counter("iothread." + std::to_string(threadId) + ".migrated_out"))
+            , _syscalls("iothread." + std::to_string(threadId))
             , _poller(pollerFactory.createPoller())
+            , _readyChannels(readyWaitHistograms(threadId))
             , _events(_poller->maxEventsPerPoll())
+            , _mux(threadId, *_poller, *SocketImpl::singleton, _syscalls)
+#if defined(VSOCK_COROUTINES)
+            , _coroutines(threadId, *_poller, *SocketImpl::singleton, _syscalls)
+#endif
             , _thr([this] { run(); })
         {
         }
 
         ~IOThread()
+        {
+            stop();
+        }
+
+        // Ends the loop and waits for it, channels left open stay where they are.
+        void stop()
         {
             _terminateFlag = true;
 
@@ -37,53 +73,320 @@ namespace vsockio
 
         size_t id() const { return _id; }
 
-        void addChannel(std::unique_ptr<Socket>&& ap, std::unique_ptr<Socket>&& bp);
+        // Restricts the thread to the given CPUs, returns false if the kernel refused.
+        bool setAffinity(const std::vector<int>& cpus);
+
+        void addChannel(PendingSocket&& a, PendingSocket&& b, ServiceContext* service, const ChannelTimeline& timeline = {});
+
+        // Runs a task on this thread between two polls, so other threads can look at channels
+        // without any locking in the loop. Tasks must be short and must not block.
+        void post(std::function<void()>&& task);
+
+        // One line per channel with its state and byte counts. Only call on this thread, e.g. from a posted task.
+        void describeChannels(std::ostream& os) const;
+
+        // Syscalls made by this thread, split by outcome, and the bytes it relayed.
+        const SyscallCounters& syscalls() const { return _syscalls; }
+
+        // Smoothed time the loop spends between polls, i.e. how late readiness events get handled.
+        std::chrono::microseconds loopLag() const { return std::chrono::microseconds(_loopLagUs.load(std::memory_order_relaxed)); }
+
+        // CPU the loop last ran on, -1 before its first iteration.
+        int cpu() const { return _cpu.load(std::memory_order_relaxed); }
+
+        // Channels and tunnels as of the loop's last iteration, plus those dispatched to it since.
+        size_t channelCount() const { return _channelCount.load(std::memory_order_relaxed); }
+
+        // Nanoseconds spent handling events so far, for utilization over an interval.
+        uint64_t busyNs() const { return _busyNs.value(); }
+
+        // Lets the thread stop once it has no channels left. New channels must no longer be
+        // dispatched to it; channels it already has are relayed until they close.
+        void retire() { _retiring.store(true, std::memory_order_relaxed); }
+
+        // Takes a retiring thread back into service, starting it again if it has already stopped.
+        void reactivate();
+
+        bool running() const { return !_stopped.load(std::memory_order_acquire); }
+
+        // Moves channels of this thread to target, another thread of the same pool, from a task on
+        // this thread. Given this thread's load (share of time busy) and the load it should come down
+        // to, it moves the channel that relayed the most since last time without overshooting, or
+        // with all set, every channel that can move (for a retiring thread).
+        void offloadTo(IOThread& target, double load, double targetLoad, bool all);
+
+        // Takes over a channel another thread has let go of; it is registered on the next loop
+        // iteration and served once regardless of events, which may have been missed in between.
+        // Returns false if this thread has stopped.
+        bool adoptChannel(DirectChannel* channel);
 
     private:
         struct PendingChannel
         {
-            std::unique_ptr<Socket> _ap;
-            std::unique_ptr<Socket> _bp;
+            PendingSocket _a;
+            PendingSocket _b;
+            ServiceContext* _service;
+            ChannelTimeline _timeline;
         };
 
         void run();
+        // No channels, streams or tunnels with streams left, and none on the way.
+        bool idle();
+        // Channels, tunnels and channels on the way, for channelCount().
+        size_t channelsHeld();
         void addPendingChannels();
+        void runTasks();
         void addPendingChannel(PendingChannel&& pendingChannel);
+        void addMigratedChannels();
+        void moveChannels(IOThread& target, double load, double targetLoad, bool all);
+        // Unregisters a channel that canMigrate() from this thread, leaving it to another.
+        void detachChannel(DirectChannel* channel);
+        bool addToPoller(int fd, ChannelHandle* handle);
         void poll();
-        int getPollTimeout() const;
+        int getPollTimeout(std::chrono::steady_clock::time_point now) const;
         void performIO();
+        // Writes what throughput mode channels held back during performIO().
+        void flushHeldBack();
         void cleanup();
+        void park(DirectChannel* channel, std::chrono::steady_clock::time_point until);
+        void wakeParkedChannels();
+        void updateLoopLag(std::chrono::steady_clock::duration iterationTime);
+        bool serve(DirectChannel* channel);
+        static std::array<Histogram*, NUM_PRIORITIES> readyWaitHistograms(size_t threadId);
 
         const size_t _id;
+        const BusyPollOptions _busyPoll;
+        AdaptiveSpin _spin;
+        // where the thread's time goes: handling events, polling without blocking while spinning, blocked in poll
+        Counter& _busyNs;
+        Counter& _spinNs;
+        Counter& _idleNs;
+        Gauge& _spinWindowUs;
+        Counter& _migratedIn;
+        Counter& _migratedOut;
+        SyscallCounters _syscalls;
         std::atomic<bool> _terminateFlag = false;
+        std::atomic<bool> _retiring = false;
+        std::atomic<bool> _stopped = false;
+        // channels moving in from other threads; a thread only stops with none left, see adoptChannel(),
+        // and while still retiring, see reactivate()
+        std::mutex _migrationLock;
+        std::vector<DirectChannel*> _migratedChannels;
+        std::atomic<int64_t> _loopLagUs = 0;
+        std::atomic<int> _cpu = -1;
+        std::atomic<size_t> _channelCount = 0;
+        bool _busyPollWarned = false;
         std::unique_ptr<Poller> _poller;
         ThreadSafeQueue<PendingChannel> _pendingChannels;
+        ThreadSafeQueue<std::function<void()>> _tasks;
         std::unordered_set<DirectChannel*> _channels;
-        std::unordered_set<DirectChannel*> _readyChannels;
+        ReadyQueues<DirectChannel> _readyChannels;
         std::unordered_set<DirectChannel*> _terminatedChannels;
+        // channels holding writes back until the end of this loop iteration
+        std::vector<DirectChannel*> _heldBackChannels;
+        // channels waiting on a timer (e.g. for rate limit tokens), ordered by wake up time
+        std::set<std::pair<std::chrono::steady_clock::time_point, DirectChannel*>> _parkedChannels;
         std::vector<VsbEvent> _events;
+        Slab<DirectChannel> _channelSlab;
+        MuxEngine _mux;
+#if defined(VSOCK_COROUTINES)
+        CoroEngine _coroutines;
+#endif
         std::thread _thr;
     };
 
     class IOThreadPool
     {
     public:
-        explicit IOThreadPool(size_t size, PollerFactory& pollerFactory)
+        // Thread ids (and so metric names) start at firstThreadId, keeping them unique across pools.
+        // With cpus set, every thread of the pool may run on any of those CPUs and no others.
+        // With pinEach too, thread i runs on cpus[i % cpus.size()] only.
+        // A pool with maxSize above size can grow() to that many threads at runtime and shrink() again.
+        IOThreadPool(size_t size, PollerFactory& pollerFactory, const BusyPollOptions& busyPoll = {}, size_t firstThreadId = 0, const std::vector<int>& cpus = {}, size_t maxSize = 0, bool pinEach = false)
+            : _pollerFactory(pollerFactory)
+            , _busyPoll(busyPoll)
+            , _firstThreadId(firstThreadId)
+            , _cpus(cpus)
+            , _pinEach(pinEach)
+            , _maxSize(std::max(size, maxSize))
+            , _threads(new std::unique_ptr<IOThread>[_maxSize])
+            , _placedSameCpu(Metrics::instance->counter("dispatch.incoming_cpu.same_cpu"))
+            , _placedSameNode(Metrics::instance->counter("dispatch.incoming_cpu.same_node"))
+            , _placedElsewhere(Metrics::instance->counter("dispatch.incoming_cpu.other"))
         {
             for (size_t i = 0; i < size; ++i) {
-                _threads.push_back(std::make_unique<IOThread>(i, pollerFactory));
+                startThread(i);
             }
+            _started.store(size, std::memory_order_release);
+            _active.store(size, std::memory_order_release);
         }
 
-        void addChannel(std::unique_ptr<Socket>&& ap, std::unique_ptr<Socket>&& bp) const
+        ~IOThreadPool()
+        {
+            // channels moved between threads live in each other's slabs, so no thread may run on
+            // while another is destroyed
+            for (size_t i = 0; i < size(); i++)
+            {
+                _threads[i]->stop();
+            }
+        }
+
+        // Channels go round-robin over the active threads. In a pool with a thread pinned to each CPU,
+        // given the CPU that processes the client's packets (see incomingCpu()), a thread that runs on
+        // that CPU is preferred, then one on the same NUMA node, the least lagging of them if there are
+        // several, unless it is well behind the least loaded thread.
+        void addChannel(PendingSocket&& a, PendingSocket&& b, ServiceContext* service, const ChannelTimeline& timeline = {}, int incomingCpu = -1) const
         {
             thread_local static size_t channelCount = 0;
-            _threads[channelCount % _threads.size()]->addChannel(std::move(ap), std::move(bp));
+            // shrink() waits for dispatches that may still pick the thread it retires; sequentially
+            // consistent, so either shrink() sees this dispatch or this dispatch sees the new size
+            _dispatching.fetch_add(1);
+            const size_t active = _active.load();
+            size_t index = channelCount % active;
+            if (_pinEach && incomingCpu >= 0 && active > 1)
+            {
+                index = placeNear(incomingCpu, index, active);
+            }
+            _threads[index]->addChannel(std::move(a), std::move(b), service, timeline);
+            _dispatching.fetch_sub(1);
             ++channelCount;
         }
 
+        // Threads started so far, including retired ones, which keep their ids and metrics.
+        size_t size() const { return _started.load(std::memory_order_acquire); }
+
+        // Threads new channels are dispatched to.
+        size_t activeSize() const { return _active.load(std::memory_order_acquire); }
+
+        size_t maxSize() const { return _maxSize; }
+
+        IOThread& thread(size_t index) const { return *_threads[index]; }
+
+        // Adds a thread to the dispatch rotation: a retiring one if there is one, else a new one.
+        // Returns false at maxSize. Not to be called concurrently with shrink().
+        bool grow()
+        {
+            const size_t active = activeSize();
+            if (active == _maxSize)
+            {
+                return false;
+            }
+
+            if (active < size())
+            {
+                _threads[active]->reactivate();
+            }
+            else
+            {
+                startThread(active);
+                _started.store(active + 1, std::memory_order_release);
+            }
+            _active.store(active + 1, std::memory_order_release);
+            return true;
+        }
+
+        // Takes the last active thread out of the dispatch rotation; it stops once its channels
+        // have closed. Returns false with one thread left. Not to be called concurrently with grow().
+        bool shrink()
+        {
+            const size_t active = activeSize();
+            if (active <= 1)
+            {
+                return false;
+            }
+
+            _active.store(active - 1);
+            while (_dispatching.load() != 0)
+            {
+                std::this_thread::yield();
+            }
+            _threads[active - 1]->retire();
+            return true;
+        }
+
+        std::chrono::microseconds loopLag() const
+        {
+            std::chrono::microseconds lag{0};
+            for (size_t i = 0; i < size(); i++)
+            {
+                if (_threads[i]->running())
+                {
+                    lag = std::max(lag, _threads[i]->loopLag());
+                }
+            }
+            return lag;
+        }
+
     private:
-        std::vector<std::unique_ptr<IOThread>> _threads;
+        // how far above the pool's least loaded thread a thread near the client may be
+        static constexpr std::chrono::microseconds PLACEMENT_LAG_SLACK{500};
+        static constexpr size_t PLACEMENT_CHANNEL_SLACK = 16;
+
+        // The thread for a channel whose packets arrive on cpu, starting the search at the
+        // round-robin pick so equally good threads still take turns. Threads whose loop lag or
+        // channel count is well above the pool's lowest are left out, so one busy receive queue
+        // cannot pile its clients onto one thread.
+        size_t placeNear(int cpu, size_t start, size_t active) const
+        {
+            std::chrono::microseconds minLag = _threads[0]->loopLag();
+            size_t minChannels = _threads[0]->channelCount();
+            for (size_t i = 1; i < active; i++)
+            {
+                minLag = std::min(minLag, _threads[i]->loopLag());
+                minChannels = std::min(minChannels, _threads[i]->channelCount());
+            }
+            const auto overloaded = [&](const IOThread& thread) {
+                return thread.loopLag() > 2 * minLag + PLACEMENT_LAG_SLACK ||
+                    thread.channelCount() > minChannels + minChannels / 2 + PLACEMENT_CHANNEL_SLACK;
+            };
+
+            const CpuTopology& topology = CpuTopology::system();
+            const int node = topology.nodeOf(cpu);
+            size_t best = start;
+            int bestRank = 3; // 0 = same CPU, 1 = same node, 2 = elsewhere, 3 = none yet
+            for (size_t i = 0; i < active; i++)
+            {
+                const size_t index = (start + i) % active;
+                if (overloaded(*_threads[index]))
+                {
+                    continue;
+                }
+                const int threadCpu = _threads[index]->cpu();
+                const int rank = threadCpu == cpu ? 0 : node >= 0 && topology.nodeOf(threadCpu) == node ? 1 : 2;
+                if (rank < bestRank || (rank == bestRank && _threads[index]->loopLag() < _threads[best]->loopLag()))
+                {
+                    best = index;
+                    bestRank = rank;
+                }
+            }
+            (bestRank == 0 ? _placedSameCpu : bestRank == 1 ? _placedSameNode : _placedElsewhere).add();
+            return best;
+        }
+
+        void startThread(size_t index)
+        {
+            _threads[index] = std::make_unique<IOThread>(_firstThreadId + index, _pollerFactory, _busyPoll);
+            const std::vector<int> cpus = _pinEach && !_cpus.empty() ? std::vector<int>{_cpus[index % _cpus.size()]} : _cpus;
+            if (!cpus.empty() && !_threads[index]->setAffinity(cpus))
+            {
+                Logger::instance->Log(Logger::WARNING, "iothread id=", _firstThreadId + index, " could not be pinned to its CPUs, running unpinned");
+            }
+        }
+
+        PollerFactory& _pollerFactory;
+        const BusyPollOptions _busyPoll;
+        const size_t _firstThreadId;
+        const std::vector<int> _cpus;
+        const bool _pinEach;
+        const size_t _maxSize;
+        // fixed slots, so readers never see them move while the pool grows
+        std::unique_ptr<std::unique_ptr<IOThread>[]> _threads;
+        std::atomic<size_t> _started{0};
+        std::atomic<size_t> _active{0};
+        mutable std::atomic<int> _dispatching{0};
+        Counter& _placedSameCpu;
+        Counter& _placedSameNode;
+        Counter& _placedElsewhere;
     };
 
 }
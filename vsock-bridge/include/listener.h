@@ -4,9 +4,16 @@
 #include "dispatcher.h"
 #include "endpoint.h"
 #include "epoll_poller.h"
+#include "iocontrol.h"
 #include "logger.h"
+#include "placement.h"
+#include "service.h"
 
+#include <algorithm>
+#include <chrono>
 #include <cstdint>
+#include <mutex>
+#include <thread>
 
 #include <arpa/inet.h>
 #include <errno.h>
@@ -17,66 +24,38 @@
 #include <string.h>
 #include <sys/epoll.h>
 #include <sys/fcntl.h>
+#include <sys/poll.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 namespace vsockio
 {
-	struct IOControl {
-		static bool setNonBlocking(int fd) {
-			const int flags = fcntl(fd, F_GETFL, 0);
-			if (flags == -1) {
-				const int err = errno;
-				Logger::instance->Log(Logger::ERROR, "fcntl error: ", strerror(err));
-				return false;
-			}
-			if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
-				const int err = errno;
-				Logger::instance->Log(Logger::ERROR, "fcntl error: ", strerror(err));
-				return false;
-			}
-			return true;
-		}
-
-		static int setBlocking(int fd) {
-			const int flags = fcntl(fd, F_GETFL, 0);
-			if (flags == -1) {
-				int err = errno;
-				Logger::instance->Log(Logger::ERROR, "fcntl error: ", strerror(err));
-				return false;
-			}
-			if (fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) == -1) {
-				int err = errno;
-				Logger::instance->Log(Logger::ERROR, "fcntl error: ", strerror(err));
-				return false;
-			}
-			return true;
-		}
-
-        static bool setTcpNoDelay(int fd) {
-            int enable = 1;
-            if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable)) < 0)
-            {
-                const int err = errno;
-                Logger::instance->Log(Logger::ERROR, "setsockopt error: ", strerror(err));
-                return false;
-            }
-            return true;
-        }
-	};
-
+    // Accepts the clients of one listen socket and hands them to the dispatcher. The socket is
+    // non-blocking: run() serves it alone on the calling thread, an Acceptor serves many on one.
     struct Listener
     {
+        using Clock = AdmissionControl::Clock;
+
         const int MAX_POLLER_EVENTS = 256;
         const int SO_BACKLOG = 64;
+        // connections accepted per serve() call, so one busy port does not hold up the others
+        static constexpr int ACCEPT_BATCH = 16;
+        static constexpr std::chrono::milliseconds MIN_ACCEPT_BACKOFF{1};
+        static constexpr std::chrono::milliseconds MAX_ACCEPT_BACKOFF{500};
+        // how often a paused or draining listener checks whether it has been resumed
+        static constexpr std::chrono::milliseconds STATE_CHECK_INTERVAL{50};
 
-        Listener(std::unique_ptr<Endpoint>&& listenEndpoint, std::unique_ptr<Endpoint>&& connectEndpoint, Dispatcher& dispatcher)
+        Listener(std::unique_ptr<Endpoint>&& listenEndpoint, std::unique_ptr<Endpoint>&& connectEndpoint, Dispatcher& dispatcher, ServiceContext& service)
             : _fd(-1)
             , _listenEp(std::move(listenEndpoint))
             , _connectEp(std::move(connectEndpoint))
             , _events(new VsbEvent[MAX_POLLER_EVENTS])
             , _listenEpClone(_listenEp->clone())
             , _dispatcher(dispatcher)
+            , _service(service)
+            , _fdExhausted(Metrics::instance->counter("service." + service._name + ".fd_exhausted"))
+            , _acceptErrors(Metrics::instance->counter("service." + service._name + ".accept_errors"))
         {
 			const int fd = _listenEp->getSocket();
 			if (fd < 0)
@@ -93,6 +72,15 @@ namespace vsockio
 
             std::pair<const sockaddr*, socklen_t> addressAndLen = _listenEp->getAddress();
 
+            if (addressAndLen.first->sa_family == AF_UNIX)
+            {
+                const auto* unixAddress = reinterpret_cast<const sockaddr_un*>(addressAndLen.first);
+                if (unixAddress->sun_path[0] != '\0')
+                {
+                    removeStaleSocket(*unixAddress, addressAndLen.second);
+                }
+            }
+
             if (bind(fd, addressAndLen.first, addressAndLen.second) < 0)
             {
 				const int err = errno;
@@ -101,13 +89,34 @@ namespace vsockio
 				throw std::runtime_error("failed to bind");
             }
 
-            /* listener fd is blocking intentially */
-			if (!IOControl::setBlocking(fd))
+			if (!IOControl::setNonBlocking(fd))
 			{
-				throw std::runtime_error("failed to set blocking");
+				close(fd);
+				throw std::runtime_error("failed to set non-blocking");
 			}
 
             _fd = fd;
+            _spareFd = openSpareFd();
+
+            if (_service._options.connectsOnWorkers() && !_service._connect)
+            {
+                // channels connect from their IO threads, with an endpoint of their own
+                std::shared_ptr<Endpoint> backendEp = _connectEp->clone();
+                auto mutex = std::make_shared<std::mutex>();
+                _service._connect = [backendEp, mutex] {
+                    bool fdExhausted = false;
+                    PendingSocket backend = connectTo(*backendEp, fdExhausted, mutex.get());
+                    if (fdExhausted)
+                    {
+                        Logger::instance->Log(Logger::WARNING, "out of file descriptors connecting to ", backendEp->describe());
+                    }
+                    return backend;
+                };
+            }
+            if (_service._options._http && _service._backends == nullptr)
+            {
+                _service._backends = std::make_unique<BackendPool>("service." + _service._name, _service._options._maxIdleBackends, _service._connect);
+            }
         }
 
 		Listener(const Listener&) = delete;
@@ -119,9 +128,13 @@ namespace vsockio
 			{
 				close(_fd);
 			}
+			if (_spareFd >= 0)
+			{
+				close(_spareFd);
+			}
 		}
 
-        void run()
+        void start()
         {
             if (listen(_fd, SO_BACKLOG) < 0)
             {
@@ -131,89 +144,273 @@ namespace vsockio
             }
 
             Logger::instance->Log(Logger::INFO, "listening on ", _listenEp->describe(), ", fd=", _fd);
+        }
+
+        void run()
+        {
+            start();
 
             // accept loop
             for (;;)
             {
-                acceptConnection();
+                // wait for a client before deciding, rather than in accept, so that admission and
+                // admin state changes apply to the very next connection
+                const auto now = Clock::now();
+                if (now < _notBefore)
+                {
+                    std::this_thread::sleep_for(_notBefore - now);
+                }
+                else if (clientPending(STATE_CHECK_INTERVAL))
+                {
+                    _ready = true;
+                    serve(Clock::now());
+                }
             }
         }
 
-        void acceptConnection()
+        // Accepts pending clients until the backlog is empty (clearing ready()), ACCEPT_BATCH have
+        // been taken or admission, pausing or accept errors defer the rest until notBefore().
+        void serve(Clock::time_point now)
+        {
+            for (int i = 0; i < ACCEPT_BATCH && _ready && _notBefore <= now; i++)
+            {
+                if (admitConnection(now))
+                {
+                    acceptConnection();
+                }
+
+                if (_acceptBackoff.count() > 0)
+                {
+                    _notBefore = std::max(_notBefore, Clock::now() + _acceptBackoff);
+                }
+            }
+        }
+
+        // Set when the socket reports clients, until accept finds none left.
+        bool ready() const { return _ready; }
+        void setReady() { _ready = true; }
+        Clock::time_point notBefore() const { return _notBefore; }
+
+        // Returns true if the pending connection may be accepted. When overloaded or paused, either
+        // defers (leaving clients in the kernel backlog) or accepts and drops one connection.
+        bool admitConnection(Clock::time_point now)
+        {
+            switch (_service.state())
+            {
+                case ServiceContext::State::Paused:
+                    _notBefore = now + STATE_CHECK_INTERVAL;
+                    return false;
+                case ServiceContext::State::Draining:
+                    rejectConnection();
+                    return false;
+                case ServiceContext::State::Running:
+                    break;
+            }
+
+            AdmissionControl* decidedBy = nullptr;
+            const auto decision = _service.admit(now, _dispatcher.loopLag(), decidedBy);
+            if (decision == AdmissionControl::Decision::Admit)
+            {
+                return true;
+            }
+
+            if (_service._admission.limits()._overloadAction == AdmissionLimits::OverloadAction::Reject)
+            {
+                rejectConnection();
+            }
+            else
+            {
+                _notBefore = now + decidedBy->retryDelay(decision, now);
+            }
+            return false;
+        }
+
+        void rejectConnection()
+        {
+            const int clientFd = acceptClient();
+            if (clientFd >= 0)
+            {
+                close(clientFd);
+                _service._rejected.add();
+            }
+        }
+
+        // Accepts a client, returns -1 if there is none. Persistent errors (such as running out of
+        // file descriptors) make the accept loop back off exponentially instead of spinning, until
+        // a connection has been set up again.
+        int acceptClient()
         {
             // accepted connection should have the same protocol with listen endpoint
             auto addrAndLen = _listenEpClone->getWritableAddress();
             const int clientFd = accept(_fd, addrAndLen.first, &addrAndLen.second);
 
-            if (clientFd == -1)
+            if (clientFd >= 0)
             {
-                const int err = errno;
-                if (err == EAGAIN || err == EWOULDBLOCK)
-                {
-                    // nothing to accept
-                    return;
-                }
-                else
+                return clientFd;
+            }
+
+            const int err = errno;
+            if (err == EAGAIN || err == EWOULDBLOCK)
+            {
+                _ready = false;
+                return -1;
+            }
+            if (err == EINTR || err == ECONNABORTED)
+            {
+                // the client went away before we got to it
+                return -1;
+            }
+
+            if (err == EMFILE || err == ENFILE)
+            {
+                onFdExhausted(err);
+                shedWithSpareFd();
+            }
+            else
+            {
+                _acceptErrors.add();
+                if (_acceptBackoff.count() == 0)
                 {
-                    // accept failed
                     Logger::instance->Log(Logger::ERROR, "error during accept (fd=", _fd, "): ", strerror(err));
-                    return;
                 }
             }
 
-			auto inPeer = std::make_unique<Socket>(clientFd, *SocketImpl::singleton);
+            increaseBackoff();
+            return -1;
+        }
+
+        void acceptConnection()
+        {
+            const int clientFd = acceptClient();
+            if (clientFd == -1)
+            {
+                // woken up for a client that gave up, or none at all: the token was not used
+                _service.refund();
+                return;
+            }
+
+            ChannelTimeline timeline;
+            timeline._accepted = ChannelTimeline::Clock::now();
+
+			PendingSocket inPeer(clientFd);
 			if (!IOControl::setNonBlocking(clientFd))
 			{
 				Logger::instance->Log(Logger::ERROR, "failed to set non-blocking mode (fd=", clientFd, ")");
 				return;
 			}
 
-            if (_listenEp->getAddress().first->sa_family == AF_INET && !IOControl::setTcpNoDelay(clientFd))
+            const bool tcp = _listenEp->getAddress().first->sa_family == AF_INET;
+            if (tcp && !IOControl::setTcpNoDelay(clientFd))
             {
                 Logger::instance->Log(Logger::ERROR, "failed to turn off Nagle algorithm (fd=", clientFd, ")");
                 return;
             }
+            // the client's packets are processed on this CPU, its channel is best relayed there too
+            const int cpu = tcp ? incomingCpu(clientFd) : -1;
 
-            auto outPeer = connectToPeer();
-			if (!outPeer)
-			{
-				return;
-			}
+            // http channels take a backend connection from the pool once the client sends a request,
+            // mux channels carry their streams over tunnels
+            PendingSocket outPeer;
+            if (!_service._options.connectsOnWorkers())
+            {
+                outPeer = connectToPeer();
+                if (!outPeer)
+                {
+                    return;
+                }
+            }
+
+            inPeer.onConnected();
+            if (outPeer.connected())
+            {
+                timeline._connected = ChannelTimeline::Clock::now();
+            }
 
-            inPeer->onConnected();
+			Logger::instance->Log(Logger::DEBUG, "Dispatcher will handle channel for accepted connection fd=", inPeer.fd(), ", peer fd=", outPeer.fd());
+            _service.onChannelOpened();
+            _dispatcher.addChannel(std::move(inPeer), std::move(outPeer), &_service, timeline, cpu);
 
-			Logger::instance->Log(Logger::DEBUG, "Dispatcher will handle channel for accepted connection fd=", inPeer->fd(), ", peer fd=", outPeer->fd());
-            _dispatcher.addChannel(std::move(inPeer), std::move(outPeer));
+            // only now, as out of descriptors accept tends to get the last one and connect fails
+            if (_acceptBackoff.count() > 0)
+            {
+                Logger::instance->Log(Logger::INFO, "accept recovered on ", _listenEp->describe());
+                _acceptBackoff = std::chrono::milliseconds(0);
+            }
 		}
 
-        std::unique_ptr<Socket> connectToPeer()
+        PendingSocket connectToPeer()
 		{
-            const int fd = _connectEp->getSocket();
+            bool fdExhausted = false;
+            PendingSocket peer = connectTo(*_connectEp, fdExhausted);
+            if (fdExhausted)
+            {
+                onFdExhausted(errno);
+                increaseBackoff();
+            }
+            return peer;
+        }
+
+        // Starts a non-blocking connection to the endpoint. Empty if it could not be started;
+        // fdExhausted is set if that was for lack of file descriptors, with errno still telling which.
+        // An endpoint shared between threads needs endpointLock, held only while picking the address.
+        static PendingSocket connectTo(const Endpoint& endpoint, bool& fdExhausted, std::mutex* endpointLock = nullptr)
+		{
+            sockaddr_storage address;
+            socklen_t addressLen;
+            {
+                std::unique_lock<std::mutex> lock;
+                if (endpointLock != nullptr)
+                {
+                    lock = std::unique_lock<std::mutex>(*endpointLock);
+                }
+
+                if (!endpoint.resolved())
+                {
+                    Logger::instance->Log(Logger::WARNING, "no resolved address for ", endpoint.describe());
+                    return {};
+                }
+
+                // one address per connection, the next one goes to the next address of a rotating endpoint
+                const auto addrAndLen = endpoint.getAddress();
+                endpoint.nextAddress();
+                memcpy(&address, addrAndLen.first, addrAndLen.second);
+                addressLen = addrAndLen.second;
+            }
+            const auto* addr = reinterpret_cast<const sockaddr*>(&address);
+
+            const int fd = endpoint.getSocket();
             if (fd == -1)
             {
-                Logger::instance->Log(Logger::ERROR, "creating remote socket failed");
-                return nullptr;
+                const int err = errno;
+                if (err == EMFILE || err == ENFILE)
+                {
+                    fdExhausted = true;
+                }
+                else
+                {
+                    Logger::instance->Log(Logger::ERROR, "creating remote socket failed: ", strerror(err));
+                }
+                return {};
             }
 
-			auto peer = std::make_unique<Socket>(fd, *SocketImpl::singleton);
+			PendingSocket peer(fd);
 
             if (!IOControl::setNonBlocking(fd))
 			{
 				Logger::instance->Log(Logger::ERROR, "failed to set non-blocking mode (fd=", fd, ")");
-				return nullptr;
+				return {};
 			}
 
-            if (_connectEp->getAddress().first->sa_family == AF_INET && !IOControl::setTcpNoDelay(fd))
+            if (addr->sa_family == AF_INET && !IOControl::setTcpNoDelay(fd))
             {
                 Logger::instance->Log(Logger::ERROR, "failed to turn off Nagle algorithm (fd=", fd, ")");
-                return nullptr;
+                return {};
             }
 
-            auto addrAndLen = _connectEp->getAddress();
-            int status = connect(fd, addrAndLen.first, addrAndLen.second);
+            int status = connect(fd, addr, addressLen);
             if (status == 0)
             {
-                peer->onConnected();
+                peer.onConnected();
                 Logger::instance->Log(Logger::DEBUG, "connected to remote endpoint (fd=", fd, ") with status=", status);
 				return peer;
             }
@@ -225,17 +422,105 @@ namespace vsockio
             else
             {
                 Logger::instance->Log(Logger::WARNING, "failed to connect to remote endpoint (fd=", fd, "): ", strerror(status));
-				return nullptr;
+				return {};
             }
         }
 
         inline bool listening() const { return _fd >= 0; }
 
+        void onFdExhausted(int err)
+        {
+            _fdExhausted.add();
+            if (_acceptBackoff.count() == 0)
+            {
+                // logged once per episode, the counter tracks every occurrence
+                Logger::instance->Log(Logger::WARNING, "out of file descriptors on ", _listenEp->describe(), " (", strerror(err), "), shedding connections until some are released");
+            }
+        }
+
+        // Frees the reserved descriptor to accept and immediately close one pending client,
+        // so it gets a fast failure rather than waiting in the backlog for a timeout.
+        void shedWithSpareFd()
+        {
+            if (_spareFd < 0)
+            {
+                _spareFd = openSpareFd();
+                return;
+            }
+
+            // accept reports EMFILE even when nothing is pending, so only give up the spare
+            // descriptor if there is a client to shed
+            if (!clientPending(std::chrono::milliseconds(0)))
+            {
+                return;
+            }
+
+            close(_spareFd);
+            _spareFd = -1;
+
+            auto addrAndLen = _listenEpClone->getWritableAddress();
+            const int clientFd = accept(_fd, addrAndLen.first, &addrAndLen.second);
+            if (clientFd >= 0)
+            {
+                close(clientFd);
+                _service._rejected.add();
+            }
+
+            _spareFd = openSpareFd();
+        }
+
+        bool clientPending(std::chrono::milliseconds timeout) const
+        {
+            pollfd pfd{_fd, POLLIN, 0};
+            return ::poll(&pfd, 1, static_cast<int>(timeout.count())) == 1;
+        }
+
+        void increaseBackoff()
+        {
+            _acceptBackoff = std::clamp(_acceptBackoff * 2, std::chrono::milliseconds(MIN_ACCEPT_BACKOFF), std::chrono::milliseconds(MAX_ACCEPT_BACKOFF));
+        }
+
+        // Removes a socket file left behind by a previous run, which would make bind fail with
+        // EADDRINUSE. Anything but a socket, or a socket something still accepts on, is left in
+        // place for bind to fail on.
+        static void removeStaleSocket(const sockaddr_un& address, socklen_t len)
+        {
+            struct stat st;
+            if (lstat(address.sun_path, &st) != 0 || !S_ISSOCK(st.st_mode))
+            {
+                return;
+            }
+
+            const int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (probe < 0)
+            {
+                return;
+            }
+            const bool stale = connect(probe, reinterpret_cast<const sockaddr*>(&address), len) < 0 && errno == ECONNREFUSED;
+            close(probe);
+            if (stale)
+            {
+                unlink(address.sun_path);
+            }
+        }
+
+        static int openSpareFd()
+        {
+            return open("/dev/null", O_RDONLY | O_CLOEXEC);
+        }
+
         int _fd;
         std::unique_ptr<Endpoint> _listenEp;
         std::unique_ptr<Endpoint> _listenEpClone;
         std::unique_ptr<Endpoint> _connectEp;
         std::unique_ptr<VsbEvent[]> _events;
         Dispatcher& _dispatcher;
+        ServiceContext& _service;
+        int _spareFd = -1;
+        std::chrono::milliseconds _acceptBackoff{0};
+        bool _ready = false;
+        Clock::time_point _notBefore{};
+        Counter& _fdExhausted;
+        Counter& _acceptErrors;
     };
 }
\ No newline at end of file
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <atomic>
 #include <chrono>
 #include <ctime>
 #include <fstream>
@@ -26,7 +27,8 @@ struct Logger {
 		CRITICAL = 4,
 	};
 
-	int _minLevel;
+	// changed at runtime through the admin socket while other threads log
+	std::atomic<int> _minLevel;
 	static Logger* instance;
 	std::mutex _lock;
 	LoggingStream* _streamProvider;
@@ -34,7 +36,11 @@ struct Logger {
 	Logger() : _streamProvider(nullptr), _minLevel(DEBUG) {}
 
 	void setMinLevel(int minLevel) {
-		_minLevel = minLevel;
+		_minLevel.store(minLevel, std::memory_order_relaxed);
+	}
+
+	int minLevel() const {
+		return _minLevel.load(std::memory_order_relaxed);
 	}
 
 	static const char *getLogLevelStr(int level)
@@ -58,7 +64,7 @@ struct Logger {
 	template <typename... Ts>
 	void Log(int level, const Ts&... args)
 	{
-		if (level < _minLevel || _streamProvider == nullptr) return;
+		if (level < _minLevel.load(std::memory_order_relaxed) || _streamProvider == nullptr) return;
 		std::lock_guard<std::mutex> lk(_lock);
 		auto& s = _streamProvider->startLog(level);
         (s << ... << args);
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace vsockio
+{
+    // Block compression in the LZ4 block format: runs of literals and (offset, length) back references
+    // within the block, with a single-probe hash table. It gives up ratio for speed, which suits
+    // repetitive text such as JSON, and blocks are independent of each other.
+    namespace lz4
+    {
+        // Blocks are at most this big, so offsets and hash table positions fit 16 bits.
+        constexpr size_t MAX_BLOCK_SIZE = 64 * 1024;
+
+        // Largest compressed size of a block of n bytes, for data that does not compress at all.
+        constexpr size_t compressBound(size_t n) { return n + n / 255 + 16; }
+
+        // Compresses n <= MAX_BLOCK_SIZE bytes into dst, which must have room for compressBound(n).
+        // Returns the compressed size.
+        size_t compress(const uint8_t* src, size_t n, uint8_t* dst);
+
+        // Decompresses a block into at most capacity bytes. Returns the decompressed size, or -1
+        // if the block is malformed or does not fit.
+        int decompress(const uint8_t* src, size_t n, uint8_t* dst, size_t capacity);
+    }
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "metrics.h"
+
+#include <cstdint>
+#include <string>
+
+namespace vsockio
+{
+    // Cap on the bytes held in IO buffers, e.g. for a service, optionally nested in a wider budget
+    // (the global one). Reservations have to fit into every level. Safe to share between threads.
+    class MemoryBudget
+    {
+    public:
+        // limit 0 = unlimited, usage is still tracked
+        MemoryBudget(const std::string& name, uint64_t limit, MemoryBudget* parent = nullptr)
+            : _limit(limit)
+            , _parent(parent)
+            , _used(Metrics::instance->gauge(name + ".buffered_bytes"))
+            , _waits(Metrics::instance->counter(name + ".buffer_waits"))
+        {
+        }
+
+        MemoryBudget(const MemoryBudget&) = delete;
+        MemoryBudget& operator=(const MemoryBudget&) = delete;
+
+        bool tryReserve(uint64_t bytes)
+        {
+            if (_limit == 0)
+            {
+                _used.add(bytes);
+            }
+            else if (!_used.tryAdd(bytes, _limit))
+            {
+                return false;
+            }
+
+            if (_parent != nullptr && !_parent->tryReserve(bytes))
+            {
+                _used.sub(bytes);
+                return false;
+            }
+            return true;
+        }
+
+        // Reserves even beyond the limit, for memory needed to make progress.
+        void forceReserve(uint64_t bytes)
+        {
+            _used.add(bytes);
+            if (_parent != nullptr)
+            {
+                _parent->forceReserve(bytes);
+            }
+        }
+
+        void release(uint64_t bytes)
+        {
+            _used.sub(bytes);
+            if (_parent != nullptr)
+            {
+                _parent->release(bytes);
+            }
+        }
+
+        // A read had to wait for buffer memory.
+        void onWait() { _waits.add(); }
+
+        uint64_t limit() const { return _limit; }
+        int64_t used() const { return _used.value(); }
+        int64_t highWater() const { return _used.highWater(); }
+
+    private:
+        const uint64_t _limit;
+        MemoryBudget* const _parent;
+        Gauge& _used;
+        Counter& _waits;
+    };
+}
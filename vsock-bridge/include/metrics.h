@@ -0,0 +1,134 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+
+namespace vsockio
+{
+    struct Counter
+    {
+        std::atomic<uint64_t> _value{0};
+
+        void add(uint64_t n = 1) { _value.fetch_add(n, std::memory_order_relaxed); }
+        uint64_t value() const { return _value.load(std::memory_order_relaxed); }
+    };
+
+    struct Gauge
+    {
+        std::atomic<int64_t> _value{0};
+        std::atomic<int64_t> _highWater{0};
+
+        void add(int64_t n = 1)
+        {
+            const int64_t v = _value.fetch_add(n, std::memory_order_relaxed) + n;
+            int64_t hw = _highWater.load(std::memory_order_relaxed);
+            while (v > hw && !_highWater.compare_exchange_weak(hw, v, std::memory_order_relaxed)) {}
+        }
+
+        // Adds n unless that would take the value above max.
+        bool tryAdd(int64_t n, int64_t max)
+        {
+            int64_t v = _value.load(std::memory_order_relaxed);
+            do
+            {
+                if (v + n > max) return false;
+            } while (!_value.compare_exchange_weak(v, v + n, std::memory_order_relaxed));
+
+            int64_t hw = _highWater.load(std::memory_order_relaxed);
+            while (v + n > hw && !_highWater.compare_exchange_weak(hw, v + n, std::memory_order_relaxed)) {}
+            return true;
+        }
+
+        void sub(int64_t n = 1) { _value.fetch_sub(n, std::memory_order_relaxed); }
+
+        void set(int64_t v)
+        {
+            _value.store(v, std::memory_order_relaxed);
+            int64_t hw = _highWater.load(std::memory_order_relaxed);
+            while (v > hw && !_highWater.compare_exchange_weak(hw, v, std::memory_order_relaxed)) {}
+        }
+
+        int64_t value() const { return _value.load(std::memory_order_relaxed); }
+        int64_t highWater() const { return _highWater.load(std::memory_order_relaxed); }
+    };
+
+    // Distribution of non-negative values (e.g. latencies in microseconds) in power of two buckets:
+    // bucket 0 counts zeros, bucket i values in [2^(i-1), 2^i). Quantiles are reported as the upper
+    // bound of their bucket (but at most the maximum), so they are accurate to within a factor of two.
+    struct Histogram
+    {
+        static constexpr int NUM_BUCKETS = 40;
+
+        std::atomic<uint64_t> _buckets[NUM_BUCKETS] = {};
+        std::atomic<uint64_t> _count{0};
+        std::atomic<uint64_t> _max{0};
+
+        void record(uint64_t value)
+        {
+            _buckets[bucketFor(value)].fetch_add(1, std::memory_order_relaxed);
+            _count.fetch_add(1, std::memory_order_relaxed);
+            uint64_t max = _max.load(std::memory_order_relaxed);
+            while (value > max && !_max.compare_exchange_weak(max, value, std::memory_order_relaxed)) {}
+        }
+
+        uint64_t count() const { return _count.load(std::memory_order_relaxed); }
+        uint64_t max() const { return _max.load(std::memory_order_relaxed); }
+
+        // Upper bound of the bucket holding quantile q (0 to 1) capped at the maximum, 0 if nothing was recorded.
+        uint64_t quantile(double q) const
+        {
+            uint64_t total = 0;
+            for (const auto& b : _buckets) total += b.load(std::memory_order_relaxed);
+            if (total == 0) return 0;
+
+            const uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(q * total + 0.5));
+            uint64_t seen = 0;
+            for (int i = 0; i < NUM_BUCKETS; i++)
+            {
+                seen += _buckets[i].load(std::memory_order_relaxed);
+                if (seen >= rank) return std::min(upperBound(i), max());
+            }
+            return max();
+        }
+
+        static int bucketFor(uint64_t value)
+        {
+            return value == 0 ? 0 : std::min(NUM_BUCKETS - 1, 64 - __builtin_clzll(value));
+        }
+
+        static uint64_t upperBound(int bucket)
+        {
+            return bucket == 0 ? 0 : (uint64_t(1) << bucket) - 1;
+        }
+    };
+
+    // Process wide registry of named metrics. Look metrics up once when setting up
+    // and keep the reference: lookups take a lock, updates are plain relaxed atomics.
+    class Metrics
+    {
+    public:
+        static Metrics* instance;
+
+        Counter& counter(const std::string& name);
+        Gauge& gauge(const std::string& name);
+        Histogram& histogram(const std::string& name);
+
+        // The counter if it was registered already, null otherwise.
+        Counter* findCounter(const std::string& name) const;
+
+        // One "name value" line per metric, sorted by name.
+        void dump(std::ostream& os) const;
+
+    private:
+        mutable std::mutex _lock;
+        std::map<std::string, std::unique_ptr<Counter>> _counters;
+        std::map<std::string, std::unique_ptr<Gauge>> _gauges;
+        std::map<std::string, std::unique_ptr<Histogram>> _histograms;
+    };
+}
@@ -0,0 +1,265 @@
+#pragma once
+
+#include "channel.h"
+#include "eventdef.h"
+#include "logger.h"
+#include "metrics.h"
+#include "poller.h"
+#include "service.h"
+#include "socket.h"
+#include "syscall_stats.h"
+#include "timeline.h"
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <ostream>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace vsockio
+{
+    // Multiplexed tunnels: a mux client service carries its clients as streams over a few
+    // connections (tunnels) to a mux server service on the other bridge, which connects each
+    // stream to its backend. Opening a stream is a frame on an open tunnel instead of a connect.
+    //
+    // Every frame starts with an 8 byte header: stream id (32 bit), type, flags (unused, 0) and
+    // payload length (16 bit), integers in network byte order. Both ends start a tunnel with a
+    // Hello frame on stream 0 and use the lower of the two versions and payload sizes; the
+    // window each announces is how many bytes of a stream it accepts before acknowledging them
+    // with Window frames, so a slow stream never holds up the others on its tunnel.
+    enum class MuxFrameType : uint8_t
+    {
+        Hello = 1,  // magic "VSMX", version (16 bit), window (32 bit), max payload (16 bit)
+        Open,       // client: new stream, no payload
+        Data,
+        Window,     // increment (32 bit) of the receiver's window for the stream
+        Close,      // the sender's side of the stream closed; the receiver delivers what it has and closes too
+        Reset,      // the stream failed, drop it right away
+    };
+
+    struct MuxFrameHeader
+    {
+        static constexpr size_t SIZE = 8;
+
+        uint32_t _stream;
+        MuxFrameType _type;
+        uint16_t _length;
+
+        void encode(uint8_t* out) const;
+        static MuxFrameHeader decode(const uint8_t* in);
+    };
+
+    struct MuxHello
+    {
+        static constexpr size_t SIZE = 12;
+        static constexpr uint16_t VERSION = 1;
+
+        uint16_t _version = VERSION;
+        uint32_t _window = 0;
+        uint16_t _maxPayload = 0;
+
+        void encode(uint8_t* out) const;
+        // Empty if the payload is not a hello from a mux peer.
+        static std::optional<MuxHello> decode(const uint8_t* in, size_t len);
+    };
+
+    // Bytes queued in one direction. Space is reserved and filled in place, e.g. by a read straight
+    // behind a frame header, and handed out from the front.
+    class MuxBuffer
+    {
+    public:
+        // Memory is counted against the budget, not refused: what is queued is bounded by the
+        // stream windows and the tunnel's output limit, new streams are refused instead.
+        explicit MuxBuffer(MemoryBudget* budget = nullptr) : _budget(budget) {}
+
+        MuxBuffer(const MuxBuffer&) = delete;
+        MuxBuffer& operator=(const MuxBuffer&) = delete;
+
+        ~MuxBuffer()
+        {
+            if (_budget != nullptr) _budget->release(_capacity);
+        }
+
+        const uint8_t* data() const { return _data.get() + _begin; }
+        size_t size() const { return _end - _begin; }
+        bool empty() const { return _begin == _end; }
+
+        // At least n bytes to write to at the end, valid until the next call.
+        uint8_t* reserve(size_t n);
+        void commit(size_t n) { _end += n; }
+
+        void append(const uint8_t* data, size_t n);
+        void consume(size_t n);
+
+    private:
+        MemoryBudget* const _budget;
+        std::unique_ptr<uint8_t[]> _data;
+        size_t _capacity = 0;
+        size_t _begin = 0;
+        size_t _end = 0;
+    };
+
+    struct MuxTunnel;
+    struct MuxStream;
+
+    // A socket of a tunnel or of one of its streams, registered with the poller. Readiness is
+    // edge-triggered: a flag is set by an event and cleared when a call returns EAGAIN.
+    struct MuxSocket
+    {
+        MuxSocket(int fd, bool connected, MuxTunnel& tunnel, MuxStream* stream)
+            : _fd(fd)
+            , _connected(connected)
+            , _tunnel(tunnel)
+            , _stream(stream)
+            , _handle(nullptr, 0, fd)
+        {
+            _handle._mux = this;
+        }
+
+        int _fd;
+        bool _connected;
+        bool _readable = false;
+        bool _writable = false;
+        MuxTunnel& _tunnel;
+        MuxStream* const _stream;   // null for the tunnel's own socket
+        ChannelHandle _handle;      // registered with the poller, points back here
+    };
+
+    // A client connection relayed over a tunnel: the client itself on the mux client side, the
+    // connection to the backend on the server side.
+    struct MuxStream
+    {
+        MuxStream(uint32_t id, MuxTunnel& tunnel, bool connected, int fd);
+
+        const uint32_t _id;
+        MuxSocket _socket;
+        uint32_t _sendWindow = 0;       // bytes the peer still accepts
+        uint32_t _receiveWindow = 0;    // bytes the peer may still send
+        uint32_t _unacknowledged = 0;   // delivered to the socket, not yet given back to the peer
+        MuxBuffer _toSocket;            // received, not yet written to the socket
+        bool _peerClosed = false;
+        bool _closed = false;
+        uint64_t _bytesIn = 0;          // read from the socket
+        uint64_t _bytesOut = 0;         // written to the socket
+        ChannelTimeline _timeline;
+    };
+
+    struct MuxTunnel
+    {
+        MuxTunnel(int id, MuxRole role, ServiceContext* service, bool connected, int fd)
+            : _id(id)
+            , _role(role)
+            , _service(service)
+            , _socket(fd, connected, *this, nullptr)
+            , _in(&service->_bufferBudget)
+            , _out(&service->_bufferBudget) {}
+
+        const int _id;
+        const MuxRole _role;
+        ServiceContext* const _service;
+        MuxSocket _socket;
+        bool _handshakeDone = false;
+        bool _failed = false;
+        uint32_t _peerWindow = 0;
+        uint16_t _maxPayload = 0;
+        uint32_t _nextStreamId = 1;     // streams are opened by the client side only
+        MuxBuffer _in;
+        MuxBuffer _out;
+        std::unordered_map<uint32_t, std::unique_ptr<MuxStream>> _streams;
+        ChannelTimeline _timeline;
+    };
+
+    inline MuxStream::MuxStream(uint32_t id, MuxTunnel& tunnel, bool connected, int fd)
+        : _id(id)
+        , _socket(fd, connected, tunnel, this)
+        , _toSocket(&tunnel._service->_bufferBudget) {}
+
+    // Runs the tunnels and streams of mux services on one IO thread. Client side tunnels are
+    // opened on demand, one per service and thread, so a bridge keeps about as many vsock
+    // connections to its peer as it has workers.
+    class MuxEngine
+    {
+    public:
+        static constexpr uint16_t MAX_PAYLOAD = 16 * 1024;
+        // a tunnel stops taking data from its streams while this much output is queued
+        static constexpr size_t MAX_QUEUED_OUTPUT = 1024 * 1024;
+        // bytes read from a tunnel in one go before other sockets get their turn
+        static constexpr size_t READ_BUDGET = 256 * 1024;
+
+        MuxEngine(size_t threadId, Poller& poller, SocketImpl& impl, SyscallCounters& threadSyscalls);
+
+        MuxEngine(const MuxEngine&) = delete;
+        MuxEngine& operator=(const MuxEngine&) = delete;
+
+        ~MuxEngine();
+
+        // Mux client side: carries an accepted client as a new stream.
+        void addStream(PendingSocket&& client, ServiceContext* service, const ChannelTimeline& timeline);
+
+        // Mux server side: serves the streams of an accepted tunnel.
+        void addTunnel(PendingSocket&& tunnel, ServiceContext* service, const ChannelTimeline& timeline);
+
+        void onEvent(MuxSocket* socket, IOEvent flags);
+
+        bool hasWork() const { return !_readyTunnels.empty() || !_readyStreams.empty(); }
+
+        void run();
+
+        // Frees the streams and tunnels closed during run().
+        void cleanup();
+
+        void describeChannels(std::ostream& os) const;
+
+        size_t tunnels() const { return _tunnels.size(); }
+
+        // No streams, and no server side tunnels that could open some.
+        bool idle() const;
+
+    private:
+        MuxTunnel* openTunnel(ServiceContext* service);
+        MuxTunnel* addTunnelSocket(MuxRole role, ServiceContext* service, PendingSocket&& socket, const ChannelTimeline& timeline);
+        MuxStream* addStreamSocket(MuxTunnel& tunnel, uint32_t id, PendingSocket&& socket);
+        // Whether the tunnel may carry another stream: under the service's mux-max-streams and max-buffered-bytes.
+        bool admitStream(const MuxTunnel& tunnel) const;
+        Counter& counter(ServiceContext* service, const char* name);
+        bool registerSocket(MuxSocket& socket);
+
+        void serviceTunnel(MuxTunnel& tunnel);
+        void serviceStream(MuxStream& stream);
+        bool checkConnected(MuxSocket& socket);
+        void readTunnel(MuxTunnel& tunnel);
+        // Returns the bytes of frames handled, a partial frame at the end is left alone.
+        size_t handleFrames(MuxTunnel& tunnel, const uint8_t* data, size_t len);
+        bool handleFrame(MuxTunnel& tunnel, const MuxFrameHeader& header, const uint8_t* payload);
+        void onHello(MuxTunnel& tunnel, const MuxHello& hello);
+        void onOpen(MuxTunnel& tunnel, uint32_t id);
+        void onData(MuxTunnel& tunnel, MuxStream& stream, const uint8_t* payload, size_t len);
+        void readStream(MuxStream& stream);
+        void writeStream(MuxStream& stream);
+        void flushTunnel(MuxTunnel& tunnel);
+
+        void queueFrame(MuxTunnel& tunnel, uint32_t stream, MuxFrameType type, const uint8_t* payload = nullptr, uint16_t length = 0);
+        void queueWindowIfDue(MuxTunnel& tunnel, MuxStream& stream);
+
+        void closeStream(MuxStream& stream);
+        void failTunnel(MuxTunnel& tunnel, const char* reason);
+        void closeSocket(MuxSocket& socket);
+        void record(Syscall syscall, SyscallOutcome outcome) { _threadSyscalls.record(syscall, outcome); }
+        static SyscallOutcome outcomeOf(int err);
+
+        const size_t _threadId;
+        Poller& _poller;
+        SocketImpl& _impl;
+        SyscallCounters& _threadSyscalls;
+        int _nextTunnelId = 0;
+        std::unordered_map<MuxTunnel*, std::unique_ptr<MuxTunnel>> _tunnels;
+        std::unordered_map<ServiceContext*, MuxTunnel*> _clientTunnels;
+        std::unordered_set<MuxTunnel*> _readyTunnels;
+        std::unordered_set<MuxStream*> _readyStreams;
+        std::unordered_set<MuxTunnel*> _unflushedTunnels;
+        std::vector<std::unique_ptr<MuxStream>> _closedStreams;
+        std::vector<std::unique_ptr<MuxTunnel>> _closedTunnels;
+    };
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace vsockio
+{
+    // CPU lists as used by taskset, cgroups and sysfs, e.g. 2, 0-3 or 0-1,6.
+    std::optional<std::vector<int>> parseCpuList(const std::string& s);
+
+    // NUMA node of each CPU, from the node<n>/cpulist files under nodeRoot.
+    class CpuTopology
+    {
+    public:
+        explicit CpuTopology(const std::string& nodeRoot = "/sys/devices/system/node");
+
+        // Read once, the first time it is needed.
+        static const CpuTopology& system();
+
+        // -1 for CPUs the kernel lists under no node, e.g. without NUMA support.
+        int nodeOf(int cpu) const;
+
+    private:
+        std::vector<int> _nodeByCpu;
+    };
+
+    // CPU that processed the latest packets of a TCP socket (SO_INCOMING_CPU); with multi-queue
+    // NICs that is the CPU the flow's receive queue interrupts. -1 if the kernel does not say.
+    int incomingCpu(int fd);
+}
@@ -12,7 +12,8 @@ namespace vsockio
 
 		virtual bool add(int fd, void* handler) = 0;
 
-		virtual void remove(int fd) = 0;
+		// Returns false if the fd could not be removed.
+		virtual bool remove(int fd) = 0;
 
 		virtual int poll(VsbEvent* outEvents, int timeout) = 0;
 
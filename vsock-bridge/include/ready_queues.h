@@ -0,0 +1,122 @@
+#pragma once
+
+#include "metrics.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+
+namespace vsockio
+{
+    enum class Priority : uint8_t
+    {
+        High = 0,
+        Normal = 1,
+        Low = 2,
+    };
+
+    constexpr size_t NUM_PRIORITIES = 3;
+
+    inline const char* priorityName(Priority priority)
+    {
+        switch (priority)
+        {
+            case Priority::High: return "high";
+            case Priority::Normal: return "normal";
+            case Priority::Low: return "low";
+            default: return "unknown";
+        }
+    }
+
+    // Channels with pending IO, one FIFO per priority class.
+    //
+    // Higher classes are served first. While a thread has channels of a higher class, lower classes
+    // get LOWER_PRIORITY_SLICE per loop iteration before the loop goes back to polling, so new events
+    // on high priority channels do not wait behind bulk transfers. Every class still gets at least one
+    // channel served per iteration and channels rotate through their FIFO, so nothing starves.
+    //
+    // T needs a Clock::time_point _readySince (default = not queued) and a Priority _priority.
+    template <typename T>
+    class ReadyQueues
+    {
+    public:
+        using Clock = std::chrono::steady_clock;
+
+        static constexpr std::chrono::microseconds LOWER_PRIORITY_SLICE{200};
+
+        // waits[p] (may be null) records how long channels of class p were queued, in microseconds.
+        explicit ReadyQueues(const std::array<Histogram*, NUM_PRIORITIES>& waits = {})
+            : _waits(waits) {}
+
+        void onChannelAdded(Priority priority) { ++_channels[index(priority)]; }
+        void onChannelRemoved(Priority priority) { --_channels[index(priority)]; }
+
+        // Queues the item unless it is queued already.
+        void push(T* item, Clock::time_point now)
+        {
+            if (item->_readySince != Clock::time_point()) return;
+            item->_readySince = now;
+            _queues[index(item->_priority)].push_back(item);
+        }
+
+        void remove(T* item)
+        {
+            if (item->_readySince == Clock::time_point()) return;
+            auto& queue = _queues[index(item->_priority)];
+            queue.erase(std::find(queue.begin(), queue.end(), item));
+            item->_readySince = {};
+        }
+
+        bool empty() const
+        {
+            return std::all_of(_queues.begin(), _queues.end(), [](const auto& q) { return q.empty(); });
+        }
+
+        size_t size(Priority priority) const { return _queues[index(priority)].size(); }
+
+        // Calls serve(item) for queued items in priority order; items are queued again if it returns true.
+        template <typename Serve>
+        void serve(Serve&& serve)
+        {
+            const auto start = Clock::now();
+            size_t higherChannels = 0;
+            for (size_t p = 0; p < NUM_PRIORITIES; p++)
+            {
+                auto& queue = _queues[p];
+                // items queued again during this pass wait for the next one
+                const size_t queued = queue.size();
+                for (size_t served = 0; served < queued; served++)
+                {
+                    const auto now = Clock::now();
+                    if (higherChannels != 0 && served != 0 && now - start > LOWER_PRIORITY_SLICE)
+                    {
+                        break;
+                    }
+
+                    T* item = queue.front();
+                    queue.pop_front();
+                    if (_waits[p] != nullptr)
+                    {
+                        _waits[p]->record(std::chrono::duration_cast<std::chrono::microseconds>(now - item->_readySince).count());
+                    }
+                    item->_readySince = {};
+
+                    if (serve(item))
+                    {
+                        push(item, Clock::now());
+                    }
+                }
+                higherChannels += _channels[p];
+            }
+        }
+
+    private:
+        static size_t index(Priority priority) { return static_cast<size_t>(priority); }
+
+        std::array<std::deque<T*>, NUM_PRIORITIES> _queues;
+        std::array<size_t, NUM_PRIORITIES> _channels{};
+        const std::array<Histogram*, NUM_PRIORITIES> _waits;
+    };
+}
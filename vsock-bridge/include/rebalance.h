@@ -0,0 +1,53 @@
+#pragma once
+
+#include "autoscale.h"
+#include "iothread.h"
+#include "metrics.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+namespace vsockio
+{
+    struct RebalanceOptions
+    {
+        std::chrono::milliseconds _interval{1000};
+        // difference in share of time busy between the busiest and the idlest worker worth acting on
+        double _minGap = 0.25;
+        // and how busy the busiest must be, below that nothing is waiting on it anyway
+        double _minLoad = 0.5;
+    };
+
+    // Moves channels between the workers of a pool while their loads drift apart, one channel
+    // from the busiest to the idlest per sample. Workers the pool has taken out of service hand
+    // all their channels to the least loaded active one instead of relaying them until they close.
+    class Rebalancer
+    {
+    public:
+        Rebalancer(IOThreadPool& pool, const RebalanceOptions& options = {});
+
+        Rebalancer(const Rebalancer&) = delete;
+        Rebalancer& operator=(const Rebalancer&) = delete;
+
+        ~Rebalancer();
+
+        // Samples every interval on a thread of its own.
+        void start();
+
+        // Takes a sample and asks threads to move channels where due. Returns the number of
+        // threads asked; the moves themselves happen on those threads shortly after.
+        int sample(std::chrono::steady_clock::time_point now);
+
+    private:
+        IOThreadPool& _pool;
+        const RebalanceOptions _options;
+        PoolLoad _load;
+        Counter& _rebalances;
+        std::mutex _stopLock;
+        std::condition_variable _stopSignal;
+        bool _stop = false;
+        std::thread _thr;
+    };
+}
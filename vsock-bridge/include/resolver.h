@@ -0,0 +1,79 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <netinet/in.h>
+
+namespace vsockio
+{
+    // Keeps the IPv4 addresses of connect endpoint hostnames up to date.
+    //
+    // Lookups happen on the resolver's own thread (or synchronously at startup), never on the
+    // accept or IO paths: those only load the latest address set, which is swapped atomically.
+    // The system resolver does not expose record TTLs, so each hostname is refreshed after a
+    // configured TTL; on failure the previous addresses are kept and the lookup is retried sooner.
+    class Resolver
+    {
+    public:
+        using Clock = std::chrono::steady_clock;
+        using AddressList = std::vector<sockaddr_in>;
+        using LookupFunction = std::function<bool(const std::string& hostname, uint16_t port, AddressList& result)>;
+
+        static constexpr std::chrono::seconds DEFAULT_TTL{30};
+        static constexpr std::chrono::seconds MAX_RETRY_INTERVAL{5};
+
+        struct Entry
+        {
+            Entry(const std::string& hostname, uint16_t port, std::chrono::seconds ttl)
+                : _hostname(hostname), _port(port), _ttl(ttl) {}
+
+            std::shared_ptr<const AddressList> addresses() const
+            {
+                return std::atomic_load(&_addresses);
+            }
+
+            const std::string _hostname;
+            const uint16_t _port;
+            const std::chrono::seconds _ttl;
+            std::shared_ptr<const AddressList> _addresses;
+            Clock::time_point _nextRefresh;
+        };
+
+        explicit Resolver(LookupFunction lookup = systemLookup) : _lookup(std::move(lookup)) {}
+
+        Resolver(const Resolver&) = delete;
+        Resolver& operator=(const Resolver&) = delete;
+
+        ~Resolver() { stop(); }
+
+        std::shared_ptr<Entry> track(const std::string& hostname, uint16_t port, std::chrono::seconds ttl = DEFAULT_TTL);
+
+        // Resolve all tracked hostnames that are due, returns the time of the next refresh.
+        Clock::time_point refresh(Clock::time_point now);
+
+        void start();
+        void stop();
+
+        static bool systemLookup(const std::string& hostname, uint16_t port, AddressList& result);
+
+    private:
+        bool resolve(Entry& entry, Clock::time_point now);
+        void run();
+
+        LookupFunction _lookup;
+        std::mutex _lock;
+        std::condition_variable _wakeup;
+        std::vector<std::shared_ptr<Entry>> _entries;
+        bool _stopFlag = false;
+        std::thread _thr;
+    };
+}
@@ -0,0 +1,189 @@
+#pragma once
+
+#include "admission.h"
+#include "backend_pool.h"
+#include "buffer.h"
+#include "logger.h"
+#include "memory_budget.h"
+#include "metrics.h"
+#include "ready_queues.h"
+#include "shaper.h"
+#include "syscall_stats.h"
+#include "timeline.h"
+#include "token_bucket.h"
+#include "transform.h"
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <sstream>
+#include <string>
+
+namespace vsockio
+{
+    // How an IO thread relays a service's channels.
+    enum class ChannelEngine
+    {
+        StateMachine,
+        Coroutine,  // only in builds with VSOCK_COROUTINES, see coro_engine.h
+    };
+
+    // Services relaying many client streams over few connections, see mux.h.
+    enum class MuxRole
+    {
+        None,
+        Client,     // accepts clients, carries them as streams over tunnels it opens
+        Server,     // accepts tunnels, connects each stream in them to the backend
+    };
+
+    struct ServiceOptions
+    {
+        AdmissionLimits _admission;
+        ShapingLimits _shaping;
+        BufferLimits _buffers;
+        uint64_t _maxBufferedBytes = 0; // 0 = unlimited
+        Priority _priority = Priority::Normal;
+        uint32_t _timingSampleRate = 0; // log the timeline of one in this many channels, 0 = none
+        ChannelEngine _engine = ChannelEngine::StateMachine;
+        bool _http = false;             // follow HTTP/1.1 framing and pool backend connections, see http.h
+        uint32_t _maxIdleBackends = 16;
+        MuxRole _mux = MuxRole::None;
+        uint32_t _muxWindow = 256 * 1024; // bytes a stream may have in flight in each direction
+        uint32_t _muxMaxStreams = 1024; // streams open at a time on one tunnel
+        CompressSide _compress = CompressSide::None;
+        bool _coalesceWrites = false;   // throughput mode, see Socket::setCoalescing()
+        std::chrono::microseconds _coalesceDelay{0}; // how long throughput mode holds writes, 0 = until the end of the loop iteration
+
+        // Channels get their backend connection on their IO thread rather than from the listener.
+        bool connectsOnWorkers() const { return _http || _mux != MuxRole::None; }
+    };
+
+    // Runtime state of a configured service, shared by its listener and all of its channels.
+    struct ServiceContext
+    {
+        // Set from the admin socket, followed by the listener from its next connection on.
+        enum class State
+        {
+            Running,
+            Paused,     // new connections wait in the kernel backlog
+            Draining,   // new connections are refused, open channels run to completion
+        };
+
+        ServiceContext(const std::string& name, const ServiceOptions& options, AdmissionControl* global = nullptr, MemoryBudget* globalBuffers = nullptr)
+            : _name(name)
+            , _options(options)
+            , _admission("service." + name, options._admission)
+            , _global(global)
+            , _bufferBudget("service." + name, options._maxBufferedBytes, globalBuffers)
+            , _rateLimit(options._shaping._serviceRate != 0
+                ? std::make_unique<TokenBucket>(options._shaping._serviceRate, options._shaping.burstFor(options._shaping._serviceRate))
+                : nullptr)
+            , _accepted(Metrics::instance->counter("service." + name + ".accepted"))
+            , _rejected(Metrics::instance->counter("service." + name + ".rejected"))
+            , _timings("service." + name)
+            , _syscalls("service." + name)
+            , _compression("service." + name)
+        {
+        }
+
+        ServiceContext(const ServiceContext&) = delete;
+        ServiceContext& operator=(const ServiceContext&) = delete;
+
+        AdmissionControl::Decision admit(AdmissionControl::Clock::time_point now, std::chrono::microseconds loopLag, AdmissionControl*& decidedBy)
+        {
+            decidedBy = _global;
+            if (_global)
+            {
+                const auto decision = _global->check(now, loopLag);
+                if (decision != AdmissionControl::Decision::Admit) return decision;
+            }
+
+            decidedBy = &_admission;
+            const auto decision = _admission.check(now, loopLag);
+            if (decision != AdmissionControl::Decision::Admit && _global)
+            {
+                // one busy service must not use up the accept rate of all the others
+                _global->refund();
+            }
+            return decision;
+        }
+
+        // Gives back what admit() took for a connection that was not there to accept after all.
+        void refund()
+        {
+            _admission.refund();
+            if (_global) _global->refund();
+        }
+
+        void onChannelOpened()
+        {
+            _accepted.add();
+            _admission.onChannelOpened();
+            if (_global) _global->onChannelOpened();
+        }
+
+        void onChannelClosed(const ChannelTimeline& timeline, const SyscallCounts& syscalls = {}, uint64_t bytesRelayed = 0)
+        {
+            _admission.onChannelClosed();
+            if (_global) _global->onChannelClosed();
+
+            _syscalls.add(syscalls);
+            _syscalls.addBytesRelayed(bytesRelayed);
+
+            _timings.record(timeline);
+            const uint32_t sampleRate = _options._timingSampleRate;
+            if (sampleRate != 0 && _closedChannels.fetch_add(1, std::memory_order_relaxed) % sampleRate == 0)
+            {
+                std::ostringstream os;
+                timeline.describe(os);
+                Logger::instance->Log(Logger::INFO, "service ", _name, " channel timeline:", os.str());
+            }
+        }
+
+        State state() const { return _state.load(std::memory_order_relaxed); }
+        void setState(State state) { _state.store(state, std::memory_order_relaxed); }
+
+        static const char* stateName(State state)
+        {
+            switch (state)
+            {
+                case State::Running: return "running";
+                case State::Paused: return "paused";
+                case State::Draining: return "draining";
+                default: return "unknown";
+            }
+        }
+
+        std::unique_ptr<Shaper> createShaper()
+        {
+            return _options._shaping.enabled() ? std::make_unique<Shaper>(_rateLimit.get(), _options._shaping) : nullptr;
+        }
+
+        // Null for the pass-through path when the service does not compress.
+        std::unique_ptr<StreamTransform> createTransform(bool readsFromListenSide)
+        {
+            return vsockio::createTransform(_options._compress, readsFromListenSide, &_compression);
+        }
+
+        const std::string _name;
+        const ServiceOptions _options;
+        AdmissionControl _admission;
+        AdmissionControl* const _global;
+        MemoryBudget _bufferBudget;
+        std::unique_ptr<TokenBucket> _rateLimit;
+        Counter& _accepted;
+        Counter& _rejected;
+        ChannelTimings _timings;
+        // folded in from each channel as it closes, so long lived channels only show up once they are done
+        SyscallCounters _syscalls;
+        CompressionCounters _compression;
+        // for services that connect on their IO threads, set up by the listener which knows where to;
+        // callable from any thread
+        std::function<PendingSocket()> _connect;
+        // backend connections of http services
+        std::unique_ptr<BackendPool> _backends;
+        std::atomic<uint64_t> _closedChannels{0};
+        std::atomic<State> _state{State::Running};
+    };
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "token_bucket.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <optional>
+
+namespace vsockio
+{
+    struct ShapingLimits
+    {
+        uint64_t _serviceRate = 0;      // bytes per second across all channels of a service, 0 = unlimited
+        uint64_t _connectionRate = 0;   // bytes per second per channel, 0 = unlimited
+        uint64_t _burst = 0;            // bucket size in bytes, 0 = a tenth of a second worth of traffic
+
+        bool enabled() const { return _serviceRate != 0 || _connectionRate != 0; }
+
+        uint64_t burstFor(uint64_t rate) const
+        {
+            return _burst != 0 ? _burst : std::max<uint64_t>(rate / 10, MIN_BURST);
+        }
+
+        static constexpr uint64_t MIN_BURST = 4096;
+    };
+
+    // Limits the bytes a channel reads, in both directions combined. Only channels of services
+    // with a configured limit get a shaper, others skip the checks entirely.
+    class Shaper
+    {
+    public:
+        using Clock = TokenBucket::Clock;
+
+        // Reads wait until at least this many bytes (or a full burst) can be read, otherwise a
+        // busy channel would keep reading the few bytes that trickle into the bucket.
+        static constexpr uint64_t MIN_READ_BYTES = 1024;
+
+        Shaper(TokenBucket* serviceBucket, const ShapingLimits& limits)
+            : _service(serviceBucket)
+            , _minRead(MIN_READ_BYTES)
+        {
+            if (limits._connectionRate != 0)
+            {
+                _connection.emplace(limits._connectionRate, limits.burstFor(limits._connectionRate));
+                _minRead = std::min(_minRead, _connection->burst());
+            }
+            if (_service)
+            {
+                _minRead = std::min(_minRead, _service->burst());
+            }
+        }
+
+        // Bytes that may be read now, 0 if the read should wait.
+        int allowance(int wanted, Clock::time_point now) const
+        {
+            uint64_t allowed = wanted;
+            if (_service) allowed = std::min(allowed, _service->available(now));
+            if (_connection) allowed = std::min(allowed, _connection->available(now));
+            return allowed < std::min<uint64_t>(wanted, _minRead) ? 0 : static_cast<int>(allowed);
+        }
+
+        void consume(int bytes, Clock::time_point now)
+        {
+            if (_service) _service->consume(bytes, now);
+            if (_connection) _connection->consume(bytes, now);
+        }
+
+        Clock::duration waitTime(Clock::time_point now) const
+        {
+            Clock::duration wait{0};
+            if (_service) wait = std::max(wait, _service->timeUntilAvailable(_minRead, now));
+            if (_connection) wait = std::max(wait, _connection->timeUntilAvailable(_minRead, now));
+            return wait;
+        }
+
+    private:
+        TokenBucket* _service;
+        uint64_t _minRead;
+        std::optional<TokenBucket> _connection;
+    };
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace vsockio
+{
+    // Free-list allocator for objects of one type, used by a single thread.
+    //
+    // Objects live in cache line aligned slots carved out of contiguous chunks, so once the slab has
+    // grown to the working set, creating and destroying objects never touches the global allocator
+    // and neighbouring objects never share a cache line. Chunks are kept until the slab is destroyed.
+    // An object may move to another slab (disown, then adopt), which frees its slot when it is
+    // destroyed; the slab it came from must outlive that.
+    template <typename T>
+    class Slab
+    {
+    public:
+        static constexpr size_t CACHE_LINE = 64;
+        static constexpr size_t SLOT_SIZE = (sizeof(T) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+        static constexpr size_t SLOTS_PER_CHUNK = 64;
+
+        static_assert(alignof(T) <= CACHE_LINE, "slab slots are only cache line aligned");
+
+        Slab() = default;
+        Slab(const Slab&) = delete;
+        Slab& operator=(const Slab&) = delete;
+
+        // Objects still alive are not destroyed, only their memory is returned.
+        ~Slab()
+        {
+            for (void* chunk : _chunks)
+            {
+                ::operator delete(chunk, std::align_val_t(CACHE_LINE));
+            }
+        }
+
+        template <typename... Args>
+        T* create(Args&&... args)
+        {
+            void* slot = allocate();
+            try
+            {
+                return new (slot) T(std::forward<Args>(args)...);
+            }
+            catch (...)
+            {
+                deallocate(slot);
+                throw;
+            }
+        }
+
+        void destroy(T* object)
+        {
+            object->~T();
+            deallocate(object);
+        }
+
+        // Hands a live object over to another slab, see adopt().
+        void disown(T*) { --_inUse; }
+
+        // Takes over a live object disowned by another slab; destroying it frees the slot into this one.
+        void adopt(T*) { ++_inUse; }
+
+        size_t inUse() const { return _inUse; }
+        size_t capacity() const { return _chunks.size() * SLOTS_PER_CHUNK; }
+
+    private:
+        struct FreeSlot
+        {
+            FreeSlot* _next;
+        };
+
+        void* allocate()
+        {
+            if (_free == nullptr)
+            {
+                addChunk();
+            }
+            FreeSlot* slot = _free;
+            _free = slot->_next;
+            ++_inUse;
+            return slot;
+        }
+
+        void deallocate(void* p)
+        {
+            push(p);
+            --_inUse;
+        }
+
+        void push(void* p)
+        {
+            auto* slot = static_cast<FreeSlot*>(p);
+            slot->_next = _free;
+            _free = slot;
+        }
+
+        void addChunk()
+        {
+            auto* chunk = static_cast<std::uint8_t*>(::operator new(SLOT_SIZE * SLOTS_PER_CHUNK, std::align_val_t(CACHE_LINE)));
+            _chunks.push_back(chunk);
+
+            // push in reverse so a fresh chunk hands out its slots in address order
+            for (size_t i = SLOTS_PER_CHUNK; i-- > 0; )
+            {
+                push(chunk + i * SLOT_SIZE);
+            }
+        }
+
+        FreeSlot* _free = nullptr;
+        size_t _inUse = 0;
+        std::vector<void*> _chunks;
+    };
+}
@@ -2,10 +2,18 @@
 
 #include "buffer.h"
 #include "poller.h"
+#include "shaper.h"
+#include "syscall_stats.h"
+#include "transform.h"
 
 #include <cassert>
+#include <cerrno>
+#include <chrono>
 #include <functional>
 #include <memory>
+#include <utility>
+
+#include <sys/uio.h>
 
 namespace vsockio
 {
@@ -16,9 +24,14 @@ namespace vsockio
 		std::function<int(int, void*, int)> read;
 		std::function<int(int, void*, int)> write;
 		std::function<int(int)> close;
+		std::function<int(int, const iovec*, int)> readv;
+		std::function<int(int, const iovec*, int)> writev;
 
-		SocketImpl() {}
+		SocketImpl()
+			: readv(emulateReadv())
+			, writev(emulateWritev()) {}
 
+		// Without vectored implementations readv/writev go through read/write one segment at a time.
 		SocketImpl(
 			std::function<int(int, void*, int)> readImpl,
 			std::function<int(int, void*, int)> writeImpl,
@@ -26,9 +39,68 @@ namespace vsockio
 		) :
 			read(readImpl), 
 			write(writeImpl), 
-			close(closeImpl) {}
+			close(closeImpl),
+			readv(emulateReadv()),
+			writev(emulateWritev()) {}
+
+		SocketImpl(
+			std::function<int(int, void*, int)> readImpl,
+			std::function<int(int, void*, int)> writeImpl,
+			std::function<int(int)> closeImpl,
+			std::function<int(int, const iovec*, int)> readvImpl,
+			std::function<int(int, const iovec*, int)> writevImpl
+		) :
+			read(readImpl),
+			write(writeImpl),
+			close(closeImpl),
+			readv(readvImpl),
+			writev(writevImpl) {}
+
+		// the emulations refer back to this object
+		SocketImpl(const SocketImpl&) = delete;
+		SocketImpl& operator=(const SocketImpl&) = delete;
+
+	private:
+		std::function<int(int, const iovec*, int)> emulateReadv()
+		{
+			return [this](int fd, const iovec* iov, int count) { return emulateVectored(read, fd, iov, count); };
+		}
+
+		std::function<int(int, const iovec*, int)> emulateWritev()
+		{
+			return [this](int fd, const iovec* iov, int count) { return emulateVectored(write, fd, iov, count); };
+		}
+
+		static int emulateVectored(const std::function<int(int, void*, int)>& io, int fd, const iovec* iov, int count)
+		{
+			int total = 0;
+			for (int i = 0; i < count; i++)
+			{
+				const int n = io(fd, iov[i].iov_base, static_cast<int>(iov[i].iov_len));
+				if (n < 0)
+				{
+					return total > 0 ? total : n;
+				}
+				total += n;
+				if (n < static_cast<int>(iov[i].iov_len))
+				{
+					break;
+				}
+			}
+			return total;
+		}
+	};
+
+	// Sees the bytes read from a socket before they are relayed, e.g. to follow a protocol's framing.
+	struct StreamObserver
+	{
+		virtual ~StreamObserver() = default;
+
+		virtual void onData(const uint8_t* data, size_t len) = 0;
 	};
 
+	class PendingSocket;
+
 	class Socket
 	{
 	public:
@@ -63,14 +135,89 @@ namespace vsockio
 			_poller = poller;
 		}
 
+		// Size bounds for the buffer holding data queued for this socket.
+		void setBufferLimits(const BufferLimits& limits)
+		{
+			_buffer.setLimits(limits);
+		}
+
+		void setBufferBudget(MemoryBudget* budget)
+		{
+			_buffer.setBudget(budget);
+		}
+
+		void setShaper(Shaper* shaper)
+		{
+			_shaper = shaper;
+		}
+
+		// Where the syscalls made for this socket are counted, either may be null.
+		void setSyscallCounters(SyscallCounts* channel, SyscallCounters* thread)
+		{
+			_channelSyscalls = channel;
+			_threadSyscalls = thread;
+		}
+
+        void setObserver(StreamObserver* observer)
+        {
+            _observer = observer;
+        }
+
+        // Passes what is read through the transform before queueing it for the peer, see transform.h.
+        void setTransform(StreamTransform* transform)
+        {
+            _transform = transform;
+        }
+
+        // Throughput mode: what the peer reads is held back and written in one go once the buffer
+        // is full, the peer's input closes or delay has passed since the first held byte, so chatty
+        // flows cost fewer writes and packets. With no delay, held data goes out at the end of the
+        // IO thread's loop iteration. See flushDue().
+        void setCoalescing(bool on, std::chrono::microseconds delay = {})
+        {
+            _coalesce = on;
+            _coalesceDelay = delay;
+        }
+
+        // Takes over a connection for a socket without one (fd -1) and registers it with the poller.
+        // Closes the socket if there is no connection or it cannot be polled.
+        bool attach(PendingSocket&& socket, void* pollHandle);
+
+        // Gives up the connection, leaving the socket open without one. Only for sockets with
+        // nothing queued in either direction, i.e. between exchanges of a request/response protocol.
+        PendingSocket detach();
+
+        bool attached() const { return _fd >= 0; }
+
+        // Input is ready but the shaper has no tokens left for it.
+        bool throttled() const { return _throttled; }
+
+        // Input is ready but the buffer budget has no room for a block to read it into.
+        bool waitingForBuffer() const { return _waitingForBuffer; }
+
         bool connected() const { return _connected; }
         void onConnected() { _connected = true; }
         void checkConnected();
 
         bool closed() const { return _inputClosed && _outputClosed; }
 
+        // Bytes read from this socket since the channel was opened, i.e. relayed towards the peer.
+        uint64_t bytesRead() const { return _bytesRead; }
+
+        // Bytes read from the peer and not yet written to this socket.
+        int queuedBytes() const { return _buffer.remainingDataSize(); }
+
         bool canReadWriteMore() const { return (_canReadMore || _canWriteMore) && !closed(); }
 
+        // Whether the socket has borrowed a buffer block, which belongs to its thread's pool.
+        bool holdsBuffer() const { return _buffer.allocated(); }
+
+        // When data held back by throughput mode must be written, default = none held.
+        std::chrono::steady_clock::time_point flushDue() const
+        {
+            return _heldBackSince == std::chrono::steady_clock::time_point() ? _heldBackSince : _heldBackSince + _coalesceDelay;
+        }
+
     private:
 		bool readFromInput();
 		bool writeToOutput();
@@ -79,13 +226,27 @@ namespace vsockio
 
 		bool read(Buffer& buffer);
 		bool send(Buffer& buffer);
+		bool holdBack();
+		static void releaseIfEmpty(Buffer& buffer);
         void close();
 
+        void recordSyscall(Syscall syscall, SyscallOutcome outcome)
+        {
+            if (_channelSyscalls != nullptr) _channelSyscalls->record(syscall, outcome);
+            if (_threadSyscalls != nullptr) _threadSyscalls->record(syscall, outcome);
+        }
+
+        static SyscallOutcome outcomeOf(int err)
+        {
+            return err == EAGAIN || err == EWOULDBLOCK ? SyscallOutcome::Again : SyscallOutcome::Error;
+        }
+
 		void closeInput();
 
         bool inputClosed() const { return _inputClosed; }
         bool outputClosed() const { return _outputClosed; }
         bool hasQueuedData() const { return !_buffer.consumed(); }
+        bool hasHeldBackOutput() const { return _transform != nullptr && _transform->pending(); }
 
         Buffer& buffer() { return _buffer; }
 
@@ -99,6 +260,67 @@ namespace vsockio
 		int _fd;
         bool _connected = false;
 		Poller* _poller = nullptr;
+        Shaper* _shaper = nullptr;
+        bool _throttled = false;
+        bool _waitingForBuffer = false;
+        uint64_t _bytesRead = 0;
+        SyscallCounts* _channelSyscalls = nullptr;
+        SyscallCounters* _threadSyscalls = nullptr;
+        StreamObserver* _observer = nullptr;
+        StreamTransform* _transform = nullptr;
+        bool _coalesce = false;
+        std::chrono::microseconds _coalesceDelay{0};
+        // when the data now held back was first held, default = nothing held
+        std::chrono::steady_clock::time_point _heldBackSince;
         Buffer _buffer;
 	};
-}
\ No newline at end of file
+
+	// A socket fd on its way from a listener to an IOThread. Closes the fd unless it is handed over.
+	class PendingSocket
+	{
+	public:
+		PendingSocket() = default;
+		explicit PendingSocket(int fd) : _fd(fd) {}
+
+		PendingSocket(PendingSocket&& other) noexcept
+			: _fd(std::exchange(other._fd, -1))
+			, _connected(other._connected) {}
+
+		PendingSocket& operator=(PendingSocket&& other) noexcept
+		{
+			if (this != &other)
+			{
+				reset();
+				_fd = std::exchange(other._fd, -1);
+				_connected = other._connected;
+			}
+			return *this;
+		}
+
+		~PendingSocket()
+		{
+			reset();
+		}
+
+		explicit operator bool() const { return _fd >= 0; }
+		int fd() const { return _fd; }
+
+		bool connected() const { return _connected; }
+		void onConnected() { _connected = true; }
+
+		int release() { return std::exchange(_fd, -1); }
+
+	private:
+		void reset()
+		{
+			if (_fd >= 0)
+			{
+				SocketImpl::singleton->close(_fd);
+				_fd = -1;
+			}
+		}
+
+		int _fd = -1;
+		bool _connected = false;
+	};
+}
@@ -0,0 +1,205 @@
+#pragma once
+
+#include "metrics.h"
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+namespace vsockio
+{
+    enum class Syscall : uint8_t
+    {
+        Read = 0,           // read/readv on a channel socket
+        Write = 1,          // write/writev on a channel socket
+        ConnectCheck = 2,   // zero byte write probing whether a non-blocking connect finished
+        Close = 3,
+        PollWait = 4,
+        PollAdd = 5,
+        PollRemove = 6,
+    };
+
+    constexpr size_t NUM_SYSCALLS = 7;
+
+    // Ok means the call did its job (moved bytes, reported events, ...), Again that there was nothing
+    // to do (EAGAIN, or a poll returning no events) and the call was wasted.
+    enum class SyscallOutcome : uint8_t
+    {
+        Ok = 0,
+        Again = 1,
+        Error = 2,
+    };
+
+    constexpr size_t NUM_SYSCALL_OUTCOMES = 3;
+
+    inline const char* syscallName(Syscall syscall)
+    {
+        switch (syscall)
+        {
+            case Syscall::Read: return "read";
+            case Syscall::Write: return "write";
+            case Syscall::ConnectCheck: return "connect_check";
+            case Syscall::Close: return "close";
+            case Syscall::PollWait: return "epoll_wait";
+            case Syscall::PollAdd: return "epoll_add";
+            case Syscall::PollRemove: return "epoll_remove";
+            default: return "unknown";
+        }
+    }
+
+    inline const char* syscallOutcomeName(SyscallOutcome outcome)
+    {
+        switch (outcome)
+        {
+            case SyscallOutcome::Ok: return "ok";
+            case SyscallOutcome::Again: return "eagain";
+            case SyscallOutcome::Error: return "error";
+            default: return "unknown";
+        }
+    }
+
+    // "syscalls=N eagain=N errors=N bytes_relayed=N syscalls_per_kb=X", the efficiency summary shown on the admin socket.
+    inline void describeSyscallTotals(std::ostream& os, uint64_t syscalls, uint64_t again, uint64_t errors, uint64_t bytesRelayed)
+    {
+        os << "syscalls=" << syscalls << " eagain=" << again << " errors=" << errors << " bytes_relayed=" << bytesRelayed << " syscalls_per_kb=";
+        if (bytesRelayed != 0)
+            os << static_cast<double>(syscalls) * 1024 / bytesRelayed;
+        else
+            os << "-";
+    }
+
+    // Syscalls of one channel. Only touched by the channel's IO thread, so plain integers.
+    struct SyscallCounts
+    {
+        std::array<std::array<uint64_t, NUM_SYSCALL_OUTCOMES>, NUM_SYSCALLS> _counts{};
+
+        void record(Syscall syscall, SyscallOutcome outcome)
+        {
+            ++_counts[static_cast<size_t>(syscall)][static_cast<size_t>(outcome)];
+        }
+
+        uint64_t count(Syscall syscall, SyscallOutcome outcome) const
+        {
+            return _counts[static_cast<size_t>(syscall)][static_cast<size_t>(outcome)];
+        }
+
+        uint64_t total() const
+        {
+            uint64_t total = 0;
+            for (const auto& outcomes : _counts)
+                for (const uint64_t n : outcomes) total += n;
+            return total;
+        }
+
+        uint64_t total(SyscallOutcome outcome) const
+        {
+            uint64_t total = 0;
+            for (const auto& outcomes : _counts) total += outcomes[static_cast<size_t>(outcome)];
+            return total;
+        }
+
+        void describe(std::ostream& os, uint64_t bytesRelayed) const
+        {
+            describeSyscallTotals(os, total(), total(SyscallOutcome::Again), total(SyscallOutcome::Error), bytesRelayed);
+        }
+    };
+
+    // Syscalls and relayed bytes of a thread or service as "<prefix>.syscalls.<call>.<outcome>" and
+    // "<prefix>.bytes_relayed" metrics. A counter is registered on its first use, so the stats only list
+    // calls that happened.
+    class SyscallCounters
+    {
+    public:
+        explicit SyscallCounters(const std::string& prefix)
+            : _prefix(prefix)
+            , _bytesRelayed(Metrics::instance->counter(prefix + ".bytes_relayed"))
+        {
+        }
+
+        SyscallCounters(const SyscallCounters&) = delete;
+        SyscallCounters& operator=(const SyscallCounters&) = delete;
+
+        void record(Syscall syscall, SyscallOutcome outcome, uint64_t n = 1)
+        {
+            counter(syscall, outcome).add(n);
+        }
+
+        void add(const SyscallCounts& counts)
+        {
+            for (size_t s = 0; s < NUM_SYSCALLS; s++)
+            {
+                for (size_t o = 0; o < NUM_SYSCALL_OUTCOMES; o++)
+                {
+                    if (counts._counts[s][o] != 0)
+                    {
+                        record(static_cast<Syscall>(s), static_cast<SyscallOutcome>(o), counts._counts[s][o]);
+                    }
+                }
+            }
+        }
+
+        void addBytesRelayed(uint64_t n) { _bytesRelayed.add(n); }
+
+        uint64_t bytesRelayed() const { return _bytesRelayed.value(); }
+
+        uint64_t count(Syscall syscall, SyscallOutcome outcome) const
+        {
+            auto& slot = _counters[static_cast<size_t>(syscall)][static_cast<size_t>(outcome)];
+            Counter* c = slot.load(std::memory_order_acquire);
+            if (c == nullptr)
+            {
+                // another instance with the same prefix may have registered it, reading must not register it though
+                c = Metrics::instance->findCounter(name(syscall, outcome));
+                if (c == nullptr) return 0;
+                slot.store(c, std::memory_order_release);
+            }
+            return c->value();
+        }
+
+        uint64_t total() const
+        {
+            uint64_t total = 0;
+            for (size_t s = 0; s < NUM_SYSCALLS; s++)
+                for (size_t o = 0; o < NUM_SYSCALL_OUTCOMES; o++)
+                    total += count(static_cast<Syscall>(s), static_cast<SyscallOutcome>(o));
+            return total;
+        }
+
+        void describe(std::ostream& os) const
+        {
+            uint64_t again = 0;
+            uint64_t errors = 0;
+            for (size_t s = 0; s < NUM_SYSCALLS; s++)
+            {
+                again += count(static_cast<Syscall>(s), SyscallOutcome::Again);
+                errors += count(static_cast<Syscall>(s), SyscallOutcome::Error);
+            }
+            describeSyscallTotals(os, total(), again, errors, bytesRelayed());
+        }
+
+    private:
+        std::string name(Syscall syscall, SyscallOutcome outcome) const
+        {
+            return _prefix + ".syscalls." + syscallName(syscall) + "." + syscallOutcomeName(outcome);
+        }
+
+        Counter& counter(Syscall syscall, SyscallOutcome outcome)
+        {
+            auto& slot = _counters[static_cast<size_t>(syscall)][static_cast<size_t>(outcome)];
+            Counter* c = slot.load(std::memory_order_acquire);
+            if (c == nullptr)
+            {
+                // the registry hands out the same counter for a name, so racing threads end up agreeing
+                c = &Metrics::instance->counter(name(syscall, outcome));
+                slot.store(c, std::memory_order_release);
+            }
+            return *c;
+        }
+
+        const std::string _prefix;
+        Counter& _bytesRelayed;
+        mutable std::array<std::array<std::atomic<Counter*>, NUM_SYSCALL_OUTCOMES>, NUM_SYSCALLS> _counters{};
+    };
+}
@@ -37,6 +37,18 @@ namespace vsockio
             _queue.pop();
             return result;
         }
+
+        bool empty()
+        {
+            std::lock_guard<std::mutex> lk(_queueLock);
+            return _queue.empty();
+        }
+
+        size_t size()
+        {
+            std::lock_guard<std::mutex> lk(_queueLock);
+            return _queue.size();
+        }
     };
 
 }
\ No newline at end of file
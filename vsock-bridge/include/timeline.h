@@ -0,0 +1,96 @@
+#pragma once
+
+#include "metrics.h"
+
+#include <chrono>
+#include <ostream>
+#include <string>
+
+namespace vsockio
+{
+    // When a channel went through each step from accept to close. Default time points mean the step
+    // did not happen (yet); channels not created by a listener have no accept time.
+    struct ChannelTimeline
+    {
+        using Clock = std::chrono::steady_clock;
+
+        Clock::time_point _accepted;
+        Clock::time_point _dispatched;          // queued for an IO thread
+        Clock::time_point _registered;          // added to the IO thread's poller
+        Clock::time_point _connected;           // backend connection established
+        Clock::time_point _firstRequestByte;    // first byte read from the client
+        Clock::time_point _firstResponseByte;   // first byte read from the backend
+        Clock::time_point _closed;
+
+        static bool isSet(Clock::time_point t) { return t != Clock::time_point(); }
+
+        bool complete() const
+        {
+            return isSet(_connected) && isSet(_firstRequestByte) && isSet(_firstResponseByte);
+        }
+
+        // Offsets from accept, e.g. "dispatched=+12us registered=+30us connected=- ...".
+        void describe(std::ostream& os) const
+        {
+            const std::pair<const char*, Clock::time_point> steps[] = {
+                {"dispatched", _dispatched},
+                {"registered", _registered},
+                {"connected", _connected},
+                {"first_request_byte", _firstRequestByte},
+                {"first_response_byte", _firstResponseByte},
+                {"closed", _closed},
+            };
+            for (const auto& [name, t] : steps)
+            {
+                os << " " << name << "=";
+                if (isSet(_accepted) && isSet(t))
+                    os << "+" << std::chrono::duration_cast<std::chrono::microseconds>(t - _accepted).count() << "us";
+                else
+                    os << "-";
+            }
+        }
+    };
+
+    // Per-service histograms of the phases between timeline steps, recorded when channels close.
+    struct ChannelTimings
+    {
+        explicit ChannelTimings(const std::string& prefix)
+            : _dispatch(Metrics::instance->histogram(prefix + ".timing.dispatch_us"))
+            , _handoff(Metrics::instance->histogram(prefix + ".timing.handoff_us"))
+            , _connect(Metrics::instance->histogram(prefix + ".timing.connect_us"))
+            , _firstResponse(Metrics::instance->histogram(prefix + ".timing.first_response_us"))
+            , _requestToResponse(Metrics::instance->histogram(prefix + ".timing.request_to_response_us"))
+            , _lifetime(Metrics::instance->histogram(prefix + ".timing.lifetime_ms"))
+        {
+        }
+
+        void record(const ChannelTimeline& t)
+        {
+            recordMicros(_dispatch, t._accepted, t._dispatched);
+            recordMicros(_handoff, t._dispatched, t._registered);
+            recordMicros(_connect, t._accepted, t._connected);
+            recordMicros(_firstResponse, t._connected, t._firstResponseByte);
+            recordMicros(_requestToResponse, t._firstRequestByte, t._firstResponseByte);
+            if (ChannelTimeline::isSet(t._accepted) && ChannelTimeline::isSet(t._closed))
+            {
+                _lifetime.record(std::chrono::duration_cast<std::chrono::milliseconds>(t._closed - t._accepted).count());
+            }
+        }
+
+        Histogram& _dispatch;           // accepted -> dispatched: admission and starting the backend connect
+        Histogram& _handoff;            // dispatched -> registered: waiting for the IO thread to pick it up
+        Histogram& _connect;            // accepted -> backend connected
+        Histogram& _firstResponse;      // backend connected -> first byte from the backend
+        Histogram& _requestToResponse;  // first byte from the client -> first byte from the backend
+        Histogram& _lifetime;           // accepted -> closed, in milliseconds
+
+    private:
+        static void recordMicros(Histogram& histogram, ChannelTimeline::Clock::time_point from, ChannelTimeline::Clock::time_point to)
+        {
+            if (ChannelTimeline::isSet(from) && ChannelTimeline::isSet(to) && to >= from)
+            {
+                histogram.record(std::chrono::duration_cast<std::chrono::microseconds>(to - from).count());
+            }
+        }
+    };
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace vsockio
+{
+    // Lock-free token bucket, safe to share between threads.
+    //
+    // Implemented as GCRA: instead of a token count the bucket keeps the time at which it
+    // would be full again ("theoretical arrival time"). Consuming n tokens pushes that time
+    // n / rate seconds forward; tokens are available while it is less than one burst ahead of now.
+    class TokenBucket
+    {
+    public:
+        using Clock = std::chrono::steady_clock;
+
+        TokenBucket(uint64_t ratePerSecond, uint64_t burst)
+            : _ratePerSecond(ratePerSecond)
+            , _burstNs(toNs(std::max<uint64_t>(burst, 1)))
+        {
+        }
+
+        uint64_t ratePerSecond() const { return _ratePerSecond; }
+        uint64_t burst() const { return fromNs(_burstNs); }
+
+        // Number of tokens that can be consumed right now.
+        uint64_t available(Clock::time_point now) const
+        {
+            const int64_t nowNs = sinceEpoch(now);
+            const int64_t debt = std::max<int64_t>(_tat.load(std::memory_order_relaxed) - nowNs, 0);
+            return debt >= _burstNs ? 0 : fromNs(_burstNs - debt);
+        }
+
+        // Consume n tokens unconditionally; the bucket may go into debt.
+        void consume(uint64_t n, Clock::time_point now)
+        {
+            const int64_t nowNs = sinceEpoch(now);
+            const int64_t cost = toNs(n);
+            int64_t tat = _tat.load(std::memory_order_relaxed);
+            while (!_tat.compare_exchange_weak(tat, std::max(tat, nowNs) + cost, std::memory_order_relaxed)) {}
+        }
+
+        bool tryConsume(uint64_t n, Clock::time_point now)
+        {
+            const int64_t nowNs = sinceEpoch(now);
+            const int64_t cost = toNs(n);
+            int64_t tat = _tat.load(std::memory_order_relaxed);
+            for (;;)
+            {
+                const int64_t newTat = std::max(tat, nowNs) + cost;
+                if (newTat - nowNs > _burstNs) return false;
+                if (_tat.compare_exchange_weak(tat, newTat, std::memory_order_relaxed)) return true;
+            }
+        }
+
+        // Give back n tokens consumed for something that did not happen after all.
+        void refund(uint64_t n)
+        {
+            const int64_t cost = toNs(n);
+            int64_t tat = _tat.load(std::memory_order_relaxed);
+            while (!_tat.compare_exchange_weak(tat, tat - cost, std::memory_order_relaxed)) {}
+        }
+
+        // Time until at least n tokens (capped at the burst size) are available.
+        Clock::duration timeUntilAvailable(uint64_t n, Clock::time_point now) const
+        {
+            const int64_t nowNs = sinceEpoch(now);
+            const int64_t needed = std::min(toNs(n), _burstNs);
+            const int64_t wait = _tat.load(std::memory_order_relaxed) + needed - _burstNs - nowNs;
+            return std::chrono::nanoseconds(std::max<int64_t>(wait, 0));
+        }
+
+    private:
+        int64_t toNs(uint64_t tokens) const
+        {
+            return static_cast<int64_t>(static_cast<double>(tokens) * 1e9 / _ratePerSecond);
+        }
+
+        uint64_t fromNs(int64_t ns) const
+        {
+            return static_cast<uint64_t>(static_cast<double>(ns) * _ratePerSecond / 1e9);
+        }
+
+        static int64_t sinceEpoch(Clock::time_point t)
+        {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(t.time_since_epoch()).count();
+        }
+
+        const uint64_t _ratePerSecond;
+        const int64_t _burstNs;
+        std::atomic<int64_t> _tat{0};
+    };
+}
@@ -0,0 +1,160 @@
+#pragma once
+
+#include "buffer.h"
+#include "metrics.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace vsockio
+{
+    // Which side of a service's channels carries a compressed stream: the bridge on the other end of
+    // that connection must be configured with the opposite side.
+    enum class CompressSide
+    {
+        None,
+        Listen,     // clients send compressed data and receive it compressed
+        Connect,    // the backend receives compressed data and answers compressed
+    };
+
+    // Per-service byte counts of the compression stage, e.g. service.<name>.compress.in_bytes.
+    struct CompressionCounters
+    {
+        explicit CompressionCounters(const std::string& prefix)
+            : _compressIn(Metrics::instance->counter(prefix + ".compress.in_bytes"))
+            , _compressOut(Metrics::instance->counter(prefix + ".compress.out_bytes"))
+            , _decompressIn(Metrics::instance->counter(prefix + ".decompress.in_bytes"))
+            , _decompressOut(Metrics::instance->counter(prefix + ".decompress.out_bytes"))
+        {
+        }
+
+        Counter& _compressIn;
+        Counter& _compressOut;
+        Counter& _decompressIn;
+        Counter& _decompressOut;
+    };
+
+    // A stage between reading from a socket and queueing the data for its peer. Sockets without one
+    // read straight into the peer's buffer; with one they read into a per-thread scratch block and
+    // the stage produces what gets queued. Output that does not fit the peer's buffer is held back
+    // here, and the peer's socket takes it over as its buffer drains.
+    class StreamTransform
+    {
+    public:
+        static constexpr size_t MAX_READ = 64 * 1024;
+
+        virtual ~StreamTransform() = default;
+
+        // How much to read at once while the output buffer has freeSpace bytes free.
+        virtual size_t maxInput(size_t freeSpace) const { return std::min(freeSpace, MAX_READ); }
+
+        // Transforms len bytes read from the socket. Returns false if the input is malformed.
+        virtual bool process(const uint8_t* data, size_t len, Buffer& out) = 0;
+
+        // Queues held back output into out, returns true once none is left.
+        virtual bool drainTo(Buffer& out);
+
+        // Whether there is output for drainTo().
+        virtual bool pending() const { return heldBack(); }
+
+        // Input turned out malformed while draining, the stream cannot go on.
+        virtual bool malformed() const { return false; }
+
+        // Output held back for lack of room, at most about a block.
+        size_t pendingBytes() const { return _pending.size() - _pendingBegin; }
+
+        // Frees staging memory not in use, once the socket has no more input for now, so idle
+        // channels hold none.
+        virtual void trim();
+
+        // Per-thread block of MAX_READ bytes to read into.
+        static uint8_t* inputScratch();
+
+    protected:
+        // Queues data into out, holding back what does not fit.
+        void emit(const uint8_t* data, size_t len, Buffer& out);
+
+        bool heldBack() const { return _pendingBegin < _pending.size(); }
+
+    private:
+        std::vector<uint8_t> _pending;
+        size_t _pendingBegin = 0;
+    };
+
+    // Compressed streams are a sequence of frames: a 4 byte header (type, payload length in 24 bits,
+    // network byte order) and the payload, either a block as read or an lz4 block of at most
+    // MAX_READ bytes once decompressed. Blocks that do not shrink go as they are, so incompressible
+    // data costs a header per block plus the failed attempts.
+    enum class FrameType : uint8_t
+    {
+        Stored = 0,
+        Lz4 = 1,
+    };
+
+    class BlockCompressor : public StreamTransform
+    {
+    public:
+        static constexpr size_t FRAME_HEADER_SIZE = 4;
+        // blocks that do not shrink by at least 1/16th go stored
+        static constexpr size_t MIN_SAVING_SHIFT = 4;
+        // after this many stored blocks in a row, the next BACKOFF_BLOCKS are not even tried
+        static constexpr uint32_t BACKOFF_AFTER = 4;
+        static constexpr uint32_t BACKOFF_BLOCKS = 32;
+
+        explicit BlockCompressor(CompressionCounters* counters = nullptr)
+            : _counters(counters) {}
+
+        // Reads several times what fits, expecting it to shrink; what does not fit is held back.
+        size_t maxInput(size_t freeSpace) const override { return std::min(freeSpace * 4, MAX_READ); }
+
+        bool process(const uint8_t* data, size_t len, Buffer& out) override;
+
+        static void writeHeader(uint8_t* out, FrameType type, size_t length);
+
+    private:
+        void emitStored(const uint8_t* data, size_t len, Buffer& out);
+
+        CompressionCounters* const _counters;
+        uint32_t _storedInARow = 0;
+        uint32_t _skip = 0;
+    };
+
+    class BlockDecompressor : public StreamTransform
+    {
+    public:
+        explicit BlockDecompressor(CompressionCounters* counters = nullptr)
+            : _counters(counters) {}
+
+        // Decodes frames only while out has room, so a small read of highly compressed frames
+        // cannot expand into more than a block of held back output. The rest waits for drainTo().
+        bool process(const uint8_t* data, size_t len, Buffer& out) override;
+
+        bool drainTo(Buffer& out) override;
+        bool pending() const override { return heldBack() || frameCollected(); }
+        bool malformed() const override { return _malformed; }
+
+        void trim() override;
+
+    private:
+        // Length of the frame starting with this header, 0 if it is not a valid one.
+        static size_t frameLength(const uint8_t* header);
+        bool decodeFrame(const uint8_t* frame, size_t len, Buffer& out);
+        // Decodes the complete frames in _partial while out has room. False if one is malformed.
+        bool decodeCollected(Buffer& out);
+        bool frameCollected() const;
+
+        CompressionCounters* const _counters;
+        // input not decoded yet: whole frames waiting for room, then a frame split across reads
+        std::vector<uint8_t> _partial;
+        size_t _partialBegin = 0;
+        bool _malformed = false;
+    };
+
+    // The stage for the socket of a channel reading from the listen side (a) or the connect side (b):
+    // data coming from the compressed side is decompressed, data going to it compressed.
+    std::unique_ptr<StreamTransform> createTransform(CompressSide compressed, bool readsFromListenSide, CompressionCounters* counters);
+}
@@ -1,11 +1,22 @@
 ﻿#pragma once
 
+#include "acceptor.h"
+#include "admin.h"
+#include "autoscale.h"
+#include "buffer_pool.h"
 #include "config.h"
 #include "dispatcher.h"
 #include "iothread.h"
 #include "listener.h"
 #include "logger.h"
+#include "metrics.h"
+#include "rebalance.h"
+#include "resolver.h"
+#include "service.h"
 #include "socket.h"
 
+#include <limits>
+#include <sstream>
+
 #include <signal.h>
 #include <sys/stat.h>
\ No newline at end of file
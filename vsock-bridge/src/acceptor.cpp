@@ -0,0 +1,73 @@
+#include "acceptor.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace vsockio
+{
+    Acceptor::Acceptor(PollerFactory& pollerFactory)
+        : _poller(pollerFactory.createPoller())
+        , _events(_poller->maxEventsPerPoll())
+        , _wakeups(Metrics::instance->counter("acceptor.wakeups"))
+    {
+    }
+
+    void Acceptor::add(Listener& listener)
+    {
+        listener.start();
+        if (!_poller->add(listener._fd, &listener))
+        {
+            throw std::runtime_error("failed to poll listener socket");
+        }
+        // clients may have connected between listen and add, edge triggered polling would not report them
+        listener.setReady();
+        _listeners.push_back(&listener);
+    }
+
+    void Acceptor::run()
+    {
+        for (;;)
+        {
+            runOnce(std::chrono::milliseconds(-1));
+        }
+    }
+
+    void Acceptor::runOnce(std::chrono::milliseconds maxWait)
+    {
+        const int eventCount = _poller->poll(_events.data(), pollTimeout(Listener::Clock::now(), maxWait));
+        _wakeups.add();
+        for (int i = 0; i < eventCount; i++)
+        {
+            static_cast<Listener*>(_events[i].data)->setReady();
+        }
+
+        const auto now = Listener::Clock::now();
+        for (Listener* listener : _listeners)
+        {
+            if (listener->ready() && listener->notBefore() <= now)
+            {
+                listener->serve(now);
+            }
+        }
+    }
+
+    int Acceptor::pollTimeout(Listener::Clock::time_point now, std::chrono::milliseconds maxWait) const
+    {
+        // negative waits forever, like the poller's timeout
+        int timeout = static_cast<int>(maxWait.count());
+        for (const Listener* listener : _listeners)
+        {
+            if (!listener->ready())
+            {
+                continue;
+            }
+            // rounded up, a deferred listener must not be polled for just before it is due
+            const auto due = std::chrono::ceil<std::chrono::milliseconds>(std::max(listener->notBefore() - now, Listener::Clock::duration::zero()));
+            if (timeout < 0 || due.count() < timeout)
+            {
+                timeout = static_cast<int>(due.count());
+            }
+        }
+        return timeout;
+    }
+}
@@ -0,0 +1,314 @@
+#include <admin.h>
+#include <endpoint.h>
+#include <logger.h>
+#include <metrics.h>
+
+#include <algorithm>
+#include <future>
+#include <memory>
+#include <sstream>
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+namespace vsockio
+{
+    bool AdminServer::start(const std::string& path)
+    {
+        UnixEndpoint endpoint(path);
+        const int fd = endpoint.getSocket();
+        if (fd < 0)
+        {
+            Logger::instance->Log(Logger::ERROR, "failed to create admin socket: ", strerror(errno));
+            return false;
+        }
+
+        if (!endpoint.isAbstract())
+        {
+            unlink(path.c_str());
+        }
+
+        const auto addrAndLen = endpoint.getAddress();
+        if (bind(fd, addrAndLen.first, addrAndLen.second) < 0 || listen(fd, 4) < 0)
+        {
+            const int err = errno;
+            close(fd);
+            Logger::instance->Log(Logger::ERROR, "failed to listen on admin socket ", endpoint.describe(), ": ", strerror(err));
+            return false;
+        }
+
+        Logger::instance->Log(Logger::INFO, "admin socket listening on ", endpoint.describe());
+        _fd = fd;
+        _path = path;
+        _thr = std::thread([this] { run(); });
+        return true;
+    }
+
+    void AdminServer::stop()
+    {
+        if (_fd < 0)
+        {
+            return;
+        }
+
+        _stopFlag = true;
+        // wakes up the blocking accept
+        shutdown(_fd, SHUT_RDWR);
+        if (_thr.joinable())
+        {
+            _thr.join();
+        }
+        close(_fd);
+        _fd = -1;
+
+        if (!_path.empty() && _path[0] != '@')
+        {
+            unlink(_path.c_str());
+        }
+    }
+
+    void AdminServer::run()
+    {
+        while (!_stopFlag.load())
+        {
+            const int clientFd = accept(_fd, nullptr, nullptr);
+            if (clientFd < 0)
+            {
+                if (errno != EINTR && errno != ECONNABORTED && !_stopFlag.load())
+                {
+                    Logger::instance->Log(Logger::ERROR, "error during accept on admin socket: ", strerror(errno));
+                    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                }
+                continue;
+            }
+
+            serve(clientFd);
+            close(clientFd);
+        }
+    }
+
+    void AdminServer::serve(int clientFd)
+    {
+        // clients are served one at a time, so one that goes quiet must not hold the socket forever
+        timeval timeout{CLIENT_TIMEOUT.count(), 0};
+        setsockopt(clientFd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(clientFd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        std::string pending;
+        char buf[512];
+        for (;;)
+        {
+            const ssize_t n = read(clientFd, buf, sizeof(buf));
+            if (n <= 0)
+            {
+                return;
+            }
+            pending.append(buf, n);
+
+            size_t eol;
+            while ((eol = pending.find('\n')) != std::string::npos)
+            {
+                const std::string reply = execute(pending.substr(0, eol));
+                pending.erase(0, eol + 1);
+
+                size_t written = 0;
+                while (written < reply.size())
+                {
+                    const ssize_t w = send(clientFd, reply.data() + written, reply.size() - written, MSG_NOSIGNAL);
+                    if (w <= 0)
+                    {
+                        return;
+                    }
+                    written += w;
+                }
+            }
+
+            if (pending.size() > MAX_COMMAND_LENGTH)
+            {
+                return;
+            }
+        }
+    }
+
+    std::string AdminServer::execute(const std::string& commandLine)
+    {
+        std::istringstream words(commandLine);
+        std::string command, argument, extra;
+        words >> command >> argument >> extra;
+
+        if (!extra.empty())
+        {
+            return "error: too many arguments\n";
+        }
+        if (command == "channels" && argument.empty())
+        {
+            return listChannels();
+        }
+        if (command == "services" && argument.empty())
+        {
+            return listServices();
+        }
+        if (command == "syscalls" && argument.empty())
+        {
+            return listSyscalls();
+        }
+        if (command == "stats" && argument.empty())
+        {
+            std::ostringstream os;
+            Metrics::instance->dump(os);
+            return os.str();
+        }
+        if (command == "log-level")
+        {
+            return setLogLevel(argument);
+        }
+        if (command == "pause")
+        {
+            return setServiceState(command, argument, ServiceContext::State::Paused);
+        }
+        if (command == "resume")
+        {
+            return setServiceState(command, argument, ServiceContext::State::Running);
+        }
+        if (command == "drain")
+        {
+            return setServiceState(command, argument, ServiceContext::State::Draining);
+        }
+        if (command == "help" || command.empty())
+        {
+            return "commands: channels, services, stats, syscalls, log-level [n], pause <service>, resume <service>, drain <service>\n";
+        }
+        return "error: unknown command " + command + "\n";
+    }
+
+    std::string AdminServer::listChannels()
+    {
+        // ask every thread first so they all work on it at the same time
+        std::vector<std::pair<size_t, std::future<std::string>>> replies;
+        for (const auto* pool : _pools)
+        {
+            for (size_t i = 0; i < pool->size(); i++)
+            {
+                IOThread& thread = pool->thread(i);
+                if (!thread.running())
+                {
+                    // retired, has no channels
+                    continue;
+                }
+                auto reply = std::make_shared<std::promise<std::string>>();
+                replies.emplace_back(thread.id(), reply->get_future());
+                thread.post([reply, &thread] {
+                    std::ostringstream os;
+                    thread.describeChannels(os);
+                    reply->set_value(os.str());
+                });
+            }
+        }
+
+        std::ostringstream os;
+        const auto deadline = std::chrono::steady_clock::now() + IOTHREAD_TIMEOUT;
+        for (auto& [id, reply] : replies)
+        {
+            if (reply.wait_until(deadline) != std::future_status::ready)
+            {
+                os << "iothread " << id << ": no reply within " << IOTHREAD_TIMEOUT.count() << "s\n";
+                continue;
+            }
+
+            const std::string channels = reply.get();
+            os << "iothread " << id << ": " << std::count(channels.begin(), channels.end(), '\n') << " channels\n" << channels;
+        }
+        return os.str();
+    }
+
+    std::string AdminServer::listServices() const
+    {
+        std::ostringstream os;
+        for (const auto* service : _services)
+        {
+            os << "service " << service->_name
+                << " state=" << ServiceContext::stateName(service->state())
+                << " channels=" << service->_admission.channels()
+                << "\n";
+        }
+        return os.str();
+    }
+
+    std::string AdminServer::listSyscalls() const
+    {
+        // the counters are atomics, so unlike channel listings this needs no help from the IO threads
+        std::ostringstream os;
+        for (const auto* pool : _pools)
+        {
+            for (size_t i = 0; i < pool->size(); i++)
+            {
+                const IOThread& thread = pool->thread(i);
+                os << "iothread " << thread.id() << " ";
+                thread.syscalls().describe(os);
+                os << "\n";
+            }
+        }
+        for (const auto* service : _services)
+        {
+            os << "service " << service->_name << " ";
+            service->_syscalls.describe(os);
+            os << "\n";
+        }
+        return os.str();
+    }
+
+    std::string AdminServer::setLogLevel(const std::string& argument)
+    {
+        if (argument.empty())
+        {
+            return "log-level " + std::to_string(Logger::instance->minLevel()) + "\n";
+        }
+
+        int level = -1;
+        try
+        {
+            size_t parsed = 0;
+            level = std::stoi(argument, &parsed);
+            if (parsed != argument.size()) level = -1;
+        }
+        catch (const std::exception&)
+        {
+        }
+
+        if (level < Logger::DEBUG || level > Logger::CRITICAL)
+        {
+            return "error: log level must be 0, 1, 2, 3 or 4\n";
+        }
+
+        Logger::instance->setMinLevel(level);
+        Logger::instance->Log(Logger::INFO, "log level set to ", level, " from admin socket");
+        return "ok\n";
+    }
+
+    std::string AdminServer::setServiceState(const std::string& command, const std::string& name, ServiceContext::State state)
+    {
+        if (name.empty())
+        {
+            return "error: " + command + " needs a service name\n";
+        }
+
+        auto* service = findService(name);
+        if (service == nullptr)
+        {
+            return "error: no service named " + name + "\n";
+        }
+
+        service->setState(state);
+        Logger::instance->Log(Logger::INFO, "service ", name, " is ", ServiceContext::stateName(state), " (admin socket)");
+        return "ok\n";
+    }
+
+    ServiceContext* AdminServer::findService(const std::string& name) const
+    {
+        const auto it = std::find_if(_services.begin(), _services.end(), [&name](const auto* s) { return s->_name == name; });
+        return it != _services.end() ? *it : nullptr;
+    }
+}
@@ -0,0 +1,77 @@
+#include "admission.h"
+#include "logger.h"
+
+#include <algorithm>
+
+namespace vsockio
+{
+    constexpr std::chrono::milliseconds AdmissionControl::OVERLOAD_RETRY_INTERVAL;
+
+    AdmissionControl::AdmissionControl(const std::string& name, const AdmissionLimits& limits)
+        : _name(name)
+        , _limits(limits)
+        , _resumeChannels(limits._resumeChannels != 0 ? limits._resumeChannels : limits._maxChannels * 9 / 10)
+        , _acceptRate(limits._maxAcceptRate != 0 ? std::make_unique<TokenBucket>(limits._maxAcceptRate, limits._maxAcceptRate) : nullptr)
+        , _channels(Metrics::instance->gauge(name + ".channels"))
+        , _overloadEvents(Metrics::instance->counter(name + ".overload_events"))
+    {
+    }
+
+    AdmissionControl::Decision AdmissionControl::check(Clock::time_point now, std::chrono::microseconds loopLag)
+    {
+        const int64_t channels = _channels.value();
+
+        if (_shedding.load(std::memory_order_relaxed))
+        {
+            if (!recovered(channels, loopLag))
+            {
+                return Decision::Overloaded;
+            }
+
+            if (_shedding.exchange(false))
+            {
+                Logger::instance->Log(Logger::INFO, _name, " recovered from overload, channels=", channels, ", loop lag=", loopLag.count(), "us");
+            }
+        }
+
+        if (overloaded(channels, loopLag))
+        {
+            if (!_shedding.exchange(true))
+            {
+                _overloadEvents.add();
+                Logger::instance->Log(Logger::WARNING, _name, " overloaded, shedding new connections, channels=", channels, ", loop lag=", loopLag.count(), "us");
+            }
+            return Decision::Overloaded;
+        }
+
+        if (_acceptRate && !_acceptRate->tryConsume(1, now))
+        {
+            return Decision::RateLimited;
+        }
+
+        return Decision::Admit;
+    }
+
+    AdmissionControl::Clock::duration AdmissionControl::retryDelay(Decision decision, Clock::time_point now) const
+    {
+        if (decision == Decision::RateLimited && _acceptRate)
+        {
+            return std::max<Clock::duration>(_acceptRate->timeUntilAvailable(1, now), std::chrono::microseconds(100));
+        }
+        return OVERLOAD_RETRY_INTERVAL;
+    }
+
+    bool AdmissionControl::overloaded(int64_t channels, std::chrono::microseconds loopLag) const
+    {
+        if (_limits._maxChannels != 0 && channels >= _limits._maxChannels) return true;
+        if (_limits._maxLoopLagMs != 0 && loopLag > std::chrono::milliseconds(_limits._maxLoopLagMs)) return true;
+        return false;
+    }
+
+    bool AdmissionControl::recovered(int64_t channels, std::chrono::microseconds loopLag) const
+    {
+        if (_limits._maxChannels != 0 && channels > _resumeChannels) return false;
+        if (_limits._maxLoopLagMs != 0 && loopLag > std::chrono::milliseconds(_limits._maxLoopLagMs) / 2) return false;
+        return true;
+    }
+}
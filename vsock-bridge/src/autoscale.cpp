@@ -0,0 +1,179 @@
+#include "autoscale.h"
+#include "logger.h"
+
+#include <cmath>
+#include <fstream>
+
+#include <sched.h>
+
+namespace vsockio
+{
+    namespace
+    {
+        std::optional<int64_t> readNumber(std::istream& is)
+        {
+            int64_t value;
+            if (is >> value) return value;
+            return std::nullopt;
+        }
+    }
+
+    std::optional<double> cgroupCpuQuota(const std::string& cgroupRoot)
+    {
+        // v2: "<quota> <period>" in microseconds, or "max <period>" without a quota
+        std::ifstream cpuMax(cgroupRoot + "/cpu.max");
+        if (cpuMax.good())
+        {
+            std::string quota;
+            int64_t period = 0;
+            if (!(cpuMax >> quota >> period) || quota == "max" || period <= 0)
+            {
+                return std::nullopt;
+            }
+            try
+            {
+                const int64_t us = std::stoll(quota);
+                return us > 0 ? std::optional<double>(static_cast<double>(us) / period) : std::nullopt;
+            }
+            catch (const std::exception&)
+            {
+                return std::nullopt;
+            }
+        }
+
+        // v1: a quota of -1 means none
+        for (const char* controller : {"/cpu", "/cpu,cpuacct"})
+        {
+            std::ifstream quotaFile(cgroupRoot + controller + "/cpu.cfs_quota_us");
+            std::ifstream periodFile(cgroupRoot + controller + "/cpu.cfs_period_us");
+            if (!quotaFile.good() || !periodFile.good())
+            {
+                continue;
+            }
+            const auto quota = readNumber(quotaFile);
+            const auto period = readNumber(periodFile);
+            if (!quota || !period || *quota <= 0 || *period <= 0)
+            {
+                return std::nullopt;
+            }
+            return static_cast<double>(*quota) / *period;
+        }
+        return std::nullopt;
+    }
+
+    size_t availableCpus(const std::string& cgroupRoot)
+    {
+        size_t cpus = std::thread::hardware_concurrency();
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (sched_getaffinity(0, sizeof(set), &set) == 0)
+        {
+            cpus = CPU_COUNT(&set);
+        }
+
+        if (const auto quota = cgroupCpuQuota(cgroupRoot))
+        {
+            cpus = std::min(cpus, static_cast<size_t>(std::ceil(*quota)));
+        }
+        return std::max<size_t>(cpus, 1);
+    }
+
+    PoolLoad::PoolLoad(const IOThreadPool& pool)
+        : _pool(pool)
+        , _lastBusyNs(pool.maxSize(), 0)
+        , _lastSample(std::chrono::steady_clock::now())
+    {
+        for (size_t i = 0; i < _pool.size(); i++)
+        {
+            _lastBusyNs[i] = _pool.thread(i).busyNs();
+        }
+    }
+
+    std::vector<double> PoolLoad::sample(std::chrono::steady_clock::time_point now)
+    {
+        const double elapsedNs = std::chrono::duration<double, std::nano>(now - _lastSample).count();
+        _lastSample = now;
+
+        std::vector<double> load(_pool.size(), 0);
+        for (size_t i = 0; i < load.size(); i++)
+        {
+            const uint64_t busyNs = _pool.thread(i).busyNs();
+            load[i] = elapsedNs > 0 ? (busyNs - _lastBusyNs[i]) / elapsedNs : 0;
+            _lastBusyNs[i] = busyNs;
+        }
+        return load;
+    }
+
+    PoolScaler::PoolScaler(IOThreadPool& pool, const ScalingOptions& options)
+        : _pool(pool)
+        , _options(options)
+        , _load(pool)
+        , _activeWorkers(Metrics::instance->gauge("workers.active"))
+        , _grown(Metrics::instance->counter("workers.grown"))
+        , _shrunk(Metrics::instance->counter("workers.shrunk"))
+    {
+        _activeWorkers.set(_pool.activeSize());
+    }
+
+    PoolScaler::~PoolScaler()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_stopLock);
+            _stop = true;
+        }
+        _stopSignal.notify_all();
+        if (_thr.joinable())
+        {
+            _thr.join();
+        }
+    }
+
+    void PoolScaler::start()
+    {
+        _thr = std::thread([this] {
+            std::unique_lock<std::mutex> lock(_stopLock);
+            while (!_stopSignal.wait_for(lock, _options._interval, [this] { return _stop; }))
+            {
+                sample(std::chrono::steady_clock::now());
+            }
+        });
+    }
+
+    int PoolScaler::sample(std::chrono::steady_clock::time_point now)
+    {
+        // average utilization of the active workers
+        const size_t active = _pool.activeSize();
+        const auto threadLoad = _load.sample(now);
+        double load = 0;
+        for (size_t i = 0; i < active; i++)
+        {
+            load += threadLoad[i] / active;
+        }
+
+        _busySamples = load > _options._growAbove ? _busySamples + 1 : 0;
+        _idleSamples = active > 1 && load * active / (active - 1) < _options._shrinkBelow ? _idleSamples + 1 : 0;
+
+        int change = 0;
+        if (_busySamples >= _options._growAfter && _pool.grow())
+        {
+            Logger::instance->Log(Logger::INFO, "workers ", load * 100, "% busy, growing the pool to ", _pool.activeSize());
+            _grown.add();
+            change = 1;
+        }
+        else if (_idleSamples >= _options._shrinkAfter && _pool.shrink())
+        {
+            Logger::instance->Log(Logger::INFO, "workers ", load * 100, "% busy, shrinking the pool to ", _pool.activeSize());
+            _shrunk.add();
+            change = -1;
+        }
+
+        if (change != 0)
+        {
+            // let the new size settle before judging it
+            _busySamples = 0;
+            _idleSamples = 0;
+            _activeWorkers.set(_pool.activeSize());
+        }
+        return change;
+    }
+}
@@ -0,0 +1,86 @@
+#include "backend_pool.h"
+#include "logger.h"
+
+#include <cerrno>
+
+#include <sys/socket.h>
+
+namespace vsockio
+{
+    BackendPool::BackendPool(const std::string& name, uint32_t maxIdle, Connect connect)
+        : _maxIdle(maxIdle)
+        , _connect(std::move(connect))
+        , _connects(Metrics::instance->counter(name + ".backend.connects"))
+        , _reused(Metrics::instance->counter(name + ".backend.reused"))
+        , _released(Metrics::instance->counter(name + ".backend.released"))
+        , _discarded(Metrics::instance->counter(name + ".backend.discarded"))
+        , _idleGauge(Metrics::instance->gauge(name + ".backend.idle"))
+    {
+    }
+
+    PendingSocket BackendPool::acquire()
+    {
+        // syscalls are made outside the lock, so IO threads do not wait on each other's
+        while (true)
+        {
+            PendingSocket socket;
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                if (_idle.empty())
+                {
+                    break;
+                }
+                socket = std::move(_idle.back());
+                _idle.pop_back();
+            }
+            _idleGauge.add(-1);
+            if (stillIdle(socket.fd()))
+            {
+                _reused.add();
+                return socket;
+            }
+
+            Logger::instance->Log(Logger::DEBUG, "[backend pool] discarding connection closed by the backend (fd=", socket.fd(), ")");
+            _discarded.add();
+        }
+
+        PendingSocket socket = _connect();
+        if (socket)
+        {
+            _connects.add();
+        }
+        return socket;
+    }
+
+    void BackendPool::release(PendingSocket&& socket)
+    {
+        if (!socket)
+        {
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_idle.size() >= _maxIdle)
+        {
+            _discarded.add();
+            return; // closed by the PendingSocket going away
+        }
+
+        _idle.push_back(std::move(socket));
+        _idleGauge.add(1);
+        _released.add();
+    }
+
+    size_t BackendPool::idle() const
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _idle.size();
+    }
+
+    bool BackendPool::stillIdle(int fd)
+    {
+        char c;
+        const ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+        return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+    }
+}
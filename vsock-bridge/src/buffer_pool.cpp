@@ -0,0 +1,145 @@
+#include "buffer_pool.h"
+#include "logger.h"
+
+#include <atomic>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+
+#include <sys/mman.h>
+
+namespace vsockio
+{
+    namespace
+    {
+        std::atomic<bool> useHugePages{false};
+    }
+
+    BufferPool& BufferPool::local()
+    {
+        thread_local BufferPool pool;
+        return pool;
+    }
+
+    void BufferPool::setUseHugePages(bool enable)
+    {
+        useHugePages.store(enable, std::memory_order_relaxed);
+    }
+
+    BufferPool::BufferPool()
+        : _inUseBytes(Metrics::instance->gauge("buffers.in_use_bytes"))
+        , _mappedBytes(Metrics::instance->gauge("buffers.mapped_bytes"))
+    {
+    }
+
+    BufferPool::~BufferPool()
+    {
+        for (void* arena : _arenas)
+        {
+            munmap(arena, ARENA_SIZE);
+        }
+        _inUseBytes.sub(_bytesInUse);
+        _mappedBytes.sub(arenaBytes());
+    }
+
+    std::uint8_t* BufferPool::acquire(int sizeClass)
+    {
+        assert(sizeClass >= 0 && sizeClass < NUM_SIZE_CLASSES);
+        const size_t size = classSize(sizeClass);
+
+        std::uint8_t* block;
+        if (_free[sizeClass] != nullptr)
+        {
+            block = reinterpret_cast<std::uint8_t*>(_free[sizeClass]);
+            _free[sizeClass] = _free[sizeClass]->_next;
+        }
+        else
+        {
+            if (static_cast<size_t>(_end - _next) < size)
+            {
+                // hand the tail of the old arena to the smaller classes rather than wasting it
+                for (int c = sizeClass - 1; c >= 0; --c)
+                {
+                    while (static_cast<size_t>(_end - _next) >= classSize(c))
+                    {
+                        push(_next, c);
+                        _next += classSize(c);
+                    }
+                }
+
+                if (!addArena())
+                {
+                    return nullptr;
+                }
+            }
+            block = _next;
+            _next += size;
+        }
+
+        ++_blocksInUse;
+        _bytesInUse += size;
+        _inUseBytes.add(size);
+        return block;
+    }
+
+    void BufferPool::release(std::uint8_t* block, int sizeClass)
+    {
+        assert(block != nullptr && _blocksInUse > 0);
+
+        push(block, sizeClass);
+
+        const size_t size = classSize(sizeClass);
+        --_blocksInUse;
+        _bytesInUse -= size;
+        _inUseBytes.sub(size);
+    }
+
+    void BufferPool::push(std::uint8_t* block, int sizeClass)
+    {
+        // LIFO so the next acquire gets the block that is most likely still in cache
+        auto* freeBlock = reinterpret_cast<FreeBlock*>(block);
+        freeBlock->_next = _free[sizeClass];
+        _free[sizeClass] = freeBlock;
+    }
+
+    bool BufferPool::addArena()
+    {
+        void* arena = MAP_FAILED;
+        if (useHugePages.load(std::memory_order_relaxed))
+        {
+            arena = mmap(nullptr, ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (arena == MAP_FAILED)
+            {
+                thread_local bool warned = false;
+                if (!warned)
+                {
+                    const int err = errno;
+                    Logger::instance->Log(Logger::WARNING, "no huge pages for buffer arena, using regular pages: ", strerror(err));
+                    warned = true;
+                }
+            }
+        }
+
+        if (arena == MAP_FAILED)
+        {
+            arena = mmap(nullptr, ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (arena == MAP_FAILED)
+            {
+                const int err = errno;
+                Logger::instance->Log(Logger::ERROR, "failed to map buffer arena: ", strerror(err));
+                return false;
+            }
+
+            if (useHugePages.load(std::memory_order_relaxed))
+            {
+                madvise(arena, ARENA_SIZE, MADV_HUGEPAGE);
+            }
+        }
+
+        _arenas.push_back(arena);
+        _next = static_cast<std::uint8_t*>(arena);
+        _end = _next + ARENA_SIZE;
+        _mappedBytes.add(ARENA_SIZE);
+        return true;
+    }
+}
@@ -7,10 +7,58 @@ namespace vsockio
         // Try reading from and writing to both sockets.
         // This is less efficient, but keeps the logic simple.
 
-        _a->readInput();
-        _b->readInput();
-        _a->writeOutput();
-        _b->writeOutput();
+        _a.readInput();
+        if (_http != nullptr && !_b.attached() && !_b.closed() && _b.queuedBytes() != 0)
+        {
+            attachBackend();
+        }
+        _b.readInput();
+        _a.writeOutput();
+        _b.writeOutput();
+
+        if (_http != nullptr && _b.attached() && _b.connected() && !_b.closed() && _b.queuedBytes() == 0 && _http->backendIdle())
+        {
+            releaseBackend();
+        }
+
+        if (!_timeline.complete())
+        {
+            updateTimeline();
+        }
+    }
+
+    void DirectChannel::attachBackend()
+    {
+        PendingSocket backend = _service->_backends != nullptr ? _service->_backends->acquire() : PendingSocket();
+        const int fd = backend.fd();
+        // the handle is looked up by fd when events come in
+        _hb._fd = fd;
+        if (!_b.attach(std::move(backend), &_hb))
+        {
+            _hb._fd = -1;
+        }
+    }
+
+    void DirectChannel::releaseBackend()
+    {
+        _hb._fd = -1;
+        _service->_backends->release(_b.detach());
+    }
+
+    void DirectChannel::updateTimeline()
+    {
+        const bool connected = !ChannelTimeline::isSet(_timeline._connected) && _b.connected();
+        const bool request = !ChannelTimeline::isSet(_timeline._firstRequestByte) && _a.bytesRead() != 0;
+        const bool response = !ChannelTimeline::isSet(_timeline._firstResponseByte) && _b.bytesRead() != 0;
+        if (!connected && !request && !response)
+        {
+            return;
+        }
+
+        const auto now = ChannelTimeline::Clock::now();
+        if (connected) _timeline._connected = now;
+        if (request) _timeline._firstRequestByte = now;
+        if (response) _timeline._firstResponseByte = now;
     }
 
 }
\ No newline at end of file
@@ -1,5 +1,7 @@
+#include "buffer_pool.h"
 #include "config.h"
 #include "logger.h"
+#include "placement.h"
 
 #include <algorithm>
 #include <fstream>
@@ -7,6 +9,8 @@
 #include <optional>
 #include <sstream>
 
+#include <sys/un.h>
+
 namespace vsockproxy
 {
 	/*
@@ -45,6 +49,9 @@ namespace vsockproxy
 		switch (t)
 		{
 		case ServiceType::DIRECT_PROXY: return "direct";
+		case ServiceType::HTTP_PROXY: return "http";
+		case ServiceType::MUX_CLIENT: return "mux-client";
+		case ServiceType::MUX_SERVER: return "mux-server";
 		default: return "unknown";
 		}
 	}
@@ -55,6 +62,7 @@ namespace vsockproxy
 		{
 		case EndpointScheme::TCP4: return "tcp";
 		case EndpointScheme::VSOCK: return "vsock";
+		case EndpointScheme::UNIX: return "unix";
 		default: return "unknown";
 		}
 	}
@@ -79,6 +87,58 @@ namespace vsockproxy
         }
 	}
 
+    static std::optional<uint32_t> trystrtoul(const std::string& s)
+	{
+		if (s.empty() || !std::all_of(s.begin(), s.end(), ::isdigit)) return std::nullopt;
+
+        try
+        {
+            const auto result = std::stoull(s);
+            if (result > std::numeric_limits<uint32_t>::max())
+            {
+                return std::nullopt;
+            }
+            return static_cast<uint32_t>(result);
+        }
+        catch (...)
+        {
+            return std::nullopt;
+        }
+	}
+
+    // byte sizes and rates with an optional binary suffix, e.g. 512, 64k, 10M, 1g
+    static std::optional<uint64_t> trystrtosize(const std::string& s)
+	{
+		if (s.empty()) return std::nullopt;
+
+		uint64_t multiplier = 1;
+		std::string digits = s;
+		switch (::tolower(s.back()))
+		{
+		case 'k': multiplier = 1ull << 10; break;
+		case 'm': multiplier = 1ull << 20; break;
+		case 'g': multiplier = 1ull << 30; break;
+		default: break;
+		}
+		if (multiplier != 1) digits.pop_back();
+
+		if (digits.empty() || !std::all_of(digits.begin(), digits.end(), ::isdigit)) return std::nullopt;
+
+        try
+        {
+            const auto result = std::stoull(digits);
+            if (result > std::numeric_limits<uint64_t>::max() / multiplier)
+            {
+                return std::nullopt;
+            }
+            return result * multiplier;
+        }
+        catch (...)
+        {
+            return std::nullopt;
+        }
+	}
+
     static YamlLine nextLine(std::ifstream& s)
 	{
         YamlLine y;
@@ -160,25 +220,80 @@ namespace vsockproxy
 			{
                 endpointConfig._scheme = EndpointScheme::TCP4;
 			}
+			else if (scheme == "unix")
+			{
+                endpointConfig._scheme = EndpointScheme::UNIX;
+			}
 		}
 		p += 3; // skip '://'
 
+		if (endpointConfig._scheme == EndpointScheme::UNIX)
+		{
+			// unix:///path/to/socket or unix://@abstract-name, no port
+			endpointConfig._address = value.substr(std::min(p, value.size()));
+			if (endpointConfig._address.empty())
+			{
+				Logger::instance->Log(Logger::CRITICAL, "missing unix socket path: ", value);
+				return std::nullopt;
+			}
+			if (endpointConfig._address.size() >= sizeof(sockaddr_un::sun_path))
+			{
+				Logger::instance->Log(Logger::CRITICAL, "unix socket path too long (max ", sizeof(sockaddr_un::sun_path) - 1, " bytes): ", value);
+				return std::nullopt;
+			}
+			return endpointConfig;
+		}
+
 		const size_t p2 = value.find(':', p);
 		if (p2 != value.npos)
 		{
             endpointConfig._address = value.substr(p, p2 - p);
-            const auto port = trystrtous(value.substr(p2 + 1));
-            if (!port)
+            // a single port or an inclusive range, e.g. 9000-9099
+            const std::string ports = value.substr(p2 + 1);
+            const size_t dash = ports.find('-');
+            const auto port = trystrtous(ports.substr(0, dash));
+            const auto last = dash == std::string::npos ? port : trystrtous(ports.substr(dash + 1));
+            if (!port || !last || *last < *port || *last - *port == std::numeric_limits<uint16_t>::max())
             {
-                Logger::instance->Log(Logger::CRITICAL, "invalid port number: ", value.substr(p2 + 1));
+                Logger::instance->Log(Logger::CRITICAL, "invalid port number: ", ports);
                 return std::nullopt;
             }
             endpointConfig._port = *port;
+            endpointConfig._portCount = static_cast<uint16_t>(*last - *port + 1);
 		}
 
         return endpointConfig;
 	}
 
+	// A listen port range maps port by port onto a connect range of the same size, or onto a single port.
+	static bool checkPortRanges(const ServiceDescription& sd)
+	{
+		const uint16_t listenPorts = sd._listenEndpoint._portCount;
+		const uint16_t connectPorts = sd._connectEndpoint._portCount;
+		if (listenPorts == 1 && connectPorts == 1)
+		{
+			return true;
+		}
+
+		if (listenPorts == 1)
+		{
+			Logger::instance->Log(Logger::CRITICAL, "connect port range without a listen port range for service: ", sd._name);
+			return false;
+		}
+		if (connectPorts != 1 && connectPorts != listenPorts)
+		{
+			Logger::instance->Log(Logger::CRITICAL, "connect port range of ", connectPorts, " ports does not match listen port range of ", listenPorts, " for service: ", sd._name);
+			return false;
+		}
+		if (sd._type != ServiceType::DIRECT_PROXY)
+		{
+			// the other types connect from their workers, to a single backend per service
+			Logger::instance->Log(Logger::CRITICAL, "port ranges are only supported for direct services, not for service: ", sd._name);
+			return false;
+		}
+		return true;
+	}
+
 	std::vector<ServiceDescription> loadConfig(const std::string& filepath)
 	{
 		std::vector<ServiceDescription> services;
@@ -204,6 +319,7 @@ namespace vsockproxy
 			{
 				if (cs._type != ServiceType::UNKNOWN)
 				{
+					if (!checkPortRanges(cs)) return {};
 					services.push_back(cs);
 				}
 				cs = ServiceDescription();
@@ -225,6 +341,12 @@ namespace vsockproxy
 					{
 						if (line._value == "direct")
 							cs._type = ServiceType::DIRECT_PROXY;
+						else if (line._value == "http")
+							cs._type = ServiceType::HTTP_PROXY;
+						else if (line._value == "mux-client")
+							cs._type = ServiceType::MUX_CLIENT;
+						else if (line._value == "mux-server")
+							cs._type = ServiceType::MUX_SERVER;
 						else
                         {
                             Logger::instance->Log(Logger::CRITICAL, "unknown service type for service: ", cs._name);
@@ -251,27 +373,263 @@ namespace vsockproxy
                         }
                         cs._connectEndpoint = *endpoint;
 					}
+					else if (line._key == "resolve-ttl")
+					{
+                        const auto ttl = trystrtoul(line._value);
+                        if (!ttl || *ttl == 0)
+                        {
+                            Logger::instance->Log(Logger::CRITICAL, "invalid resolve-ttl: ", line._value, " for service: ", cs._name);
+                            return {};
+                        }
+                        cs._resolveTtlSeconds = *ttl;
+					}
+					else if (line._key == "timing-sample")
+					{
+                        const auto rate = trystrtoul(line._value);
+                        if (!rate)
+                        {
+                            Logger::instance->Log(Logger::CRITICAL, "invalid timing-sample: ", line._value, " for service: ", cs._name);
+                            return {};
+                        }
+                        cs._timingSampleRate = *rate;
+					}
+					else if (line._key == "max-channels" || line._key == "resume-channels" || line._key == "max-accept-rate" || line._key == "max-loop-lag-ms")
+					{
+                        const auto limit = trystrtoul(line._value);
+                        if (!limit)
+                        {
+                            Logger::instance->Log(Logger::CRITICAL, "invalid ", line._key, ": ", line._value, " for service: ", cs._name);
+                            return {};
+                        }
+                        if (line._key == "max-channels") cs._maxChannels = *limit;
+                        else if (line._key == "resume-channels") cs._resumeChannels = *limit;
+                        else if (line._key == "max-accept-rate") cs._maxAcceptRate = *limit;
+                        else cs._maxLoopLagMs = *limit;
+					}
+					else if (line._key == "buffer-min" || line._key == "buffer-max")
+					{
+                        const auto size = trystrtosize(line._value);
+                        if (!size || *size > vsockio::BufferPool::MAX_BLOCK_SIZE)
+                        {
+                            Logger::instance->Log(Logger::CRITICAL, "invalid ", line._key, ": ", line._value, " for service: ", cs._name, ", must be at most ", vsockio::BufferPool::MAX_BLOCK_SIZE);
+                            return {};
+                        }
+                        if (line._key == "buffer-min") cs._bufferMin = *size;
+                        else cs._bufferMax = *size;
+					}
+					else if (line._key == "max-buffered-bytes")
+					{
+                        const auto size = trystrtosize(line._value);
+                        if (!size)
+                        {
+                            Logger::instance->Log(Logger::CRITICAL, "invalid ", line._key, ": ", line._value, " for service: ", cs._name);
+                            return {};
+                        }
+                        cs._maxBufferedBytes = *size;
+					}
+					else if (line._key == "rate-limit" || line._key == "connection-rate-limit" || line._key == "rate-limit-burst")
+					{
+                        const auto size = trystrtosize(line._value);
+                        if (!size)
+                        {
+                            Logger::instance->Log(Logger::CRITICAL, "invalid ", line._key, ": ", line._value, " for service: ", cs._name);
+                            return {};
+                        }
+                        if (line._key == "rate-limit") cs._rateLimit = *size;
+                        else if (line._key == "connection-rate-limit") cs._connectionRateLimit = *size;
+                        else cs._rateLimitBurst = *size;
+					}
+					else if (line._key == "workers")
+					{
+                        const auto workers = trystrtoul(line._value);
+                        if (!workers || *workers == 0)
+                        {
+                            Logger::instance->Log(Logger::CRITICAL, "invalid workers: ", line._value, " for service: ", cs._name, ", must be at least 1");
+                            return {};
+                        }
+                        cs._workers = *workers;
+					}
+					else if (line._key == "cpus")
+					{
+                        const auto cpus = vsockio::parseCpuList(line._value);
+                        if (!cpus)
+                        {
+                            Logger::instance->Log(Logger::CRITICAL, "invalid cpus: ", line._value, " for service: ", cs._name, ", must be a list like 0-3,6");
+                            return {};
+                        }
+                        cs._cpus = *cpus;
+					}
+					else if (line._key == "priority")
+					{
+                        if (line._value == "high")
+                            cs._priority = 0;
+                        else if (line._value == "normal")
+                            cs._priority = 1;
+                        else if (line._value == "low")
+                            cs._priority = 2;
+                        else
+                        {
+                            Logger::instance->Log(Logger::CRITICAL, "invalid priority: ", line._value, " for service: ", cs._name, ", must be high, normal or low");
+                            return {};
+                        }
+					}
+					else if (line._key == "engine")
+					{
+                        if (line._value == "state-machine")
+                            cs._coroutineEngine = false;
+                        else if (line._value == "coroutine")
+                            cs._coroutineEngine = true;
+                        else
+                        {
+                            Logger::instance->Log(Logger::CRITICAL, "invalid engine: ", line._value, " for service: ", cs._name, ", must be state-machine or coroutine");
+                            return {};
+                        }
+#if !defined(VSOCK_COROUTINES)
+                        if (cs._coroutineEngine)
+                        {
+                            Logger::instance->Log(Logger::CRITICAL, "engine: coroutine for service: ", cs._name, " needs a build with -DVSOCK_COROUTINES=ON");
+                            return {};
+                        }
+#endif
+					}
+					else if (line._key == "max-idle-backends")
+					{
+                        const auto maxIdle = trystrtoul(line._value);
+                        if (!maxIdle)
+                        {
+                            Logger::instance->Log(Logger::CRITICAL, "invalid max-idle-backends: ", line._value, " for service: ", cs._name);
+                            return {};
+                        }
+                        cs._maxIdleBackends = *maxIdle;
+					}
+					else if (line._key == "compress")
+					{
+                        if (line._value == "none")
+                            cs._compress = 0;
+                        else if (line._value == "listen")
+                            cs._compress = 1;
+                        else if (line._value == "connect")
+                            cs._compress = 2;
+                        else
+                        {
+                            Logger::instance->Log(Logger::CRITICAL, "invalid compress: ", line._value, " for service: ", cs._name, ", must be none, listen or connect");
+                            return {};
+                        }
+					}
+					else if (line._key == "write-mode")
+					{
+                        if (line._value == "latency")
+                            cs._coalesceWrites = false;
+                        else if (line._value == "throughput")
+                            cs._coalesceWrites = true;
+                        else
+                        {
+                            Logger::instance->Log(Logger::CRITICAL, "invalid write-mode: ", line._value, " for service: ", cs._name, ", must be latency or throughput");
+                            return {};
+                        }
+					}
+					else if (line._key == "mux-window")
+					{
+                        const auto size = trystrtosize(line._value);
+                        if (!size || *size < 4096 || *size > (1u << 30))
+                        {
+                            Logger::instance->Log(Logger::CRITICAL, "invalid mux-window: ", line._value, " for service: ", cs._name, ", must be between 4k and 1g");
+                            return {};
+                        }
+                        cs._muxWindow = static_cast<uint32_t>(*size);
+					}
+					else if (line._key == "coalesce-delay-us")
+					{
+                        const auto delay = trystrtoul(line._value);
+                        if (!delay || *delay > 100000)
+                        {
+                            Logger::instance->Log(Logger::CRITICAL, "invalid coalesce-delay-us: ", line._value, " for service: ", cs._name, ", must be at most 100000");
+                            return {};
+                        }
+                        cs._coalesceDelayUs = *delay;
+					}
+					else if (line._key == "mux-max-streams")
+					{
+                        const auto maxStreams = trystrtoul(line._value);
+                        if (!maxStreams || *maxStreams == 0)
+                        {
+                            Logger::instance->Log(Logger::CRITICAL, "invalid mux-max-streams: ", line._value, " for service: ", cs._name, ", must be at least 1");
+                            return {};
+                        }
+                        cs._muxMaxStreams = *maxStreams;
+					}
+					else if (line._key == "overload")
+					{
+                        if (line._value == "pause")
+                            cs._rejectWhenOverloaded = false;
+                        else if (line._value == "reject")
+                            cs._rejectWhenOverloaded = true;
+                        else
+                        {
+                            Logger::instance->Log(Logger::CRITICAL, "invalid overload action: ", line._value, " for service: ", cs._name, ", must be pause or reject");
+                            return {};
+                        }
+					}
 				}
 			}
 		}
 
 		if (cs._type != ServiceType::UNKNOWN)
 		{
+			if (!checkPortRanges(cs)) return {};
 			services.push_back(cs);
 		}
 
 		return services;
 	}
 
+	static std::string describe(const EndpointConfig& ec)
+	{
+		std::string s = nameEndpointScheme(ec._scheme) + "://" + ec._address;
+		if (ec._scheme != EndpointScheme::UNIX)
+		{
+			s += ":" + std::to_string(ec._port);
+			if (ec._portCount > 1) s += "-" + std::to_string(ec._port + ec._portCount - 1);
+		}
+		return s;
+	}
+
 	std::string describe(const ServiceDescription& sd)
 	{
 		std::stringstream ss;
 		ss << sd._name
 			<< "\n  type: " << nameServiceType(sd._type)
-			<< "\n  listen: " << nameEndpointScheme(sd._listenEndpoint._scheme) << "://" << sd._listenEndpoint._address << ":" << sd._listenEndpoint._port
-			<< "\n  connect: " << nameEndpointScheme(sd._connectEndpoint._scheme) << "://" << sd._connectEndpoint._address << ":" << sd._connectEndpoint._port;
+			<< "\n  listen: " << describe(sd._listenEndpoint)
+			<< "\n  connect: " << describe(sd._connectEndpoint);
+
+		if (sd._maxChannels != 0) ss << "\n  max-channels: " << sd._maxChannels;
+		if (sd._maxAcceptRate != 0) ss << "\n  max-accept-rate: " << sd._maxAcceptRate;
+		if (sd._maxLoopLagMs != 0) ss << "\n  max-loop-lag-ms: " << sd._maxLoopLagMs;
+		if (sd._rateLimit != 0) ss << "\n  rate-limit: " << sd._rateLimit;
+		if (sd._connectionRateLimit != 0) ss << "\n  connection-rate-limit: " << sd._connectionRateLimit;
+		if (sd._bufferMin != 0) ss << "\n  buffer-min: " << sd._bufferMin;
+		if (sd._bufferMax != 0) ss << "\n  buffer-max: " << sd._bufferMax;
+		if (sd._maxBufferedBytes != 0) ss << "\n  max-buffered-bytes: " << sd._maxBufferedBytes;
+		if (sd._timingSampleRate != 0) ss << "\n  timing-sample: " << sd._timingSampleRate;
+		if (sd._priority != 1) ss << "\n  priority: " << (sd._priority == 0 ? "high" : "low");
+		if (sd._coroutineEngine) ss << "\n  engine: coroutine";
+		if (sd._type == ServiceType::HTTP_PROXY) ss << "\n  max-idle-backends: " << sd._maxIdleBackends;
+		if (sd._type == ServiceType::MUX_CLIENT || sd._type == ServiceType::MUX_SERVER) ss << "\n  mux-window: " << sd._muxWindow << "\n  mux-max-streams: " << sd._muxMaxStreams;
+		if (sd._compress != 0) ss << "\n  compress: " << (sd._compress == 1 ? "listen" : "connect");
+		if (sd._coalesceWrites) ss << "\n  write-mode: throughput";
+		if (sd._coalesceDelayUs != 0) ss << "\n  coalesce-delay-us: " << sd._coalesceDelayUs;
+		if (sd._workers != 0) ss << "\n  workers: " << sd._workers;
+		if (!sd._cpus.empty())
+		{
+			ss << "\n  cpus: ";
+			for (size_t i = 0; i < sd._cpus.size(); i++) ss << (i == 0 ? "" : ",") << sd._cpus[i];
+		}
 
 		return ss.str();
 	}
 
-}
\ No newline at end of file
+	std::optional<uint64_t> parseSize(const std::string& s)
+	{
+		return trystrtosize(s);
+	}
+}
@@ -0,0 +1,390 @@
+#include <coro_engine.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <exception>
+
+namespace vsockio
+{
+    FramePool& FramePool::local()
+    {
+        thread_local FramePool pool;
+        return pool;
+    }
+
+    FramePool::~FramePool()
+    {
+        for (auto& frames : _free)
+        {
+            for (void* frame : frames)
+            {
+                ::operator delete(frame);
+            }
+        }
+    }
+
+    void* FramePool::allocate(size_t size)
+    {
+        const size_t sc = sizeClass(size);
+        _inUseBytes += sc * GRANULE;
+        if (sc * GRANULE > MAX_POOLED_SIZE)
+        {
+            return ::operator new(size);
+        }
+
+        auto& frames = _free[sc];
+        if (frames.empty())
+        {
+            return ::operator new(sc * GRANULE);
+        }
+        void* frame = frames.back();
+        frames.pop_back();
+        return frame;
+    }
+
+    void FramePool::deallocate(void* frame, size_t size)
+    {
+        const size_t sc = sizeClass(size);
+        _inUseBytes -= std::min(_inUseBytes, sc * GRANULE);
+        if (sc * GRANULE > MAX_POOLED_SIZE)
+        {
+            ::operator delete(frame);
+            return;
+        }
+        _free[sc].push_back(frame);
+    }
+
+    void CoroTask::promise_type::unhandled_exception()
+    {
+        Logger::instance->Log(Logger::CRITICAL, "unhandled exception in channel coroutine");
+        std::terminate();
+    }
+
+    CoroEngine::~CoroEngine()
+    {
+        while (!_channels.empty())
+        {
+            destroy(*_channels.begin());
+        }
+    }
+
+    void CoroEngine::addChannel(int id, PendingSocket&& a, PendingSocket&& b, ServiceContext* service, const ChannelTimeline& timeline)
+    {
+        const bool aConnected = a.connected();
+        const bool bConnected = b.connected();
+        auto* channel = _slab.create(id, a.release(), aConnected, b.release(), bConnected, service);
+        channel->_timeline = timeline;
+        channel->_timeline._registered = Clock::now();
+        _channels.insert(channel);
+
+        for (CoroSocket* socket : {&channel->_a, &channel->_b})
+        {
+            const bool added = _poller.add(socket->_fd, &socket->_handle);
+            record(*channel, Syscall::PollAdd, added ? SyscallOutcome::Ok : SyscallOutcome::Error);
+            if (!added)
+            {
+                destroy(channel);
+                return;
+            }
+        }
+
+        channel->_open = open(*channel);
+        _ready.push_back(channel->_open.handle());
+    }
+
+    void CoroEngine::onEvent(CoroSocket* socket, IOEvent flags)
+    {
+        // errors are picked up by the next call on the socket, so wake both directions for them
+        if (flags & (IOEvent::InputReady | IOEvent::Error))
+        {
+            socket->_readable = true;
+            if (socket->_readWaiter) _ready.push_back(std::exchange(socket->_readWaiter, {}));
+        }
+        if (flags & (IOEvent::OutputReady | IOEvent::Error))
+        {
+            socket->_writable = true;
+            if (socket->_writeWaiter) _ready.push_back(std::exchange(socket->_writeWaiter, {}));
+        }
+    }
+
+    void CoroEngine::run()
+    {
+        if (!_timers.empty())
+        {
+            const auto now = Clock::now();
+            while (!_timers.empty() && _timers.begin()->first <= now)
+            {
+                _ready.push_back(_timers.begin()->second);
+                _timers.erase(_timers.begin());
+            }
+        }
+
+        // coroutines that yield during this pass run again in the next one
+        for (size_t n = _ready.size(); n > 0 && !_ready.empty(); n--)
+        {
+            const auto handle = _ready.front();
+            _ready.pop_front();
+            handle.resume();
+        }
+    }
+
+    void CoroEngine::cleanup()
+    {
+        for (auto* channel : _closing)
+        {
+            destroy(channel);
+        }
+        _closing.clear();
+    }
+
+    void CoroEngine::describeChannels(std::ostream& os) const
+    {
+        std::vector<const CoroChannel*> channels(_channels.begin(), _channels.end());
+        std::sort(channels.begin(), channels.end(), [](const auto* x, const auto* y) { return x->_id < y->_id; });
+
+        for (const auto* channel : channels)
+        {
+            os << "channel " << channel->_id
+                << " service=" << (channel->_service != nullptr ? channel->_service->_name : "-")
+                << " state=" << channel->state()
+                << " a.fd=" << channel->_a._fd
+                << " b.fd=" << channel->_b._fd
+                << " a_to_b_bytes=" << channel->_a._bytesRead
+                << " b_to_a_bytes=" << channel->_b._bytesRead
+                << " queued_to_a=" << channel->_bToA.remainingDataSize()
+                << " queued_to_b=" << channel->_aToB.remainingDataSize()
+                << " ";
+            channel->_syscalls.describe(os, channel->bytesRelayed());
+            os << " engine=coroutine\n";
+        }
+    }
+
+    CoroTask CoroEngine::open(CoroChannel& channel)
+    {
+        CoroSocket& b = channel._b;
+        while (!b._connected)
+        {
+            co_await b.writable();
+
+            char c;
+            const int result = _impl.write(b._fd, &c, 0);
+            const int err = errno;
+            record(channel, Syscall::ConnectCheck, result == 0 ? SyscallOutcome::Ok : outcomeOf(err));
+            if (result == 0)
+            {
+                b._connected = true;
+                b._readable = true;
+            }
+            else if (err == EAGAIN || err == EWOULDBLOCK)
+            {
+                b._writable = false;
+            }
+            else
+            {
+                Logger::instance->Log(Logger::WARNING, "[coroutine] connection error, closing (fd=", b._fd, "): ", err, ", ", strerror(err));
+                close(channel);
+                co_return;
+            }
+        }
+
+        if (!ChannelTimeline::isSet(channel._timeline._connected))
+        {
+            channel._timeline._connected = Clock::now();
+        }
+
+        channel._aToBTask = relay(channel, channel._a, channel._b, channel._aToB);
+        channel._bToATask = relay(channel, channel._b, channel._a, channel._bToA);
+        _ready.push_back(channel._aToBTask.handle());
+        _ready.push_back(channel._bToATask.handle());
+    }
+
+    // Reads from one socket and writes everything read to the other. When the input ends the data
+    // read so far is written out and the whole channel is closed, as with the state machine channels.
+    CoroTask CoroEngine::relay(CoroChannel& channel, CoroSocket& from, CoroSocket& to, Buffer& buffer)
+    {
+        auto& firstByte = &from == &channel._a ? channel._timeline._firstRequestByte : channel._timeline._firstResponseByte;
+        uint64_t sinceYield = 0;
+        bool inputEnded = false;
+
+        while (!inputEnded)
+        {
+            co_await from.readable();
+
+            if (!buffer.allocated())
+            {
+                // like the state machine, overdraw the budget while the other direction holds memory so the channel cannot deadlock itself
+                const Buffer& other = &buffer == &channel._aToB ? channel._bToA : channel._aToB;
+                const auto acquired = buffer.acquire(/*overdraw:*/ other.allocated());
+                if (acquired == Buffer::AcquireResult::OverBudget)
+                {
+                    co_await sleepFor(DirectChannel::BUFFER_RETRY_INTERVAL);
+                    continue;
+                }
+                if (acquired == Buffer::AcquireResult::OutOfMemory)
+                {
+                    Logger::instance->Log(Logger::ERROR, "[coroutine] no buffer memory for read, closing (fd=", from._fd, ")");
+                    close(channel);
+                    co_return;
+                }
+            }
+
+            int len = buffer.remainingCapacity();
+            Shaper::Clock::time_point now;
+            if (channel._shaper != nullptr)
+            {
+                now = Shaper::Clock::now();
+                len = channel._shaper->allowance(len, now);
+                if (len == 0)
+                {
+                    co_await sleepFor(channel._shaper->waitTime(now));
+                    continue;
+                }
+            }
+
+            iovec segments[2];
+            const int segmentCount = buffer.freeSegments(segments, len);
+            const int bytesRead = segmentCount == 1
+                ? _impl.read(from._fd, segments[0].iov_base, segments[0].iov_len)
+                : _impl.readv(from._fd, segments, segmentCount);
+            const int readErr = bytesRead < 0 ? errno : 0;
+            record(channel, Syscall::Read, bytesRead >= 0 ? SyscallOutcome::Ok : outcomeOf(readErr));
+
+            if (bytesRead > 0)
+            {
+                if (channel._shaper != nullptr)
+                {
+                    channel._shaper->consume(bytesRead, now);
+                }
+                buffer.produce(bytesRead);
+                from._bytesRead += bytesRead;
+                _threadSyscalls.addBytesRelayed(bytesRead);
+                sinceYield += bytesRead;
+                if (!ChannelTimeline::isSet(firstByte))
+                {
+                    firstByte = Clock::now();
+                }
+            }
+            else if (bytesRead == 0)
+            {
+                Logger::instance->Log(Logger::DEBUG, "[coroutine] read returns 0, closing (fd=", from._fd, ")");
+                inputEnded = true;
+            }
+            else if (readErr == EAGAIN || readErr == EWOULDBLOCK)
+            {
+                from._readable = false;
+            }
+            else
+            {
+                Logger::instance->Log(Logger::WARNING, "[coroutine] error on read, closing (fd=", from._fd, "): ", readErr, ", ", strerror(readErr));
+                close(channel);
+                co_return;
+            }
+
+            while (!buffer.consumed())
+            {
+                co_await to.writable();
+
+                iovec data[2];
+                const int dataCount = buffer.dataSegments(data);
+                const int bytesWritten = dataCount == 1
+                    ? _impl.write(to._fd, data[0].iov_base, data[0].iov_len)
+                    : _impl.writev(to._fd, data, dataCount);
+                const int writeErr = bytesWritten < 0 ? errno : 0;
+                record(channel, Syscall::Write, bytesWritten >= 0 ? SyscallOutcome::Ok : outcomeOf(writeErr));
+
+                if (bytesWritten > 0)
+                {
+                    buffer.consume(bytesWritten);
+                }
+                else if (writeErr == EAGAIN || writeErr == EWOULDBLOCK)
+                {
+                    to._writable = false;
+                }
+                else
+                {
+                    Logger::instance->Log(Logger::WARNING, "[coroutine] error on send, closing (fd=", to._fd, "): ", strerror(writeErr));
+                    close(channel);
+                    co_return;
+                }
+            }
+
+            // hand the block back while there is nothing in flight, idle channels hold no buffer memory
+            buffer.release();
+
+            if (sinceYield >= YIELD_BYTES)
+            {
+                sinceYield = 0;
+                co_await yield();
+            }
+        }
+
+        close(channel);
+    }
+
+    void CoroEngine::record(CoroChannel& channel, Syscall syscall, SyscallOutcome outcome)
+    {
+        channel._syscalls.record(syscall, outcome);
+        _threadSyscalls.record(syscall, outcome);
+    }
+
+    SyscallOutcome CoroEngine::outcomeOf(int err)
+    {
+        return err == EAGAIN || err == EWOULDBLOCK ? SyscallOutcome::Again : SyscallOutcome::Error;
+    }
+
+    // Called from a coroutine of the channel, which must return right after; frames are destroyed in cleanup().
+    void CoroEngine::close(CoroChannel& channel)
+    {
+        if (!channel._closing)
+        {
+            channel._closing = true;
+            _closing.push_back(&channel);
+        }
+    }
+
+    void CoroEngine::closeSocket(CoroChannel& channel, CoroSocket& socket)
+    {
+        if (socket._closed) return;
+        socket._closed = true;
+
+        record(channel, Syscall::PollRemove, _poller.remove(socket._fd) ? SyscallOutcome::Ok : SyscallOutcome::Error);
+        record(channel, Syscall::Close, _impl.close(socket._fd) == 0 ? SyscallOutcome::Ok : SyscallOutcome::Error);
+    }
+
+    void CoroEngine::destroy(CoroChannel* channel)
+    {
+        Logger::instance->Log(Logger::DEBUG, "iothread id=", _threadId, " closing coroutine channel id=", channel->_id);
+
+        for (const CoroTask* task : {&channel->_open, &channel->_aToBTask, &channel->_bToATask})
+        {
+            if (*task) cancel(task->handle());
+        }
+        channel->_open.reset();
+        channel->_aToBTask.reset();
+        channel->_bToATask.reset();
+        channel->_aToB.release();
+        channel->_bToA.release();
+
+        closeSocket(*channel, channel->_a);
+        closeSocket(*channel, channel->_b);
+
+        if (channel->_service != nullptr)
+        {
+            channel->_timeline._closed = Clock::now();
+            channel->_service->onChannelClosed(channel->_timeline, channel->_syscalls, channel->bytesRelayed());
+        }
+
+        _channels.erase(channel);
+        _slab.destroy(channel);
+    }
+
+    void CoroEngine::cancel(std::coroutine_handle<> handle)
+    {
+        _ready.erase(std::remove(_ready.begin(), _ready.end(), handle), _ready.end());
+        for (auto it = _timers.begin(); it != _timers.end(); )
+        {
+            it = it->second == handle ? _timers.erase(it) : std::next(it);
+        }
+    }
+}
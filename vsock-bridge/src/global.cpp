@@ -1,6 +1,7 @@
 #include <socket.h>
 
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 using namespace vsockio;
@@ -8,5 +9,7 @@ using namespace vsockio;
 SocketImpl* SocketImpl::singleton = new SocketImpl(
 	/*read: */  [](int fd, void* buf, int len) { return ::read(fd, buf, len); },
 	/*write:*/  [](int fd, void* buf, int len) { return ::write(fd, buf, len); },
-	/*close:*/  [](int fd) { return ::close(fd); }
+	/*close:*/  [](int fd) { return ::close(fd); },
+	/*readv:*/  [](int fd, const iovec* iov, int count) { return ::readv(fd, iov, count); },
+	/*writev:*/ [](int fd, const iovec* iov, int count) { return ::writev(fd, iov, count); }
 );
@@ -0,0 +1,323 @@
+#include <http.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <string_view>
+
+namespace vsockio
+{
+    namespace
+    {
+        bool equalsIgnoreCase(std::string_view a, std::string_view b)
+        {
+            return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](char x, char y) {
+                return std::tolower(static_cast<unsigned char>(x)) == std::tolower(static_cast<unsigned char>(y));
+            });
+        }
+
+        std::string_view trim(std::string_view s)
+        {
+            while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) s.remove_prefix(1);
+            while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) s.remove_suffix(1);
+            return s;
+        }
+
+        // Calls fn with each trimmed element of a comma separated header value.
+        template <typename Fn>
+        void forEachToken(std::string_view value, Fn&& fn)
+        {
+            while (!value.empty())
+            {
+                const size_t comma = value.find(',');
+                fn(trim(value.substr(0, comma)));
+                if (comma == std::string_view::npos) break;
+                value.remove_prefix(comma + 1);
+            }
+        }
+
+        bool parseNumber(std::string_view s, int base, uint64_t& value)
+        {
+            if (s.empty() || s.size() > 15) return false;
+            value = 0;
+            for (const char c : s)
+            {
+                int digit;
+                if (c >= '0' && c <= '9') digit = c - '0';
+                else if (base == 16 && c >= 'a' && c <= 'f') digit = c - 'a' + 10;
+                else if (base == 16 && c >= 'A' && c <= 'F') digit = c - 'A' + 10;
+                else return false;
+                value = value * base + digit;
+            }
+            return true;
+        }
+    }
+
+    void HttpFramer::feed(const uint8_t* data, size_t len)
+    {
+        while (len > 0 && _state != State::Opaque)
+        {
+            size_t used;
+            if (_state == State::Body || _state == State::ChunkData)
+            {
+                used = static_cast<size_t>(std::min<uint64_t>(len, _remaining));
+                _remaining -= used;
+                if (_remaining == 0)
+                {
+                    if (_state == State::Body)
+                        onMessageDone();
+                    else
+                        _state = State::ChunkDataEnd;
+                }
+            }
+            else
+            {
+                used = scanLine(data, len);
+            }
+            data += used;
+            len -= used;
+        }
+    }
+
+    size_t HttpFramer::scanLine(const uint8_t* data, size_t len)
+    {
+        if (_state == State::ChunkSize || _state == State::ChunkDataEnd)
+        {
+            // chunk framing lines are limited one by one, a long body has many of them
+            if (_line.empty()) _headerBytes = 0;
+        }
+
+        const auto* eol = static_cast<const uint8_t*>(memchr(data, '\n', len));
+        const size_t used = eol != nullptr ? static_cast<size_t>(eol - data) + 1 : len;
+        _headerBytes += used;
+        if (_headerBytes > MAX_HEADER_BYTES)
+        {
+            becomeOpaque();
+            return len;
+        }
+
+        if (eol == nullptr)
+        {
+            _line.append(reinterpret_cast<const char*>(data), len);
+            return len;
+        }
+
+        // most lines arrive whole and are looked at where they are
+        std::string_view line;
+        if (_line.empty())
+        {
+            line = std::string_view(reinterpret_cast<const char*>(data), used - 1);
+        }
+        else
+        {
+            _line.append(reinterpret_cast<const char*>(data), used - 1);
+            line = _line;
+        }
+        if (!line.empty() && line.back() == '\r')
+        {
+            line.remove_suffix(1);
+        }
+
+        _current = line;
+        onLine();
+        _line.clear();
+        return used;
+    }
+
+    void HttpFramer::onLine()
+    {
+        switch (_state)
+        {
+        case State::StartLine:
+            // empty lines before a message are allowed and ignored
+            if (!_current.empty()) onStartLine();
+            break;
+        case State::Headers:
+            if (_current.empty())
+                onHeadersDone();
+            else
+                onHeader();
+            break;
+        case State::ChunkSize:
+        {
+            uint64_t size;
+            if (!parseNumber(trim(_current.substr(0, _current.find(';'))), 16, size))
+            {
+                becomeOpaque();
+            }
+            else if (size == 0)
+            {
+                _state = State::Trailers;
+            }
+            else
+            {
+                _remaining = size;
+                _state = State::ChunkData;
+            }
+            break;
+        }
+        case State::ChunkDataEnd:
+            if (_current.empty())
+                _state = State::ChunkSize;
+            else
+                becomeOpaque();
+            break;
+        case State::Trailers:
+            if (_current.empty()) onMessageDone();
+            break;
+        default:
+            break;
+        }
+    }
+
+    void HttpFramer::onStartLine()
+    {
+        _state = State::Headers;
+        if (_kind == Kind::Request)
+        {
+            // METHOD target HTTP/1.x
+            const size_t space = _current.find(' ');
+            const size_t lastSpace = _current.rfind(' ');
+            if (space == std::string_view::npos || lastSpace == space)
+            {
+                becomeOpaque();
+                return;
+            }
+            const std::string_view method = _current.substr(0, space);
+            const std::string_view version = _current.substr(lastSpace + 1);
+            if (version.substr(0, 7) != "HTTP/1." || method == "CONNECT")
+            {
+                becomeOpaque();
+                return;
+            }
+            _http11 = version != "HTTP/1.0";
+            _head = method == "HEAD";
+            _headRequests.push_back(_head);
+        }
+        else
+        {
+            // HTTP/1.x 200 OK
+            uint64_t status = 0;
+            if (_current.substr(0, 7) != "HTTP/1." || _current.size() < 12 || _current[8] != ' ' || !parseNumber(_current.substr(9, 3), 10, status))
+            {
+                becomeOpaque();
+                return;
+            }
+            _http11 = _current.substr(0, 8) != "HTTP/1.0";
+            _status = static_cast<int>(status);
+            if (_status >= 200 && !_headRequests.empty())
+            {
+                _head = _headRequests.front();
+                _headRequests.pop_front();
+            }
+        }
+    }
+
+    void HttpFramer::onHeader()
+    {
+        const size_t colon = _current.find(':');
+        if (colon == std::string_view::npos || colon == 0)
+        {
+            becomeOpaque();
+            return;
+        }
+        const std::string_view name = _current.substr(0, colon);
+        const std::string_view value = trim(_current.substr(colon + 1));
+
+        if (equalsIgnoreCase(name, "content-length"))
+        {
+            uint64_t length;
+            if (!parseNumber(value, 10, length) || (_hasContentLength && length != _contentLength))
+            {
+                becomeOpaque();
+                return;
+            }
+            _hasContentLength = true;
+            _contentLength = length;
+        }
+        else if (equalsIgnoreCase(name, "transfer-encoding"))
+        {
+            // only a final chunked coding delimits the body
+            std::string_view last;
+            forEachToken(value, [&](std::string_view token) { last = token; });
+            if (!equalsIgnoreCase(last, "chunked"))
+            {
+                becomeOpaque();
+                return;
+            }
+            _chunked = true;
+        }
+        else if (equalsIgnoreCase(name, "connection"))
+        {
+            forEachToken(value, [this](std::string_view token) {
+                if (equalsIgnoreCase(token, "close")) _connectionClose = true;
+                else if (equalsIgnoreCase(token, "keep-alive")) _connectionKeepAlive = true;
+            });
+        }
+    }
+
+    void HttpFramer::onHeadersDone()
+    {
+        if (_kind == Kind::Response)
+        {
+            if (_status == 101)
+            {
+                // switching protocols, whatever follows is not HTTP/1.1 any more
+                becomeOpaque();
+                return;
+            }
+            if (_status < 200)
+            {
+                // interim response, the final one follows
+                resetMessage();
+                return;
+            }
+            if (_head || _status == 204 || _status == 304)
+            {
+                onMessageDone();
+                return;
+            }
+        }
+
+        if (_chunked)
+        {
+            _state = State::ChunkSize;
+        }
+        else if (_hasContentLength && _contentLength != 0)
+        {
+            _remaining = _contentLength;
+            _state = State::Body;
+        }
+        else if (_hasContentLength || _kind == Kind::Request)
+        {
+            onMessageDone();
+        }
+        else
+        {
+            // response delimited by closing the connection
+            becomeOpaque();
+        }
+    }
+
+    void HttpFramer::onMessageDone()
+    {
+        ++_messages;
+        _keepAlive = _http11 ? !_connectionClose : _connectionKeepAlive;
+        resetMessage();
+    }
+
+    void HttpFramer::resetMessage()
+    {
+        _state = State::StartLine;
+        _headerBytes = 0;
+        _remaining = 0;
+        _http11 = false;
+        _head = false;
+        _status = 0;
+        _hasContentLength = false;
+        _contentLength = 0;
+        _chunked = false;
+        _connectionClose = false;
+        _connectionKeepAlive = false;
+    }
+}
@@ -1,25 +1,239 @@
 #include <iothread.h>
+#include <iocontrol.h>
+
+#include <pthread.h>
+#include <sched.h>
 
 namespace vsockio
 {
-    void IOThread::addChannel(std::unique_ptr<Socket>&& ap, std::unique_ptr<Socket>&& bp)
+    void IOThread::addChannel(PendingSocket&& a, PendingSocket&& b, ServiceContext* service, const ChannelTimeline& timeline)
+    {
+        PendingChannel pendingChannel{std::move(a), std::move(b), service, timeline};
+        pendingChannel._timeline._dispatched = ChannelTimeline::Clock::now();
+        _pendingChannels.enqueue(std::move(pendingChannel));
+        _channelCount.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    bool IOThread::setAffinity(const std::vector<int>& cpus)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (const int cpu : cpus)
+        {
+            if (cpu < 0 || cpu >= CPU_SETSIZE) return false;
+            CPU_SET(cpu, &set);
+        }
+        return pthread_setaffinity_np(_thr.native_handle(), sizeof(set), &set) == 0;
+    }
+
+    void IOThread::post(std::function<void()>&& task)
+    {
+        _tasks.enqueue(std::move(task));
+    }
+
+    void IOThread::reactivate()
     {
-        _pendingChannels.enqueue({std::move(ap), std::move(bp)});
+        bool stopped;
+        {
+            // decided together with run()'s decision to stop: either it sees the thread back in
+            // service and carries on, or this sees it stopped and starts it again
+            std::lock_guard<std::mutex> lock(_migrationLock);
+            _retiring.store(false, std::memory_order_relaxed);
+            stopped = _stopped.load(std::memory_order_relaxed);
+        }
+        if (stopped)
+        {
+            _thr.join();
+            _stopped.store(false, std::memory_order_relaxed);
+            _loopLagUs.store(0, std::memory_order_relaxed);
+            Logger::instance->Log(Logger::INFO, "iothread id=", id(), " restarted");
+            _thr = std::thread([this] { run(); });
+        }
     }
 
     void IOThread::run()
     {
         while (!_terminateFlag.load(std::memory_order_relaxed))
         {
+            _cpu.store(sched_getcpu(), std::memory_order_relaxed);
             addPendingChannels();
+            runTasks();
             poll();
+            const auto start = std::chrono::steady_clock::now();
+            wakeParkedChannels();
             performIO();
+            flushHeldBack();
             cleanup();
+            const auto elapsed = std::chrono::steady_clock::now() - start;
+            updateLoopLag(elapsed);
+            _channelCount.store(channelsHeld(), std::memory_order_relaxed);
+            _busyNs.add(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+
+            if (_retiring.load(std::memory_order_relaxed) && idle())
+            {
+                std::lock_guard<std::mutex> lock(_migrationLock);
+                if (_retiring.load(std::memory_order_relaxed) && _migratedChannels.empty())
+                {
+                    Logger::instance->Log(Logger::INFO, "iothread id=", id(), " retired");
+                    _stopped.store(true, std::memory_order_release);
+                    break;
+                }
+            }
+        }
+        runTasks();
+        _stopped.store(true, std::memory_order_release);
+    }
+
+    size_t IOThread::channelsHeld()
+    {
+        size_t channels = _channels.size() + _mux.tunnels() + _pendingChannels.size();
+#if defined(VSOCK_COROUTINES)
+        channels += _coroutines.channels();
+#endif
+        return channels;
+    }
+
+    bool IOThread::idle()
+    {
+#if defined(VSOCK_COROUTINES)
+        if (_coroutines.channels() != 0) return false;
+#endif
+        return _channels.empty() && _mux.idle() && _pendingChannels.empty() && _tasks.empty();
+    }
+
+    void IOThread::updateLoopLag(std::chrono::steady_clock::duration iterationTime)
+    {
+        // exponentially weighted moving average with alpha = 1/8
+        const int64_t sample = std::chrono::duration_cast<std::chrono::microseconds>(iterationTime).count();
+        const int64_t lag = _loopLagUs.load(std::memory_order_relaxed);
+        _loopLagUs.store(lag + (sample - lag) / 8, std::memory_order_relaxed);
+    }
+
+    void IOThread::offloadTo(IOThread& target, double load, double targetLoad, bool all)
+    {
+        post([this, &target, load, targetLoad, all] { moveChannels(target, load, targetLoad, all); });
+    }
+
+    void IOThread::moveChannels(IOThread& target, double load, double targetLoad, bool all)
+    {
+        uint64_t total = 0;
+        for (auto* channel : _channels)
+        {
+            total += channel->bytesRelayed() - channel->_rebalanceMark;
+        }
+
+        // a channel's share of the load is estimated by its share of the bytes relayed since last time
+        std::vector<DirectChannel*> moving;
+        DirectChannel* heaviest = nullptr;
+        double heaviestLoad = 0;
+        for (auto* channel : _channels)
+        {
+            const uint64_t relayed = channel->bytesRelayed() - channel->_rebalanceMark;
+            channel->_rebalanceMark = channel->bytesRelayed();
+            if (!channel->canMigrate() || _terminatedChannels.count(channel) != 0)
+            {
+                continue;
+            }
+
+            const double channelLoad = total != 0 ? load * relayed / total : 0;
+            if (all)
+            {
+                moving.push_back(channel);
+            }
+            else if (channelLoad < load - targetLoad && (heaviest == nullptr || channelLoad > heaviestLoad))
+            {
+                // moving a channel busier than the gap would only move the hot spot
+                heaviest = channel;
+                heaviestLoad = channelLoad;
+            }
+        }
+        if (heaviest != nullptr && heaviestLoad > 0)
+        {
+            moving.push_back(heaviest);
+        }
+
+        for (auto* channel : moving)
+        {
+            detachChannel(channel);
+            if (target.adoptChannel(channel))
+            {
+                _migratedOut.add();
+                Logger::instance->Log(Logger::DEBUG, "iothread id=", id(), " moved channel id=", channel->_id, " to iothread id=", target.id());
+            }
+            else
+            {
+                // the target stopped in the meantime, take it back
+                adoptChannel(channel);
+            }
+        }
+    }
+
+    bool IOThread::adoptChannel(DirectChannel* channel)
+    {
+        std::lock_guard<std::mutex> lock(_migrationLock);
+        if (_stopped.load(std::memory_order_relaxed))
+        {
+            return false;
+        }
+        _migratedChannels.push_back(channel);
+        return true;
+    }
+
+    void IOThread::detachChannel(DirectChannel* channel)
+    {
+        for (Socket* socket : {&channel->_a, &channel->_b})
+        {
+            if (socket->attached())
+            {
+                _syscalls.record(Syscall::PollRemove, _poller->remove(socket->fd()) ? SyscallOutcome::Ok : SyscallOutcome::Error);
+            }
+            socket->setPoller(nullptr);
+        }
+        channel->setThreadSyscalls(nullptr);
+
+        _channels.erase(channel);
+        _readyChannels.remove(channel);
+        _readyChannels.onChannelRemoved(channel->_priority);
+        _channelSlab.disown(channel);
+    }
+
+    void IOThread::addMigratedChannels()
+    {
+        std::vector<DirectChannel*> channels;
+        {
+            std::lock_guard<std::mutex> lock(_migrationLock);
+            if (_migratedChannels.empty())
+            {
+                return;
+            }
+            channels.swap(_migratedChannels);
+        }
+
+        const auto now = std::chrono::steady_clock::now();
+        for (auto* channel : channels)
+        {
+            _channelSlab.adopt(channel);
+            channel->_a.setPoller(_poller.get());
+            channel->_b.setPoller(_poller.get());
+            channel->setThreadSyscalls(&_syscalls);
+            if (!addToPoller(channel->_a.fd(), &channel->_ha) ||
+                (channel->_b.attached() && !addToPoller(channel->_b.fd(), &channel->_hb)))
+            {
+                _channelSlab.destroy(channel);
+                continue;
+            }
+
+            _channels.insert(channel);
+            _readyChannels.onChannelAdded(channel->_priority);
+            _readyChannels.push(channel, now);
+            _migratedIn.add();
         }
     }
 
     void IOThread::addPendingChannels()
     {
+        addMigratedChannels();
+
         while (true)
         {
             auto pendingChannel = _pendingChannels.dequeue();
@@ -32,37 +246,156 @@ namespace vsockio
         }
     }
 
+    void IOThread::runTasks()
+    {
+        while (auto task = _tasks.dequeue())
+        {
+            (*task)();
+        }
+    }
+
+    void IOThread::describeChannels(std::ostream& os) const
+    {
+        std::vector<const DirectChannel*> channels(_channels.begin(), _channels.end());
+        std::sort(channels.begin(), channels.end(), [](const auto* x, const auto* y) { return x->_id < y->_id; });
+
+        for (const auto* channel : channels)
+        {
+            os << "channel " << channel->_id
+                << " service=" << (channel->_service != nullptr ? channel->_service->_name : "-")
+                << " state=" << channel->state()
+                << " a.fd=" << channel->_a.fd()
+                << " b.fd=" << channel->_b.fd()
+                << " a_to_b_bytes=" << channel->_a.bytesRead()
+                << " b_to_a_bytes=" << channel->_b.bytesRead()
+                << " queued_to_a=" << channel->_a.queuedBytes()
+                << " queued_to_b=" << channel->_b.queuedBytes()
+                << " ";
+            channel->_syscalls.describe(os, channel->bytesRelayed());
+            os << "\n";
+        }
+        _mux.describeChannels(os);
+#if defined(VSOCK_COROUTINES)
+        _coroutines.describeChannels(os);
+#endif
+    }
+
     void IOThread::addPendingChannel(PendingChannel&& pendingChannel)
     {
         thread_local static int channelId = 0;
 
-        Logger::instance->Log(Logger::DEBUG, "iothread id=", id(), " creating channel id=", channelId, ", a.fd=", pendingChannel._ap->fd(), ", b.fd=", pendingChannel._bp->fd());
-        auto channel = std::make_unique<DirectChannel>(channelId, std::move(pendingChannel._ap), std::move(pendingChannel._bp));
+        if (pendingChannel._service != nullptr && pendingChannel._service->_options._mux != MuxRole::None)
+        {
+            // a client becomes a stream on one of the thread's tunnels, an accepted tunnel carries many
+            if (pendingChannel._service->_options._mux == MuxRole::Client)
+                _mux.addStream(std::move(pendingChannel._a), pendingChannel._service, pendingChannel._timeline);
+            else
+                _mux.addTunnel(std::move(pendingChannel._a), pendingChannel._service, pendingChannel._timeline);
+            return;
+        }
+
+#if defined(VSOCK_COROUTINES)
+        if (pendingChannel._service != nullptr && pendingChannel._service->_options._engine == ChannelEngine::Coroutine && !pendingChannel._service->_options._http)
+        {
+            Logger::instance->Log(Logger::DEBUG, "iothread id=", id(), " creating coroutine channel id=", channelId, ", a.fd=", pendingChannel._a.fd(), ", b.fd=", pendingChannel._b.fd());
+            _coroutines.addChannel(channelId++, std::move(pendingChannel._a), std::move(pendingChannel._b), pendingChannel._service, pendingChannel._timeline);
+            return;
+        }
+#endif
+
+        Logger::instance->Log(Logger::DEBUG, "iothread id=", id(), " creating channel id=", channelId, ", a.fd=", pendingChannel._a.fd(), ", b.fd=", pendingChannel._b.fd());
+        const bool aConnected = pendingChannel._a.connected();
+        const bool bConnected = pendingChannel._b.connected();
+        auto* channel = _channelSlab.create(channelId, pendingChannel._a.release(), *SocketImpl::singleton, pendingChannel._b.release(), *SocketImpl::singleton, pendingChannel._service);
         ++channelId;
+        channel->_timeline = pendingChannel._timeline;
+        channel->_timeline._registered = ChannelTimeline::Clock::now();
 
-        channel->_a->setPoller(_poller.get());
-        channel->_b->setPoller(_poller.get());
-        if (!_poller->add(channel->_a->fd(), (void*)&channel->_ha) ||
-            !_poller->add(channel->_b->fd(), (void*)&channel->_hb))
+        if (aConnected) channel->_a.onConnected();
+        if (bConnected) channel->_b.onConnected();
+
+        if (_busyPoll._socketBusyPollUs != 0)
         {
+            const int us = static_cast<int>(_busyPoll._socketBusyPollUs);
+            // http channels get their backend from the service's pool later on, those connections are not busy polled
+            if ((!IOControl::setBusyPoll(channel->_a.fd(), us) || (channel->_b.attached() && !IOControl::setBusyPoll(channel->_b.fd(), us))) && !_busyPollWarned)
+            {
+                Logger::instance->Log(Logger::WARNING, "iothread id=", id(), " could not set SO_BUSY_POLL, continuing without it");
+                _busyPollWarned = true;
+            }
+        }
+
+        channel->_a.setPoller(_poller.get());
+        channel->_b.setPoller(_poller.get());
+        channel->setThreadSyscalls(&_syscalls);
+        if (!addToPoller(channel->_a.fd(), &channel->_ha) ||
+            (channel->_b.attached() && !addToPoller(channel->_b.fd(), &channel->_hb)))
+        {
+            _channelSlab.destroy(channel);
             return;
         }
 
-        _channels.insert(channel.release());
+        _channels.insert(channel);
+        _readyChannels.onChannelAdded(channel->_priority);
+    }
+
+    bool IOThread::addToPoller(int fd, ChannelHandle* handle)
+    {
+        const bool added = _poller->add(fd, handle);
+        _syscalls.record(Syscall::PollAdd, added ? SyscallOutcome::Ok : SyscallOutcome::Error);
+        return added;
     }
 
     void IOThread::poll()
     {
-        const int eventCount = _poller->poll(_events.data(), getPollTimeout());
+        const auto start = std::chrono::steady_clock::now();
+        int timeout = getPollTimeout(start);
+        const bool spinning = timeout != 0 && _spin.enabled() && _spin.shouldSpin(start);
+        if (spinning)
+        {
+            timeout = 0;
+        }
+
+        const int eventCount = _poller->poll(_events.data(), timeout);
+        _syscalls.record(Syscall::PollWait, eventCount > 0 ? SyscallOutcome::Ok : eventCount == 0 ? SyscallOutcome::Again : SyscallOutcome::Error);
+        const auto end = std::chrono::steady_clock::now();
+        const uint64_t elapsedNs = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+        if (eventCount > 0 || (timeout == 0 && !spinning))
+        {
+            _busyNs.add(elapsedNs);
+        }
+        else
+        {
+            (spinning ? _spinNs : _idleNs).add(elapsedNs);
+        }
+
         if (eventCount == -1) {
             Logger::instance->Log(Logger::CRITICAL, "Poller returns error.");
             return;
         }
 
+        if (eventCount > 0 && _spin.enabled())
+        {
+            _spin.onActivity(end);
+            _spinWindowUs.set(_spin.window().count());
+        }
+
         for (int i = 0; i < eventCount; i++) {
             auto* handle = static_cast<ChannelHandle *>(_events[i].data);
+            if (handle->_mux != nullptr)
+            {
+                _mux.onEvent(handle->_mux, _events[i].ioFlags);
+                continue;
+            }
+#if defined(VSOCK_COROUTINES)
+            if (handle->_coroutine != nullptr)
+            {
+                _coroutines.onEvent(handle->_coroutine, _events[i].ioFlags);
+                continue;
+            }
+#endif
             auto* channel = handle->_channel;
-            _readyChannels.insert(channel);
+            _readyChannels.push(channel, end);
 
             Socket& s = channel->getSocket(handle->_fd);
             if ((_events[i].ioFlags & (IOEvent::OutputReady | IOEvent::Error)) && !s.connected())
@@ -72,35 +405,129 @@ namespace vsockio
         }
     }
 
-    int IOThread::getPollTimeout() const
+    int IOThread::getPollTimeout(std::chrono::steady_clock::time_point now) const
     {
-        return _readyChannels.empty() ? 1 : 0;
+        if (!_readyChannels.empty() || _mux.hasWork())
+        {
+            return 0;
+        }
+
+#if defined(VSOCK_COROUTINES)
+        if (_coroutines.hasWork(now))
+        {
+            return 0;
+        }
+#endif
+
+        if (!_parkedChannels.empty() && _parkedChannels.begin()->first <= now)
+        {
+            return 0;
+        }
+
+        return 1;
+    }
+
+    void IOThread::park(DirectChannel* channel, std::chrono::steady_clock::time_point until)
+    {
+        channel->_parkedUntil = until;
+        _parkedChannels.emplace(until, channel);
+    }
+
+    void IOThread::wakeParkedChannels()
+    {
+        if (_parkedChannels.empty())
+        {
+            return;
+        }
+
+        const auto now = std::chrono::steady_clock::now();
+        while (!_parkedChannels.empty() && _parkedChannels.begin()->first <= now)
+        {
+            auto* channel = _parkedChannels.begin()->second;
+            _parkedChannels.erase(_parkedChannels.begin());
+            channel->_parkedUntil = {};
+            _readyChannels.push(channel, now);
+        }
     }
 
     void IOThread::performIO()
     {
-        for (auto it = _readyChannels.begin(); it != _readyChannels.end(); )
+        _readyChannels.serve([this](DirectChannel* channel) { return serve(channel); });
+        _mux.run();
+#if defined(VSOCK_COROUTINES)
+        _coroutines.run();
+#endif
+    }
+
+    // Returns true if the channel should stay queued for more IO.
+    bool IOThread::serve(DirectChannel* channel)
+    {
+        channel->performIO();
+        if (channel->throttled() && !channel->parked())
+        {
+            // edge-triggered polling will not report the pending input again, so come back on a timer
+            const auto now = std::chrono::steady_clock::now();
+            park(channel, now + channel->throttleDelay(now));
+        }
+
+        const auto flushDue = channel->flushDue();
+        if (flushDue != std::chrono::steady_clock::time_point())
         {
-            auto* channel = *it;
-            channel->performIO();
-            if (!channel->canReadWriteMore())
+            if (flushDue <= std::chrono::steady_clock::now())
             {
-                it = _readyChannels.erase(it);
+                // no delay configured, written once every ready channel had its turn
+                _heldBackChannels.push_back(channel);
             }
-            else
+            else if (!channel->parked() || flushDue < channel->_parkedUntil)
             {
-                ++it;
+                // nothing may come along to write held back data, so come back when it is due
+                if (channel->parked())
+                {
+                    _parkedChannels.erase({channel->_parkedUntil, channel});
+                }
+                park(channel, flushDue);
             }
+        }
+
+        if (channel->canBeTerminated())
+        {
+            _terminatedChannels.insert(channel);
+            return false;
+        }
+
+        return channel->canReadWriteMore();
+    }
 
+    void IOThread::flushHeldBack()
+    {
+        for (auto* channel : _heldBackChannels)
+        {
+            channel->flushHeldBack();
             if (channel->canBeTerminated())
             {
                 _terminatedChannels.insert(channel);
             }
         }
+        _heldBackChannels.clear();
+    }
+
+    std::array<Histogram*, NUM_PRIORITIES> IOThread::readyWaitHistograms(size_t threadId)
+    {
+        std::array<Histogram*, NUM_PRIORITIES> histograms;
+        for (size_t p = 0; p < NUM_PRIORITIES; p++)
+        {
+            histograms[p] = &Metrics::instance->histogram("iothread." + std::to_string(threadId) + ".ready_wait_us." + priorityName(static_cast<Priority>(p)));
+        }
+        return histograms;
     }
 
     void IOThread::cleanup()
     {
+        _mux.cleanup();
+#if defined(VSOCK_COROUTINES)
+        _coroutines.cleanup();
+#endif
+
         if (_terminatedChannels.empty())
         {
             return;
@@ -109,8 +536,13 @@ namespace vsockio
         for (auto* channel : _terminatedChannels)
         {
             _channels.erase(channel);
-            _readyChannels.erase(channel);
-            delete channel;
+            _readyChannels.remove(channel);
+            _readyChannels.onChannelRemoved(channel->_priority);
+            if (channel->parked())
+            {
+                _parkedChannels.erase({channel->_parkedUntil, channel});
+            }
+            _channelSlab.destroy(channel);
         }
 
         _terminatedChannels.clear();
@@ -0,0 +1,211 @@
+#include "lz4.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+namespace vsockio
+{
+    namespace lz4
+    {
+        namespace
+        {
+            constexpr size_t MIN_MATCH = 4;
+            // the format ends a block with literals: the last match starts 12 bytes before the end
+            // at the latest and ends 5 bytes before it
+            constexpr size_t MATCH_FIND_LIMIT = 12;
+            constexpr size_t LAST_LITERALS = 5;
+            constexpr int HASH_BITS = 12;
+            // after this many misses in a row the search skips ahead faster through incompressible data
+            constexpr int SKIP_TRIGGER = 6;
+
+            uint32_t read32(const uint8_t* p)
+            {
+                uint32_t v;
+                memcpy(&v, p, sizeof(v));
+                return v;
+            }
+
+            uint32_t hash(uint32_t sequence)
+            {
+                return (sequence * 2654435761u) >> (32 - HASH_BITS);
+            }
+
+            uint64_t read64(const uint8_t* p)
+            {
+                uint64_t v;
+                memcpy(&v, p, sizeof(v));
+                return v;
+            }
+
+            // Length of the common prefix of p and ref, up to limit; eight bytes per step.
+            size_t matchLength(const uint8_t* p, const uint8_t* ref, const uint8_t* limit)
+            {
+                const uint8_t* const start = p;
+                while (p + sizeof(uint64_t) <= limit)
+                {
+                    const uint64_t diff = read64(p) ^ read64(ref);
+                    if (diff != 0)
+                    {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+                        return p - start + (__builtin_clzll(diff) >> 3);
+#else
+                        // the lowest set bit is in the first differing byte
+                        return p - start + (__builtin_ctzll(diff) >> 3);
+#endif
+                    }
+                    p += sizeof(uint64_t);
+                    ref += sizeof(uint64_t);
+                }
+                while (p < limit && *p == *ref)
+                {
+                    ++p;
+                    ++ref;
+                }
+                return p - start;
+            }
+
+            uint8_t* writeLength(uint8_t* op, size_t len)
+            {
+                while (len >= 255)
+                {
+                    *op++ = 255;
+                    len -= 255;
+                }
+                *op++ = static_cast<uint8_t>(len);
+                return op;
+            }
+
+            uint8_t* writeLiterals(uint8_t* op, const uint8_t* literals, size_t len, size_t matchLen)
+            {
+                uint8_t* token = op++;
+                *token = static_cast<uint8_t>((len >= 15 ? 15 : len) << 4 | (matchLen >= 15 ? 15 : matchLen));
+                if (len >= 15) op = writeLength(op, len - 15);
+                memcpy(op, literals, len);
+                return op + len;
+            }
+
+            bool readLength(const uint8_t*& ip, const uint8_t* iend, size_t& len)
+            {
+                uint8_t b;
+                do
+                {
+                    if (ip == iend) return false;
+                    b = *ip++;
+                    len += b;
+                } while (b == 255);
+                return true;
+            }
+        }
+
+        size_t compress(const uint8_t* src, size_t n, uint8_t* dst)
+        {
+            assert(n <= MAX_BLOCK_SIZE);
+            uint8_t* op = dst;
+            const uint8_t* anchor = src;
+
+            if (n >= MATCH_FIND_LIMIT + 1)
+            {
+                // positions within the block, 0 doubles as empty: a candidate is checked before it is used
+                uint16_t table[1 << HASH_BITS] = {};
+                const uint8_t* ip = src + 1;
+                const uint8_t* const findLimit = src + n - MATCH_FIND_LIMIT;
+                const uint8_t* const matchLimit = src + n - LAST_LITERALS;
+
+                while (ip < findLimit)
+                {
+                    const uint8_t* ref;
+                    int misses = 0;
+                    for (;;)
+                    {
+                        const uint32_t h = hash(read32(ip));
+                        ref = src + table[h];
+                        table[h] = static_cast<uint16_t>(ip - src);
+                        if (ref < ip && read32(ref) == read32(ip))
+                        {
+                            break;
+                        }
+                        ip += 1 + (misses++ >> SKIP_TRIGGER);
+                        if (ip >= findLimit)
+                        {
+                            goto last_literals;
+                        }
+                    }
+
+                    // the match may start earlier than where it was found
+                    while (ip > anchor && ref > src && ip[-1] == ref[-1])
+                    {
+                        --ip;
+                        --ref;
+                    }
+
+                    const uint8_t* const matchEnd = ip + MIN_MATCH + matchLength(ip + MIN_MATCH, ref + MIN_MATCH, matchLimit);
+
+                    const size_t matchLen = matchEnd - ip - MIN_MATCH;
+                    const uint16_t offset = static_cast<uint16_t>(ip - ref);
+                    op = writeLiterals(op, anchor, ip - anchor, matchLen);
+                    *op++ = static_cast<uint8_t>(offset);
+                    *op++ = static_cast<uint8_t>(offset >> 8);
+                    if (matchLen >= 15) op = writeLength(op, matchLen - 15);
+
+                    ip = anchor = matchEnd;
+                    if (ip < findLimit)
+                    {
+                        table[hash(read32(ip - 2))] = static_cast<uint16_t>(ip - 2 - src);
+                    }
+                }
+            }
+
+        last_literals:
+            op = writeLiterals(op, anchor, src + n - anchor, 0);
+            return op - dst;
+        }
+
+        int decompress(const uint8_t* src, size_t n, uint8_t* dst, size_t capacity)
+        {
+            const uint8_t* ip = src;
+            const uint8_t* const iend = src + n;
+            uint8_t* op = dst;
+            uint8_t* const oend = dst + capacity;
+
+            while (ip < iend)
+            {
+                const uint8_t token = *ip++;
+                size_t literals = token >> 4;
+                if (literals == 15 && !readLength(ip, iend, literals)) return -1;
+                if (literals > static_cast<size_t>(iend - ip) || literals > static_cast<size_t>(oend - op)) return -1;
+                memcpy(op, ip, literals);
+                ip += literals;
+                op += literals;
+
+                if (ip == iend)
+                {
+                    // a block ends with literals
+                    break;
+                }
+
+                if (iend - ip < 2) return -1;
+                const size_t offset = ip[0] | ip[1] << 8;
+                ip += 2;
+                if (offset == 0 || offset > static_cast<size_t>(op - dst)) return -1;
+
+                size_t matchLen = token & 15;
+                if (matchLen == 15 && !readLength(ip, iend, matchLen)) return -1;
+                matchLen += MIN_MATCH;
+                if (matchLen > static_cast<size_t>(oend - op)) return -1;
+
+                // an overlapping match repeats the last offset bytes: copy what is there, which
+                // doubles the repeated run, until the match is complete
+                const uint8_t* const ref = op - offset;
+                while (matchLen != 0)
+                {
+                    const size_t chunk = std::min<size_t>(op - ref, matchLen);
+                    memcpy(op, ref, chunk);
+                    op += chunk;
+                    matchLen -= chunk;
+                }
+            }
+            return static_cast<int>(op - dst);
+        }
+    }
+}
@@ -0,0 +1,68 @@
+#include "metrics.h"
+
+namespace vsockio
+{
+    Metrics* Metrics::instance = new Metrics();
+
+    Counter& Metrics::counter(const std::string& name)
+    {
+        std::lock_guard<std::mutex> lk(_lock);
+        auto& c = _counters[name];
+        if (!c) c = std::make_unique<Counter>();
+        return *c;
+    }
+
+    Counter* Metrics::findCounter(const std::string& name) const
+    {
+        std::lock_guard<std::mutex> lk(_lock);
+        const auto it = _counters.find(name);
+        return it != _counters.end() ? it->second.get() : nullptr;
+    }
+
+    Gauge& Metrics::gauge(const std::string& name)
+    {
+        std::lock_guard<std::mutex> lk(_lock);
+        auto& g = _gauges[name];
+        if (!g) g = std::make_unique<Gauge>();
+        return *g;
+    }
+
+    Histogram& Metrics::histogram(const std::string& name)
+    {
+        std::lock_guard<std::mutex> lk(_lock);
+        auto& h = _histograms[name];
+        if (!h) h = std::make_unique<Histogram>();
+        return *h;
+    }
+
+    void Metrics::dump(std::ostream& os) const
+    {
+        std::lock_guard<std::mutex> lk(_lock);
+
+        // merge the per-kind maps so the output is sorted by name
+        std::map<std::string, std::string> lines;
+        for (const auto& c : _counters)
+        {
+            lines[c.first] = std::to_string(c.second->value());
+        }
+        for (const auto& g : _gauges)
+        {
+            lines[g.first] = std::to_string(g.second->value()) + " (max " + std::to_string(g.second->highWater()) + ")";
+        }
+
+        for (const auto& h : _histograms)
+        {
+            const Histogram& histogram = *h.second;
+            lines[h.first] = "count=" + std::to_string(histogram.count())
+                + " p50=" + std::to_string(histogram.quantile(0.5))
+                + " p90=" + std::to_string(histogram.quantile(0.9))
+                + " p99=" + std::to_string(histogram.quantile(0.99))
+                + " max=" + std::to_string(histogram.max());
+        }
+
+        for (const auto& line : lines)
+        {
+            os << line.first << " " << line.second << "\n";
+        }
+    }
+}
@@ -0,0 +1,896 @@
+#include "mux.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+namespace vsockio
+{
+    namespace
+    {
+        const uint8_t HELLO_MAGIC[4] = {'V', 'S', 'M', 'X'};
+
+        void put16(uint8_t* out, uint16_t v)
+        {
+            out[0] = static_cast<uint8_t>(v >> 8);
+            out[1] = static_cast<uint8_t>(v);
+        }
+
+        void put32(uint8_t* out, uint32_t v)
+        {
+            out[0] = static_cast<uint8_t>(v >> 24);
+            out[1] = static_cast<uint8_t>(v >> 16);
+            out[2] = static_cast<uint8_t>(v >> 8);
+            out[3] = static_cast<uint8_t>(v);
+        }
+
+        uint16_t get16(const uint8_t* in)
+        {
+            return static_cast<uint16_t>(in[0] << 8 | in[1]);
+        }
+
+        uint32_t get32(const uint8_t* in)
+        {
+            return uint32_t(in[0]) << 24 | uint32_t(in[1]) << 16 | uint32_t(in[2]) << 8 | uint32_t(in[3]);
+        }
+
+        const char* roleName(MuxRole role)
+        {
+            return role == MuxRole::Client ? "client" : "server";
+        }
+    }
+
+    void MuxFrameHeader::encode(uint8_t* out) const
+    {
+        put32(out, _stream);
+        out[4] = static_cast<uint8_t>(_type);
+        out[5] = 0;
+        put16(out + 6, _length);
+    }
+
+    MuxFrameHeader MuxFrameHeader::decode(const uint8_t* in)
+    {
+        return {get32(in), static_cast<MuxFrameType>(in[4]), get16(in + 6)};
+    }
+
+    void MuxHello::encode(uint8_t* out) const
+    {
+        memcpy(out, HELLO_MAGIC, sizeof(HELLO_MAGIC));
+        put16(out + 4, _version);
+        put32(out + 6, _window);
+        put16(out + 10, _maxPayload);
+    }
+
+    std::optional<MuxHello> MuxHello::decode(const uint8_t* in, size_t len)
+    {
+        // later versions may append fields
+        if (len < SIZE || memcmp(in, HELLO_MAGIC, sizeof(HELLO_MAGIC)) != 0)
+        {
+            return std::nullopt;
+        }
+        MuxHello hello;
+        hello._version = get16(in + 4);
+        hello._window = get32(in + 6);
+        hello._maxPayload = get16(in + 10);
+        return hello;
+    }
+
+    uint8_t* MuxBuffer::reserve(size_t n)
+    {
+        if (_capacity - _end >= n)
+        {
+            return _data.get() + _end;
+        }
+
+        const size_t used = size();
+        if (_capacity - used < n)
+        {
+            // grow, moving what is queued to the front
+            const size_t capacity = std::max(_capacity * 2, used + n);
+            std::unique_ptr<uint8_t[]> data(new uint8_t[capacity]);
+            if (_budget != nullptr) _budget->forceReserve(capacity - _capacity);
+            if (used != 0) memcpy(data.get(), _data.get() + _begin, used);
+            _data = std::move(data);
+            _capacity = capacity;
+        }
+        else
+        {
+            memmove(_data.get(), _data.get() + _begin, used);
+        }
+        _begin = 0;
+        _end = used;
+        return _data.get() + _end;
+    }
+
+    void MuxBuffer::append(const uint8_t* data, size_t n)
+    {
+        memcpy(reserve(n), data, n);
+        commit(n);
+    }
+
+    void MuxBuffer::consume(size_t n)
+    {
+        _begin += n;
+        if (_begin == _end)
+        {
+            _begin = _end = 0;
+        }
+    }
+
+    MuxEngine::MuxEngine(size_t threadId, Poller& poller, SocketImpl& impl, SyscallCounters& threadSyscalls)
+        : _threadId(threadId)
+        , _poller(poller)
+        , _impl(impl)
+        , _threadSyscalls(threadSyscalls)
+    {
+    }
+
+    MuxEngine::~MuxEngine()
+    {
+        while (!_tunnels.empty())
+        {
+            failTunnel(*_tunnels.begin()->first, "worker stopping");
+        }
+        cleanup();
+    }
+
+    void MuxEngine::addStream(PendingSocket&& client, ServiceContext* service, const ChannelTimeline& timeline)
+    {
+        const auto it = _clientTunnels.find(service);
+        MuxTunnel* tunnel = it != _clientTunnels.end() ? it->second : openTunnel(service);
+        MuxStream* stream = nullptr;
+        if (tunnel != nullptr && !admitStream(*tunnel))
+        {
+            Logger::instance->Log(Logger::WARNING, "[mux] iothread id=", _threadId, " tunnel ", tunnel->_id, " of ", service->_name, " is at its stream or buffer limit, closing a client");
+            counter(service, "refused").add();
+            service->onChannelClosed(timeline);
+            return;
+        }
+        if (tunnel != nullptr)
+        {
+            // ids are odd and wrap around, skipping those of streams still open
+            uint32_t id = tunnel->_nextStreamId;
+            while (tunnel->_streams.count(id) != 0) id += 2;
+            stream = addStreamSocket(*tunnel, id, std::move(client));
+            tunnel->_nextStreamId = id + 2;
+        }
+        if (stream == nullptr)
+        {
+            Logger::instance->Log(Logger::WARNING, "[mux] iothread id=", _threadId, " no tunnel for a client of ", service->_name, ", closing it");
+            service->onChannelClosed(timeline);
+            return;
+        }
+
+        stream->_timeline = timeline;
+        stream->_timeline._registered = ChannelTimeline::Clock::now();
+        if (tunnel->_handshakeDone)
+        {
+            stream->_sendWindow = tunnel->_peerWindow;
+            stream->_timeline._connected = stream->_timeline._registered;
+        }
+        queueFrame(*tunnel, stream->_id, MuxFrameType::Open);
+        counter(service, "streams").add();
+    }
+
+    void MuxEngine::addTunnel(PendingSocket&& tunnel, ServiceContext* service, const ChannelTimeline& timeline)
+    {
+        if (addTunnelSocket(MuxRole::Server, service, std::move(tunnel), timeline) == nullptr)
+        {
+            service->onChannelClosed(timeline);
+        }
+    }
+
+    MuxTunnel* MuxEngine::openTunnel(ServiceContext* service)
+    {
+        PendingSocket socket = service->_connect ? service->_connect() : PendingSocket();
+        if (!socket)
+        {
+            return nullptr;
+        }
+
+        ChannelTimeline timeline;
+        timeline._accepted = ChannelTimeline::Clock::now();
+        MuxTunnel* tunnel = addTunnelSocket(MuxRole::Client, service, std::move(socket), timeline);
+        if (tunnel != nullptr)
+        {
+            _clientTunnels[service] = tunnel;
+            counter(service, "tunnel_connects").add();
+        }
+        return tunnel;
+    }
+
+    MuxTunnel* MuxEngine::addTunnelSocket(MuxRole role, ServiceContext* service, PendingSocket&& socket, const ChannelTimeline& timeline)
+    {
+        const bool connected = socket.connected();
+        auto tunnel = std::make_unique<MuxTunnel>(_nextTunnelId++, role, service, connected, socket.release());
+        tunnel->_timeline = timeline;
+        tunnel->_timeline._registered = ChannelTimeline::Clock::now();
+        if (!registerSocket(tunnel->_socket))
+        {
+            closeSocket(tunnel->_socket);
+            return nullptr;
+        }
+
+        Logger::instance->Log(Logger::DEBUG, "[mux] iothread id=", _threadId, " ", roleName(role), " tunnel ", tunnel->_id, " for ", service->_name, " (fd=", tunnel->_socket._fd, ")");
+        auto* t = tunnel.get();
+        _tunnels.emplace(t, std::move(tunnel));
+
+        // both ends say hello right away, nothing else may come before it
+        MuxHello hello;
+        hello._window = service->_options._muxWindow;
+        hello._maxPayload = MAX_PAYLOAD;
+        uint8_t payload[MuxHello::SIZE];
+        hello.encode(payload);
+        queueFrame(*t, 0, MuxFrameType::Hello, payload, sizeof(payload));
+        return t;
+    }
+
+    MuxStream* MuxEngine::addStreamSocket(MuxTunnel& tunnel, uint32_t id, PendingSocket&& socket)
+    {
+        if (!socket || tunnel._streams.count(id) != 0)
+        {
+            return nullptr;
+        }
+
+        const bool connected = socket.connected();
+        auto stream = std::make_unique<MuxStream>(id, tunnel, connected, socket.release());
+        stream->_receiveWindow = tunnel._service->_options._muxWindow;
+        if (!registerSocket(stream->_socket))
+        {
+            closeSocket(stream->_socket);
+            return nullptr;
+        }
+
+        auto* s = stream.get();
+        tunnel._streams.try_emplace(id, std::move(stream));
+        return s;
+    }
+
+    bool MuxEngine::admitStream(const MuxTunnel& tunnel) const
+    {
+        if (tunnel._streams.size() >= tunnel._service->_options._muxMaxStreams)
+        {
+            return false;
+        }
+        const MemoryBudget& budget = tunnel._service->_bufferBudget;
+        return budget.limit() == 0 || budget.used() < static_cast<int64_t>(budget.limit());
+    }
+
+    bool MuxEngine::registerSocket(MuxSocket& socket)
+    {
+        // an edge-triggered add reports the socket's current readiness
+        const bool added = _poller.add(socket._fd, &socket._handle);
+        record(Syscall::PollAdd, added ? SyscallOutcome::Ok : SyscallOutcome::Error);
+        return added;
+    }
+
+    Counter& MuxEngine::counter(ServiceContext* service, const char* name)
+    {
+        return Metrics::instance->counter("service." + service->_name + ".mux." + name);
+    }
+
+    void MuxEngine::onEvent(MuxSocket* socket, IOEvent flags)
+    {
+        // errors are picked up by the next call on the socket
+        if (flags & (IOEvent::InputReady | IOEvent::Error)) socket->_readable = true;
+        if (flags & (IOEvent::OutputReady | IOEvent::Error)) socket->_writable = true;
+
+        if (socket->_stream != nullptr)
+            _readyStreams.insert(socket->_stream);
+        else
+            _readyTunnels.insert(&socket->_tunnel);
+    }
+
+    void MuxEngine::run()
+    {
+        // tunnels first, window updates from the peer let streams send more in the same pass
+        const auto tunnels = std::move(_readyTunnels);
+        _readyTunnels.clear();
+        for (auto* tunnel : tunnels)
+        {
+            if (!tunnel->_failed) serviceTunnel(*tunnel);
+        }
+
+        const auto streams = std::move(_readyStreams);
+        _readyStreams.clear();
+        for (auto* stream : streams)
+        {
+            if (!stream->_closed) serviceStream(*stream);
+        }
+
+        // one write per tunnel for all the frames its streams queued
+        const auto unflushed = std::move(_unflushedTunnels);
+        _unflushedTunnels.clear();
+        for (auto* tunnel : unflushed)
+        {
+            if (!tunnel->_failed) flushTunnel(*tunnel);
+        }
+    }
+
+    void MuxEngine::cleanup()
+    {
+        for (const auto& stream : _closedStreams)
+        {
+            _readyStreams.erase(stream.get());
+        }
+        _closedStreams.clear();
+
+        for (const auto& tunnel : _closedTunnels)
+        {
+            _readyTunnels.erase(tunnel.get());
+            _unflushedTunnels.erase(tunnel.get());
+        }
+        _closedTunnels.clear();
+    }
+
+    bool MuxEngine::idle() const
+    {
+        for (const auto& [tunnel, owned] : _tunnels)
+        {
+            if (tunnel->_role == MuxRole::Server || !tunnel->_streams.empty())
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void MuxEngine::describeChannels(std::ostream& os) const
+    {
+        std::vector<const MuxTunnel*> tunnels;
+        for (const auto& entry : _tunnels) tunnels.push_back(entry.first);
+        std::sort(tunnels.begin(), tunnels.end(), [](const auto* x, const auto* y) { return x->_id < y->_id; });
+
+        for (const auto* tunnel : tunnels)
+        {
+            os << "mux tunnel " << tunnel->_id
+                << " service=" << tunnel->_service->_name
+                << " role=" << roleName(tunnel->_role)
+                << " state=" << (!tunnel->_socket._connected ? "connecting" : tunnel->_handshakeDone ? "open" : "handshake")
+                << " fd=" << tunnel->_socket._fd
+                << " streams=" << tunnel->_streams.size()
+                << " queued_out=" << tunnel->_out.size()
+                << "\n";
+
+            std::vector<const MuxStream*> streams;
+            for (const auto& entry : tunnel->_streams) streams.push_back(entry.second.get());
+            std::sort(streams.begin(), streams.end(), [](const auto* x, const auto* y) { return x->_id < y->_id; });
+            for (const auto* stream : streams)
+            {
+                os << "mux stream " << tunnel->_id << "/" << stream->_id
+                    << " state=" << (!stream->_socket._connected ? "connecting" : stream->_peerClosed ? "closing" : "open")
+                    << " fd=" << stream->_socket._fd
+                    << " in_bytes=" << stream->_bytesIn
+                    << " out_bytes=" << stream->_bytesOut
+                    << " send_window=" << stream->_sendWindow
+                    << " queued_to_socket=" << stream->_toSocket.size()
+                    << "\n";
+            }
+        }
+    }
+
+    void MuxEngine::serviceTunnel(MuxTunnel& tunnel)
+    {
+        if (!tunnel._socket._connected && !checkConnected(tunnel._socket))
+        {
+            return;
+        }
+
+        if (tunnel._socket._readable)
+        {
+            readTunnel(tunnel);
+        }
+        if (!tunnel._failed && !tunnel._out.empty())
+        {
+            flushTunnel(tunnel);
+        }
+    }
+
+    void MuxEngine::serviceStream(MuxStream& stream)
+    {
+        if (!stream._socket._connected && !checkConnected(stream._socket))
+        {
+            return;
+        }
+
+        if (!stream._toSocket.empty() && stream._socket._writable)
+        {
+            writeStream(stream);
+        }
+        if (!stream._closed && stream._socket._readable)
+        {
+            readStream(stream);
+        }
+    }
+
+    bool MuxEngine::checkConnected(MuxSocket& socket)
+    {
+        if (!socket._writable)
+        {
+            return false;
+        }
+
+        char c;
+        const int result = _impl.write(socket._fd, &c, 0);
+        const int err = errno;
+        record(Syscall::ConnectCheck, result == 0 ? SyscallOutcome::Ok : outcomeOf(err));
+        if (result == 0)
+        {
+            socket._connected = true;
+            socket._readable = true;
+            if (socket._stream != nullptr && !ChannelTimeline::isSet(socket._stream->_timeline._connected))
+            {
+                socket._stream->_timeline._connected = ChannelTimeline::Clock::now();
+            }
+            return true;
+        }
+
+        if (err == EAGAIN || err == EWOULDBLOCK)
+        {
+            socket._writable = false;
+            return false;
+        }
+
+        Logger::instance->Log(Logger::WARNING, "[mux] connection error (fd=", socket._fd, "): ", err, ", ", strerror(err));
+        if (socket._stream != nullptr)
+        {
+            queueFrame(socket._tunnel, socket._stream->_id, MuxFrameType::Reset);
+            closeStream(*socket._stream);
+        }
+        else
+        {
+            failTunnel(socket._tunnel, "connect failed");
+        }
+        return false;
+    }
+
+    void MuxEngine::readTunnel(MuxTunnel& tunnel)
+    {
+        MuxSocket& socket = tunnel._socket;
+        size_t budget = READ_BUDGET;
+        while (socket._readable && budget > 0)
+        {
+            // room for at least one whole frame behind a partial one
+            constexpr size_t READ_SIZE = 64 * 1024;
+            static_assert(READ_SIZE >= MuxFrameHeader::SIZE + MAX_PAYLOAD, "a frame must fit");
+            uint8_t* space = tunnel._in.reserve(READ_SIZE);
+            const int n = _impl.read(socket._fd, space, READ_SIZE);
+            const int err = n < 0 ? errno : 0;
+            record(Syscall::Read, n >= 0 ? SyscallOutcome::Ok : outcomeOf(err));
+            if (n > 0)
+            {
+                tunnel._in.commit(n);
+                budget -= std::min<size_t>(budget, n);
+                tunnel._in.consume(handleFrames(tunnel, tunnel._in.data(), tunnel._in.size()));
+                if (tunnel._failed) return;
+            }
+            else if (n == 0)
+            {
+                failTunnel(tunnel, "closed by the peer");
+                return;
+            }
+            else if (err == EAGAIN || err == EWOULDBLOCK)
+            {
+                socket._readable = false;
+            }
+            else
+            {
+                failTunnel(tunnel, strerror(err));
+                return;
+            }
+        }
+
+        if (socket._readable)
+        {
+            _readyTunnels.insert(&tunnel);
+        }
+    }
+
+    size_t MuxEngine::handleFrames(MuxTunnel& tunnel, const uint8_t* data, size_t len)
+    {
+        size_t used = 0;
+        while (len - used >= MuxFrameHeader::SIZE)
+        {
+            const auto header = MuxFrameHeader::decode(data + used);
+            if (header._length > MAX_PAYLOAD)
+            {
+                failTunnel(tunnel, "frame too large");
+                return used;
+            }
+            if (len - used - MuxFrameHeader::SIZE < header._length)
+            {
+                break;
+            }
+            if (!handleFrame(tunnel, header, data + used + MuxFrameHeader::SIZE))
+            {
+                return used;
+            }
+            used += MuxFrameHeader::SIZE + header._length;
+        }
+        return used;
+    }
+
+    bool MuxEngine::handleFrame(MuxTunnel& tunnel, const MuxFrameHeader& header, const uint8_t* payload)
+    {
+        if (header._type == MuxFrameType::Hello)
+        {
+            const auto hello = MuxHello::decode(payload, header._length);
+            if (!hello || header._stream != 0 || tunnel._handshakeDone)
+            {
+                failTunnel(tunnel, "bad hello");
+                return false;
+            }
+            onHello(tunnel, *hello);
+            return !tunnel._failed;
+        }
+
+        if (!tunnel._handshakeDone)
+        {
+            failTunnel(tunnel, "frame before hello");
+            return false;
+        }
+
+        if (header._type == MuxFrameType::Open)
+        {
+            if (tunnel._role != MuxRole::Server || header._stream == 0 || tunnel._streams.count(header._stream) != 0)
+            {
+                failTunnel(tunnel, "unexpected open");
+                return false;
+            }
+            onOpen(tunnel, header._stream);
+            return true;
+        }
+
+        const auto it = tunnel._streams.find(header._stream);
+        if (it == tunnel._streams.end())
+        {
+            // closed on this side already, the peer learns from the Close or Reset sent then
+            return true;
+        }
+        MuxStream& stream = *it->second;
+
+        switch (header._type)
+        {
+        case MuxFrameType::Data:
+            onData(tunnel, stream, payload, header._length);
+            break;
+        case MuxFrameType::Window:
+            if (header._length < 4)
+            {
+                failTunnel(tunnel, "bad window update");
+                return false;
+            }
+            stream._sendWindow += get32(payload);
+            if (stream._socket._readable) _readyStreams.insert(&stream);
+            break;
+        case MuxFrameType::Close:
+            stream._peerClosed = true;
+            if (stream._toSocket.empty()) closeStream(stream);
+            break;
+        case MuxFrameType::Reset:
+            closeStream(stream);
+            break;
+        default:
+            failTunnel(tunnel, "unknown frame type");
+            return false;
+        }
+        return true;
+    }
+
+    void MuxEngine::onHello(MuxTunnel& tunnel, const MuxHello& hello)
+    {
+        const uint16_t version = std::min(MuxHello::VERSION, hello._version);
+        if (version < 1 || hello._window == 0 || hello._maxPayload == 0)
+        {
+            failTunnel(tunnel, "no common protocol version");
+            return;
+        }
+
+        tunnel._handshakeDone = true;
+        tunnel._peerWindow = hello._window;
+        tunnel._maxPayload = std::min(MAX_PAYLOAD, hello._maxPayload);
+        Logger::instance->Log(Logger::DEBUG, "[mux] tunnel ", tunnel._id, " open, version ", version, ", peer window ", hello._window);
+
+        // streams opened before the peer's hello may send now
+        const auto now = ChannelTimeline::Clock::now();
+        for (auto& entry : tunnel._streams)
+        {
+            MuxStream& stream = *entry.second;
+            stream._sendWindow = tunnel._peerWindow;
+            if (!ChannelTimeline::isSet(stream._timeline._connected)) stream._timeline._connected = now;
+            if (stream._socket._readable) _readyStreams.insert(&stream);
+        }
+    }
+
+    void MuxEngine::onOpen(MuxTunnel& tunnel, uint32_t id)
+    {
+        if (!admitStream(tunnel))
+        {
+            // refused before connecting, a peer opening streams in a loop gets no backend connections
+            Logger::instance->Log(Logger::WARNING, "[mux] tunnel ", tunnel._id, " of ", tunnel._service->_name, " is at its stream or buffer limit, refusing stream ", id);
+            counter(tunnel._service, "refused").add();
+            queueFrame(tunnel, id, MuxFrameType::Reset);
+            return;
+        }
+
+        PendingSocket backend = tunnel._service->_connect ? tunnel._service->_connect() : PendingSocket();
+        MuxStream* stream = addStreamSocket(tunnel, id, std::move(backend));
+        if (stream == nullptr)
+        {
+            Logger::instance->Log(Logger::WARNING, "[mux] could not connect stream ", id, " of tunnel ", tunnel._id, " to the backend of ", tunnel._service->_name);
+            queueFrame(tunnel, id, MuxFrameType::Reset);
+            return;
+        }
+
+        stream->_sendWindow = tunnel._peerWindow;
+        stream->_timeline._accepted = stream->_timeline._registered = ChannelTimeline::Clock::now();
+        counter(tunnel._service, "streams").add();
+    }
+
+    void MuxEngine::onData(MuxTunnel& tunnel, MuxStream& stream, const uint8_t* payload, size_t len)
+    {
+        if (len > stream._receiveWindow || stream._peerClosed)
+        {
+            Logger::instance->Log(Logger::WARNING, "[mux] stream ", stream._id, " of tunnel ", tunnel._id, " sent beyond its window, resetting it");
+            queueFrame(tunnel, stream._id, MuxFrameType::Reset);
+            closeStream(stream);
+            return;
+        }
+        stream._receiveWindow -= len;
+        if (!ChannelTimeline::isSet(stream._timeline._firstResponseByte))
+        {
+            stream._timeline._firstResponseByte = ChannelTimeline::Clock::now();
+        }
+
+        // straight from the tunnel's input when nothing is queued ahead of it
+        if (stream._toSocket.empty() && stream._socket._connected && stream._socket._writable)
+        {
+            const int n = _impl.write(stream._socket._fd, const_cast<uint8_t*>(payload), static_cast<int>(len));
+            const int err = n < 0 ? errno : 0;
+            record(Syscall::Write, n >= 0 ? SyscallOutcome::Ok : outcomeOf(err));
+            if (n > 0)
+            {
+                payload += n;
+                len -= n;
+                stream._bytesOut += n;
+                stream._unacknowledged += n;
+                queueWindowIfDue(tunnel, stream);
+            }
+            else if (err == EAGAIN || err == EWOULDBLOCK)
+            {
+                stream._socket._writable = false;
+            }
+            else
+            {
+                queueFrame(tunnel, stream._id, MuxFrameType::Reset);
+                closeStream(stream);
+                return;
+            }
+        }
+
+        if (len > 0)
+        {
+            stream._toSocket.append(payload, len);
+        }
+    }
+
+    void MuxEngine::writeStream(MuxStream& stream)
+    {
+        MuxTunnel& tunnel = stream._socket._tunnel;
+        while (!stream._toSocket.empty())
+        {
+            const int n = _impl.write(stream._socket._fd, const_cast<uint8_t*>(stream._toSocket.data()), static_cast<int>(stream._toSocket.size()));
+            const int err = n < 0 ? errno : 0;
+            record(Syscall::Write, n >= 0 ? SyscallOutcome::Ok : outcomeOf(err));
+            if (n > 0)
+            {
+                stream._toSocket.consume(n);
+                stream._bytesOut += n;
+                stream._unacknowledged += n;
+            }
+            else if (err == EAGAIN || err == EWOULDBLOCK)
+            {
+                stream._socket._writable = false;
+                break;
+            }
+            else
+            {
+                queueFrame(tunnel, stream._id, MuxFrameType::Reset);
+                closeStream(stream);
+                return;
+            }
+        }
+
+        if (stream._toSocket.empty() && stream._peerClosed)
+        {
+            closeStream(stream);
+            return;
+        }
+        queueWindowIfDue(tunnel, stream);
+    }
+
+    void MuxEngine::readStream(MuxStream& stream)
+    {
+        MuxTunnel& tunnel = stream._socket._tunnel;
+        if (!tunnel._handshakeDone || stream._sendWindow == 0 || tunnel._out.size() >= MAX_QUEUED_OUTPUT)
+        {
+            // picked up again on the hello, a window update or once the tunnel drained
+            return;
+        }
+
+        // one frame per turn, so busy streams take turns on the tunnel
+        const size_t len = std::min<size_t>(stream._sendWindow, tunnel._maxPayload);
+        uint8_t* frame = tunnel._out.reserve(MuxFrameHeader::SIZE + len);
+        const int n = _impl.read(stream._socket._fd, frame + MuxFrameHeader::SIZE, static_cast<int>(len));
+        const int err = n < 0 ? errno : 0;
+        record(Syscall::Read, n >= 0 ? SyscallOutcome::Ok : outcomeOf(err));
+        if (n > 0)
+        {
+            MuxFrameHeader{stream._id, MuxFrameType::Data, static_cast<uint16_t>(n)}.encode(frame);
+            tunnel._out.commit(MuxFrameHeader::SIZE + n);
+            _unflushedTunnels.insert(&tunnel);
+            stream._sendWindow -= n;
+            stream._bytesIn += n;
+            _threadSyscalls.addBytesRelayed(n);
+            if (!ChannelTimeline::isSet(stream._timeline._firstRequestByte))
+            {
+                stream._timeline._firstRequestByte = ChannelTimeline::Clock::now();
+            }
+            _readyStreams.insert(&stream);
+        }
+        else if (n == 0)
+        {
+            queueFrame(tunnel, stream._id, MuxFrameType::Close);
+            closeStream(stream);
+        }
+        else if (err == EAGAIN || err == EWOULDBLOCK)
+        {
+            stream._socket._readable = false;
+        }
+        else
+        {
+            queueFrame(tunnel, stream._id, MuxFrameType::Reset);
+            closeStream(stream);
+        }
+    }
+
+    void MuxEngine::flushTunnel(MuxTunnel& tunnel)
+    {
+        MuxSocket& socket = tunnel._socket;
+        if (!socket._connected || !socket._writable)
+        {
+            // flushed on the next writable event
+            return;
+        }
+
+        const bool wasFull = tunnel._out.size() >= MAX_QUEUED_OUTPUT;
+        while (!tunnel._out.empty())
+        {
+            const int n = _impl.write(socket._fd, const_cast<uint8_t*>(tunnel._out.data()), static_cast<int>(tunnel._out.size()));
+            const int err = n < 0 ? errno : 0;
+            record(Syscall::Write, n >= 0 ? SyscallOutcome::Ok : outcomeOf(err));
+            if (n > 0)
+            {
+                tunnel._out.consume(n);
+            }
+            else if (err == EAGAIN || err == EWOULDBLOCK)
+            {
+                socket._writable = false;
+                break;
+            }
+            else
+            {
+                failTunnel(tunnel, strerror(err));
+                return;
+            }
+        }
+
+        if (wasFull && tunnel._out.size() < MAX_QUEUED_OUTPUT)
+        {
+            for (auto& entry : tunnel._streams)
+            {
+                if (entry.second->_socket._readable) _readyStreams.insert(entry.second.get());
+            }
+        }
+    }
+
+    void MuxEngine::queueFrame(MuxTunnel& tunnel, uint32_t stream, MuxFrameType type, const uint8_t* payload, uint16_t length)
+    {
+        uint8_t* frame = tunnel._out.reserve(MuxFrameHeader::SIZE + length);
+        MuxFrameHeader{stream, type, length}.encode(frame);
+        if (length != 0) memcpy(frame + MuxFrameHeader::SIZE, payload, length);
+        tunnel._out.commit(MuxFrameHeader::SIZE + length);
+        _unflushedTunnels.insert(&tunnel);
+        if (type == MuxFrameType::Reset)
+        {
+            counter(tunnel._service, "resets").add();
+        }
+    }
+
+    void MuxEngine::queueWindowIfDue(MuxTunnel& tunnel, MuxStream& stream)
+    {
+        // acknowledging a quarter of the window at a time keeps updates rare and the peer sending
+        if (stream._unacknowledged < tunnel._service->_options._muxWindow / 4 || stream._peerClosed)
+        {
+            return;
+        }
+
+        uint8_t increment[4];
+        put32(increment, stream._unacknowledged);
+        queueFrame(tunnel, stream._id, MuxFrameType::Window, increment, sizeof(increment));
+        stream._receiveWindow += stream._unacknowledged;
+        stream._unacknowledged = 0;
+    }
+
+    void MuxEngine::closeStream(MuxStream& stream)
+    {
+        if (stream._closed)
+        {
+            return;
+        }
+        stream._closed = true;
+        closeSocket(stream._socket);
+
+        MuxTunnel& tunnel = stream._socket._tunnel;
+        if (tunnel._role == MuxRole::Client)
+        {
+            // client streams are the service's channels
+            stream._timeline._closed = ChannelTimeline::Clock::now();
+            tunnel._service->onChannelClosed(stream._timeline, {}, stream._bytesIn + stream._bytesOut);
+        }
+
+        const auto it = tunnel._streams.find(stream._id);
+        _closedStreams.push_back(std::move(it->second));
+        tunnel._streams.erase(it);
+    }
+
+    void MuxEngine::failTunnel(MuxTunnel& tunnel, const char* reason)
+    {
+        if (tunnel._failed)
+        {
+            return;
+        }
+        tunnel._failed = true;
+        Logger::instance->Log(Logger::WARNING, "[mux] iothread id=", _threadId, " closing ", roleName(tunnel._role), " tunnel ", tunnel._id, " of ", tunnel._service->_name,
+            " with ", tunnel._streams.size(), " streams: ", reason);
+
+        while (!tunnel._streams.empty())
+        {
+            closeStream(*tunnel._streams.begin()->second);
+        }
+        closeSocket(tunnel._socket);
+
+        const auto client = _clientTunnels.find(tunnel._service);
+        if (client != _clientTunnels.end() && client->second == &tunnel)
+        {
+            // the next client opens a new one
+            _clientTunnels.erase(client);
+        }
+        if (tunnel._role == MuxRole::Server)
+        {
+            // server tunnels are the service's channels
+            tunnel._timeline._closed = ChannelTimeline::Clock::now();
+            tunnel._service->onChannelClosed(tunnel._timeline);
+        }
+
+        const auto it = _tunnels.find(&tunnel);
+        _closedTunnels.push_back(std::move(it->second));
+        _tunnels.erase(it);
+    }
+
+    void MuxEngine::closeSocket(MuxSocket& socket)
+    {
+        if (socket._fd < 0)
+        {
+            return;
+        }
+        record(Syscall::PollRemove, _poller.remove(socket._fd) ? SyscallOutcome::Ok : SyscallOutcome::Error);
+        record(Syscall::Close, _impl.close(socket._fd) == 0 ? SyscallOutcome::Ok : SyscallOutcome::Error);
+        socket._fd = -1;
+    }
+
+    SyscallOutcome MuxEngine::outcomeOf(int err)
+    {
+        return err == EAGAIN || err == EWOULDBLOCK ? SyscallOutcome::Again : SyscallOutcome::Error;
+    }
+}
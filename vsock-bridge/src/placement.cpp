@@ -0,0 +1,90 @@
+#include "placement.h"
+
+#include <dirent.h>
+#include <fstream>
+#include <sstream>
+
+#include <sched.h>
+#include <sys/socket.h>
+
+namespace vsockio
+{
+    std::optional<std::vector<int>> parseCpuList(const std::string& s)
+    {
+        std::vector<int> cpus;
+        std::stringstream ss(s);
+        std::string range;
+        while (std::getline(ss, range, ','))
+        {
+            try
+            {
+                size_t end = 0;
+                const size_t dash = range.find('-');
+                const unsigned long first = std::stoul(range.substr(0, dash), &end);
+                if (end != (dash == std::string::npos ? range.size() : dash)) return std::nullopt;
+                const unsigned long last = dash == std::string::npos ? first : std::stoul(range.substr(dash + 1), &end);
+                if (dash != std::string::npos && end != range.size() - dash - 1) return std::nullopt;
+                if (first > last || last >= CPU_SETSIZE) return std::nullopt;
+                for (unsigned long cpu = first; cpu <= last; cpu++)
+                {
+                    cpus.push_back(static_cast<int>(cpu));
+                }
+            }
+            catch (const std::exception&)
+            {
+                return std::nullopt;
+            }
+        }
+        if (cpus.empty()) return std::nullopt;
+        return cpus;
+    }
+
+    CpuTopology::CpuTopology(const std::string& nodeRoot)
+    {
+        DIR* dir = opendir(nodeRoot.c_str());
+        if (dir == nullptr)
+        {
+            return;
+        }
+        while (const dirent* entry = readdir(dir))
+        {
+            const std::string name = entry->d_name;
+            if (name.compare(0, 4, "node") != 0 || name.size() == 4 || name.find_first_not_of("0123456789", 4) != std::string::npos)
+            {
+                continue;
+            }
+
+            std::string list;
+            std::ifstream(nodeRoot + "/" + name + "/cpulist") >> list;
+            const int node = std::stoi(name.substr(4));
+            for (const int cpu : parseCpuList(list).value_or(std::vector<int>()))
+            {
+                if (static_cast<size_t>(cpu) >= _nodeByCpu.size()) _nodeByCpu.resize(cpu + 1, -1);
+                _nodeByCpu[cpu] = node;
+            }
+        }
+        closedir(dir);
+    }
+
+    const CpuTopology& CpuTopology::system()
+    {
+        static const CpuTopology topology;
+        return topology;
+    }
+
+    int CpuTopology::nodeOf(int cpu) const
+    {
+        return cpu >= 0 && static_cast<size_t>(cpu) < _nodeByCpu.size() ? _nodeByCpu[cpu] : -1;
+    }
+
+    int incomingCpu(int fd)
+    {
+        int cpu = -1;
+        socklen_t len = sizeof(cpu);
+        if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) != 0)
+        {
+            return -1;
+        }
+        return cpu;
+    }
+}
@@ -0,0 +1,75 @@
+#include "rebalance.h"
+#include "logger.h"
+
+namespace vsockio
+{
+    Rebalancer::Rebalancer(IOThreadPool& pool, const RebalanceOptions& options)
+        : _pool(pool)
+        , _options(options)
+        , _load(pool)
+        , _rebalances(Metrics::instance->counter("workers.rebalanced"))
+    {
+    }
+
+    Rebalancer::~Rebalancer()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_stopLock);
+            _stop = true;
+        }
+        _stopSignal.notify_all();
+        if (_thr.joinable())
+        {
+            _thr.join();
+        }
+    }
+
+    void Rebalancer::start()
+    {
+        _thr = std::thread([this] {
+            std::unique_lock<std::mutex> lock(_stopLock);
+            while (!_stopSignal.wait_for(lock, _options._interval, [this] { return _stop; }))
+            {
+                sample(std::chrono::steady_clock::now());
+            }
+        });
+    }
+
+    int Rebalancer::sample(std::chrono::steady_clock::time_point now)
+    {
+        const size_t active = _pool.activeSize();
+        const auto load = _load.sample(now);
+
+        size_t busiest = 0;
+        size_t idlest = 0;
+        for (size_t i = 1; i < active; i++)
+        {
+            if (load[i] > load[busiest]) busiest = i;
+            if (load[i] < load[idlest]) idlest = i;
+        }
+
+        int asked = 0;
+        for (size_t i = active; i < load.size(); i++)
+        {
+            if (_pool.thread(i).running())
+            {
+                _pool.thread(i).offloadTo(_pool.thread(idlest), load[i], load[idlest], /*all:*/ true);
+                ++asked;
+            }
+        }
+
+        if (busiest != idlest && load[busiest] >= _options._minLoad && load[busiest] - load[idlest] >= _options._minGap)
+        {
+            Logger::instance->Log(Logger::DEBUG, "iothread id=", _pool.thread(busiest).id(), " ", load[busiest] * 100, "% busy, moving a channel to iothread id=", _pool.thread(idlest).id(), " ", load[idlest] * 100, "% busy");
+            // moving half the gap leaves both threads equally busy
+            _pool.thread(busiest).offloadTo(_pool.thread(idlest), load[busiest], (load[busiest] + load[idlest]) / 2, /*all:*/ false);
+            ++asked;
+        }
+
+        if (asked != 0)
+        {
+            _rebalances.add(asked);
+        }
+        return asked;
+    }
+}
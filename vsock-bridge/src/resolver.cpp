@@ -0,0 +1,127 @@
+#include "logger.h"
+#include "resolver.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <netdb.h>
+#include <sys/socket.h>
+
+namespace vsockio
+{
+    constexpr std::chrono::seconds Resolver::DEFAULT_TTL;
+    constexpr std::chrono::seconds Resolver::MAX_RETRY_INTERVAL;
+
+    std::shared_ptr<Resolver::Entry> Resolver::track(const std::string& hostname, uint16_t port, std::chrono::seconds ttl)
+    {
+        auto entry = std::make_shared<Entry>(hostname, port, ttl);
+        entry->_addresses = std::make_shared<const AddressList>();
+
+        // initial lookup happens on the calling thread, so the endpoint is usable as soon as the listener starts
+        resolve(*entry, Clock::now());
+
+        {
+            std::lock_guard<std::mutex> lk(_lock);
+            _entries.push_back(entry);
+        }
+        _wakeup.notify_one();
+        return entry;
+    }
+
+    Resolver::Clock::time_point Resolver::refresh(Clock::time_point now)
+    {
+        std::vector<std::shared_ptr<Entry>> entries;
+        {
+            std::lock_guard<std::mutex> lk(_lock);
+            entries = _entries;
+        }
+
+        auto next = now + DEFAULT_TTL;
+        for (auto& entry : entries)
+        {
+            if (entry->_nextRefresh <= now)
+            {
+                resolve(*entry, now);
+            }
+            next = std::min(next, entry->_nextRefresh);
+        }
+        return next;
+    }
+
+    bool Resolver::resolve(Entry& entry, Clock::time_point now)
+    {
+        AddressList addresses;
+        if (_lookup(entry._hostname, entry._port, addresses) && !addresses.empty())
+        {
+            std::atomic_store(&entry._addresses, std::shared_ptr<const AddressList>(std::make_shared<AddressList>(std::move(addresses))));
+            entry._nextRefresh = now + entry._ttl;
+            return true;
+        }
+
+        Logger::instance->Log(Logger::WARNING, "failed to resolve ", entry._hostname, ", keeping ", entry.addresses()->size(), " previously resolved address(es)");
+        entry._nextRefresh = now + std::min(entry._ttl, std::chrono::seconds(MAX_RETRY_INTERVAL));
+        return false;
+    }
+
+    void Resolver::start()
+    {
+        _thr = std::thread([this] { run(); });
+    }
+
+    void Resolver::stop()
+    {
+        {
+            std::lock_guard<std::mutex> lk(_lock);
+            _stopFlag = true;
+        }
+        _wakeup.notify_one();
+
+        if (_thr.joinable())
+        {
+            _thr.join();
+        }
+    }
+
+    void Resolver::run()
+    {
+        std::unique_lock<std::mutex> lk(_lock);
+        while (!_stopFlag)
+        {
+            lk.unlock();
+            const auto next = refresh(Clock::now());
+            lk.lock();
+            _wakeup.wait_until(lk, next, [this] { return _stopFlag; });
+        }
+    }
+
+    bool Resolver::systemLookup(const std::string& hostname, uint16_t port, AddressList& result)
+    {
+        addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+
+        addrinfo* info = nullptr;
+        const int status = getaddrinfo(hostname.c_str(), nullptr, &hints, &info);
+        if (status != 0)
+        {
+            Logger::instance->Log(Logger::DEBUG, "getaddrinfo(", hostname, ") failed: ", gai_strerror(status));
+            return false;
+        }
+
+        for (const addrinfo* ai = info; ai != nullptr; ai = ai->ai_next)
+        {
+            sockaddr_in addr = *reinterpret_cast<const sockaddr_in*>(ai->ai_addr);
+            addr.sin_port = htons(port);
+            const bool duplicate = std::any_of(result.begin(), result.end(),
+                [&](const sockaddr_in& a) { return a.sin_addr.s_addr == addr.sin_addr.s_addr; });
+            if (!duplicate)
+            {
+                result.push_back(addr);
+            }
+        }
+
+        freeaddrinfo(info);
+        return true;
+    }
+}
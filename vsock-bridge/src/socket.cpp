@@ -1,8 +1,10 @@
 #include "logger.h"
 #include "socket.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cstring>
+#include <utility>
 
 #include <sys/socket.h>
 
@@ -12,7 +14,56 @@ namespace vsockio
         : _fd(fd)
         , _impl(impl)
     {
-        assert(_fd >= 0);
+    }
+
+    bool Socket::attach(PendingSocket&& socket, void* pollHandle)
+    {
+        assert(_fd < 0);
+        if (!socket)
+        {
+            Logger::instance->Log(Logger::WARNING, "[socket] no connection to attach, closing");
+            close();
+            return false;
+        }
+
+        _connected = socket.connected();
+        _fd = socket.release();
+        if (_poller != nullptr)
+        {
+            const bool added = _poller->add(_fd, pollHandle);
+            recordSyscall(Syscall::PollAdd, added ? SyscallOutcome::Ok : SyscallOutcome::Error);
+            if (!added)
+            {
+                Logger::instance->Log(Logger::ERROR, "[socket] failed to add attached connection to poller, closing (fd=", _fd, ")");
+                close();
+                return false;
+            }
+        }
+
+        Logger::instance->Log(Logger::DEBUG, "[socket] attached (fd=", _fd, ")");
+        return true;
+    }
+
+    PendingSocket Socket::detach()
+    {
+        assert(_fd >= 0 && _buffer.consumed());
+        if (_poller != nullptr)
+        {
+            recordSyscall(Syscall::PollRemove, _poller->remove(_fd) ? SyscallOutcome::Ok : SyscallOutcome::Error);
+        }
+
+        Logger::instance->Log(Logger::DEBUG, "[socket] detached (fd=", _fd, ")");
+        PendingSocket socket(std::exchange(_fd, -1));
+        if (_connected)
+        {
+            socket.onConnected();
+        }
+        _connected = false;
+        _canReadMore = false;
+        _canWriteMore = false;
+        _throttled = false;
+        _waitingForBuffer = false;
+        return socket;
     }
 
     bool Socket::readFromInput()
@@ -21,6 +72,8 @@ namespace vsockio
 
         if (_inputClosed) return false;
 
+        _throttled = false;
+        _waitingForBuffer = false;
         const bool canReadMoreData = read(_peer->buffer());
         return canReadMoreData;
     }
@@ -33,16 +86,23 @@ namespace vsockio
 
         bool canSendModeData = false;
         if (!_outputClosed) {
-            if (!_buffer.consumed()) {
+            if (!_buffer.consumed() && !holdBack()) {
                 canSendModeData = send(_buffer);
+                // output the peer's transform held back for lack of room, before the block goes back
+                while (canSendModeData && _peer->hasHeldBackOutput())
+                {
+                    _peer->_transform->drainTo(_buffer);
+                    canSendModeData = send(_buffer);
+                }
                 if (_buffer.consumed())
                 {
-                    _buffer.reset();
+                    // hand the block back while there is nothing in flight, idle channels hold no buffer memory
+                    _buffer.release();
                 }
             }
         }
 
-        if (_peer->closed() && _buffer.consumed())
+        if (_peer->closed() && _buffer.consumed() && !_peer->hasHeldBackOutput())
         {
             Logger::instance->Log(Logger::DEBUG, "[socket] writeToOutput finished draining socket, closing (fd=", _fd, ")");
             close();
@@ -51,19 +111,115 @@ namespace vsockio
         return canSendModeData;
     }
 
+    bool Socket::holdBack()
+    {
+        if (!_coalesce || _peer->_inputClosed || !_buffer.hasRemainingCapacity())
+        {
+            _heldBackSince = {};
+            return false;
+        }
+
+        const auto now = std::chrono::steady_clock::now();
+        if (_heldBackSince == std::chrono::steady_clock::time_point())
+        {
+            _heldBackSince = now;
+        }
+        else if (now - _heldBackSince >= _coalesceDelay)
+        {
+            _heldBackSince = {};
+            return false;
+        }
+        return true;
+    }
+
     bool Socket::read(Buffer& buffer)
     {
+        if (!buffer.allocated())
+        {
+            // Data queued in the other direction may only drain once the far end gets to write
+            // its responses, i.e. once this read goes through. Waiting here could deadlock the
+            // channel with the budget held by its own buffer, so overdraw the budget instead.
+            switch (buffer.acquire(/*overdraw:*/ _buffer.allocated()))
+            {
+            case Buffer::AcquireResult::Acquired:
+                break;
+            case Buffer::AcquireResult::OverBudget:
+                _waitingForBuffer = true;
+                return false;
+            case Buffer::AcquireResult::OutOfMemory:
+                Logger::instance->Log(Logger::ERROR, "[socket] no buffer memory for read, closing (fd=", _fd, ")");
+                close();
+                return false;
+            }
+        }
+
+        if (_transform != nullptr && !_transform->drainTo(buffer)) return false;
+
+        if (_transform != nullptr && _transform->malformed())
+        {
+            Logger::instance->Log(Logger::WARNING, "[socket] malformed input for the stream transform, closing (fd=", _fd, ")");
+            releaseIfEmpty(buffer);
+            close();
+            return false;
+        }
+
         if (!buffer.hasRemainingCapacity()) return false;
 
+        int len = _transform == nullptr ? buffer.remainingCapacity() : static_cast<int>(_transform->maxInput(buffer.remainingCapacity()));
+        Shaper::Clock::time_point now;
+        if (_shaper != nullptr)
+        {
+            now = Shaper::Clock::now();
+            len = _shaper->allowance(len, now);
+            if (len == 0)
+            {
+                _throttled = true;
+                releaseIfEmpty(buffer);
+                return false;
+            }
+        }
+
+        iovec segments[2];
+        int segmentCount = 1;
+        if (_transform == nullptr)
+            segmentCount = buffer.freeSegments(segments, len);
+        else
+            segments[0] = {StreamTransform::inputScratch(), static_cast<size_t>(len)};
+
         PERF_LOG("read");
-        const int bytesRead = _impl.read(_fd, buffer.tail(), buffer.remainingCapacity());
-        int err = 0;
+        const int bytesRead = segmentCount == 1
+            ? _impl.read(_fd, segments[0].iov_base, segments[0].iov_len)
+            : _impl.readv(_fd, segments, segmentCount);
+        int err = bytesRead < 0 ? errno : 0;
+        recordSyscall(Syscall::Read, bytesRead >= 0 ? SyscallOutcome::Ok : outcomeOf(err));
         if (bytesRead > 0)
         {
             // New content read
 
             //Logger::instance->Log(Logger::DEBUG, "[socket] read returns ", bytesRead, " (fd=", _fd, ")");
-            buffer.produce(bytesRead);
+            if (_shaper != nullptr)
+            {
+                _shaper->consume(bytesRead, now);
+            }
+            if (_transform == nullptr) buffer.produce(bytesRead);
+            _bytesRead += bytesRead;
+            if (_observer != nullptr)
+            {
+                for (int i = 0, remaining = bytesRead; i < segmentCount && remaining > 0; i++)
+                {
+                    const int len = std::min(remaining, static_cast<int>(segments[i].iov_len));
+                    _observer->onData(static_cast<const uint8_t*>(segments[i].iov_base), len);
+                    remaining -= len;
+                }
+            }
+            if (_threadSyscalls != nullptr) _threadSyscalls->addBytesRelayed(bytesRead);
+            if (_transform != nullptr && !_transform->process(static_cast<const uint8_t*>(segments[0].iov_base), bytesRead, buffer))
+            {
+                Logger::instance->Log(Logger::WARNING, "[socket] malformed input for the stream transform, closing (fd=", _fd, ")");
+                releaseIfEmpty(buffer);
+                close();
+                return false;
+            }
             return true;
         }
         else if (bytesRead == 0)
@@ -71,13 +227,16 @@ namespace vsockio
             // Source closed
 
             Logger::instance->Log(Logger::DEBUG, "[socket] read returns 0, closing (fd=", _fd, ")");
+            releaseIfEmpty(buffer);
             close();
             return false;
         }
-        else if ((err = errno) == EAGAIN || err == EWOULDBLOCK)
+        else if (err == EAGAIN || err == EWOULDBLOCK)
         {
             // No new data
 
+            releaseIfEmpty(buffer);
+            if (_transform != nullptr) _transform->trim();
             return false;
         }
         else
@@ -85,21 +244,36 @@ namespace vsockio
             // Error
 
             Logger::instance->Log(Logger::WARNING, "[socket] error on read, closing (fd=", _fd, "): ", err, ", ", strerror(err));
+            releaseIfEmpty(buffer);
             close();
             return false;
         }
     }
 
+    void Socket::releaseIfEmpty(Buffer& buffer)
+    {
+        if (buffer.consumed())
+        {
+            buffer.release();
+        }
+    }
+
     bool Socket::send(Buffer& buffer)
     {
         if (buffer.consumed()) return false;
 
         do
         {
+            iovec segments[2];
+            const int segmentCount = buffer.dataSegments(segments);
+
             PERF_LOG("send");
-            const int bytesWritten = _impl.write(_fd, buffer.head(), buffer.remainingDataSize());
+            const int bytesWritten = segmentCount == 1
+                ? _impl.write(_fd, segments[0].iov_base, segments[0].iov_len)
+                : _impl.writev(_fd, segments, segmentCount);
 
-            int err = 0;
+            const int err = bytesWritten < 0 ? errno : 0;
+            recordSyscall(Syscall::Write, bytesWritten >= 0 ? SyscallOutcome::Ok : outcomeOf(err));
             if (bytesWritten > 0)
             {
                 // Some data written to downstream
@@ -108,7 +282,7 @@ namespace vsockio
                 //Logger::instance->Log(Logger::DEBUG, "[socket] write returns ", bytesWritten, " (fd=", _fd, ")");
                 buffer.consume(bytesWritten);
             }
-            else if((err = errno) == EAGAIN || err == EWOULDBLOCK)
+            else if (err == EAGAIN || err == EWOULDBLOCK)
             {
                 // Write blocked
                 return false;
@@ -130,7 +304,8 @@ namespace vsockio
     {
         char c;
         const int bytesWritten = _impl.write(_fd, &c, 0);
-        int err = errno;
+        const int err = errno;
+        recordSyscall(Syscall::ConnectCheck, bytesWritten == 0 ? SyscallOutcome::Ok : outcomeOf(err));
         if (bytesWritten == 0)
         {
             _connected = true;
@@ -155,16 +330,23 @@ namespace vsockio
             _inputClosed = true;
             _outputClosed = true;
 
-            if (_poller)
+            if (_fd < 0)
+            {
+                // detached, there is no connection to close
+            }
+            else if (_poller)
             {
                 // epoll is meant to automatically deregister sockets on close, but apparently some systems
                 // have bugs around this, so do it explicitly
                 Logger::instance->Log(Logger::DEBUG, "[socket] remove from poller (fd=", _fd, ")");
-                _poller->remove(_fd);
+                recordSyscall(Syscall::PollRemove, _poller->remove(_fd) ? SyscallOutcome::Ok : SyscallOutcome::Error);
             }
 
-            Logger::instance->Log(Logger::DEBUG, "[socket] close, fd=", _fd);
-            _impl.close(_fd);
+            if (_fd >= 0)
+            {
+                Logger::instance->Log(Logger::DEBUG, "[socket] close, fd=", _fd);
+                recordSyscall(Syscall::Close, _impl.close(_fd) == 0 ? SyscallOutcome::Ok : SyscallOutcome::Error);
+            }
             if (_peer != nullptr)
             {
                 _peer->onPeerClosed();
@@ -179,6 +361,13 @@ namespace vsockio
             Logger::instance->Log(Logger::DEBUG, "[socket] onPeerClosed draining socket (fd=", _fd, ")");
             closeInput();
 
+            if (_fd < 0)
+            {
+                // detached, nothing more will be sent
+                close();
+                return;
+            }
+
             // force process the output queue
             writeToOutput();
 
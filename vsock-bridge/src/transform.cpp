@@ -0,0 +1,282 @@
+#include "lz4.h"
+#include "transform.h"
+
+#include <cassert>
+#include <cstring>
+
+namespace vsockio
+{
+    namespace
+    {
+        static_assert(StreamTransform::MAX_READ <= lz4::MAX_BLOCK_SIZE, "blocks must fit lz4's limit");
+
+        constexpr size_t MAX_PAYLOAD = lz4::compressBound(StreamTransform::MAX_READ);
+
+        // Compressed frames are built here before being queued, decompressed blocks land here.
+        uint8_t* outputScratch()
+        {
+            thread_local static uint8_t scratch[BlockCompressor::FRAME_HEADER_SIZE + MAX_PAYLOAD];
+            return scratch;
+        }
+    }
+
+    uint8_t* StreamTransform::inputScratch()
+    {
+        thread_local static uint8_t scratch[MAX_READ];
+        return scratch;
+    }
+
+    void StreamTransform::emit(const uint8_t* data, size_t len, Buffer& out)
+    {
+        if (!heldBack())
+        {
+            iovec segments[2];
+            const int segmentCount = out.freeSegments(segments, static_cast<int>(std::min<size_t>(len, out.remainingCapacity())));
+            for (int i = 0; i < segmentCount; i++)
+            {
+                memcpy(segments[i].iov_base, data, segments[i].iov_len);
+                out.produce(static_cast<int>(segments[i].iov_len));
+                data += segments[i].iov_len;
+                len -= segments[i].iov_len;
+            }
+        }
+
+        if (len != 0)
+        {
+            _pending.insert(_pending.end(), data, data + len);
+        }
+    }
+
+    bool StreamTransform::drainTo(Buffer& out)
+    {
+        if (!heldBack())
+        {
+            return true;
+        }
+
+        assert(out.allocated());
+        const size_t len = std::min<size_t>(_pending.size() - _pendingBegin, out.remainingCapacity());
+        iovec segments[2];
+        const int segmentCount = out.freeSegments(segments, static_cast<int>(len));
+        for (int i = 0; i < segmentCount; i++)
+        {
+            memcpy(segments[i].iov_base, _pending.data() + _pendingBegin, segments[i].iov_len);
+            out.produce(static_cast<int>(segments[i].iov_len));
+            _pendingBegin += segments[i].iov_len;
+        }
+
+        if (heldBack())
+        {
+            return false;
+        }
+
+        // the memory is kept while data flows, see trim()
+        _pending.clear();
+        _pendingBegin = 0;
+        return true;
+    }
+
+    void StreamTransform::trim()
+    {
+        if (!heldBack())
+        {
+            std::vector<uint8_t>().swap(_pending);
+            _pendingBegin = 0;
+        }
+    }
+
+    void BlockCompressor::writeHeader(uint8_t* out, FrameType type, size_t length)
+    {
+        out[0] = static_cast<uint8_t>(type);
+        out[1] = static_cast<uint8_t>(length >> 16);
+        out[2] = static_cast<uint8_t>(length >> 8);
+        out[3] = static_cast<uint8_t>(length);
+    }
+
+    bool BlockCompressor::process(const uint8_t* data, size_t len, Buffer& out)
+    {
+        assert(len <= MAX_READ);
+        if (_counters != nullptr) _counters->_compressIn.add(len);
+
+        if (_skip != 0)
+        {
+            --_skip;
+            emitStored(data, len, out);
+            return true;
+        }
+
+        uint8_t* frame = outputScratch();
+        const size_t compressed = lz4::compress(data, len, frame + FRAME_HEADER_SIZE);
+        if (compressed > len - (len >> MIN_SAVING_SHIFT))
+        {
+            // likely already compressed or encrypted, stop trying for a while if it keeps happening
+            if (++_storedInARow >= BACKOFF_AFTER)
+            {
+                _storedInARow = 0;
+                _skip = BACKOFF_BLOCKS;
+            }
+            emitStored(data, len, out);
+            return true;
+        }
+
+        _storedInARow = 0;
+        writeHeader(frame, FrameType::Lz4, compressed);
+        emit(frame, FRAME_HEADER_SIZE + compressed, out);
+        if (_counters != nullptr) _counters->_compressOut.add(FRAME_HEADER_SIZE + compressed);
+        return true;
+    }
+
+    void BlockCompressor::emitStored(const uint8_t* data, size_t len, Buffer& out)
+    {
+        uint8_t header[FRAME_HEADER_SIZE];
+        writeHeader(header, FrameType::Stored, len);
+        emit(header, sizeof(header), out);
+        emit(data, len, out);
+        if (_counters != nullptr) _counters->_compressOut.add(FRAME_HEADER_SIZE + len);
+    }
+
+    size_t BlockDecompressor::frameLength(const uint8_t* header)
+    {
+        const size_t length = size_t(header[1]) << 16 | size_t(header[2]) << 8 | header[3];
+        switch (static_cast<FrameType>(header[0]))
+        {
+        case FrameType::Stored:
+            return length != 0 && length <= MAX_READ ? BlockCompressor::FRAME_HEADER_SIZE + length : 0;
+        case FrameType::Lz4:
+            return length != 0 && length <= MAX_PAYLOAD ? BlockCompressor::FRAME_HEADER_SIZE + length : 0;
+        default:
+            return 0;
+        }
+    }
+
+    bool BlockDecompressor::process(const uint8_t* data, size_t len, Buffer& out)
+    {
+        constexpr size_t HEADER_SIZE = BlockCompressor::FRAME_HEADER_SIZE;
+        if (_counters != nullptr) _counters->_decompressIn.add(len);
+
+        // whole frames are decoded straight from what was read, while their output has room
+        while (_partial.empty() && len >= HEADER_SIZE)
+        {
+            const size_t frameLen = frameLength(data);
+            if (frameLen == 0)
+            {
+                return false;
+            }
+            if (frameLen > len || heldBack() || !out.hasRemainingCapacity())
+            {
+                break;
+            }
+            if (!decodeFrame(data, frameLen, out)) return false;
+            data += frameLen;
+            len -= frameLen;
+        }
+
+        if (len != 0)
+        {
+            _partial.erase(_partial.begin(), _partial.begin() + _partialBegin);
+            _partialBegin = 0;
+            _partial.insert(_partial.end(), data, data + len);
+        }
+        return decodeCollected(out);
+    }
+
+    bool BlockDecompressor::drainTo(Buffer& out)
+    {
+        if (!StreamTransform::drainTo(out))
+        {
+            return false;
+        }
+        if (!decodeCollected(out))
+        {
+            // reported by malformed() before the next read
+            _malformed = true;
+            _partial.clear();
+            _partialBegin = 0;
+        }
+        return !pending();
+    }
+
+    bool BlockDecompressor::decodeCollected(Buffer& out)
+    {
+        constexpr size_t HEADER_SIZE = BlockCompressor::FRAME_HEADER_SIZE;
+        while (_partial.size() - _partialBegin >= HEADER_SIZE)
+        {
+            const uint8_t* frame = _partial.data() + _partialBegin;
+            const size_t frameLen = frameLength(frame);
+            if (frameLen == 0)
+            {
+                return false;
+            }
+            if (frameLen > _partial.size() - _partialBegin || heldBack() || !out.hasRemainingCapacity())
+            {
+                break;
+            }
+            if (!decodeFrame(frame, frameLen, out)) return false;
+            _partialBegin += frameLen;
+        }
+
+        if (_partialBegin == _partial.size())
+        {
+            _partial.clear();
+            _partialBegin = 0;
+        }
+        return true;
+    }
+
+    bool BlockDecompressor::frameCollected() const
+    {
+        const size_t collected = _partial.size() - _partialBegin;
+        if (collected < BlockCompressor::FRAME_HEADER_SIZE)
+        {
+            return false;
+        }
+        const size_t frameLen = frameLength(_partial.data() + _partialBegin);
+        return frameLen != 0 && frameLen <= collected;
+    }
+
+    void BlockDecompressor::trim()
+    {
+        StreamTransform::trim();
+        if (_partial.empty())
+        {
+            std::vector<uint8_t>().swap(_partial);
+        }
+    }
+
+    bool BlockDecompressor::decodeFrame(const uint8_t* frame, size_t len, Buffer& out)
+    {
+        const uint8_t* payload = frame + BlockCompressor::FRAME_HEADER_SIZE;
+        const size_t payloadLen = len - BlockCompressor::FRAME_HEADER_SIZE;
+        if (static_cast<FrameType>(frame[0]) == FrameType::Stored)
+        {
+            emit(payload, payloadLen, out);
+            if (_counters != nullptr) _counters->_decompressOut.add(payloadLen);
+            return true;
+        }
+
+        uint8_t* block = outputScratch();
+        const int decoded = lz4::decompress(payload, payloadLen, block, MAX_READ);
+        if (decoded <= 0)
+        {
+            return false;
+        }
+        emit(block, decoded, out);
+        if (_counters != nullptr) _counters->_decompressOut.add(decoded);
+        return true;
+    }
+
+    std::unique_ptr<StreamTransform> createTransform(CompressSide compressed, bool readsFromListenSide, CompressionCounters* counters)
+    {
+        if (compressed == CompressSide::None)
+        {
+            return nullptr;
+        }
+
+        const bool readsCompressed = (compressed == CompressSide::Listen) == readsFromListenSide;
+        if (readsCompressed)
+        {
+            return std::make_unique<BlockDecompressor>(counters);
+        }
+        return std::make_unique<BlockCompressor>(counters);
+    }
+}
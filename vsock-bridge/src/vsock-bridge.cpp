@@ -10,10 +10,20 @@ static void sigpipe_handler(int unused)
     Logger::instance->Log(Logger::DEBUG, "SIGPIPE received");
 }
 
+static bool isIPv4Literal(const std::string& address)
+{
+    in_addr addr;
+    return inet_pton(AF_INET, address.c_str(), &addr) == 1;
+}
+
 static std::unique_ptr<Endpoint> createEndpoint(EndpointScheme scheme, const std::string& address, uint16_t port)
 {
     if (scheme == EndpointScheme::TCP4)
     {
+        if (!isIPv4Literal(address))
+        {
+            return nullptr;
+        }
         return std::move(std::make_unique<TCP4Endpoint>(address, port));
     }
     else if (scheme == EndpointScheme::VSOCK)
@@ -21,16 +31,60 @@ static std::unique_ptr<Endpoint> createEndpoint(EndpointScheme scheme, const std
         int cid = std::atoi(address.c_str());
         return std::move(std::make_unique<VSockEndpoint>(cid, port));
     }
+    else if (scheme == EndpointScheme::UNIX)
+    {
+        return std::move(std::make_unique<UnixEndpoint>(address));
+    }
     else
     {
         return nullptr;
     }
 }
 
-static std::unique_ptr<Listener> createListener(Dispatcher& dispatcher, EndpointScheme inScheme, const std::string& inAddress, uint16_t inPort, EndpointScheme outScheme, const std::string& outAddress, uint16_t outPort)
+static std::unique_ptr<Endpoint> createConnectEndpoint(Resolver& resolver, EndpointScheme scheme, const std::string& address, uint16_t port, uint32_t resolveTtlSeconds)
+{
+    if (scheme == EndpointScheme::TCP4 && !isIPv4Literal(address))
+    {
+        Logger::instance->Log(Logger::INFO, "resolving ", address, " every ", resolveTtlSeconds, "s");
+        return std::make_unique<TCP4HostnameEndpoint>(resolver.track(address, port, std::chrono::seconds(resolveTtlSeconds)));
+    }
+    return createEndpoint(scheme, address, port);
+}
+
+static ServiceOptions serviceOptions(const ServiceDescription& sd)
+{
+    ServiceOptions options;
+    options._admission._maxChannels = sd._maxChannels;
+    options._admission._resumeChannels = sd._resumeChannels;
+    options._admission._maxAcceptRate = sd._maxAcceptRate;
+    options._admission._maxLoopLagMs = sd._maxLoopLagMs;
+    options._admission._overloadAction = sd._rejectWhenOverloaded ? AdmissionLimits::OverloadAction::Reject : AdmissionLimits::OverloadAction::Pause;
+    options._shaping._serviceRate = sd._rateLimit;
+    options._shaping._connectionRate = sd._connectionRateLimit;
+    options._shaping._burst = sd._rateLimitBurst;
+    options._buffers = BufferLimits::fromBytes(sd._bufferMin, sd._bufferMax);
+    options._maxBufferedBytes = sd._maxBufferedBytes;
+    options._priority = static_cast<Priority>(sd._priority);
+    options._timingSampleRate = sd._timingSampleRate;
+    options._engine = sd._coroutineEngine ? ChannelEngine::Coroutine : ChannelEngine::StateMachine;
+    options._http = sd._type == ServiceType::HTTP_PROXY;
+    options._maxIdleBackends = sd._maxIdleBackends;
+    options._mux = sd._type == ServiceType::MUX_CLIENT ? MuxRole::Client : sd._type == ServiceType::MUX_SERVER ? MuxRole::Server : MuxRole::None;
+    options._muxWindow = sd._muxWindow;
+    options._muxMaxStreams = sd._muxMaxStreams;
+    // only direct channels on the state machine engine have a transform stage
+    if (sd._type == ServiceType::DIRECT_PROXY && !sd._coroutineEngine)
+        options._compress = sd._compress == 1 ? CompressSide::Listen : sd._compress == 2 ? CompressSide::Connect : CompressSide::None;
+    // http services always run on the state machine engine
+    options._coalesceWrites = sd._coalesceWrites && (sd._type == ServiceType::HTTP_PROXY || (sd._type == ServiceType::DIRECT_PROXY && !sd._coroutineEngine));
+    options._coalesceDelay = std::chrono::microseconds(sd._coalesceDelayUs);
+    return options;
+}
+
+static std::unique_ptr<Listener> createListener(Dispatcher& dispatcher, ServiceContext& service, Resolver& resolver, EndpointScheme inScheme, const std::string& inAddress, uint16_t inPort, EndpointScheme outScheme, const std::string& outAddress, uint16_t outPort, uint32_t resolveTtlSeconds)
 {
     auto listenEp { createEndpoint(inScheme, inAddress, inPort) };
-    auto connectEp{ createEndpoint(outScheme, outAddress, outPort) };
+    auto connectEp{ createConnectEndpoint(resolver, outScheme, outAddress, outPort, resolveTtlSeconds) };
 
     if (listenEp == nullptr)
     {
@@ -44,48 +98,167 @@ static std::unique_ptr<Listener> createListener(Dispatcher& dispatcher, Endpoint
     }
     else
     {
-        return std::make_unique<Listener>(std::move(listenEp), std::move(connectEp), dispatcher);
+        return std::make_unique<Listener>(std::move(listenEp), std::move(connectEp), dispatcher, service);
     }
 }
 
-static void startServices(const std::vector<ServiceDescription>& services, int numWorkers)
+static void logStats()
 {
-    Logger::instance->Log(Logger::INFO, "Starting ", numWorkers, " worker threads...");
+    std::ostringstream ss;
+    Metrics::instance->dump(ss);
+    Logger::instance->Log(Logger::INFO, "stats:\n", ss.str());
+}
 
+static void startServices(const std::vector<ServiceDescription>& services, int numWorkers, bool autoWorkers, bool rebalance, const BusyPollOptions& busyPoll, const AdmissionLimits& globalLimits, uint64_t maxBufferedBytes, const std::string& adminSocketPath, int statsIntervalSeconds)
+{
     EpollPollerFactory pollerFactory{VSB_MAX_POLL_EVENTS};
-    IOThreadPool threadPool{(size_t)numWorkers, pollerFactory};
-    Dispatcher dispatcher{threadPool};
+    std::vector<std::unique_ptr<IOThreadPool>> threadPools;
+    std::vector<std::unique_ptr<Dispatcher>> dispatchers;
+    size_t nextThreadId = 0;
+    Dispatcher* sharedDispatcher = nullptr;
+
+    std::unique_ptr<PoolScaler> sharedPoolScaler;
+    std::vector<std::unique_ptr<Rebalancer>> rebalancers;
+
+    const auto startPool = [&](size_t size, const std::vector<int>& cpus, size_t maxSize, bool pinEach) {
+        threadPools.push_back(std::make_unique<IOThreadPool>(size, pollerFactory, busyPoll, nextThreadId, cpus, maxSize, pinEach));
+        dispatchers.push_back(std::make_unique<Dispatcher>(*threadPools.back()));
+        nextThreadId += threadPools.back()->maxSize();
+        if (rebalance && threadPools.back()->maxSize() > 1)
+        {
+            rebalancers.push_back(std::make_unique<Rebalancer>(*threadPools.back()));
+            rebalancers.back()->start();
+        }
+        return dispatchers.back().get();
+    };
+
+    Resolver resolver;
+    AdmissionControl globalAdmission{"global", globalLimits};
+    MemoryBudget globalBuffers{"global", maxBufferedBytes};
+    std::vector<std::unique_ptr<ServiceContext>> serviceContexts;
     std::vector<std::unique_ptr<Listener>> listeners;
-    std::vector<std::thread> listenerThreads;
+    // one thread accepts for every listen socket
+    Acceptor acceptor{pollerFactory};
 
     for (const auto& sd : services)
     {
         Logger::instance->Log(Logger::INFO, "Starting service: ", sd._name);
-        auto listener = createListener(
-                            dispatcher,
-            /*inScheme:*/   sd._listenEndpoint._scheme,
-            /*inAddress:*/  sd._listenEndpoint._address,
-            /*inPort:*/     sd._listenEndpoint._port,
-            /*outScheme:*/  sd._connectEndpoint._scheme,
-            /*outAddress:*/ sd._connectEndpoint._address,
-            /*outPort:*/    sd._connectEndpoint._port
-        );
 
-        if (!listener)
+        // services with their own pool do not share workers with any other service
+        Dispatcher* dispatcher = nullptr;
+        if (sd._workers != 0 || !sd._cpus.empty())
+        {
+            const size_t size = sd._workers != 0 ? sd._workers : sd._cpus.size();
+            // a thread per configured CPU is pinned to it, so channels can be placed by incoming CPU
+            const bool pinEach = sd._workers == 0;
+            Logger::instance->Log(Logger::INFO, "Starting ", size, " dedicated worker threads for ", sd._name, sd._cpus.empty() ? "" : pinEach ? ", one pinned to each configured CPU" : " on configured CPUs");
+            dispatcher = startPool(size, sd._cpus, 0, pinEach);
+        }
+        else
+        {
+            if (sharedDispatcher == nullptr && autoWorkers)
+            {
+                // start with a worker per usable CPU, the scaler retires those that are not needed
+                const size_t cpus = availableCpus();
+                Logger::instance->Log(Logger::INFO, "Starting ", cpus, " worker threads, scaling between 1 and ", cpus, " with load...");
+                sharedDispatcher = startPool(cpus, {}, cpus, false);
+                sharedPoolScaler = std::make_unique<PoolScaler>(*threadPools.back());
+                sharedPoolScaler->start();
+            }
+            else if (sharedDispatcher == nullptr)
+            {
+                Logger::instance->Log(Logger::INFO, "Starting ", numWorkers, " worker threads...");
+                sharedDispatcher = startPool(numWorkers, {}, 0, false);
+            }
+            dispatcher = sharedDispatcher;
+        }
+
+        if (sd._type == ServiceType::HTTP_PROXY && sd._coroutineEngine)
+        {
+            Logger::instance->Log(Logger::WARNING, "engine: coroutine does not pool backends, ", sd._name, " runs on the state machine engine");
+        }
+        if ((sd._type == ServiceType::MUX_CLIENT || sd._type == ServiceType::MUX_SERVER) && sd._coroutineEngine)
+        {
+            Logger::instance->Log(Logger::WARNING, "engine: coroutine does not apply to mux services, ", sd._name, " runs its tunnels on the mux engine");
+        }
+        if ((sd._type == ServiceType::MUX_CLIENT || sd._type == ServiceType::MUX_SERVER) && (sd._rateLimit != 0 || sd._connectionRateLimit != 0 || sd._rateLimitBurst != 0))
+        {
+            Logger::instance->Log(Logger::WARNING, "rate-limit, connection-rate-limit and rate-limit-burst do not apply to mux services, ", sd._name, " relays unshaped");
+        }
+        if (sd._compress != 0 && (sd._type != ServiceType::DIRECT_PROXY || sd._coroutineEngine))
         {
-            Logger::instance->Log(Logger::CRITICAL, "failed to start listener for ", sd._name);
-            exit(1);
+            Logger::instance->Log(Logger::WARNING, "compress only applies to direct services on the state machine engine, ", sd._name, " relays uncompressed");
         }
+        if (sd._coalesceWrites && sd._type != ServiceType::HTTP_PROXY && (sd._type != ServiceType::DIRECT_PROXY || sd._coroutineEngine))
+        {
+            Logger::instance->Log(Logger::WARNING, "write-mode: throughput only applies to direct and http services on the state machine engine, ", sd._name, " writes immediately");
+        }
+        if (sd._coalesceDelayUs != 0 && !sd._coalesceWrites)
+        {
+            Logger::instance->Log(Logger::WARNING, "coalesce-delay-us only applies with write-mode: throughput, ", sd._name, " writes immediately");
+        }
+
+        serviceContexts.push_back(std::make_unique<ServiceContext>(sd._name, serviceOptions(sd), &globalAdmission, &globalBuffers));
+
+        // a port range gets a listener per port, sharing the service's limits and stats
+        for (uint16_t i = 0; i < sd._listenEndpoint._portCount; i++)
+        {
+            auto listener = createListener(
+                                *dispatcher,
+                                *serviceContexts.back(),
+                                resolver,
+                /*inScheme:*/   sd._listenEndpoint._scheme,
+                /*inAddress:*/  sd._listenEndpoint._address,
+                /*inPort:*/     static_cast<uint16_t>(sd._listenEndpoint._port + i),
+                /*outScheme:*/  sd._connectEndpoint._scheme,
+                /*outAddress:*/ sd._connectEndpoint._address,
+                /*outPort:*/    static_cast<uint16_t>(sd._connectEndpoint._port + (sd._connectEndpoint._portCount > 1 ? i : 0)),
+                /*resolveTtl:*/ sd._resolveTtlSeconds
+            );
+
+            if (!listener)
+            {
+                Logger::instance->Log(Logger::CRITICAL, "failed to start listener for ", sd._name);
+                exit(1);
+            }
 
-        listenerThreads.emplace_back(&Listener::run, listener.get());
-        listeners.emplace_back(std::move(listener));
+            acceptor.add(*listener);
+            listeners.emplace_back(std::move(listener));
+        }
     }
 
-    for (auto& t : listenerThreads)
+    Logger::instance->Log(Logger::INFO, "accepting on ", acceptor.listeners(), " listen sockets");
+    std::thread acceptorThread(&Acceptor::run, &acceptor);
+
+    resolver.start();
+
+    std::vector<ServiceContext*> adminServices;
+    for (const auto& sc : serviceContexts)
+    {
+        adminServices.push_back(sc.get());
+    }
+    std::vector<const IOThreadPool*> adminPools;
+    for (const auto& pool : threadPools)
     {
-        if (t.joinable())
-            t.join();
+        adminPools.push_back(pool.get());
     }
+    AdminServer admin{std::move(adminPools), std::move(adminServices)};
+    if (!adminSocketPath.empty() && !admin.start(adminSocketPath))
+    {
+        Logger::instance->Log(Logger::CRITICAL, "failed to start admin socket on ", adminSocketPath);
+        exit(1);
+    }
+
+    if (statsIntervalSeconds > 0)
+    {
+        for (;;)
+        {
+            std::this_thread::sleep_for(std::chrono::seconds(statsIntervalSeconds));
+            logStats();
+        }
+    }
+
+    acceptorThread.join();
 }
 
 static void showHelp()
@@ -95,7 +268,17 @@ static void showHelp()
         << "  -c/--config: path to configuration file\n"
         << "  -d/--daemon: running in daemon mode\n"
         << "  --log-level: log level, 0=debug, 1=info, 2=warning, 3=error, 4=critical (default: info)\n"
-        << "  --workers: number of IO worker threads, positive integer (default: 1)\n"
+        << "  --workers: number of IO worker threads shared by services without their own, positive integer or 'auto' to scale with load up to the usable CPUs (default: 1)\n"
+        << "  --rebalance: move channels from busy IO worker threads to idle ones of the same pool (default: off)\n"
+        << "  --busy-poll: keep polling without blocking for up to n microseconds after activity, trading CPU for latency (default: 0, disabled)\n"
+        << "  --so-busy-poll: set SO_BUSY_POLL to n microseconds on relayed sockets (default: 0, not set)\n"
+        << "  --huge-pages: back IO buffer arenas with huge pages when available (default: off)\n"
+        << "  --max-channels: cap on concurrent channels across all services (default: unlimited)\n"
+        << "  --max-accept-rate: cap on new connections per second across all services (default: unlimited)\n"
+        << "  --max-loop-lag-ms: stop admitting connections while worker loop lag exceeds this (default: disabled)\n"
+        << "  --max-buffered-bytes: cap on memory held in IO buffers across all services, e.g. 256m (default: unlimited)\n"
+        << "  --stats-interval: log stats every n seconds (default: 0, disabled)\n"
+        << "  --admin-socket: serve admin commands on this unix socket path, '@name' for the abstract namespace (default: none)\n"
         << std::flush;
 }
 
@@ -107,6 +290,28 @@ static void quitBadArgs(const char* reason, bool showhelp)
     exit(1);
 }
 
+static uint32_t parseNonNegativeArg(int& i, int argc, char* argv[])
+{
+    const std::string name = argv[i];
+    if (i + 1 == argc)
+    {
+        quitBadArgs(("no number followed by " + name).c_str(), false);
+    }
+    try
+    {
+        const long value = std::stol(std::string(argv[++i]));
+        if (value >= 0 && value <= std::numeric_limits<uint32_t>::max())
+        {
+            return (uint32_t)value;
+        }
+    }
+    catch (const std::exception&)
+    {
+    }
+    quitBadArgs((name + " should be a non-negative integer").c_str(), false);
+    return 0;
+}
+
 int main(int argc, char* argv[])
 {
     __sighandler_t sig = SIG_IGN;
@@ -116,6 +321,13 @@ int main(int argc, char* argv[])
     std::string configPath;
     int minLogLevel = 1;
     int numWorkerThreads = 1;
+    bool autoWorkers = false;
+    bool rebalance = false;
+    int statsIntervalSeconds = 0;
+    BusyPollOptions busyPoll;
+    AdmissionLimits globalLimits;
+    uint64_t maxBufferedBytes = 0;
+    std::string adminSocketPath;
 
     if (argc < 2)
     {
@@ -152,6 +364,13 @@ int main(int argc, char* argv[])
                 quitBadArgs("no number followed by --workers", false);
             }
 
+            if (strcmp(argv[i + 1], "auto") == 0)
+            {
+                autoWorkers = true;
+                ++i;
+                continue;
+            }
+
             numWorkerThreads = std::stoi(std::string(argv[++i]));
 
             if (numWorkerThreads == 0)
@@ -160,6 +379,69 @@ int main(int argc, char* argv[])
             }
         }
 
+        else if (strcmp(argv[i], "--rebalance") == 0)
+        {
+            rebalance = true;
+        }
+
+        else if (strcmp(argv[i], "--busy-poll") == 0)
+        {
+            busyPoll._maxSpinUs = parseNonNegativeArg(i, argc, argv);
+        }
+
+        else if (strcmp(argv[i], "--so-busy-poll") == 0)
+        {
+            busyPoll._socketBusyPollUs = parseNonNegativeArg(i, argc, argv);
+        }
+
+        else if (strcmp(argv[i], "--huge-pages") == 0)
+        {
+            BufferPool::setUseHugePages(true);
+        }
+
+        else if (strcmp(argv[i], "--max-channels") == 0)
+        {
+            globalLimits._maxChannels = parseNonNegativeArg(i, argc, argv);
+        }
+
+        else if (strcmp(argv[i], "--max-accept-rate") == 0)
+        {
+            globalLimits._maxAcceptRate = parseNonNegativeArg(i, argc, argv);
+        }
+
+        else if (strcmp(argv[i], "--max-loop-lag-ms") == 0)
+        {
+            globalLimits._maxLoopLagMs = parseNonNegativeArg(i, argc, argv);
+        }
+
+        else if (strcmp(argv[i], "--max-buffered-bytes") == 0)
+        {
+            if (i + 1 == argc)
+            {
+                quitBadArgs("no size followed by --max-buffered-bytes", false);
+            }
+            const auto size = parseSize(argv[++i]);
+            if (!size)
+            {
+                quitBadArgs("--max-buffered-bytes should be a size like 64m", false);
+            }
+            maxBufferedBytes = *size;
+        }
+
+        else if (strcmp(argv[i], "--admin-socket") == 0)
+        {
+            if (i + 1 == argc)
+            {
+                quitBadArgs("no path followed by --admin-socket", false);
+            }
+            adminSocketPath = std::string(argv[++i]);
+        }
+
+        else if (strcmp(argv[i], "--stats-interval") == 0)
+        {
+            statsIntervalSeconds = parseNonNegativeArg(i, argc, argv);
+        }
+
         else if (strcmp(argv[i], "--log-level") == 0)
         {
             if (i + 1 == argc)
@@ -220,7 +502,7 @@ int main(int argc, char* argv[])
         exit(1);
     }
 
-    startServices(services, numWorkerThreads);
+    startServices(services, numWorkerThreads, autoWorkers, rebalance, busyPoll, globalLimits, maxBufferedBytes, adminSocketPath, statsIntervalSeconds);
 
     return 0;
 }
\ No newline at end of file
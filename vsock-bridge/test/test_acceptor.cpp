@@ -0,0 +1,395 @@
+#include <acceptor.h>
+#include <dispatcher.h>
+#include <endpoint.h>
+#include <epoll_poller.h>
+#include <iothread.h>
+#include <listener.h>
+#include <service.h>
+
+#include "catch.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/poll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace vsockio;
+
+namespace
+{
+    int listenOn(const UnixEndpoint& ep)
+    {
+        const int fd = ep.getSocket();
+        const auto addrAndLen = ep.getAddress();
+        REQUIRE(bind(fd, addrAndLen.first, addrAndLen.second) == 0);
+        REQUIRE(listen(fd, 16) == 0);
+        return fd;
+    }
+
+    int connectTo(const UnixEndpoint& ep)
+    {
+        const int fd = ep.getSocket();
+        const auto addrAndLen = ep.getAddress();
+        REQUIRE(connect(fd, addrAndLen.first, addrAndLen.second) == 0);
+        return fd;
+    }
+
+    // Accepts a relayed connection on a backend, -1 if none arrives in time.
+    int acceptWithin(int listenFd, std::chrono::milliseconds timeout)
+    {
+        pollfd pfd{listenFd, POLLIN, 0};
+        if (::poll(&pfd, 1, static_cast<int>(timeout.count())) != 1) return -1;
+        return accept(listenFd, nullptr, nullptr);
+    }
+
+    std::string readSome(int fd)
+    {
+        char buf[64];
+        pollfd pfd{fd, POLLIN, 0};
+        if (::poll(&pfd, 1, 1000) != 1) return "";
+        const ssize_t n = read(fd, buf, sizeof(buf));
+        return n > 0 ? std::string(buf, n) : "";
+    }
+
+    // Runs body in a child process, as one that lowers its descriptor limit, and returns its exit
+    // code. Fork before any thread is started, the child must not inherit a lock one of them holds.
+    int runInChild(const std::function<int()>& body)
+    {
+        const pid_t child = fork();
+        REQUIRE(child >= 0);
+        if (child == 0)
+        {
+            _exit(body());
+        }
+        int status = 0;
+        REQUIRE(waitpid(child, &status, 0) == child);
+        REQUIRE(WIFEXITED(status));
+        return WEXITSTATUS(status);
+    }
+
+    // Lowers the descriptor limit and uses up every descriptor below it but `spare`.
+    bool exhaustFds(int spare)
+    {
+        const int lowest = open("/dev/null", O_RDONLY);
+        close(lowest);
+        rlimit limit;
+        getrlimit(RLIMIT_NOFILE, &limit);
+        const rlimit lowered{static_cast<rlim_t>(lowest + spare + 2), limit.rlim_max};
+        if (setrlimit(RLIMIT_NOFILE, &lowered) != 0) return false;
+
+        std::vector<int> fds;
+        for (int fd; (fd = open("/dev/null", O_RDONLY)) >= 0;) fds.push_back(fd);
+        for (int i = 0; i < spare && !fds.empty(); i++)
+        {
+            close(fds.back());
+            fds.pop_back();
+        }
+        return errno == EMFILE;
+    }
+}
+
+SCENARIO("Acceptor serving several listen sockets on one thread")
+{
+    EpollPollerFactory pollerFactory(16);
+    IOThreadPool threads(1, pollerFactory);
+    Dispatcher dispatcher(threads);
+    ServiceContext service("acceptor-test", ServiceOptions());
+
+    const UnixEndpoint backendA("@vsock-test-acceptor-backend-a");
+    const UnixEndpoint backendB("@vsock-test-acceptor-backend-b");
+    const UnixEndpoint frontA("@vsock-test-acceptor-a");
+    const UnixEndpoint frontB("@vsock-test-acceptor-b");
+    const int backendFdA = listenOn(backendA);
+    const int backendFdB = listenOn(backendB);
+
+    Listener listenerA(std::make_unique<UnixEndpoint>(frontA), std::make_unique<UnixEndpoint>(backendA), dispatcher, service);
+    Listener listenerB(std::make_unique<UnixEndpoint>(frontB), std::make_unique<UnixEndpoint>(backendB), dispatcher, service);
+    Acceptor acceptor(pollerFactory);
+    acceptor.add(listenerA);
+    acceptor.add(listenerB);
+    REQUIRE(acceptor.listeners() == 2);
+
+    std::atomic<bool> stop{false};
+    std::thread acceptorThread([&] {
+        while (!stop) acceptor.runOnce(std::chrono::milliseconds(10));
+    });
+
+    GIVEN("Clients of both listen sockets")
+    {
+        const int clientA = connectTo(frontA);
+        const int clientB = connectTo(frontB);
+
+        THEN("Each is relayed to the backend of its own listener")
+        {
+            const int relayedA = acceptWithin(backendFdA, std::chrono::milliseconds(1000));
+            const int relayedB = acceptWithin(backendFdB, std::chrono::milliseconds(1000));
+            REQUIRE(relayedA >= 0);
+            REQUIRE(relayedB >= 0);
+
+            REQUIRE(write(clientA, "to-a", 4) == 4);
+            REQUIRE(write(clientB, "to-b", 4) == 4);
+            REQUIRE(readSome(relayedA) == "to-a");
+            REQUIRE(readSome(relayedB) == "to-b");
+            close(relayedA);
+            close(relayedB);
+        }
+
+        close(clientA);
+        close(clientB);
+    }
+
+    GIVEN("A paused service")
+    {
+        service.setState(ServiceContext::State::Paused);
+        const int client = connectTo(frontA);
+
+        THEN("Its client waits in the backlog until the service resumes, without new events")
+        {
+            REQUIRE(acceptWithin(backendFdA, std::chrono::milliseconds(150)) == -1);
+            service.setState(ServiceContext::State::Running);
+            const int relayed = acceptWithin(backendFdA, std::chrono::milliseconds(1000));
+            REQUIRE(relayed >= 0);
+            close(relayed);
+        }
+
+        close(client);
+    }
+
+    stop = true;
+    acceptorThread.join();
+    close(backendFdA);
+    close(backendFdB);
+    for (int attempt = 0; attempt < 200 && service._admission.channels() != 0; attempt++)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+}
+
+SCENARIO("Listener admitting a connection that is not there")
+{
+    EpollPollerFactory pollerFactory(16);
+    IOThreadPool threads(1, pollerFactory);
+    Dispatcher dispatcher(threads);
+    ServiceOptions options;
+    options._admission._maxAcceptRate = 1;
+    ServiceContext service("admission-refund-test", options);
+    const UnixEndpoint backend("@vsock-test-admission-refund-backend");
+    const UnixEndpoint front("@vsock-test-admission-refund");
+    const int backendFd = listenOn(backend);
+    Listener listener(std::make_unique<UnixEndpoint>(front), std::make_unique<UnixEndpoint>(backend), dispatcher, service);
+    listener.start();
+
+    GIVEN("Wakeups with an empty backlog")
+    {
+        const auto now = Listener::Clock::now();
+        for (int i = 0; i < 3; i++)
+        {
+            listener.setReady();
+            listener.serve(now);
+            REQUIRE(!listener.ready());
+        }
+
+        THEN("They use up no accept rate, the next client is still admitted")
+        {
+            const int client = connectTo(front);
+            listener.setReady();
+            listener.serve(now);
+            REQUIRE(service._accepted.value() == 1);
+            const int relayed = acceptWithin(backendFd, std::chrono::milliseconds(1000));
+            REQUIRE(relayed >= 0);
+            close(relayed);
+            close(client);
+        }
+    }
+
+    close(backendFd);
+    for (int attempt = 0; attempt < 200 && service._admission.channels() != 0; attempt++)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+}
+
+SCENARIO("Listener binding a unix socket path")
+{
+    EpollPollerFactory pollerFactory(16);
+    IOThreadPool threads(1, pollerFactory);
+    Dispatcher dispatcher(threads);
+    ServiceContext service("unix-path-test", ServiceOptions());
+    const std::string path = "/tmp/vsock-test-listen-" + std::to_string(getpid()) + ".sock";
+    const auto listenOnPath = [&] {
+        return std::make_unique<Listener>(std::make_unique<UnixEndpoint>(path), std::make_unique<UnixEndpoint>("@vsock-test-unix-path-backend"), dispatcher, service);
+    };
+    struct stat st;
+
+    GIVEN("A file that is not a socket")
+    {
+        close(open(path.c_str(), O_WRONLY | O_CREAT, 0600));
+
+        THEN("It is left in place and binding fails")
+        {
+            REQUIRE_THROWS(listenOnPath());
+            REQUIRE(lstat(path.c_str(), &st) == 0);
+            REQUIRE(S_ISREG(st.st_mode));
+        }
+    }
+
+    GIVEN("A socket another listener accepts on")
+    {
+        auto running = listenOnPath();
+        running->start();
+
+        THEN("It is left to that listener and binding fails")
+        {
+            REQUIRE_THROWS(listenOnPath());
+            const int client = connectTo(UnixEndpoint(path));
+            close(client);
+        }
+    }
+
+    GIVEN("A socket left behind by a previous run")
+    {
+        const int stale = listenOn(UnixEndpoint(path));
+        close(stale);
+
+        THEN("It is replaced")
+        {
+            auto listener = listenOnPath();
+            listener->start();
+            const int client = connectTo(UnixEndpoint(path));
+            close(client);
+        }
+    }
+
+    unlink(path.c_str());
+}
+
+SCENARIO("Listener backing off accept errors")
+{
+    EpollPollerFactory pollerFactory(16);
+    IOThreadPool threads(1, pollerFactory);
+    Dispatcher dispatcher(threads);
+
+    GIVEN("A socket accept fails on")
+    {
+        ServiceContext service("accept-errors-test", ServiceOptions());
+        // never listening, so accept reports EINVAL
+        Listener listener(std::make_unique<UnixEndpoint>("@vsock-test-accept-errors"), std::make_unique<UnixEndpoint>("@vsock-test-accept-errors-backend"), dispatcher, service);
+        const auto now = Listener::Clock::now();
+        listener.setReady();
+        listener.serve(now);
+
+        THEN("The error is counted and accepting is deferred by a growing backoff")
+        {
+            REQUIRE(listener._acceptErrors.value() == 1);
+            REQUIRE(listener._acceptBackoff == Listener::MIN_ACCEPT_BACKOFF);
+            REQUIRE(listener.notBefore() > now);
+
+            // deferred: nothing is tried until notBefore
+            listener.serve(now);
+            REQUIRE(listener._acceptErrors.value() == 1);
+
+            listener.serve(listener.notBefore());
+            REQUIRE(listener._acceptErrors.value() == 2);
+            REQUIRE(listener._acceptBackoff == 2 * Listener::MIN_ACCEPT_BACKOFF);
+        }
+    }
+}
+
+SCENARIO("Listener out of file descriptors")
+{
+    // the descriptor limit is lowered in a child, so the test runner keeps its own; the child
+    // starts its IO thread after the fork
+
+    GIVEN("No descriptor left for accept")
+    {
+        const int failed = runInChild([] {
+            EpollPollerFactory pollerFactory(16);
+            IOThreadPool threads(1, pollerFactory);
+            Dispatcher dispatcher(threads);
+            ServiceContext service("fd-exhausted-test", ServiceOptions());
+            const UnixEndpoint front("@vsock-test-fd-exhausted");
+            Listener listener(std::make_unique<UnixEndpoint>(front), std::make_unique<UnixEndpoint>("@vsock-test-fd-exhausted-backend"), dispatcher, service);
+            listener.start();
+            const int client = front.getSocket();
+            const auto addrAndLen = front.getAddress();
+            if (connect(client, addrAndLen.first, addrAndLen.second) != 0) return 10;
+            if (!exhaustFds(0)) return 11;
+
+            const auto now = Listener::Clock::now();
+            listener.setReady();
+            listener.serve(now);
+
+            // the pending client was accepted with the spare descriptor and closed straight away
+            char byte;
+            pollfd pfd{client, POLLIN, 0};
+            if (::poll(&pfd, 1, 1000) != 1 || read(client, &byte, 1) != 0) return 12;
+            if (listener._fdExhausted.value() != 1) return 13;
+            if (service._rejected.value() != 1) return 14;
+            if (listener._acceptBackoff != Listener::MIN_ACCEPT_BACKOFF) return 15;
+            if (listener.notBefore() <= now) return 16;
+            if (listener._acceptErrors.value() != 0) return 17;
+            return 0;
+        });
+
+        THEN("The pending client is shed through the spare descriptor and accepting backs off")
+        {
+            REQUIRE(failed == 0);
+        }
+    }
+
+    GIVEN("One descriptor left, taken by accept before the backend connect needs another")
+    {
+        const int failed = runInChild([] {
+            EpollPollerFactory pollerFactory(16);
+            IOThreadPool threads(1, pollerFactory);
+            Dispatcher dispatcher(threads);
+            ServiceContext service("fd-exhausted-connect-test", ServiceOptions());
+            const UnixEndpoint front("@vsock-test-fd-exhausted-connect");
+            Listener listener(std::make_unique<UnixEndpoint>(front), std::make_unique<UnixEndpoint>("@vsock-test-fd-exhausted-connect-backend"), dispatcher, service);
+            listener.start();
+            int clients[3];
+            for (int& client : clients)
+            {
+                client = front.getSocket();
+                const auto addrAndLen = front.getAddress();
+                if (connect(client, addrAndLen.first, addrAndLen.second) != 0) return 10;
+            }
+            if (!exhaustFds(1)) return 11;
+
+            auto now = Listener::Clock::now();
+            listener.setReady();
+            for (int i = 0; i < 3; i++)
+            {
+                listener.serve(now);
+                if (listener._fdExhausted.value() != static_cast<uint64_t>(i + 1)) return 20 + i;
+                now = listener.notBefore();
+            }
+
+            // each client was accepted and dropped, and the backoff kept growing across them
+            for (int client : clients)
+            {
+                char byte;
+                pollfd pfd{client, POLLIN, 0};
+                if (::poll(&pfd, 1, 1000) != 1 || read(client, &byte, 1) != 0) return 12;
+            }
+            if (listener._acceptBackoff != 4 * Listener::MIN_ACCEPT_BACKOFF) return 13;
+            if (service._admission.channels() != 0) return 14;
+            return 0;
+        });
+
+        THEN("Accepting backs off further with every failed connect")
+        {
+            REQUIRE(failed == 0);
+        }
+    }
+}
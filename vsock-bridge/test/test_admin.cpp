@@ -0,0 +1,152 @@
+#include <admin.h>
+#include <endpoint.h>
+#include <epoll_poller.h>
+#include <iothread.h>
+#include <logger.h>
+#include <service.h>
+
+#include "catch.hpp"
+#include "test_helpers.h"
+
+#include <chrono>
+#include <thread>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace vsockio;
+
+namespace
+{
+    std::string waitForChannels(AdminServer& admin, const std::string& expected)
+    {
+        std::string reply;
+        for (int attempt = 0; attempt < 200; attempt++)
+        {
+            reply = admin.execute("channels");
+            if (reply.find(expected) != std::string::npos) break;
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+        return reply;
+    }
+}
+
+SCENARIO("AdminServer")
+{
+    EpollPollerFactory pollerFactory(16);
+    IOThreadPool threads(2, pollerFactory);
+    ServiceContext service("admin-test", ServiceOptions());
+    AdminServer admin({&threads}, {&service});
+
+    GIVEN("Service commands")
+    {
+        THEN("Services start out running")
+        {
+            REQUIRE(admin.execute("services") == "service admin-test state=running channels=0\n");
+        }
+
+        THEN("Pause, drain and resume change the service state")
+        {
+            REQUIRE(admin.execute("pause admin-test") == "ok\n");
+            REQUIRE(service.state() == ServiceContext::State::Paused);
+            REQUIRE(admin.execute("drain admin-test") == "ok\n");
+            REQUIRE(service.state() == ServiceContext::State::Draining);
+            REQUIRE(admin.execute("resume admin-test") == "ok\n");
+            REQUIRE(service.state() == ServiceContext::State::Running);
+        }
+
+        THEN("Unknown services and commands are errors")
+        {
+            REQUIRE(admin.execute("pause nope") == "error: no service named nope\n");
+            REQUIRE(admin.execute("pause") == "error: pause needs a service name\n");
+            REQUIRE(admin.execute("reboot") == "error: unknown command reboot\n");
+            REQUIRE(service.state() == ServiceContext::State::Running);
+        }
+    }
+
+    GIVEN("Log level commands")
+    {
+        const int original = Logger::instance->minLevel();
+
+        THEN("The level can be read and changed")
+        {
+            REQUIRE(admin.execute("log-level 3") == "ok\n");
+            REQUIRE(Logger::instance->minLevel() == Logger::ERROR);
+            REQUIRE(admin.execute("log-level") == "log-level 3\n");
+        }
+
+        THEN("Invalid levels are rejected")
+        {
+            REQUIRE(admin.execute("log-level 9").rfind("error:", 0) == 0);
+            REQUIRE(admin.execute("log-level 1x").rfind("error:", 0) == 0);
+            REQUIRE(Logger::instance->minLevel() == original);
+        }
+
+        Logger::instance->setMinLevel(original);
+    }
+
+    GIVEN("A channel relaying between two socket pairs")
+    {
+        int client[2], backend[2];
+        addTestChannel(threads.thread(0), service, client, backend);
+
+        REQUIRE(write(client[0], "hello", 5) == 5);
+
+        THEN("The IO thread lists it with its byte counts")
+        {
+            const std::string reply = waitForChannels(admin, "a_to_b_bytes=5");
+            REQUIRE(reply.find("iothread 0: 1 channels\n") == 0);
+            REQUIRE(reply.find("service=admin-test state=open") != std::string::npos);
+            REQUIRE(reply.find("b_to_a_bytes=0") != std::string::npos);
+            REQUIRE(reply.find("iothread 1: 0 channels\n") != std::string::npos);
+        }
+
+        THEN("Its syscalls are counted for the channel and the IO thread")
+        {
+            const std::string reply = waitForChannels(admin, "a_to_b_bytes=5");
+            REQUIRE(reply.find(" syscalls=") != std::string::npos);
+            REQUIRE(reply.find("bytes_relayed=5 ") != std::string::npos);
+
+            const std::string syscalls = admin.execute("syscalls");
+            REQUIRE(syscalls.find("iothread 0 syscalls=") == 0);
+            REQUIRE(syscalls.find("iothread 1 syscalls=") != std::string::npos);
+            REQUIRE(syscalls.find("service admin-test syscalls=") != std::string::npos);
+            REQUIRE(threads.thread(0).syscalls().count(Syscall::PollAdd, SyscallOutcome::Ok) >= 2);
+        }
+
+        close(client[0]);
+        close(backend[0]);
+        waitForChannels(admin, "iothread 0: 0 channels");
+    }
+
+    GIVEN("A running admin socket")
+    {
+        const std::string path = "@vsockpx-admin-test-" + std::to_string(getpid());
+        REQUIRE(admin.start(path));
+
+        UnixEndpoint endpoint(path);
+        const int fd = endpoint.getSocket();
+        const auto addrAndLen = endpoint.getAddress();
+        REQUIRE(connect(fd, addrAndLen.first, addrAndLen.second) == 0);
+
+        THEN("Commands sent on the socket get replies")
+        {
+            const std::string commands = "pause admin-test\nservices\n";
+            REQUIRE(write(fd, commands.data(), commands.size()) == (ssize_t)commands.size());
+
+            const std::string expected = "ok\nservice admin-test state=paused channels=0\n";
+            std::string reply;
+            char buf[256];
+            while (reply.size() < expected.size())
+            {
+                const ssize_t n = read(fd, buf, sizeof(buf));
+                if (n <= 0) break;
+                reply.append(buf, n);
+            }
+            REQUIRE(reply == expected);
+        }
+
+        close(fd);
+        admin.stop();
+    }
+}
@@ -0,0 +1,176 @@
+#include <admission.h>
+#include <service.h>
+#include <token_bucket.h>
+
+#include "catch.hpp"
+
+using namespace vsockio;
+using namespace std::chrono_literals;
+
+SCENARIO("TokenBucket")
+{
+    const auto now = TokenBucket::Clock::now();
+    TokenBucket bucket(1000, 100);
+
+    GIVEN("A new bucket")
+    {
+        THEN("It is full")
+        {
+            REQUIRE(bucket.available(now) == 100);
+            REQUIRE(bucket.timeUntilAvailable(100, now) == 0ns);
+        }
+    }
+
+    GIVEN("The burst is used up")
+    {
+        REQUIRE(bucket.tryConsume(100, now));
+
+        THEN("No more tokens until refilled")
+        {
+            REQUIRE(bucket.available(now) == 0);
+            REQUIRE(!bucket.tryConsume(1, now));
+            REQUIRE(bucket.timeUntilAvailable(10, now) == 10ms);
+        }
+
+        THEN("Tokens refill at the configured rate")
+        {
+            REQUIRE(bucket.available(now + 50ms) == 50);
+            REQUIRE(bucket.available(now + 1s) == 100);
+        }
+    }
+
+    GIVEN("The bucket goes into debt")
+    {
+        bucket.consume(300, now);
+
+        THEN("Debt has to be paid back before tokens are available")
+        {
+            REQUIRE(bucket.available(now + 150ms) == 0);
+            REQUIRE(bucket.timeUntilAvailable(1, now) > 200ms);
+            REQUIRE(bucket.available(now + 250ms) == 50);
+        }
+    }
+
+    GIVEN("Tokens are refunded")
+    {
+        REQUIRE(bucket.tryConsume(100, now));
+        bucket.refund(40);
+
+        THEN("They can be consumed again")
+        {
+            REQUIRE(bucket.available(now) == 40);
+        }
+    }
+}
+
+SCENARIO("AdmissionControl")
+{
+    const auto now = AdmissionControl::Clock::now();
+
+    GIVEN("No limits")
+    {
+        AdmissionControl admission("test.unlimited", AdmissionLimits());
+        while (admission.channels() > 0) admission.onChannelClosed(); // gauges are shared by name between runs
+        for (int i = 0; i < 1000; i++) admission.onChannelOpened();
+
+        THEN("Everything is admitted")
+        {
+            REQUIRE(admission.check(now, 1s) == AdmissionControl::Decision::Admit);
+        }
+    }
+
+    GIVEN("A channel cap with a low watermark")
+    {
+        AdmissionLimits limits;
+        limits._maxChannels = 10;
+        limits._resumeChannels = 5;
+        AdmissionControl admission("test.channels", limits);
+        while (admission.channels() > 0) admission.onChannelClosed(); // gauges are shared by name between runs
+        for (int i = 0; i < 9; i++) admission.onChannelOpened();
+
+        THEN("Admits below the cap")
+        {
+            REQUIRE(admission.check(now, 0us) == AdmissionControl::Decision::Admit);
+        }
+
+        WHEN("Cap is reached")
+        {
+            admission.onChannelOpened();
+
+            THEN("Sheds until the low watermark is reached")
+            {
+                REQUIRE(admission.check(now, 0us) == AdmissionControl::Decision::Overloaded);
+                REQUIRE(admission.shedding());
+
+                for (int i = 0; i < 4; i++) admission.onChannelClosed();
+                REQUIRE(admission.check(now, 0us) == AdmissionControl::Decision::Overloaded);
+
+                admission.onChannelClosed();
+                REQUIRE(admission.check(now, 0us) == AdmissionControl::Decision::Admit);
+                REQUIRE(!admission.shedding());
+            }
+        }
+    }
+
+    GIVEN("A loop lag threshold")
+    {
+        AdmissionLimits limits;
+        limits._maxLoopLagMs = 10;
+        AdmissionControl admission("test.lag", limits);
+
+        THEN("Sheds while lagging and resumes below half the threshold")
+        {
+            REQUIRE(admission.check(now, 5ms) == AdmissionControl::Decision::Admit);
+            REQUIRE(admission.check(now, 11ms) == AdmissionControl::Decision::Overloaded);
+            REQUIRE(admission.check(now, 7ms) == AdmissionControl::Decision::Overloaded);
+            REQUIRE(admission.check(now, 4ms) == AdmissionControl::Decision::Admit);
+        }
+    }
+
+    GIVEN("An accept rate limit")
+    {
+        AdmissionLimits limits;
+        limits._maxAcceptRate = 2;
+        AdmissionControl admission("test.rate", limits);
+
+        THEN("Admits up to the rate and asks to retry later")
+        {
+            REQUIRE(admission.check(now, 0us) == AdmissionControl::Decision::Admit);
+            REQUIRE(admission.check(now, 0us) == AdmissionControl::Decision::Admit);
+            REQUIRE(admission.check(now, 0us) == AdmissionControl::Decision::RateLimited);
+            REQUIRE(admission.retryDelay(AdmissionControl::Decision::RateLimited, now) == 500ms);
+            REQUIRE(admission.check(now + 500ms, 0us) == AdmissionControl::Decision::Admit);
+        }
+    }
+}
+
+SCENARIO("ServiceContext admission with global limits")
+{
+    const auto now = AdmissionControl::Clock::now();
+    AdmissionLimits globalLimits;
+    globalLimits._maxAcceptRate = 2;
+    AdmissionControl global("test.global", globalLimits);
+
+    ServiceOptions limitedOptions;
+    limitedOptions._admission._maxAcceptRate = 1;
+    ServiceContext limited("admission-limited", limitedOptions, &global);
+    ServiceContext other("admission-other", ServiceOptions(), &global);
+    AdmissionControl* decidedBy = nullptr;
+
+    GIVEN("A service over its own accept rate")
+    {
+        REQUIRE(limited.admit(now, 0us, decidedBy) == AdmissionControl::Decision::Admit);
+        for (int i = 0; i < 5; i++)
+        {
+            REQUIRE(limited.admit(now, 0us, decidedBy) == AdmissionControl::Decision::RateLimited);
+            REQUIRE(decidedBy == &limited._admission);
+        }
+
+        THEN("Its rejected connections leave the global rate to the other services")
+        {
+            REQUIRE(other.admit(now, 0us, decidedBy) == AdmissionControl::Decision::Admit);
+            REQUIRE(other.admit(now, 0us, decidedBy) == AdmissionControl::Decision::RateLimited);
+            REQUIRE(decidedBy == &global);
+        }
+    }
+}
@@ -0,0 +1,165 @@
+#include <autoscale.h>
+#include <epoll_poller.h>
+#include <iothread.h>
+#include <service.h>
+
+#include "catch.hpp"
+#include "test_helpers.h"
+
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <thread>
+
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace vsockio;
+
+namespace
+{
+    struct CgroupDir
+    {
+        CgroupDir()
+        {
+            char path[] = "/tmp/vsock-test-cgroup-XXXXXX";
+            _root = mkdtemp(path);
+        }
+
+        ~CgroupDir()
+        {
+            for (const char* file : {"/cpu.max", "/cpu/cpu.cfs_quota_us", "/cpu/cpu.cfs_period_us"})
+            {
+                unlink((_root + file).c_str());
+            }
+            rmdir((_root + "/cpu").c_str());
+            rmdir(_root.c_str());
+        }
+
+        void write(const std::string& file, const std::string& content)
+        {
+            mkdir((_root + "/cpu").c_str(), 0700);
+            std::ofstream(_root + file) << content;
+        }
+
+        std::string _root;
+    };
+}
+
+SCENARIO("cgroup CPU quota")
+{
+    CgroupDir cgroup;
+
+    GIVEN("No cgroup files")
+    {
+        THEN("There is no quota and every CPU we may run on is available")
+        {
+            REQUIRE(!cgroupCpuQuota(cgroup._root));
+            REQUIRE(availableCpus(cgroup._root) >= 1);
+        }
+    }
+
+    GIVEN("A cgroup v2 quota")
+    {
+        THEN("It is read in CPUs, and caps the available CPUs rounded up")
+        {
+            cgroup.write("/cpu.max", "150000 100000\n");
+            REQUIRE(cgroupCpuQuota(cgroup._root) == 1.5);
+            REQUIRE(availableCpus(cgroup._root) <= 2);
+        }
+
+        THEN("max means none")
+        {
+            cgroup.write("/cpu.max", "max 100000\n");
+            REQUIRE(!cgroupCpuQuota(cgroup._root));
+        }
+    }
+
+    GIVEN("A cgroup v1 quota")
+    {
+        THEN("It is the quota over the period, -1 meaning none")
+        {
+            cgroup.write("/cpu/cpu.cfs_quota_us", "50000\n");
+            cgroup.write("/cpu/cpu.cfs_period_us", "100000\n");
+            REQUIRE(cgroupCpuQuota(cgroup._root) == 0.5);
+            REQUIRE(availableCpus(cgroup._root) == 1);
+
+            cgroup.write("/cpu/cpu.cfs_quota_us", "-1\n");
+            REQUIRE(!cgroupCpuQuota(cgroup._root));
+        }
+    }
+}
+
+SCENARIO("PoolScaler")
+{
+    EpollPollerFactory pollerFactory(16);
+    IOThreadPool pool(3, pollerFactory, {}, 30, {}, 3);
+
+    GIVEN("Idle workers")
+    {
+        ScalingOptions options;
+        options._shrinkAfter = 2;
+        PoolScaler scaler(pool, options);
+        auto now = std::chrono::steady_clock::now();
+        const auto next = [&now] { return now += std::chrono::milliseconds(100); };
+
+        THEN("The pool shrinks one worker at a time after enough idle samples, down to one")
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            REQUIRE(scaler.sample(next()) == 0);
+            REQUIRE(scaler.sample(next()) == -1);
+            REQUIRE(pool.activeSize() == 2);
+            REQUIRE(scaler.sample(next()) == 0);
+            REQUIRE(scaler.sample(next()) == -1);
+            REQUIRE(pool.activeSize() == 1);
+            REQUIRE(scaler.sample(next()) == 0);
+            REQUIRE(scaler.sample(next()) == 0);
+            REQUIRE(Metrics::instance->gauge("workers.active").value() == 1);
+
+            for (int attempt = 0; attempt < 200 && (pool.thread(1).running() || pool.thread(2).running()); attempt++)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            }
+            REQUIRE(!pool.thread(1).running());
+            REQUIRE(!pool.thread(2).running());
+            REQUIRE(pool.thread(0).running());
+        }
+    }
+}
+
+SCENARIO("Shrinking and growing an idle pool while dispatching channels")
+{
+    EpollPollerFactory pollerFactory(16);
+    IOThreadPool pool(2, pollerFactory, {}, 40, {}, 2);
+    ServiceContext service("scale-test", ServiceOptions());
+
+    THEN("Every reactivated worker keeps running and picks up the channels sent to it")
+    {
+        for (int round = 0; round < 1000; round++)
+        {
+            REQUIRE(pool.shrink());
+            // vary how far the retiring worker gets before it is wanted back
+            std::this_thread::sleep_for(std::chrono::microseconds((round % 50) * 20));
+            REQUIRE(pool.grow());
+            REQUIRE(pool.thread(1).running());
+
+            for (int n = 0; n < 2; n++)
+            {
+                int client[2], backend[2];
+                addTestChannel(pool, service, client, backend);
+                close(client[0]);
+                close(backend[0]);
+            }
+        }
+
+        for (int attempt = 0; attempt < 400 && service._admission.channels() != 0; attempt++)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+        REQUIRE(service._admission.channels() == 0);
+        REQUIRE(pool.thread(0).running());
+        REQUIRE(pool.thread(1).running());
+    }
+}
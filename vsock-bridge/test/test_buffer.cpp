@@ -9,11 +9,24 @@ SCENARIO("Buffer")
     Buffer buffer;
 
     GIVEN("Newly created buffer")
+    {
+        THEN("Buffer holds no memory")
+        {
+            REQUIRE(!buffer.allocated());
+            REQUIRE(!buffer.hasRemainingCapacity());
+            REQUIRE(buffer.remainingDataSize() == 0);
+            REQUIRE(buffer.consumed());
+        }
+    }
+
+    REQUIRE(buffer.acquire() == Buffer::AcquireResult::Acquired);
+
+    GIVEN("Newly acquired buffer")
     {
         THEN("Buffer has basic initial state")
         {
             REQUIRE(buffer.hasRemainingCapacity());
-            REQUIRE(buffer.remainingCapacity() == Buffer::BUFFER_SIZE);
+            REQUIRE(buffer.remainingCapacity() == BufferLimits::INITIAL_SIZE);
             REQUIRE(buffer.remainingDataSize() == 0);
             REQUIRE(buffer.consumed());
         }
@@ -25,10 +38,10 @@ SCENARIO("Buffer")
 
         THEN("Buffer tail shifts, but head stays in place")
         {
-            REQUIRE(buffer.head() == buffer._data.data());
-            REQUIRE(buffer.tail() == buffer._data.data() + 5);
+            REQUIRE(buffer.head() == buffer._data);
+            REQUIRE(buffer.tail() == buffer._data + 5);
             REQUIRE(buffer.hasRemainingCapacity());
-            REQUIRE(buffer.remainingCapacity() == Buffer::BUFFER_SIZE - 5);
+            REQUIRE(buffer.remainingCapacity() == BufferLimits::INITIAL_SIZE - 5);
             REQUIRE(buffer.remainingDataSize() == 5);
             REQUIRE(!buffer.consumed());
         }
@@ -39,12 +52,12 @@ SCENARIO("Buffer")
         buffer.produce(5);
         buffer.consume(3);
 
-        THEN("Buffer head and tail shift accordingly")
+        THEN("Buffer head and tail shift accordingly, consumed space is free again")
         {
-            REQUIRE(buffer.head() == buffer._data.data() + 3);
-            REQUIRE(buffer.tail() == buffer._data.data() + 5);
+            REQUIRE(buffer.head() == buffer._data + 3);
+            REQUIRE(buffer.tail() == buffer._data + 5);
             REQUIRE(buffer.hasRemainingCapacity());
-            REQUIRE(buffer.remainingCapacity() == Buffer::BUFFER_SIZE - 5);
+            REQUIRE(buffer.remainingCapacity() == BufferLimits::INITIAL_SIZE - 2);
             REQUIRE(buffer.remainingDataSize() == 2);
             REQUIRE(!buffer.consumed());
         }
@@ -55,12 +68,12 @@ SCENARIO("Buffer")
         buffer.produce(5);
         buffer.consume(5);
 
-        THEN("Buffer head and tail shift accordingly")
+        THEN("Buffer rewinds to the start")
         {
-            REQUIRE(buffer.head() == buffer._data.data() + 5);
-            REQUIRE(buffer.tail() == buffer._data.data() + 5);
+            REQUIRE(buffer.head() == buffer._data);
+            REQUIRE(buffer.tail() == buffer._data);
             REQUIRE(buffer.hasRemainingCapacity());
-            REQUIRE(buffer.remainingCapacity() == Buffer::BUFFER_SIZE - 5);
+            REQUIRE(buffer.remainingCapacity() == BufferLimits::INITIAL_SIZE);
             REQUIRE(buffer.remainingDataSize() == 0);
             REQUIRE(buffer.consumed());
         }
@@ -68,33 +81,373 @@ SCENARIO("Buffer")
 
     GIVEN("Buffer is completely filled with data")
     {
-        buffer.produce(Buffer::BUFFER_SIZE);
+        buffer.produce(BufferLimits::INITIAL_SIZE);
 
         THEN("Buffer does not have remaining capacity")
         {
-            REQUIRE(buffer.head() == buffer._data.data());
-            REQUIRE(buffer.tail() == buffer._data.data() + Buffer::BUFFER_SIZE);
+            REQUIRE(buffer.head() == buffer._data);
+            REQUIRE(buffer.tail() == buffer._data);
             REQUIRE(!buffer.hasRemainingCapacity());
             REQUIRE(buffer.remainingCapacity() == 0);
-            REQUIRE(buffer.remainingDataSize() == Buffer::BUFFER_SIZE);
+            REQUIRE(buffer.remainingDataSize() == BufferLimits::INITIAL_SIZE);
             REQUIRE(!buffer.consumed());
         }
     }
 
+    GIVEN("Data wraps around the end of the block")
+    {
+        constexpr int SIZE = BufferLimits::INITIAL_SIZE;
+        buffer.produce(SIZE - 10);
+        buffer.consume(SIZE - 20);
+        buffer.produce(15);
+
+        THEN("Queued data spans two segments")
+        {
+            iovec segments[2];
+            REQUIRE(buffer.dataSegments(segments) == 2);
+            REQUIRE(segments[0].iov_base == buffer._data + SIZE - 20);
+            REQUIRE(segments[0].iov_len == 20);
+            REQUIRE(segments[1].iov_base == buffer._data);
+            REQUIRE(segments[1].iov_len == 5);
+            REQUIRE(buffer.tail() == buffer._data + 5);
+        }
+
+        THEN("Free space is one segment between tail and head")
+        {
+            iovec segments[2];
+            REQUIRE(buffer.freeSegments(segments, SIZE) == 1);
+            REQUIRE(segments[0].iov_base == buffer._data + 5);
+            REQUIRE(segments[0].iov_len == SIZE - 25);
+        }
+
+        AND_WHEN("The data before the wrap-around is consumed")
+        {
+            buffer.consume(20);
+
+            THEN("Queued data is one segment at the start")
+            {
+                iovec segments[2];
+                REQUIRE(buffer.dataSegments(segments) == 1);
+                REQUIRE(segments[0].iov_base == buffer._data);
+                REQUIRE(segments[0].iov_len == 5);
+            }
+        }
+    }
+
+    GIVEN("Free space wraps around the end of the block")
+    {
+        constexpr int SIZE = BufferLimits::INITIAL_SIZE;
+        buffer.produce(SIZE - 10);
+        buffer.consume(100);
+
+        THEN("Free space spans two segments")
+        {
+            iovec segments[2];
+            REQUIRE(buffer.freeSegments(segments, SIZE) == 2);
+            REQUIRE(segments[0].iov_base == buffer._data + SIZE - 10);
+            REQUIRE(segments[0].iov_len == 10);
+            REQUIRE(segments[1].iov_base == buffer._data);
+            REQUIRE(segments[1].iov_len == 100);
+        }
+
+        THEN("Free space can be limited")
+        {
+            iovec segments[2];
+            REQUIRE(buffer.freeSegments(segments, 8) == 1);
+            REQUIRE(segments[0].iov_len == 8);
+            REQUIRE(buffer.freeSegments(segments, 30) == 2);
+            REQUIRE(segments[1].iov_len == 20);
+        }
+    }
+
     GIVEN("Buffer in non-default state")
     {
         buffer.produce(5);
         buffer.consume(3);
 
-        THEN("Reset restpres the default state")
+        THEN("Reset restores the default state")
         {
             buffer.reset();
-            REQUIRE(buffer.head() == buffer._data.data());
-            REQUIRE(buffer.tail() == buffer._data.data());
+            REQUIRE(buffer.head() == buffer._data);
+            REQUIRE(buffer.tail() == buffer._data);
             REQUIRE(buffer.hasRemainingCapacity());
-            REQUIRE(buffer.remainingCapacity() == Buffer::BUFFER_SIZE);
+            REQUIRE(buffer.remainingCapacity() == BufferLimits::INITIAL_SIZE);
             REQUIRE(buffer.remainingDataSize() == 0);
             REQUIRE(buffer.consumed());
         }
     }
+
+    GIVEN("Buffer is released")
+    {
+        const size_t inUse = BufferPool::local().blocksInUse();
+        buffer.produce(5);
+        buffer.release();
+
+        THEN("The block goes back to the pool")
+        {
+            REQUIRE(!buffer.allocated());
+            REQUIRE(buffer.consumed());
+            REQUIRE(BufferPool::local().blocksInUse() == inUse - 1);
+        }
+    }
+}
+
+SCENARIO("BufferPool")
+{
+    BufferPool pool;
+
+    GIVEN("A new pool")
+    {
+        THEN("No memory is mapped until a block is needed")
+        {
+            REQUIRE(pool.arenaBytes() == 0);
+            REQUIRE(pool.blocksInUse() == 0);
+        }
+    }
+
+    GIVEN("Blocks are acquired")
+    {
+        auto* a = pool.acquire(0);
+        auto* b = pool.acquire(0);
+
+        THEN("They are distinct blocks from one arena")
+        {
+            REQUIRE(a != nullptr);
+            REQUIRE(b != nullptr);
+            REQUIRE(b - a == BufferPool::MIN_BLOCK_SIZE);
+            REQUIRE(pool.blocksInUse() == 2);
+            REQUIRE(pool.arenaBytes() == BufferPool::ARENA_SIZE);
+        }
+
+        AND_WHEN("A block is released")
+        {
+            pool.release(a, 0);
+
+            THEN("It is handed out again next")
+            {
+                REQUIRE(pool.blocksInUse() == 1);
+                REQUIRE(pool.acquire(0) == a);
+            }
+        }
+    }
+
+    GIVEN("Blocks of different classes")
+    {
+        auto* small = pool.acquire(0);
+        auto* large = pool.acquire(BufferPool::NUM_SIZE_CLASSES - 1);
+
+        THEN("Each has its class size")
+        {
+            REQUIRE(large - small == BufferPool::MIN_BLOCK_SIZE);
+            REQUIRE(pool.bytesInUse() == BufferPool::MIN_BLOCK_SIZE + BufferPool::MAX_BLOCK_SIZE);
+        }
+
+        AND_WHEN("Released")
+        {
+            pool.release(small, 0);
+
+            THEN("Blocks are only reused within their class")
+            {
+                REQUIRE(pool.acquire(1) != small);
+                REQUIRE(pool.acquire(0) == small);
+            }
+        }
+    }
+
+    GIVEN("More blocks than fit in an arena")
+    {
+        const size_t perArena = BufferPool::ARENA_SIZE / BufferPool::MIN_BLOCK_SIZE;
+        for (size_t i = 0; i <= perArena; i++)
+        {
+            REQUIRE(pool.acquire(0) != nullptr);
+        }
+
+        THEN("Another arena is mapped")
+        {
+            REQUIRE(pool.arenaBytes() == 2 * BufferPool::ARENA_SIZE);
+            REQUIRE(pool.blocksInUse() == perArena + 1);
+        }
+    }
+}
+
+SCENARIO("Buffer sizing")
+{
+    Buffer buffer;
+
+    const auto cycle = [&](int bytes)
+    {
+        REQUIRE(buffer.acquire() == Buffer::AcquireResult::Acquired);
+        buffer.produce(bytes);
+        buffer.consume(bytes);
+        buffer.release();
+    };
+
+    GIVEN("Default limits")
+    {
+        THEN("Buffers start at the initial size")
+        {
+            REQUIRE(buffer.capacity() == BufferLimits::INITIAL_SIZE);
+        }
+    }
+
+    GIVEN("A buffer that keeps filling up")
+    {
+        for (int i = 0; i < 20; i++)
+        {
+            cycle(buffer.capacity());
+        }
+
+        THEN("It grows to the largest class")
+        {
+            REQUIRE(buffer.capacity() == BufferPool::MAX_BLOCK_SIZE);
+        }
+
+        AND_WHEN("Traffic becomes small")
+        {
+            for (int i = 0; i < 20; i++)
+            {
+                cycle(100);
+            }
+
+            THEN("It shrinks back to the smallest class")
+            {
+                REQUIRE(buffer.capacity() == BufferPool::MIN_BLOCK_SIZE);
+            }
+        }
+    }
+
+    GIVEN("A buffer that is partly used")
+    {
+        cycle(buffer.capacity() / 2);
+
+        THEN("It keeps its size")
+        {
+            REQUIRE(buffer.capacity() == BufferLimits::INITIAL_SIZE);
+        }
+    }
+
+    GIVEN("A buffer acquired without reading anything")
+    {
+        cycle(0);
+
+        THEN("It keeps its size")
+        {
+            REQUIRE(buffer.capacity() == BufferLimits::INITIAL_SIZE);
+        }
+    }
+
+    GIVEN("Limits of 8k to 32k")
+    {
+        buffer.setLimits(BufferLimits::fromBytes(8 * 1024, 32 * 1024));
+
+        THEN("Buffers start at the minimum")
+        {
+            REQUIRE(buffer.capacity() == 8 * 1024);
+        }
+
+        THEN("Buffers do not grow beyond the maximum")
+        {
+            for (int i = 0; i < 20; i++)
+            {
+                cycle(buffer.capacity());
+            }
+            REQUIRE(buffer.capacity() == 32 * 1024);
+        }
+
+        THEN("Buffers do not shrink below the minimum")
+        {
+            for (int i = 0; i < 20; i++)
+            {
+                cycle(1);
+            }
+            REQUIRE(buffer.capacity() == 8 * 1024);
+        }
+    }
+}
+
+
+SCENARIO("Buffer memory budget")
+{
+    MemoryBudget global("test.global", 16 * 1024);
+    MemoryBudget service("test.service", 8 * 1024, &global);
+    Buffer a;
+    Buffer b;
+    Buffer c;
+    a.setBudget(&service);
+    b.setBudget(&service);
+    c.setBudget(&global);
+
+    GIVEN("Buffers within the budget")
+    {
+        REQUIRE(a.acquire() == Buffer::AcquireResult::Acquired);
+        REQUIRE(b.acquire() == Buffer::AcquireResult::Acquired);
+
+        THEN("Usage is accounted at every level")
+        {
+            REQUIRE(service.used() == 2 * BufferLimits::INITIAL_SIZE);
+            REQUIRE(global.used() == 2 * BufferLimits::INITIAL_SIZE);
+        }
+
+        AND_WHEN("They are released")
+        {
+            a.release();
+            b.release();
+
+            THEN("Usage drops but the high-water mark stays")
+            {
+                REQUIRE(service.used() == 0);
+                REQUIRE(global.used() == 0);
+                REQUIRE(service.highWater() >= 2 * BufferLimits::INITIAL_SIZE);
+            }
+        }
+    }
+
+    GIVEN("The service budget is used up")
+    {
+        REQUIRE(a.acquire() == Buffer::AcquireResult::Acquired);
+        REQUIRE(b.acquire() == Buffer::AcquireResult::Acquired);
+        Buffer extra;
+        extra.setBudget(&service);
+
+        THEN("Further buffers of the service wait")
+        {
+            REQUIRE(extra.acquire() == Buffer::AcquireResult::OverBudget);
+            REQUIRE(!extra.allocated());
+            REQUIRE(service.used() == 8 * 1024);
+        }
+
+        THEN("Buffers charged to the global budget only are not affected")
+        {
+            REQUIRE(c.acquire() == Buffer::AcquireResult::Acquired);
+        }
+    }
+
+    GIVEN("Only a smaller block fits")
+    {
+        REQUIRE(a.acquire() == Buffer::AcquireResult::Acquired);
+        REQUIRE(service.tryReserve(2 * 1024));
+        REQUIRE(b.acquire() == Buffer::AcquireResult::Acquired);
+
+        THEN("The smaller block is used")
+        {
+            REQUIRE(b.capacity() == 2 * 1024);
+            REQUIRE(service.used() == 8 * 1024);
+        }
+
+        b.release();
+        service.release(2 * 1024);
+    }
+
+    GIVEN("The global budget is used up by other services")
+    {
+        REQUIRE(global.tryReserve(16 * 1024));
+
+        THEN("The service waits even though its own budget has room")
+        {
+            REQUIRE(a.acquire() == Buffer::AcquireResult::OverBudget);
+            REQUIRE(service.used() == 0);
+        }
+
+        global.release(16 * 1024);
+    }
 }
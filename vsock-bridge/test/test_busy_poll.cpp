@@ -0,0 +1,98 @@
+#include <busy_poll.h>
+
+#include "catch.hpp"
+
+using namespace vsockio;
+using namespace std::chrono_literals;
+
+SCENARIO("AdaptiveSpin")
+{
+    auto now = AdaptiveSpin::Clock::now();
+    AdaptiveSpin spin(100us);
+
+    const auto eventsEvery = [&](AdaptiveSpin::Clock::duration gap, int count)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            now += gap;
+            spin.onActivity(now);
+        }
+    };
+
+    GIVEN("No activity yet")
+    {
+        THEN("It does not spin")
+        {
+            REQUIRE(spin.enabled());
+            REQUIRE(!spin.shouldSpin(now));
+        }
+    }
+
+    GIVEN("A single event")
+    {
+        spin.onActivity(now);
+
+        THEN("It spins for up to the maximum window")
+        {
+            REQUIRE(spin.window() == 100us);
+            REQUIRE(spin.shouldSpin(now + 50us));
+            REQUIRE(!spin.shouldSpin(now + 150us));
+        }
+    }
+
+    GIVEN("Events arrive close together")
+    {
+        eventsEvery(10us, 50);
+
+        THEN("The window shrinks to a quarter of the maximum")
+        {
+            REQUIRE(spin.window() == 25us);
+            REQUIRE(spin.shouldSpin(now + 20us));
+            REQUIRE(!spin.shouldSpin(now + 30us));
+        }
+    }
+
+    GIVEN("Events arrive about as often as the maximum window")
+    {
+        eventsEvery(40us, 50);
+
+        THEN("The window covers twice the typical gap")
+        {
+            REQUIRE(spin.window() > 75us);
+            REQUIRE(spin.window() <= 80us);
+        }
+    }
+
+    GIVEN("Events are further apart than the maximum window")
+    {
+        eventsEvery(1ms, 10);
+
+        THEN("It stops spinning")
+        {
+            REQUIRE(spin.window() == 0us);
+            REQUIRE(!spin.shouldSpin(now));
+        }
+
+        AND_WHEN("Traffic picks up again")
+        {
+            eventsEvery(10us, 20);
+
+            THEN("It spins again")
+            {
+                REQUIRE(spin.shouldSpin(now + 10us));
+            }
+        }
+    }
+
+    GIVEN("A zero maximum window")
+    {
+        AdaptiveSpin disabled(0us);
+        disabled.onActivity(now);
+
+        THEN("It never spins")
+        {
+            REQUIRE(!disabled.enabled());
+            REQUIRE(!disabled.shouldSpin(now));
+        }
+    }
+}
@@ -2,6 +2,9 @@
 
 #include "catch.hpp"
 
+#include <chrono>
+#include <thread>
+
 using namespace vsockio;
 
 static int mockIoAgain(int, void*, int)
@@ -46,9 +49,9 @@ SCENARIO("DirectChannel between sockets establishing connections")
 {
     SocketImpl saImpl(mockIoMustNotCall("read on sa"), mockIoMustNotCall("write on sa"), mockCloseSuccess);
     SocketImpl sbImpl(mockIoMustNotCall("read on sb"), mockIoMustNotCall("write on sa"), mockCloseSuccess);
-    DirectChannel channel(1, std::make_unique<Socket>(41, saImpl), std::make_unique<Socket>(42, sbImpl));
-    auto &sa = *channel._a;
-    auto &sb = *channel._b;
+    DirectChannel channel(1, 41, saImpl, 42, sbImpl);
+    auto &sa = channel._a;
+    auto &sb = channel._b;
 
     GIVEN("Sockets are not connected")
     {
@@ -80,9 +83,9 @@ SCENARIO("DirectChannel between sockets with one connected socket")
 {
     SocketImpl saImpl(mockIoMustNotCall("read on sa"), mockIoMustNotCall("write on sa"), mockCloseSuccess);
     SocketImpl sbImpl(mockIoMustNotCall("read on sb"), mockIoMustNotCall("write on sa"), mockCloseSuccess);
-    DirectChannel channel(1, std::make_unique<Socket>(41, saImpl), std::make_unique<Socket>(42, sbImpl));
-    auto &sa = *channel._a;
-    auto &sb = *channel._b;
+    DirectChannel channel(1, 41, saImpl, 42, sbImpl);
+    auto &sa = channel._a;
+    auto &sb = channel._b;
     sa.onConnected();
 
     GIVEN("Some data available on the connected socket")
@@ -108,9 +111,9 @@ SCENARIO("DirectChannel between connected sockets")
 {
     SocketImpl saImpl(mockIoAgain, mockIoAgain, mockCloseSuccess);
     SocketImpl sbImpl(mockIoAgain, mockIoAgain, mockCloseSuccess);
-    DirectChannel channel(1, std::make_unique<Socket>(41, saImpl), std::make_unique<Socket>(42, sbImpl));
-    auto &sa = *channel._a;
-    auto &sb = *channel._b;
+    DirectChannel channel(1, 41, saImpl, 42, sbImpl);
+    auto &sa = channel._a;
+    auto &sb = channel._b;
     sa.onConnected();
     sb.onConnected();
 
@@ -167,7 +170,7 @@ SCENARIO("DirectChannel between connected sockets")
 
     GIVEN("Write queue is full on one of the sockets")
     {
-        saImpl.read = mockIoSuccessOnce(Buffer::BUFFER_SIZE);
+        saImpl.read = mockIoSuccessOnce(BufferLimits::INITIAL_SIZE);
         channel.performIO();
 
         THEN("No reads are performed afterwards")
@@ -176,18 +179,36 @@ SCENARIO("DirectChannel between connected sockets")
             channel.performIO();
             REQUIRE(!channel.canReadWriteMore());
 
-            AND_THEN("No reads are performed even after some of the data has been written out")
+            AND_THEN("Reads resume into the space freed by a partial write")
             {
                 sbImpl.write = mockIoSuccessOnce(2);
                 channel.performIO();
                 REQUIRE(!channel.canReadWriteMore());
+
+                saImpl.read = mockIoSuccessOnce(2);
+                int segmentCount = 0;
+                size_t bytesOffered = 0;
+                sbImpl.writev = [&] (int, const iovec* iov, int count)
+                    {
+                        segmentCount = count;
+                        bytesOffered = iov[0].iov_len + iov[1].iov_len;
+                        errno = EAGAIN;
+                        return -1;
+                    };
+                channel.performIO();
+
+                AND_THEN("Data wrapping around the end of the buffer is written with one writev")
+                {
+                    REQUIRE(segmentCount == 2);
+                    REQUIRE(bytesOffered == BufferLimits::INITIAL_SIZE);
+                }
             }
         }
 
         THEN("Can resume reads after the buffer has been fully consumed")
         {
             saImpl.read = mockIoMustNotCall("sa read");
-            sbImpl.write = mockIoSuccessOnce(Buffer::BUFFER_SIZE);
+            sbImpl.write = mockIoSuccessOnce(BufferLimits::INITIAL_SIZE);
             channel.performIO();
             REQUIRE(channel.canReadWriteMore());
             REQUIRE(!sa.canReadWriteMore());
@@ -201,11 +222,39 @@ SCENARIO("DirectChannel between connected sockets")
         }
     }
 
+    GIVEN("Data has been relayed and the channel went idle")
+    {
+        const size_t inUse = BufferPool::local().blocksInUse();
+        saImpl.read = mockIoSuccessOnce(100);
+        channel.performIO();
+        REQUIRE(BufferPool::local().blocksInUse() == inUse + 1);
+
+        sbImpl.write = mockIoSuccessOnce(100);
+        channel.performIO();
+
+        THEN("No buffer memory is held")
+        {
+            REQUIRE(BufferPool::local().blocksInUse() == inUse);
+            REQUIRE(!sa.canReadWriteMore());
+        }
+    }
+
+    GIVEN("No data is available")
+    {
+        const size_t inUse = BufferPool::local().blocksInUse();
+        channel.performIO();
+
+        THEN("No buffer memory is held")
+        {
+            REQUIRE(BufferPool::local().blocksInUse() == inUse);
+        }
+    }
+
     GIVEN("Socket writes out full buffer of data")
     {
-        saImpl.read = mockIoSuccessOnce(Buffer::BUFFER_SIZE);
+        saImpl.read = mockIoSuccessOnce(BufferLimits::INITIAL_SIZE);
         channel.performIO();
-        sbImpl.write = mockIoSuccessOnce(Buffer::BUFFER_SIZE);
+        sbImpl.write = mockIoSuccessOnce(BufferLimits::INITIAL_SIZE);
         channel.performIO();
 
         THEN("Socket can write more data")
@@ -224,9 +273,9 @@ SCENARIO("DirectChannel - async connection")
 {
     SocketImpl saImpl(mockIoAgain, mockIoAgain, mockCloseSuccess);
     SocketImpl sbImpl(mockIoAgain, mockIoAgain, mockCloseSuccess);
-    DirectChannel channel(1, std::make_unique<Socket>(41, saImpl), std::make_unique<Socket>(42, sbImpl));
-    auto &sa = *channel._a;
-    auto &sb = *channel._b;
+    DirectChannel channel(1, 41, saImpl, 42, sbImpl);
+    auto &sa = channel._a;
+    auto &sb = channel._b;
     sa.onConnected();
 
     GIVEN("Second socket reports a successful connection")
@@ -245,9 +294,9 @@ SCENARIO("DirectChannel - orderly disconnects")
 {
     SocketImpl saImpl(mockIoAgain, mockIoAgain, mockCloseSuccess);
     SocketImpl sbImpl(mockIoAgain, mockIoAgain, mockCloseSuccess);
-    DirectChannel channel(1, std::make_unique<Socket>(41, saImpl), std::make_unique<Socket>(42, sbImpl));
-    auto &sa = *channel._a;
-    auto &sb = *channel._b;
+    DirectChannel channel(1, 41, saImpl, 42, sbImpl);
+    auto &sa = channel._a;
+    auto &sb = channel._b;
     sa.onConnected();
     sb.onConnected();
 
@@ -324,9 +373,9 @@ SCENARIO("DirectChannel - error conditions")
 {
     SocketImpl saImpl(mockIoAgain, mockIoAgain, mockCloseSuccess);
     SocketImpl sbImpl(mockIoAgain, mockIoAgain, mockCloseSuccess);
-    DirectChannel channel(1, std::make_unique<Socket>(41, saImpl), std::make_unique<Socket>(42, sbImpl));
-    auto &sa = *channel._a;
-    auto &sb = *channel._b;
+    DirectChannel channel(1, 41, saImpl, 42, sbImpl);
+    auto &sa = channel._a;
+    auto &sb = channel._b;
     sa.onConnected();
 
     GIVEN("Second socket reports a connection error")
@@ -418,3 +467,383 @@ SCENARIO("DirectChannel - error conditions")
         }
     }
 }
+
+SCENARIO("DirectChannel - rate limited service")
+{
+    ServiceOptions options;
+    options._shaping._connectionRate = 1000;
+    options._shaping._burst = 100;
+    ServiceContext service("test-shaped", options);
+
+    SocketImpl saImpl(mockIoAgain, mockIoAgain, mockCloseSuccess);
+    SocketImpl sbImpl(mockIoAgain, mockIoAgain, mockCloseSuccess);
+    DirectChannel channel(1, 41, saImpl, 42, sbImpl, &service);
+    auto &sa = channel._a;
+    auto &sb = channel._b;
+    sa.onConnected();
+    sb.onConnected();
+
+    GIVEN("More data available than the burst allows")
+    {
+        int requested = 0;
+        saImpl.read = [&] (int, void*, int sz) { requested = sz; return sz; };
+        channel.performIO();
+
+        THEN("Read is capped to the available tokens, which throttles both directions")
+        {
+            REQUIRE(requested == 100);
+            REQUIRE(channel.throttled());
+
+            AND_THEN("Next read is throttled instead of performed")
+            {
+                saImpl.read = mockIoMustNotCall("sa read");
+                channel.performIO();
+                REQUIRE(channel.throttled());
+                REQUIRE(!sa.canReadWriteMore());
+                REQUIRE(channel.throttleDelay(std::chrono::steady_clock::now()) > std::chrono::milliseconds(0));
+            }
+        }
+    }
+
+    GIVEN("A service without limits")
+    {
+        ServiceContext unshaped("test-unshaped", ServiceOptions());
+        DirectChannel other(2, 43, saImpl, 44, sbImpl, &unshaped);
+
+        THEN("No shaper is created")
+        {
+            REQUIRE(other._shaper == nullptr);
+            REQUIRE(!other.throttled());
+        }
+    }
+}
+
+SCENARIO("DirectChannel - buffer budget")
+{
+    ServiceOptions options;
+    options._maxBufferedBytes = BufferLimits::INITIAL_SIZE;
+    ServiceContext service("test-budget", options);
+
+    SocketImpl saImpl(mockIoAgain, mockIoAgain, mockCloseSuccess);
+    SocketImpl sbImpl(mockIoAgain, mockIoAgain, mockCloseSuccess);
+    DirectChannel channel(1, 41, saImpl, 42, sbImpl, &service);
+    auto &sa = channel._a;
+    auto &sb = channel._b;
+    sa.onConnected();
+    sb.onConnected();
+
+    GIVEN("Other channels hold the whole budget")
+    {
+        REQUIRE(service._bufferBudget.tryReserve(BufferLimits::INITIAL_SIZE));
+        bool reserved = true;
+        saImpl.read = mockIoMustNotCall("sa read");
+        channel.performIO();
+
+        THEN("Reads wait instead of spinning")
+        {
+            REQUIRE(sa.waitingForBuffer());
+            REQUIRE(!sa.canReadWriteMore());
+            REQUIRE(channel.throttled());
+            REQUIRE(channel.throttleDelay(std::chrono::steady_clock::now()) == DirectChannel::BUFFER_RETRY_INTERVAL);
+        }
+
+        AND_WHEN("The budget frees up")
+        {
+            service._bufferBudget.release(BufferLimits::INITIAL_SIZE);
+            reserved = false;
+            saImpl.read = mockIoSuccessOnce(10);
+            channel.performIO();
+
+            THEN("Reads resume")
+            {
+                REQUIRE(!sa.waitingForBuffer());
+                REQUIRE(sa.canReadWriteMore());
+            }
+        }
+
+        if (reserved) service._bufferBudget.release(BufferLimits::INITIAL_SIZE);
+    }
+
+    GIVEN("One direction of the channel holds the whole budget")
+    {
+        saImpl.read = mockIoSuccessOnce(100);
+        channel.performIO();
+        REQUIRE(service._bufferBudget.used() == BufferLimits::INITIAL_SIZE);
+
+        THEN("The other direction still gets a minimal buffer, as draining the first may depend on it")
+        {
+            sbImpl.read = mockIoSuccessOnce(10);
+            channel.performIO();
+            REQUIRE(!sb.waitingForBuffer());
+            REQUIRE(sb.canReadWriteMore());
+            REQUIRE(service._bufferBudget.used() == BufferLimits::INITIAL_SIZE + BufferPool::MIN_BLOCK_SIZE);
+        }
+    }
+}
+
+SCENARIO("DirectChannel - lifecycle timeline")
+{
+    ServiceContext service("test-timeline", ServiceOptions());
+    const uint64_t connectsBefore = service._timings._connect.count();
+    const uint64_t responsesBefore = service._timings._requestToResponse.count();
+    const uint64_t handoffsBefore = service._timings._handoff.count();
+
+    SocketImpl saImpl(mockIoAgain, mockIoAgain, mockCloseSuccess);
+    SocketImpl sbImpl(mockIoAgain, mockIoAgain, mockCloseSuccess);
+
+    GIVEN("A channel that connects, relays a request and its response, and closes")
+    {
+        {
+            DirectChannel channel(1, 41, saImpl, 42, sbImpl, &service);
+            channel._timeline._accepted = ChannelTimeline::Clock::now() - std::chrono::milliseconds(1);
+            channel._a.onConnected();
+            channel.performIO();
+            REQUIRE(!ChannelTimeline::isSet(channel._timeline._connected));
+
+            channel._b.onConnected();
+            saImpl.read = mockIoSuccessOnce(10);
+            channel.performIO();
+            REQUIRE(ChannelTimeline::isSet(channel._timeline._connected));
+            REQUIRE(ChannelTimeline::isSet(channel._timeline._firstRequestByte));
+            REQUIRE(!ChannelTimeline::isSet(channel._timeline._firstResponseByte));
+
+            sbImpl.read = mockIoSuccessOnce(10);
+            channel.performIO();
+            REQUIRE(channel._timeline.complete());
+            REQUIRE(channel._timeline._firstResponseByte >= channel._timeline._firstRequestByte);
+        }
+
+        THEN("Its phases are recorded in the service histograms when it closes")
+        {
+            REQUIRE(service._timings._connect.count() == connectsBefore + 1);
+            REQUIRE(service._timings._connect.max() >= 1000);
+            REQUIRE(service._timings._requestToResponse.count() == responsesBefore + 1);
+
+            AND_THEN("Phases with a missing step are skipped")
+            {
+                REQUIRE(service._timings._handoff.count() == handoffsBefore);
+            }
+        }
+    }
+}
+
+SCENARIO("DirectChannel - syscall accounting")
+{
+    SocketImpl saImpl(mockIoAgain, mockIoAgain, mockCloseSuccess);
+    SocketImpl sbImpl(mockIoAgain, mockIoAgain, mockCloseSuccess);
+    ServiceContext service("syscall-test", ServiceOptions());
+    auto channel = std::make_unique<DirectChannel>(1, 41, saImpl, 42, sbImpl, &service);
+    SyscallCounters thread("syscall-test-thread");
+    channel->setThreadSyscalls(&thread);
+    auto& syscalls = channel->_syscalls;
+    channel->_a.onConnected();
+
+    GIVEN("A connect that is still in progress and then succeeds")
+    {
+        channel->_b.checkConnected();
+        sbImpl.write = mockIoSuccessOnce(0);
+        channel->_b.checkConnected();
+
+        THEN("Both probes are counted by outcome")
+        {
+            REQUIRE(syscalls.count(Syscall::ConnectCheck, SyscallOutcome::Again) == 1);
+            REQUIRE(syscalls.count(Syscall::ConnectCheck, SyscallOutcome::Ok) == 1);
+        }
+    }
+
+    GIVEN("Data relayed in one direction")
+    {
+        channel->_b.onConnected();
+        const uint64_t threadReadsBefore = thread.count(Syscall::Read, SyscallOutcome::Ok);
+        const uint64_t threadBytesBefore = thread.bytesRelayed();
+        saImpl.read = mockIoSuccessOnce(5);
+        sbImpl.write = mockIoSuccessOnce(5);
+        channel->performIO();
+
+        THEN("Reads and writes are counted for the channel and the thread")
+        {
+            REQUIRE(syscalls.count(Syscall::Read, SyscallOutcome::Ok) == 1);
+            REQUIRE(syscalls.count(Syscall::Read, SyscallOutcome::Again) >= 1);
+            REQUIRE(syscalls.count(Syscall::Write, SyscallOutcome::Ok) == 1);
+            REQUIRE(syscalls.total(SyscallOutcome::Error) == 0);
+            REQUIRE(thread.count(Syscall::Read, SyscallOutcome::Ok) == threadReadsBefore + 1);
+            REQUIRE(thread.bytesRelayed() == threadBytesBefore + 5);
+        }
+
+        THEN("The service gets the totals when the channel closes")
+        {
+            const uint64_t serviceWritesBefore = service._syscalls.count(Syscall::Write, SyscallOutcome::Ok);
+            const uint64_t serviceClosesBefore = service._syscalls.count(Syscall::Close, SyscallOutcome::Ok);
+            const uint64_t serviceBytesBefore = service._syscalls.bytesRelayed();
+            saImpl.read = mockIoSuccessOnce(0);
+            channel->performIO();
+            REQUIRE(channel->canBeTerminated());
+            channel.reset();
+
+            REQUIRE(service._syscalls.count(Syscall::Write, SyscallOutcome::Ok) == serviceWritesBefore + 1);
+            REQUIRE(service._syscalls.count(Syscall::Close, SyscallOutcome::Ok) == serviceClosesBefore + 2);
+            REQUIRE(service._syscalls.bytesRelayed() == serviceBytesBefore + 5);
+        }
+    }
+}
+
+SCENARIO("DirectChannel - coalesced writes")
+{
+    const std::chrono::microseconds delay{500};
+    ServiceOptions options;
+    options._coalesceWrites = true;
+    options._coalesceDelay = delay;
+    ServiceContext service("coalesce-test", options);
+
+    SocketImpl saImpl(mockIoAgain, mockIoAgain, mockCloseSuccess);
+    SocketImpl sbImpl(mockIoAgain, mockIoAgain, mockCloseSuccess);
+    std::vector<int> writes;
+    sbImpl.write = [&](int, void*, int len) { writes.push_back(len); return len; };
+
+    DirectChannel channel(1, 41, saImpl, 42, sbImpl, &service);
+    channel._a.onConnected();
+    channel._b.onConnected();
+
+    GIVEN("A few small reads")
+    {
+        int reads = 0;
+        saImpl.read = [&](int, void*, int) { return ++reads <= 2 ? 5 : mockIoAgain(0, nullptr, 0); };
+        const auto before = std::chrono::steady_clock::now();
+        channel.performIO();
+        channel.performIO();
+        channel.performIO();
+
+        THEN("They are held back until the coalescing delay has passed")
+        {
+            REQUIRE(writes.empty());
+            REQUIRE(channel.flushDue() >= before + delay);
+            REQUIRE(channel.flushDue() <= std::chrono::steady_clock::now() + delay);
+        }
+
+        AND_WHEN("The channel is served once it is due")
+        {
+            std::this_thread::sleep_until(channel.flushDue());
+            channel.performIO();
+
+            THEN("What was held back goes out in one write")
+            {
+                REQUIRE(writes == std::vector<int>{10});
+                REQUIRE(channel.flushDue() == std::chrono::steady_clock::time_point());
+                channel.performIO();
+                REQUIRE(writes.size() == 1);
+            }
+        }
+
+        AND_WHEN("The input closes")
+        {
+            saImpl.read = [](int, void*, int) { return 0; };
+            channel.performIO();
+
+            THEN("What was held back is written right away")
+            {
+                REQUIRE(writes == std::vector<int>{10});
+            }
+        }
+    }
+
+    GIVEN("A read filling the buffer")
+    {
+        int reads = 0;
+        saImpl.read = [&](int, void*, int len) { return ++reads == 1 ? len : mockIoAgain(0, nullptr, 0); };
+        channel.performIO();
+
+        THEN("It is written right away")
+        {
+            REQUIRE(writes.size() == 1);
+            REQUIRE(channel.flushDue() == std::chrono::steady_clock::time_point());
+        }
+    }
+
+    GIVEN("A service without a coalescing delay")
+    {
+        ServiceOptions iterationOptions;
+        iterationOptions._coalesceWrites = true;
+        ServiceContext iteration("coalesce-test-iteration", iterationOptions);
+        SocketImpl scImpl(mockIoSuccessOnce(5), mockIoAgain, mockCloseSuccess);
+        SocketImpl sdImpl(mockIoAgain, mockIoAgain, mockCloseSuccess);
+        std::vector<int> heldWrites;
+        sdImpl.write = [&](int, void*, int len) { heldWrites.push_back(len); return len; };
+        DirectChannel other(2, 43, scImpl, 44, sdImpl, &iteration);
+        other._a.onConnected();
+        other._b.onConnected();
+        other.performIO();
+
+        THEN("What it reads is held only until the IO thread flushes at the end of its loop iteration")
+        {
+            REQUIRE(heldWrites.empty());
+            REQUIRE(other.flushDue() != std::chrono::steady_clock::time_point());
+            REQUIRE(other.flushDue() <= std::chrono::steady_clock::now());
+            other.flushHeldBack();
+            REQUIRE(heldWrites == std::vector<int>{5});
+            REQUIRE(other.flushDue() == std::chrono::steady_clock::time_point());
+        }
+    }
+
+    GIVEN("A service in the default latency mode")
+    {
+        ServiceContext latency("coalesce-test-latency", ServiceOptions());
+        SocketImpl scImpl(mockIoSuccessOnce(5), mockIoAgain, mockCloseSuccess);
+        SocketImpl sdImpl(mockIoAgain, mockIoAgain, mockCloseSuccess);
+        int plainWrites = 0;
+        sdImpl.write = [&](int, void*, int len) { ++plainWrites; return len; };
+        DirectChannel other(2, 43, scImpl, 44, sdImpl, &latency);
+        other._a.onConnected();
+        other._b.onConnected();
+        other.performIO();
+
+        THEN("Every read is written right away")
+        {
+            REQUIRE(plainWrites == 1);
+        }
+    }
+}
+
+SCENARIO("SocketImpl - emulated vectored IO")
+{
+    std::vector<int> requested;
+    std::vector<int> results;
+    SocketImpl impl(
+        [&] (int, void*, int sz) { requested.push_back(sz); const int r = results.front(); results.erase(results.begin()); if (r < 0) errno = EAGAIN; return r; },
+        mockIoMustNotCall("write"),
+        mockCloseSuccess);
+
+    uint8_t data[30];
+    const iovec segments[2] = {{data, 10}, {data + 10, 20}};
+
+    GIVEN("The first segment is filled")
+    {
+        results = {10, 5};
+
+        THEN("The second segment is read too")
+        {
+            REQUIRE(impl.readv(1, segments, 2) == 15);
+            REQUIRE(requested == std::vector<int>{10, 20});
+        }
+    }
+
+    GIVEN("A short read on the first segment")
+    {
+        results = {4};
+
+        THEN("It stops there")
+        {
+            REQUIRE(impl.readv(1, segments, 2) == 4);
+            REQUIRE(requested == std::vector<int>{10});
+        }
+    }
+
+    GIVEN("The second segment would block")
+    {
+        results = {10, -1};
+
+        THEN("The bytes read so far are returned")
+        {
+            REQUIRE(impl.readv(1, segments, 2) == 10);
+        }
+    }
+}
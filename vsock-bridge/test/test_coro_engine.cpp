@@ -0,0 +1,114 @@
+#include <coro_engine.h>
+#include <epoll_poller.h>
+#include <iothread.h>
+
+#include "catch.hpp"
+#include "test_helpers.h"
+
+#include <chrono>
+#include <future>
+#include <string>
+#include <thread>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace vsockio;
+
+namespace
+{
+    bool waitForChannels(ServiceContext& service, uint32_t channels)
+    {
+        for (int attempt = 0; attempt < 200 && service._admission.channels() != channels; attempt++)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+        return service._admission.channels() == channels;
+    }
+}
+
+SCENARIO("FramePool")
+{
+    FramePool pool;
+
+    GIVEN("A frame that was freed")
+    {
+        void* frame = pool.allocate(100);
+        REQUIRE(pool.inUseBytes() == 128);
+        pool.deallocate(frame, 100);
+        REQUIRE(pool.inUseBytes() == 0);
+
+        THEN("The next frame of the same size class reuses it")
+        {
+            REQUIRE(pool.allocate(120) == frame);
+            pool.deallocate(frame, 120);
+        }
+    }
+
+    GIVEN("A frame too large to pool")
+    {
+        void* frame = pool.allocate(FramePool::MAX_POOLED_SIZE + 1);
+
+        THEN("It is still counted while in use")
+        {
+            REQUIRE(pool.inUseBytes() >= FramePool::MAX_POOLED_SIZE + 1);
+            pool.deallocate(frame, FramePool::MAX_POOLED_SIZE + 1);
+            REQUIRE(pool.inUseBytes() == 0);
+        }
+    }
+}
+
+SCENARIO("CoroEngine")
+{
+    EpollPollerFactory pollerFactory(16);
+    IOThread thread(0, pollerFactory);
+    ServiceOptions options;
+    options._engine = ChannelEngine::Coroutine;
+    ServiceContext service("coro-test", options);
+
+    int client[2], backend[2];
+    addTestChannel(thread, service, client, backend);
+
+    GIVEN("A channel of a service on the coroutine engine")
+    {
+        THEN("Data is relayed in both directions")
+        {
+            REQUIRE(write(client[0], "request", 7) == 7);
+            REQUIRE(readSome(backend[0], 7) == "request");
+            REQUIRE(write(backend[0], "response", 8) == 8);
+            REQUIRE(readSome(client[0], 8) == "response");
+
+            AND_THEN("It is listed with the IO thread's channels")
+            {
+                std::promise<std::string> listing;
+                thread.post([&] {
+                    std::ostringstream os;
+                    thread.describeChannels(os);
+                    listing.set_value(os.str());
+                });
+                const std::string channels = listing.get_future().get();
+                REQUIRE(channels.find("service=coro-test state=open") != std::string::npos);
+                REQUIRE(channels.find("a_to_b_bytes=7 b_to_a_bytes=8") != std::string::npos);
+                REQUIRE(channels.find("engine=coroutine") != std::string::npos);
+            }
+        }
+
+        THEN("Data still in flight is delivered before the channel closes with the client")
+        {
+            const uint64_t closesBefore = service._syscalls.count(Syscall::Close, SyscallOutcome::Ok);
+            REQUIRE(write(client[0], "bye", 3) == 3);
+            close(client[0]);
+            REQUIRE(readSome(backend[0], 3) == "bye");
+            REQUIRE(waitForChannels(service, 0));
+            REQUIRE(service._syscalls.count(Syscall::Close, SyscallOutcome::Ok) == closesBefore + 2);
+
+            char c;
+            REQUIRE(read(backend[0], &c, 1) == 0);
+            client[0] = -1;
+        }
+    }
+
+    if (client[0] >= 0) close(client[0]);
+    close(backend[0]);
+    REQUIRE(waitForChannels(service, 0));
+}
@@ -0,0 +1,54 @@
+#include <endpoint.h>
+
+#include "catch.hpp"
+
+#include <unistd.h>
+
+using namespace vsockio;
+
+SCENARIO("UnixEndpoint")
+{
+    GIVEN("A filesystem path")
+    {
+        UnixEndpoint ep("/tmp/vsock-test.sock");
+
+        THEN("Address is null terminated and includes the path")
+        {
+            const auto addrAndLen = ep.getAddress();
+            const auto* addr = reinterpret_cast<const sockaddr_un*>(addrAndLen.first);
+            REQUIRE(addr->sun_family == AF_UNIX);
+            REQUIRE(std::string(addr->sun_path) == "/tmp/vsock-test.sock");
+            REQUIRE(addrAndLen.second == offsetof(sockaddr_un, sun_path) + 21);
+            REQUIRE(!ep.isAbstract());
+            REQUIRE(ep.describe() == "unix:///tmp/vsock-test.sock");
+        }
+    }
+
+    GIVEN("An abstract socket name")
+    {
+        UnixEndpoint ep("@vsock-test");
+
+        THEN("Address starts with a null byte and is not null terminated")
+        {
+            const auto addrAndLen = ep.getAddress();
+            const auto* addr = reinterpret_cast<const sockaddr_un*>(addrAndLen.first);
+            REQUIRE(addr->sun_path[0] == '\0');
+            REQUIRE(std::string(addr->sun_path + 1, 10) == "vsock-test");
+            REQUIRE(addrAndLen.second == offsetof(sockaddr_un, sun_path) + 11);
+            REQUIRE(ep.isAbstract());
+        }
+
+        THEN("Connections can be made through it")
+        {
+            const int listenFd = ep.getSocket();
+            REQUIRE(bind(listenFd, ep.getAddress().first, ep.getAddress().second) == 0);
+            REQUIRE(listen(listenFd, 1) == 0);
+
+            const int clientFd = ep.getSocket();
+            REQUIRE(connect(clientFd, ep.getAddress().first, ep.getAddress().second) == 0);
+
+            close(clientFd);
+            close(listenFd);
+        }
+    }
+}
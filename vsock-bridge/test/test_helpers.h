@@ -0,0 +1,71 @@
+#pragma once
+
+#include <iothread.h>
+#include <service.h>
+
+#include "catch.hpp"
+
+#include <chrono>
+#include <string>
+#include <thread>
+#include <type_traits>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace vsockio
+{
+    // Reads until expected bytes arrived, the peer closed or about two seconds passed; the socket
+    // is non-blocking.
+    inline std::string readSome(int fd, size_t expected)
+    {
+        std::string data;
+        char buf[16 * 1024];
+        for (int attempt = 0; attempt < 400 && data.size() < expected; attempt++)
+        {
+            ssize_t n = 0;
+            while (data.size() < expected && (n = read(fd, buf, sizeof(buf))) > 0)
+            {
+                data.append(buf, n);
+            }
+            if (n == 0)
+            {
+                break;
+            }
+            if (data.size() < expected)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            }
+        }
+        return data;
+    }
+
+    // Hands connected sockets a and b to thread (an IOThread or an IOThreadPool) as a channel of
+    // service. Without b (-1) the channel gets its backend the way the service does, e.g. over
+    // a mux tunnel or from the backend pool.
+    template <typename Thread>
+    void addTestChannel(Thread& thread, ServiceContext& service, int a, int b, int incomingCpu = -1)
+    {
+        PendingSocket pa(a), pb(b);
+        pa.onConnected();
+        if (pb) pb.onConnected();
+        service.onChannelOpened();
+        if constexpr (std::is_same_v<Thread, IOThreadPool>)
+            thread.addChannel(std::move(pa), std::move(pb), &service, {}, incomingCpu);
+        else
+            thread.addChannel(std::move(pa), std::move(pb), &service);
+    }
+
+    // A channel from client[1] to backend[1]; the test plays both ends over client[0] and
+    // backend[0]. Without backend, only the client side is made.
+    template <typename Thread>
+    void addTestChannel(Thread& thread, ServiceContext& service, int client[2], int backend[2], int incomingCpu = -1)
+    {
+        REQUIRE(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, client) == 0);
+        if (backend != nullptr)
+        {
+            REQUIRE(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, backend) == 0);
+        }
+        addTestChannel(thread, service, client[1], backend != nullptr ? backend[1] : -1, incomingCpu);
+    }
+}
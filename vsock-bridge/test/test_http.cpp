@@ -0,0 +1,297 @@
+#include <epoll_poller.h>
+#include <http.h>
+#include <iothread.h>
+
+#include "catch.hpp"
+#include "test_helpers.h"
+
+#include <chrono>
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace vsockio;
+
+namespace
+{
+    void feed(HttpFramer& framer, const std::string& data)
+    {
+        framer.feed(reinterpret_cast<const uint8_t*>(data.data()), data.size());
+    }
+
+    // Far ends of the connections made by a pool, which connects from the IO thread.
+    class Backends
+    {
+    public:
+        void add(int fd)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _fds.push_back(fd);
+        }
+
+        size_t size() const
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _fds.size();
+        }
+
+        bool wait(size_t count) const
+        {
+            for (int attempt = 0; attempt < 200 && size() < count; attempt++)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            }
+            return size() == count;
+        }
+
+        int operator[](size_t i) const
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _fds[i];
+        }
+
+        void close(size_t i)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            ::close(_fds[i]);
+            _fds[i] = -1;
+        }
+
+        void closeAll()
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            for (int fd : _fds)
+            {
+                if (fd >= 0) ::close(fd);
+            }
+            _fds.clear();
+        }
+
+    private:
+        mutable std::mutex _mutex;
+        std::vector<int> _fds;
+    };
+
+    bool waitForIdleBackends(const BackendPool& pool, size_t idle)
+    {
+        for (int attempt = 0; attempt < 200 && pool.idle() != idle; attempt++)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+        return pool.idle() == idle;
+    }
+}
+
+SCENARIO("HttpFramer")
+{
+    std::deque<bool> headRequests;
+    HttpFramer requests(HttpFramer::Kind::Request, headRequests);
+    HttpFramer responses(HttpFramer::Kind::Response, headRequests);
+
+    GIVEN("A request with a Content-Length body")
+    {
+        feed(requests, "POST /a HTTP/1.1\r\nHost: x\r\nContent-Length: 5\r\n\r\nhel");
+
+        THEN("It is complete once the whole body went by")
+        {
+            REQUIRE(requests.messages() == 0);
+            REQUIRE(!requests.atBoundary());
+            feed(requests, "lo");
+            REQUIRE(requests.messages() == 1);
+            REQUIRE(requests.atBoundary());
+            REQUIRE(requests.keepAlive());
+        }
+    }
+
+    GIVEN("A chunked response split at awkward places")
+    {
+        feed(requests, "GET / HTTP/1.1\r\n\r\n");
+        const std::string response = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n4\r\nwiki\r\n5;ext=1\r\npedia\r\n0\r\nTrailer: x\r\n\r\n";
+
+        THEN("It is complete after the trailers, one byte at a time")
+        {
+            for (size_t i = 0; i + 1 < response.size(); i++)
+            {
+                feed(responses, response.substr(i, 1));
+                REQUIRE(responses.messages() == 0);
+            }
+            feed(responses, response.substr(response.size() - 1));
+            REQUIRE(responses.messages() == 1);
+            REQUIRE(responses.atBoundary());
+        }
+    }
+
+    GIVEN("Pipelined requests in one read")
+    {
+        feed(requests, "GET /1 HTTP/1.1\r\n\r\nHEAD /2 HTTP/1.1\r\n\r\nGET /3 HTTP/1.1\r\n\r\n");
+
+        THEN("Each is counted, and the response to HEAD has no body despite its Content-Length")
+        {
+            REQUIRE(requests.messages() == 3);
+            feed(responses, "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok");
+            feed(responses, "HTTP/1.1 200 OK\r\nContent-Length: 100\r\n\r\n");
+            feed(responses, "HTTP/1.1 204 No Content\r\n\r\n");
+            REQUIRE(responses.messages() == 3);
+            REQUIRE(responses.atBoundary());
+        }
+    }
+
+    GIVEN("An interim response before the final one")
+    {
+        feed(requests, "POST / HTTP/1.1\r\nExpect: 100-continue\r\nContent-Length: 0\r\n\r\n");
+        feed(responses, "HTTP/1.1 100 Continue\r\n\r\n");
+
+        THEN("Only the final response is counted")
+        {
+            REQUIRE(responses.messages() == 0);
+            feed(responses, "HTTP/1.1 304 Not Modified\r\n\r\n");
+            REQUIRE(responses.messages() == 1);
+        }
+    }
+
+    GIVEN("Responses that do not keep the connection")
+    {
+        feed(requests, "GET / HTTP/1.1\r\n\r\nGET / HTTP/1.0\r\n\r\n");
+
+        THEN("Connection: close and plain HTTP/1.0 are not keep-alive")
+        {
+            feed(responses, "HTTP/1.1 200 OK\r\nConnection: Close\r\nContent-Length: 0\r\n\r\n");
+            REQUIRE(!responses.keepAlive());
+            feed(responses, "HTTP/1.0 200 OK\r\nContent-Length: 0\r\n\r\n");
+            REQUIRE(!responses.keepAlive());
+        }
+    }
+
+    GIVEN("Traffic the framer cannot follow")
+    {
+        THEN("Upgrades, bodies delimited by close and garbage make it opaque")
+        {
+            feed(requests, "GET /ws HTTP/1.1\r\nUpgrade: websocket\r\n\r\n");
+            feed(responses, "HTTP/1.1 101 Switching Protocols\r\n\r\n");
+            REQUIRE(responses.opaque());
+
+            HttpFramer untilClose(HttpFramer::Kind::Response, headRequests);
+            feed(untilClose, "HTTP/1.1 200 OK\r\n\r\n");
+            REQUIRE(untilClose.opaque());
+
+            HttpFramer garbage(HttpFramer::Kind::Request, headRequests);
+            feed(garbage, "\x16\x03\x01 hello\n");
+            REQUIRE(garbage.opaque());
+        }
+    }
+}
+
+SCENARIO("BackendPool")
+{
+    std::unique_ptr<BackendPool> pool;
+    std::future<void> release;
+    bool releasedWhileConnecting = false;
+    pool = std::make_unique<BackendPool>("test.backend-pool", 4, [&] {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) != 0) return PendingSocket();
+        // another IO thread hands a connection back while this one is connecting
+        release = std::async(std::launch::async, [&pool, fd = fds[0]] { pool->release(PendingSocket(fd)); });
+        releasedWhileConnecting = release.wait_for(std::chrono::seconds(1)) == std::future_status::ready;
+        PendingSocket backend(fds[1]);
+        backend.onConnected();
+        return backend;
+    });
+
+    GIVEN("A connection made with the pool empty")
+    {
+        PendingSocket backend = pool->acquire();
+        release.wait();
+
+        THEN("Other threads do not wait for the connect")
+        {
+            REQUIRE(backend);
+            REQUIRE(releasedWhileConnecting);
+            REQUIRE(pool->idle() == 1);
+        }
+    }
+}
+
+SCENARIO("HTTP service - backend connection pooling")
+{
+    EpollPollerFactory pollerFactory(16);
+    IOThread thread(0, pollerFactory);
+    ServiceOptions options;
+    options._http = true;
+    options._maxIdleBackends = 4;
+    ServiceContext service("http-test", options);
+
+    // the test plays the backend on the far ends of the connections the pool makes
+    Backends backends;
+    service._backends = std::make_unique<BackendPool>("service.http-test", options._maxIdleBackends, [&backends] {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) != 0) return PendingSocket();
+        backends.add(fds[0]);
+        PendingSocket backend(fds[1]);
+        backend.onConnected();
+        return backend;
+    });
+
+    const auto openClient = [&] {
+        int client[2];
+        addTestChannel(thread, service, client, nullptr);
+        return client[0];
+    };
+
+    const std::string request = "GET / HTTP/1.1\r\nHost: x\r\n\r\n";
+    const std::string response = "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok";
+
+    GIVEN("A client that completed a keep-alive exchange")
+    {
+        const int client = openClient();
+        REQUIRE(write(client, request.data(), request.size()) == static_cast<ssize_t>(request.size()));
+        REQUIRE(backends.wait(1));
+        REQUIRE(readSome(backends[0], request.size()) == request);
+        REQUIRE(write(backends[0], response.data(), response.size()) == static_cast<ssize_t>(response.size()));
+        REQUIRE(readSome(client, response.size()) == response);
+
+        THEN("The backend connection goes back to the pool")
+        {
+            REQUIRE(waitForIdleBackends(*service._backends, 1));
+
+            AND_THEN("The next client reuses it instead of connecting")
+            {
+                const int other = openClient();
+                REQUIRE(write(other, request.data(), request.size()) == static_cast<ssize_t>(request.size()));
+                REQUIRE(readSome(backends[0], request.size()) == request);
+                REQUIRE(backends.size() == 1);
+                REQUIRE(service._backends->idle() == 0);
+
+                REQUIRE(write(backends[0], response.data(), response.size()) == static_cast<ssize_t>(response.size()));
+                REQUIRE(readSome(other, response.size()) == response);
+                REQUIRE(waitForIdleBackends(*service._backends, 1));
+                close(other);
+            }
+        }
+
+        THEN("A backend closed while idle is not handed out again")
+        {
+            REQUIRE(waitForIdleBackends(*service._backends, 1));
+            backends.close(0);
+
+            const int other = openClient();
+            REQUIRE(write(other, request.data(), request.size()) == static_cast<ssize_t>(request.size()));
+            REQUIRE(backends.wait(2));
+            REQUIRE(readSome(backends[1], request.size()) == request);
+            close(other);
+        }
+
+        close(client);
+    }
+
+    for (int attempt = 0; attempt < 200 && service._admission.channels() != 0; attempt++)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    REQUIRE(service._admission.channels() == 0);
+    backends.closeAll();
+}
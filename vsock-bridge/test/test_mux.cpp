@@ -0,0 +1,309 @@
+#include <epoll_poller.h>
+#include <iothread.h>
+#include <mux.h>
+
+#include "catch.hpp"
+#include "test_helpers.h"
+
+#include <cerrno>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace vsockio;
+
+namespace
+{
+    bool waitForEof(int fd)
+    {
+        char c;
+        for (int attempt = 0; attempt < 200; attempt++)
+        {
+            const ssize_t n = read(fd, &c, 1);
+            if (n == 0) return true;
+            if (n < 0 && errno != EAGAIN) return false;
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+        return false;
+    }
+
+    // Far ends of the backend connections the mux server makes from its IO thread.
+    class Backends
+    {
+    public:
+        void add(int fd)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _fds.push_back(fd);
+        }
+
+        size_t size() const
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _fds.size();
+        }
+
+        bool wait(size_t count) const
+        {
+            for (int attempt = 0; attempt < 200 && size() < count; attempt++)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            }
+            return size() == count;
+        }
+
+        int operator[](size_t i) const
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _fds[i];
+        }
+
+        void closeAll()
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            for (int fd : _fds) close(fd);
+            _fds.clear();
+        }
+
+    private:
+        mutable std::mutex _mutex;
+        std::vector<int> _fds;
+    };
+
+    // Waits for the mux client to open a tunnel to the loopback listener, -1 if none came.
+    int acceptTunnel(int listenFd)
+    {
+        for (int attempt = 0; attempt < 200; attempt++)
+        {
+            const int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK);
+            if (fd >= 0) return fd;
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+        return -1;
+    }
+
+    bool waitForChannels(const ServiceContext& service, uint32_t channels)
+    {
+        for (int attempt = 0; attempt < 200 && service._admission.channels() != channels; attempt++)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+        return service._admission.channels() == channels;
+    }
+}
+
+SCENARIO("MuxFrameHeader and MuxHello")
+{
+    GIVEN("A frame header")
+    {
+        const MuxFrameHeader header{0x01020304, MuxFrameType::Window, 0xabcd};
+        uint8_t encoded[MuxFrameHeader::SIZE];
+        header.encode(encoded);
+
+        THEN("It is in network byte order and decodes to the same fields")
+        {
+            REQUIRE(encoded[0] == 0x01);
+            REQUIRE(encoded[3] == 0x04);
+            REQUIRE(encoded[6] == 0xab);
+            const auto decoded = MuxFrameHeader::decode(encoded);
+            REQUIRE(decoded._stream == header._stream);
+            REQUIRE(decoded._type == header._type);
+            REQUIRE(decoded._length == header._length);
+        }
+    }
+
+    GIVEN("A hello")
+    {
+        MuxHello hello;
+        hello._window = 65536;
+        hello._maxPayload = 4096;
+        uint8_t encoded[MuxHello::SIZE];
+        hello.encode(encoded);
+
+        THEN("It round trips, and anything else is not taken for one")
+        {
+            const auto decoded = MuxHello::decode(encoded, sizeof(encoded));
+            REQUIRE(decoded);
+            REQUIRE(decoded->_version == MuxHello::VERSION);
+            REQUIRE(decoded->_window == 65536);
+            REQUIRE(decoded->_maxPayload == 4096);
+
+            REQUIRE(!MuxHello::decode(encoded, sizeof(encoded) - 1));
+            encoded[0] = 'X';
+            REQUIRE(!MuxHello::decode(encoded, sizeof(encoded)));
+        }
+    }
+}
+
+SCENARIO("Mux services - streams over a tunnel on TCP loopback")
+{
+    // declared before the threads, which close what is left over when they stop
+    ServiceOptions clientOptions;
+    clientOptions._mux = MuxRole::Client;
+    clientOptions._muxWindow = 16 * 1024;
+    ServiceContext clientService("mux-client-test", clientOptions);
+
+    ServiceOptions serverOptions;
+    serverOptions._mux = MuxRole::Server;
+    serverOptions._muxWindow = 16 * 1024;
+    serverOptions._muxMaxStreams = 3;
+    ServiceContext serverService("mux-server-test", serverOptions);
+
+    // the mux server's end of the tunnels
+    const int listenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    REQUIRE(listenFd >= 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addrLen = sizeof(addr);
+    REQUIRE(bind(listenFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0);
+    REQUIRE(listen(listenFd, 8) == 0);
+    REQUIRE(getsockname(listenFd, reinterpret_cast<sockaddr*>(&addr), &addrLen) == 0);
+
+    clientService._connect = [addr] {
+        const int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (fd < 0) return PendingSocket();
+        PendingSocket tunnel(fd);
+        const int result = connect(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr));
+        if (result == 0)
+            tunnel.onConnected();
+        else if (errno != EINPROGRESS)
+            return PendingSocket();
+        return tunnel;
+    };
+
+    Backends backends;
+    serverService._connect = [&backends] {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) != 0) return PendingSocket();
+        backends.add(fds[0]);
+        PendingSocket backend(fds[1]);
+        backend.onConnected();
+        return backend;
+    };
+
+    EpollPollerFactory pollerFactory(16);
+    IOThread clientThread(0, pollerFactory);
+    IOThread serverThread(1, pollerFactory);
+
+    const auto openClient = [&] {
+        int client[2];
+        addTestChannel(clientThread, clientService, client, nullptr);
+        return client[0];
+    };
+
+    GIVEN("Several clients of the mux client")
+    {
+        std::vector<int> clients;
+        for (int i = 0; i < 3; i++)
+        {
+            clients.push_back(openClient());
+        }
+
+        const int tunnelFd = acceptTunnel(listenFd);
+        REQUIRE(tunnelFd >= 0);
+        addTestChannel(serverThread, serverService, tunnelFd, -1);
+
+        THEN("They share one tunnel and each stream reaches its own backend connection")
+        {
+            REQUIRE(backends.wait(3));
+            REQUIRE(accept(listenFd, nullptr, nullptr) < 0);
+
+            for (size_t i = 0; i < clients.size(); i++)
+            {
+                const std::string request = "request " + std::to_string(i);
+                REQUIRE(write(clients[i], request.data(), request.size()) == static_cast<ssize_t>(request.size()));
+            }
+            for (size_t i = 0; i < clients.size(); i++)
+            {
+                const std::string request = "request " + std::to_string(i);
+                const std::string response = "response " + std::to_string(i);
+                REQUIRE(readSome(backends[i], request.size()) == request);
+                REQUIRE(write(backends[i], response.data(), response.size()) == static_cast<ssize_t>(response.size()));
+                REQUIRE(readSome(clients[i], response.size()) == response);
+            }
+        }
+
+        THEN("A transfer larger than the window arrives whole")
+        {
+            REQUIRE(backends.wait(3));
+            std::string payload(256 * 1024, '\0');
+            for (size_t i = 0; i < payload.size(); i++) payload[i] = static_cast<char>(i * 7);
+
+            // the backend writes as the client reads, the stream's window keeps the tunnel from buffering it all
+            std::string received;
+            size_t sent = 0;
+            char buf[16 * 1024];
+            for (int attempt = 0; attempt < 2000 && received.size() < payload.size(); attempt++)
+            {
+                if (sent < payload.size())
+                {
+                    const ssize_t n = write(backends[1], payload.data() + sent, payload.size() - sent);
+                    if (n > 0) sent += n;
+                }
+                const ssize_t n = read(clients[1], buf, sizeof(buf));
+                if (n > 0)
+                    received.append(buf, n);
+                else
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            REQUIRE(received == payload);
+        }
+
+        THEN("A stream beyond the server's limit is refused without a backend connection")
+        {
+            REQUIRE(backends.wait(3));
+            const Counter& refused = Metrics::instance->counter("service.mux-server-test.mux.refused");
+            const uint64_t refusedBefore = refused.value();
+
+            const int extra = openClient();
+            REQUIRE(waitForEof(extra));
+            close(extra);
+            REQUIRE(waitForChannels(clientService, 3));
+            REQUIRE(refused.value() == refusedBefore + 1);
+            REQUIRE(backends.size() == 3);
+            REQUIRE(serverService._bufferBudget.used() > 0);
+        }
+
+        THEN("Closing a client closes its backend connection and nothing else")
+        {
+            REQUIRE(backends.wait(3));
+            close(clients[0]);
+            clients[0] = -1;
+            REQUIRE(waitForEof(backends[0]));
+            REQUIRE(waitForChannels(clientService, 2));
+            REQUIRE(serverService._admission.channels() == 1);
+
+            const std::string request = "still there";
+            REQUIRE(write(clients[2], request.data(), request.size()) == static_cast<ssize_t>(request.size()));
+            REQUIRE(readSome(backends[2], request.size()) == request);
+        }
+
+        THEN("Closing a backend connection closes its client")
+        {
+            REQUIRE(backends.wait(3));
+            const std::string response = "bye";
+            REQUIRE(write(backends[2], response.data(), response.size()) == static_cast<ssize_t>(response.size()));
+            shutdown(backends[2], SHUT_WR);
+            REQUIRE(readSome(clients[2], response.size()) == response);
+            REQUIRE(waitForEof(clients[2]));
+            REQUIRE(waitForChannels(clientService, 2));
+        }
+
+        for (int fd : clients)
+        {
+            if (fd >= 0) close(fd);
+        }
+        REQUIRE(waitForChannels(clientService, 0));
+    }
+
+    close(listenFd);
+    backends.closeAll();
+}
@@ -0,0 +1,264 @@
+#include <epoll_poller.h>
+#include <iothread.h>
+#include <metrics.h>
+#include <placement.h>
+#include <service.h>
+
+#include "catch.hpp"
+#include "test_helpers.h"
+
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <netinet/in.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace vsockio;
+
+namespace
+{
+    struct NodeDir
+    {
+        NodeDir()
+        {
+            char path[] = "/tmp/vsock-test-node-XXXXXX";
+            _root = mkdtemp(path);
+        }
+
+        ~NodeDir()
+        {
+            for (const auto& node : _nodes)
+            {
+                unlink((_root + "/" + node + "/cpulist").c_str());
+                rmdir((_root + "/" + node).c_str());
+            }
+            rmdir(_root.c_str());
+        }
+
+        void add(const std::string& node, const std::string& cpulist)
+        {
+            mkdir((_root + "/" + node).c_str(), 0700);
+            std::ofstream(_root + "/" + node + "/cpulist") << cpulist << "\n";
+            _nodes.push_back(node);
+        }
+
+        std::string _root;
+        std::vector<std::string> _nodes;
+    };
+
+    uint64_t placed(const std::string& where)
+    {
+        return Metrics::instance->counter("dispatch.incoming_cpu." + where).value();
+    }
+
+    // Dispatches a channel whose client's packets arrive on cpu. The test's ends are closed right
+    // away, so the channel ends once relayed.
+    void dispatch(IOThreadPool& pool, ServiceContext& service, int cpu)
+    {
+        int client[2], backend[2];
+        addTestChannel(pool, service, client, backend, cpu);
+        close(client[0]);
+        close(backend[0]);
+    }
+
+    void waitForChannels(ServiceContext& service)
+    {
+        for (int attempt = 0; attempt < 200 && service._admission.channels() != 0; attempt++)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+    }
+}
+
+SCENARIO("CPU lists")
+{
+    THEN("Single CPUs, ranges and both mixed are accepted")
+    {
+        REQUIRE(parseCpuList("2") == std::vector<int>{2});
+        REQUIRE(parseCpuList("0-3") == std::vector<int>{0, 1, 2, 3});
+        REQUIRE(parseCpuList("0-1,6") == std::vector<int>{0, 1, 6});
+    }
+
+    THEN("Anything else is rejected")
+    {
+        REQUIRE(!parseCpuList(""));
+        REQUIRE(!parseCpuList("3-1"));
+        REQUIRE(!parseCpuList("1,x"));
+        REQUIRE(!parseCpuList("1-"));
+        REQUIRE(!parseCpuList("2k"));
+        REQUIRE(!parseCpuList("0-99999"));
+    }
+}
+
+SCENARIO("NUMA topology")
+{
+    NodeDir nodes;
+
+    GIVEN("Two nodes of two CPUs each")
+    {
+        nodes.add("node0", "0-1");
+        nodes.add("node1", "2-3");
+        const CpuTopology topology(nodes._root);
+
+        THEN("Each CPU maps to its node, others to none")
+        {
+            REQUIRE(topology.nodeOf(1) == 0);
+            REQUIRE(topology.nodeOf(2) == 1);
+            REQUIRE(topology.nodeOf(4) == -1);
+            REQUIRE(topology.nodeOf(-1) == -1);
+        }
+    }
+
+    GIVEN("No node directories")
+    {
+        const CpuTopology topology(nodes._root + "/missing");
+
+        THEN("No CPU has a node")
+        {
+            REQUIRE(topology.nodeOf(0) == -1);
+        }
+    }
+}
+
+SCENARIO("Incoming CPU of an accepted TCP connection")
+{
+    const int listenFd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    REQUIRE(bind(listenFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0);
+    socklen_t len = sizeof(addr);
+    REQUIRE(getsockname(listenFd, reinterpret_cast<sockaddr*>(&addr), &len) == 0);
+    REQUIRE(listen(listenFd, 1) == 0);
+
+    const int client = socket(AF_INET, SOCK_STREAM, 0);
+    REQUIRE(connect(client, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0);
+    const int accepted = accept(listenFd, nullptr, nullptr);
+    REQUIRE(accepted >= 0);
+
+    THEN("It is one of the machine's CPUs")
+    {
+        const int cpu = incomingCpu(accepted);
+        REQUIRE(cpu >= 0);
+        REQUIRE(cpu < CPU_SETSIZE);
+    }
+
+    close(accepted);
+    close(client);
+    close(listenFd);
+}
+
+SCENARIO("Placing channels by incoming CPU")
+{
+    EpollPollerFactory pollerFactory(16);
+    ServiceContext service("placement-test", ServiceOptions());
+    // both threads pinned to the one CPU every machine has
+    IOThreadPool pool(2, pollerFactory, {}, 50, {0}, 0, /*pinEach:*/ true);
+    for (int attempt = 0; attempt < 200 && (pool.thread(0).cpu() != 0 || pool.thread(1).cpu() != 0); attempt++)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    REQUIRE(pool.thread(0).cpu() == 0);
+    REQUIRE(pool.thread(1).cpu() == 0);
+
+    GIVEN("Clients whose packets arrive on the threads' CPU")
+    {
+        const uint64_t before = placed("same_cpu");
+        dispatch(pool, service, 0);
+        dispatch(pool, service, 0);
+
+        THEN("They are placed there")
+        {
+            REQUIRE(placed("same_cpu") == before + 2);
+        }
+    }
+
+    GIVEN("A client whose packets arrive on a CPU no thread runs on")
+    {
+        const uint64_t before = placed("other");
+        dispatch(pool, service, CPU_SETSIZE - 1);
+
+        THEN("It is placed as usual")
+        {
+            REQUIRE(placed("other") == before + 1);
+        }
+    }
+
+    GIVEN("A thread on the client's CPU with far more channels than the other")
+    {
+        std::vector<int> held;
+        for (int n = 0; n < 40; n++)
+        {
+            int client[2], backend[2];
+            addTestChannel(pool.thread(0), service, client, backend);
+            held.push_back(client[0]);
+            held.push_back(backend[0]);
+        }
+        // dispatches and the thread's own recount may briefly race, let the count settle
+        for (int attempt = 0; attempt < 200 && pool.thread(0).channelCount() != 40; attempt++)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+        REQUIRE(pool.thread(0).channelCount() == 40);
+
+        THEN("Its clients go to the other thread")
+        {
+            const uint64_t before = placed("same_cpu");
+            for (int n = 0; n < 4; n++)
+            {
+                dispatch(pool, service, 0);
+                REQUIRE(pool.thread(0).channelCount() == 40);
+            }
+            REQUIRE(placed("same_cpu") == before + 4);
+        }
+
+        for (int fd : held)
+        {
+            close(fd);
+        }
+    }
+
+    GIVEN("A client of unknown CPU")
+    {
+        const uint64_t before = placed("same_cpu") + placed("same_node") + placed("other");
+        dispatch(pool, service, -1);
+
+        THEN("Placement does not look at CPUs")
+        {
+            REQUIRE(placed("same_cpu") + placed("same_node") + placed("other") == before);
+        }
+    }
+
+    waitForChannels(service);
+}
+
+SCENARIO("Placing channels in a pool without pinned threads")
+{
+    EpollPollerFactory pollerFactory(16);
+    ServiceContext service("placement-test", ServiceOptions());
+    IOThreadPool pool(2, pollerFactory, {}, 60, {0});
+    for (int attempt = 0; attempt < 200 && (pool.thread(0).cpu() != 0 || pool.thread(1).cpu() != 0); attempt++)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+
+    GIVEN("A client whose packets arrive on the threads' CPU")
+    {
+        const uint64_t before = placed("same_cpu") + placed("same_node") + placed("other");
+        dispatch(pool, service, 0);
+
+        THEN("Placement does not look at CPUs, the threads may run anywhere in their set")
+        {
+            REQUIRE(placed("same_cpu") + placed("same_node") + placed("other") == before);
+        }
+    }
+
+    waitForChannels(service);
+}
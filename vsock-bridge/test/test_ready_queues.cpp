@@ -0,0 +1,156 @@
+#include <metrics.h>
+#include <ready_queues.h>
+
+#include "catch.hpp"
+
+#include <thread>
+#include <vector>
+
+using namespace vsockio;
+
+namespace
+{
+    struct Item
+    {
+        Item(int id, Priority priority) : _id(id), _priority(priority) {}
+
+        int _id;
+        Priority _priority;
+        std::chrono::steady_clock::time_point _readySince;
+    };
+}
+
+SCENARIO("ReadyQueues")
+{
+    const auto now = std::chrono::steady_clock::now();
+    Item low(1, Priority::Low);
+    Item normal(2, Priority::Normal);
+    Item high(3, Priority::High);
+    std::vector<int> served;
+
+    GIVEN("Items of every class")
+    {
+        ReadyQueues<Item> queues;
+        queues.push(&low, now);
+        queues.push(&normal, now);
+        queues.push(&high, now);
+
+        THEN("Higher classes are served first")
+        {
+            queues.serve([&](Item* item) { served.push_back(item->_id); return false; });
+            REQUIRE(served == std::vector<int>{3, 2, 1});
+            REQUIRE(queues.empty());
+        }
+
+        THEN("Items stay queued while serve returns true, once per pass")
+        {
+            queues.serve([&](Item* item) { served.push_back(item->_id); return item == &high; });
+            REQUIRE(served == std::vector<int>{3, 2, 1});
+            REQUIRE(queues.size(Priority::High) == 1);
+
+            queues.serve([&](Item* item) { served.push_back(item->_id); return false; });
+            REQUIRE(served == std::vector<int>{3, 2, 1, 3});
+            REQUIRE(queues.empty());
+        }
+
+        THEN("Queued items are not queued twice, and can be removed")
+        {
+            queues.push(&low, now);
+            REQUIRE(queues.size(Priority::Low) == 1);
+            queues.remove(&low);
+            REQUIRE(queues.size(Priority::Low) == 0);
+
+            queues.serve([&](Item* item) { served.push_back(item->_id); return false; });
+            REQUIRE(served == std::vector<int>{3, 2});
+        }
+    }
+
+    GIVEN("Slow low priority items on a thread that also has high priority channels")
+    {
+        ReadyQueues<Item> queues;
+        queues.onChannelAdded(Priority::High);
+        std::vector<Item> items;
+        for (int i = 0; i < 4; i++) items.emplace_back(10 + i, Priority::Low);
+        for (auto& item : items) queues.push(&item, now);
+
+        const auto slow = [&](Item* item) {
+            served.push_back(item->_id);
+            std::this_thread::sleep_for(ReadyQueues<Item>::LOWER_PRIORITY_SLICE * 2);
+            return false;
+        };
+
+        THEN("Each pass serves at least one but stops after the slice, in FIFO order")
+        {
+            queues.serve(slow);
+            REQUIRE(served == std::vector<int>{10});
+            queues.serve(slow);
+            REQUIRE(served == std::vector<int>{10, 11});
+            REQUIRE(queues.size(Priority::Low) == 2);
+        }
+
+        THEN("Without high priority channels there is no slice")
+        {
+            queues.onChannelRemoved(Priority::High);
+            queues.serve(slow);
+            REQUIRE(served.size() == 4);
+        }
+    }
+
+    GIVEN("Histograms for the ready wait")
+    {
+        Histogram highWait, normalWait, lowWait;
+        ReadyQueues<Item> queues({&highWait, &normalWait, &lowWait});
+        queues.push(&high, now - std::chrono::milliseconds(5));
+        queues.push(&low, now);
+
+        THEN("The time spent queued is recorded for the item's class")
+        {
+            queues.serve([](Item*) { return false; });
+            REQUIRE(highWait.count() == 1);
+            REQUIRE(highWait.max() >= 5000);
+            REQUIRE(normalWait.count() == 0);
+            REQUIRE(lowWait.count() == 1);
+        }
+    }
+}
+
+SCENARIO("Histogram")
+{
+    Histogram h;
+
+    GIVEN("No values")
+    {
+        THEN("Quantiles are 0")
+        {
+            REQUIRE(h.count() == 0);
+            REQUIRE(h.quantile(0.99) == 0);
+        }
+    }
+
+    GIVEN("Mostly small values and a few large ones")
+    {
+        for (int i = 0; i < 98; i++) h.record(3);
+        h.record(1000);
+        h.record(5000);
+
+        THEN("Quantiles report the upper bound of their power of two bucket, capped at the maximum")
+        {
+            REQUIRE(h.count() == 100);
+            REQUIRE(h.quantile(0.5) == 3);
+            REQUIRE(h.quantile(0.99) == 1023);
+            REQUIRE(h.quantile(1.0) == 5000);
+            REQUIRE(h.max() == 5000);
+        }
+    }
+
+    GIVEN("Zeros")
+    {
+        h.record(0);
+
+        THEN("They have a bucket of their own")
+        {
+            REQUIRE(h.quantile(0.5) == 0);
+            REQUIRE(h.count() == 1);
+        }
+    }
+}
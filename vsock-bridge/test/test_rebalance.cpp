@@ -0,0 +1,182 @@
+#include <epoll_poller.h>
+#include <iothread.h>
+#include <metrics.h>
+#include <rebalance.h>
+#include <service.h>
+
+#include "catch.hpp"
+#include "test_helpers.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace vsockio;
+
+namespace
+{
+    bool waitUntil(const std::function<bool()>& condition)
+    {
+        for (int attempt = 0; attempt < 400; attempt++)
+        {
+            if (condition()) return true;
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+        return false;
+    }
+
+    uint64_t migrated(size_t threadId, const std::string& direction)
+    {
+        return Metrics::instance->counter("iothread." + std::to_string(threadId) + ".migrated_" + direction).value();
+    }
+
+    // Runs everything posted to the thread so far.
+    void drainTasks(IOThread& thread)
+    {
+        std::promise<void> ran;
+        thread.post([&ran] { ran.set_value(); });
+        REQUIRE(ran.get_future().wait_for(std::chrono::seconds(1)) == std::future_status::ready);
+    }
+
+}
+
+SCENARIO("Moving channels between IO threads")
+{
+    EpollPollerFactory pollerFactory(16);
+
+    GIVEN("A channel streaming while it is moved back and forth")
+    {
+        IOThreadPool pool(2, pollerFactory, {}, 40);
+        ServiceContext service("rebalance-test", ServiceOptions());
+        int client[2], backend[2];
+        addTestChannel(pool.thread(0), service, client, backend);
+        fcntl(client[0], F_SETFL, 0);
+        fcntl(backend[0], F_SETFL, 0);
+
+        // a running counter, so any loss or reordering shows up in the bytes read
+        constexpr size_t TOTAL = 8 * 1024 * 1024;
+        std::atomic<bool> done{false};
+        std::thread writer([&] {
+            std::vector<uint8_t> chunk(4096);
+            size_t sent = 0;
+            while (sent < TOTAL)
+            {
+                for (size_t i = 0; i < chunk.size(); i++) chunk[i] = static_cast<uint8_t>((sent + i) % 251);
+                const ssize_t n = write(client[0], chunk.data(), std::min(chunk.size(), TOTAL - sent));
+                if (n <= 0) break;
+                sent += n;
+            }
+        });
+
+        size_t received = 0;
+        bool inOrder = true;
+        std::thread reader([&] {
+            std::vector<uint8_t> buf(16384);
+            while (received < TOTAL)
+            {
+                const ssize_t n = read(backend[0], buf.data(), buf.size());
+                if (n <= 0) break;
+                for (ssize_t i = 0; i < n; i++) inOrder = inOrder && buf[i] == (received + i) % 251;
+                received += n;
+            }
+            done = true;
+        });
+
+        THEN("Every byte arrives once and in order")
+        {
+            size_t at = 0;
+            int moves = 0;
+            while (!done)
+            {
+                // a channel holding buffered bytes stays put, so not every request moves it
+                const uint64_t movedOut = migrated(40 + at, "out");
+                pool.thread(at).offloadTo(pool.thread(1 - at), 1, 0, /*all:*/ true);
+                drainTasks(pool.thread(at));
+                if (migrated(40 + at, "out") != movedOut)
+                {
+                    at = 1 - at;
+                    moves++;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            writer.join();
+            reader.join();
+
+            REQUIRE(received == TOTAL);
+            REQUIRE(inOrder);
+            REQUIRE(moves > 0);
+            // the last move may still be on its way
+            REQUIRE(waitUntil([] { return migrated(40, "in") + migrated(41, "in") == migrated(40, "out") + migrated(41, "out"); }));
+        }
+
+        close(client[0]);
+        close(backend[0]);
+        REQUIRE(waitUntil([&] { return service._admission.channels() == 0; }));
+    }
+
+    GIVEN("A channel whose backend does not read")
+    {
+        IOThreadPool pool(2, pollerFactory, {}, 42);
+        ServiceContext service("rebalance-stuck-test", ServiceOptions());
+        int client[2], backend[2];
+        addTestChannel(pool.thread(0), service, client, backend);
+
+        // fill the backend's socket buffer until the channel has to hold on to the rest
+        std::vector<uint8_t> chunk(65536, 'x');
+        REQUIRE(waitUntil([&] {
+            write(client[0], chunk.data(), chunk.size());
+            pollfd pfd{client[0], POLLOUT, 0};
+            return ::poll(&pfd, 1, 10) == 0;
+        }));
+
+        THEN("It stays on its thread")
+        {
+            pool.thread(0).offloadTo(pool.thread(1), 1, 0, /*all:*/ true);
+            drainTasks(pool.thread(0));
+            REQUIRE(migrated(42, "out") == 0);
+        }
+
+        close(client[0]);
+        close(backend[0]);
+        REQUIRE(waitUntil([&] { return service._admission.channels() == 0; }));
+    }
+
+    GIVEN("A channel on a thread the pool has retired")
+    {
+        IOThreadPool pool(2, pollerFactory, {}, 44, {}, 2);
+        ServiceContext service("rebalance-retire-test", ServiceOptions());
+        Rebalancer rebalancer(pool);
+        int client[2], backend[2];
+        addTestChannel(pool.thread(1), service, client, backend);
+        char buf[4] = {};
+        // relayed once, so the channel is registered and holds no buffers
+        REQUIRE(write(client[0], "ping", 4) == 4);
+        REQUIRE(waitUntil([&] { return read(backend[0], buf, sizeof(buf)) == 4; }));
+        REQUIRE(pool.shrink());
+
+        THEN("The rebalancer hands the channel to an active thread and the retired one stops")
+        {
+            REQUIRE(rebalancer.sample(std::chrono::steady_clock::now()) == 1);
+            REQUIRE(waitUntil([&] { return !pool.thread(1).running(); }));
+            REQUIRE(migrated(44, "in") == 1);
+
+            REQUIRE(write(client[0], "pong", 4) == 4);
+            REQUIRE(waitUntil([&] { return read(backend[0], buf, sizeof(buf)) == 4; }));
+            REQUIRE(std::string(buf, 4) == "pong");
+        }
+
+        close(client[0]);
+        close(backend[0]);
+        REQUIRE(waitUntil([&] { return service._admission.channels() == 0; }));
+    }
+}
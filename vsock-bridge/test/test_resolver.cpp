@@ -0,0 +1,168 @@
+#include <endpoint.h>
+#include <listener.h>
+#include <resolver.h>
+
+#include "catch.hpp"
+
+#include <sys/poll.h>
+
+using namespace vsockio;
+
+static sockaddr_in makeAddress(const char* ip, uint16_t port)
+{
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, ip, &addr.sin_addr);
+    return addr;
+}
+
+static std::string ipOf(const std::pair<const sockaddr*, socklen_t>& addrAndLen)
+{
+    char buf[20];
+    inet_ntop(AF_INET, &reinterpret_cast<const sockaddr_in*>(addrAndLen.first)->sin_addr, buf, sizeof(buf));
+    return buf;
+}
+
+SCENARIO("Resolver with the system resolver")
+{
+    Resolver resolver;
+
+    GIVEN("A hostname from /etc/hosts")
+    {
+        TCP4HostnameEndpoint ep(resolver.track("localhost", 8080));
+
+        THEN("Endpoint is resolved to the loopback address")
+        {
+            REQUIRE(ep.resolved());
+            const auto addrAndLen = ep.getAddress();
+            REQUIRE(ipOf(addrAndLen) == "127.0.0.1");
+            REQUIRE(ntohs(reinterpret_cast<const sockaddr_in*>(addrAndLen.first)->sin_port) == 8080);
+            REQUIRE(ep.describe() == "tcp4://localhost:8080");
+        }
+    }
+
+    GIVEN("A hostname that does not resolve")
+    {
+        TCP4HostnameEndpoint ep(resolver.track("vsock-bridge-test.invalid", 8080));
+
+        THEN("Endpoint is not resolved")
+        {
+            REQUIRE(!ep.resolved());
+        }
+    }
+}
+
+SCENARIO("Resolver with a stub lookup")
+{
+    std::vector<const char*> answer{"10.0.0.1", "10.0.0.2"};
+    int lookups = 0;
+    Resolver resolver([&] (const std::string&, uint16_t port, Resolver::AddressList& result) {
+        ++lookups;
+        for (const char* ip : answer) result.push_back(makeAddress(ip, port));
+        return !answer.empty();
+    });
+
+    const auto start = Resolver::Clock::now();
+    auto entry = resolver.track("backend", 443, std::chrono::seconds(10));
+    TCP4HostnameEndpoint ep(entry);
+
+    GIVEN("A freshly tracked hostname")
+    {
+        THEN("Lookup happened once and connections rotate through all addresses")
+        {
+            REQUIRE(lookups == 1);
+            REQUIRE(ipOf(ep.getAddress()) == "10.0.0.1");
+            REQUIRE(ipOf(ep.getAddress()) == "10.0.0.1");
+            ep.nextAddress();
+            REQUIRE(ipOf(ep.getAddress()) == "10.0.0.2");
+            ep.nextAddress();
+            REQUIRE(ipOf(ep.getAddress()) == "10.0.0.1");
+        }
+    }
+
+    GIVEN("TTL has not expired")
+    {
+        resolver.refresh(start + std::chrono::seconds(5));
+
+        THEN("No new lookup is done")
+        {
+            REQUIRE(lookups == 1);
+        }
+    }
+
+    GIVEN("TTL has expired and the address set changed")
+    {
+        answer = {"10.0.0.3"};
+        const auto next = resolver.refresh(Resolver::Clock::now() + std::chrono::seconds(11));
+
+        THEN("New address set is used")
+        {
+            REQUIRE(lookups == 2);
+            REQUIRE(ipOf(ep.getAddress()) == "10.0.0.3");
+            REQUIRE(next > Resolver::Clock::now() + std::chrono::seconds(11));
+        }
+    }
+
+    GIVEN("TTL has expired and the lookup fails")
+    {
+        answer.clear();
+        const auto now = Resolver::Clock::now() + std::chrono::seconds(11);
+        const auto next = resolver.refresh(now);
+
+        THEN("Previous address set is kept and the lookup is retried early")
+        {
+            REQUIRE(lookups == 2);
+            REQUIRE(ep.resolved());
+            REQUIRE(ipOf(ep.getAddress()) == "10.0.0.1");
+            REQUIRE(next <= now + Resolver::MAX_RETRY_INTERVAL);
+        }
+    }
+}
+
+SCENARIO("Listener connecting to a hostname with several addresses")
+{
+    // a backend on all loopback addresses, which of them a connection went to is its local address
+    const int backendFd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in backendAddr = makeAddress("0.0.0.0", 0);
+    REQUIRE(bind(backendFd, reinterpret_cast<sockaddr*>(&backendAddr), sizeof(backendAddr)) == 0);
+    REQUIRE(listen(backendFd, 16) == 0);
+    socklen_t len = sizeof(backendAddr);
+    REQUIRE(getsockname(backendFd, reinterpret_cast<sockaddr*>(&backendAddr), &len) == 0);
+
+    Resolver resolver([] (const std::string&, uint16_t port, Resolver::AddressList& result) {
+        result.push_back(makeAddress("127.0.0.1", port));
+        result.push_back(makeAddress("127.0.0.2", port));
+        return true;
+    });
+    TCP4HostnameEndpoint ep(resolver.track("backend", ntohs(backendAddr.sin_port), std::chrono::seconds(10)));
+
+    GIVEN("Successive connections")
+    {
+        std::vector<std::string> targets;
+        for (int i = 0; i < 4; i++)
+        {
+            bool fdExhausted = false;
+            PendingSocket peer = Listener::connectTo(ep, fdExhausted);
+            REQUIRE(peer.fd() >= 0);
+
+            pollfd pfd{backendFd, POLLIN, 0};
+            REQUIRE(::poll(&pfd, 1, 1000) == 1);
+            const int accepted = accept(backendFd, nullptr, nullptr);
+            REQUIRE(accepted >= 0);
+            sockaddr_in local;
+            socklen_t localLen = sizeof(local);
+            REQUIRE(getsockname(accepted, reinterpret_cast<sockaddr*>(&local), &localLen) == 0);
+            targets.push_back(ipOf({reinterpret_cast<sockaddr*>(&local), localLen}));
+            close(accepted);
+        }
+
+        THEN("Each goes to the next address in turn")
+        {
+            REQUIRE(targets == std::vector<std::string>{"127.0.0.1", "127.0.0.2", "127.0.0.1", "127.0.0.2"});
+        }
+    }
+
+    close(backendFd);
+}
@@ -0,0 +1,90 @@
+#include <slab.h>
+
+#include "catch.hpp"
+
+#include <cstdint>
+#include <set>
+
+using namespace vsockio;
+
+namespace
+{
+    struct Tracked
+    {
+        static int alive;
+
+        explicit Tracked(int value) : _value(value) { ++alive; }
+        ~Tracked() { --alive; }
+
+        int _value;
+        char _padding[70];
+    };
+
+    int Tracked::alive = 0;
+}
+
+SCENARIO("Slab")
+{
+    Slab<Tracked> slab;
+    Tracked::alive = 0;
+
+    GIVEN("A new slab")
+    {
+        THEN("It holds no memory")
+        {
+            REQUIRE(slab.capacity() == 0);
+            REQUIRE(slab.inUse() == 0);
+        }
+    }
+
+    GIVEN("Objects are created")
+    {
+        auto* a = slab.create(1);
+        auto* b = slab.create(2);
+
+        THEN("They are constructed in cache line aligned, adjacent slots")
+        {
+            REQUIRE(a->_value == 1);
+            REQUIRE(b->_value == 2);
+            REQUIRE(Tracked::alive == 2);
+            REQUIRE(Slab<Tracked>::SLOT_SIZE == 128);
+            REQUIRE(reinterpret_cast<std::uintptr_t>(a) % Slab<Tracked>::CACHE_LINE == 0);
+            REQUIRE(reinterpret_cast<std::uint8_t*>(b) - reinterpret_cast<std::uint8_t*>(a) == Slab<Tracked>::SLOT_SIZE);
+            REQUIRE(slab.inUse() == 2);
+            REQUIRE(slab.capacity() == Slab<Tracked>::SLOTS_PER_CHUNK);
+        }
+
+        AND_WHEN("One is destroyed")
+        {
+            slab.destroy(a);
+
+            THEN("It is destructed and its slot is reused next")
+            {
+                REQUIRE(Tracked::alive == 1);
+                REQUIRE(slab.inUse() == 1);
+                REQUIRE(slab.create(3) == a);
+            }
+        }
+    }
+
+    GIVEN("More objects than fit in a chunk")
+    {
+        std::set<Tracked*> objects;
+        for (size_t i = 0; i <= Slab<Tracked>::SLOTS_PER_CHUNK; i++)
+        {
+            objects.insert(slab.create(static_cast<int>(i)));
+        }
+
+        THEN("Another chunk is added and every object has its own slot")
+        {
+            REQUIRE(objects.size() == Slab<Tracked>::SLOTS_PER_CHUNK + 1);
+            REQUIRE(slab.capacity() == 2 * Slab<Tracked>::SLOTS_PER_CHUNK);
+        }
+
+        for (auto* o : objects)
+        {
+            slab.destroy(o);
+        }
+        REQUIRE(Tracked::alive == 0);
+    }
+}
@@ -1,6 +1,18 @@
+#include <epoll_poller.h>
+#include <iothread.h>
 #include <threading.h>
 
 #include "catch.hpp"
+#include "test_helpers.h"
+
+#include <chrono>
+#include <functional>
+#include <future>
+#include <thread>
+
+#include <sched.h>
+#include <sys/socket.h>
+#include <unistd.h>
 
 using namespace vsockio;
 
@@ -57,3 +69,142 @@ SCENARIO("ThreadSafeQueue")
         }
     }
 }
+
+SCENARIO("IOThreadPool")
+{
+    EpollPollerFactory pollerFactory(16);
+
+    GIVEN("A pool that starts at a thread id and is pinned to CPU 0")
+    {
+        IOThreadPool pool(2, pollerFactory, {}, 5, {0});
+
+        THEN("Thread ids continue from the first id")
+        {
+            REQUIRE(pool.size() == 2);
+            REQUIRE(pool.thread(0).id() == 5);
+            REQUIRE(pool.thread(1).id() == 6);
+        }
+
+        THEN("Posted tasks run on threads that only use CPU 0")
+        {
+            for (size_t i = 0; i < pool.size(); i++)
+            {
+                std::promise<cpu_set_t> affinity;
+                pool.thread(i).post([&affinity] {
+                    cpu_set_t set;
+                    CPU_ZERO(&set);
+                    sched_getaffinity(0, sizeof(set), &set);
+                    affinity.set_value(set);
+                });
+
+                const cpu_set_t set = affinity.get_future().get();
+                REQUIRE(CPU_COUNT(&set) == 1);
+                REQUIRE(CPU_ISSET(0, &set));
+            }
+        }
+    }
+
+    GIVEN("A pool that may grow to three threads")
+    {
+        IOThreadPool pool(2, pollerFactory, {}, 20, {}, 3);
+        const auto waitUntil = [](const std::function<bool()>& condition) {
+            for (int attempt = 0; attempt < 200; attempt++)
+            {
+                if (condition()) return true;
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            }
+            return false;
+        };
+
+        THEN("It grows to its maximum and no further")
+        {
+            REQUIRE(pool.grow());
+            REQUIRE(pool.activeSize() == 3);
+            REQUIRE(pool.size() == 3);
+            REQUIRE(pool.thread(2).id() == 22);
+            REQUIRE(!pool.grow());
+        }
+
+        THEN("A retired thread relays its channel until it closes, then stops")
+        {
+            ServiceContext service("pool-shrink-test", ServiceOptions());
+            int client[2], backend[2];
+            addTestChannel(pool.thread(1), service, client, backend);
+
+            REQUIRE(pool.shrink());
+            REQUIRE(pool.activeSize() == 1);
+            REQUIRE(!pool.shrink());
+
+            REQUIRE(write(client[0], "ping", 4) == 4);
+            char buf[4] = {};
+            REQUIRE(waitUntil([&] { return read(backend[0], buf, sizeof(buf)) == 4; }));
+            REQUIRE(pool.thread(1).running());
+
+            close(client[0]);
+            close(backend[0]);
+            REQUIRE(waitUntil([&] { return !pool.thread(1).running(); }));
+
+            // growing again restarts the retired thread rather than adding one
+            REQUIRE(pool.grow());
+            REQUIRE(pool.size() == 2);
+            REQUIRE(pool.thread(1).running());
+            std::promise<void> ran;
+            pool.thread(1).post([&ran] { ran.set_value(); });
+            REQUIRE(ran.get_future().wait_for(std::chrono::seconds(1)) == std::future_status::ready);
+        }
+    }
+}
+
+SCENARIO("IOThread relaying throughput mode channels")
+{
+    EpollPollerFactory pollerFactory(16);
+    IOThread thread(0, pollerFactory);
+    ServiceOptions options;
+    options._coalesceWrites = true;
+
+    GIVEN("No coalescing delay")
+    {
+        ServiceContext service("coalesce-iteration-test", options);
+        int client[2], backend[2];
+        addTestChannel(thread, service, client, backend);
+
+        THEN("Each message is written at the end of the loop iteration that read it")
+        {
+            for (int round = 0; round < 3; round++)
+            {
+                REQUIRE(write(client[0], "ping", 4) == 4);
+                REQUIRE(readSome(backend[0], 4) == "ping");
+                REQUIRE(write(backend[0], "pong", 4) == 4);
+                REQUIRE(readSome(client[0], 4) == "pong");
+            }
+        }
+
+        close(client[0]);
+        close(backend[0]);
+        for (int attempt = 0; attempt < 200 && service._admission.channels() != 0; attempt++)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+    }
+
+    GIVEN("A coalescing delay")
+    {
+        options._coalesceDelay = std::chrono::milliseconds(2);
+        ServiceContext service("coalesce-delay-test", options);
+        int client[2], backend[2];
+        addTestChannel(thread, service, client, backend);
+
+        THEN("Messages arrive once the delay has passed, without further traffic")
+        {
+            REQUIRE(write(client[0], "ping", 4) == 4);
+            REQUIRE(readSome(backend[0], 4) == "ping");
+        }
+
+        close(client[0]);
+        close(backend[0]);
+        for (int attempt = 0; attempt < 200 && service._admission.channels() != 0; attempt++)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+    }
+}
@@ -0,0 +1,280 @@
+#include <epoll_poller.h>
+#include <iothread.h>
+#include <lz4.h>
+#include <transform.h>
+
+#include "catch.hpp"
+#include "test_helpers.h"
+
+#include <chrono>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace vsockio;
+
+namespace
+{
+    std::vector<uint8_t> jsonLike(size_t size)
+    {
+        std::vector<uint8_t> data;
+        for (int i = 0; data.size() < size; i++)
+        {
+            const std::string record = "{\"id\":" + std::to_string(i) + ",\"advertising_id\":\"A" + std::to_string(i * 7919 % 100000) + "\",\"status\":\"success\"},";
+            data.insert(data.end(), record.begin(), record.end());
+        }
+        data.resize(size);
+        return data;
+    }
+
+    std::vector<uint8_t> randomBytes(size_t size)
+    {
+        std::mt19937 rng(42);
+        std::vector<uint8_t> data(size);
+        for (auto& b : data) b = static_cast<uint8_t>(rng());
+        return data;
+    }
+
+    std::vector<uint8_t> roundTrip(const std::vector<uint8_t>& data)
+    {
+        std::vector<uint8_t> compressed(lz4::compressBound(data.size()));
+        compressed.resize(lz4::compress(data.data(), data.size(), compressed.data()));
+        std::vector<uint8_t> decompressed(lz4::MAX_BLOCK_SIZE);
+        const int n = lz4::decompress(compressed.data(), compressed.size(), decompressed.data(), decompressed.size());
+        decompressed.resize(n < 0 ? 0 : n);
+        return decompressed;
+    }
+
+    // Takes everything queued in the buffer.
+    void drain(Buffer& buffer, std::vector<uint8_t>& out)
+    {
+        iovec segments[2];
+        const int segmentCount = buffer.dataSegments(segments);
+        for (int i = 0; i < segmentCount; i++)
+        {
+            const auto* data = static_cast<const uint8_t*>(segments[i].iov_base);
+            out.insert(out.end(), data, data + segments[i].iov_len);
+        }
+        buffer.consume(buffer.remainingDataSize());
+    }
+
+    // Runs data through the transform in slices of the given sizes, with a small output buffer.
+    std::vector<uint8_t> transformAll(StreamTransform& transform, const std::vector<uint8_t>& data, size_t slice)
+    {
+        Buffer buffer(BufferLimits::fromBytes(4096, 4096));
+        REQUIRE(buffer.acquire() == Buffer::AcquireResult::Acquired);
+        std::vector<uint8_t> out;
+        for (size_t i = 0; i < data.size(); i += slice)
+        {
+            REQUIRE(transform.process(data.data() + i, std::min(slice, data.size() - i), buffer));
+            do
+            {
+                drain(buffer, out);
+            } while (!transform.drainTo(buffer));
+            drain(buffer, out);
+        }
+        return out;
+    }
+
+}
+
+SCENARIO("lz4 block codec")
+{
+    GIVEN("Blocks of different compressibility and size")
+    {
+        THEN("They decompress to what was compressed")
+        {
+            REQUIRE(roundTrip(jsonLike(lz4::MAX_BLOCK_SIZE)) == jsonLike(lz4::MAX_BLOCK_SIZE));
+            REQUIRE(roundTrip(randomBytes(lz4::MAX_BLOCK_SIZE)) == randomBytes(lz4::MAX_BLOCK_SIZE));
+            REQUIRE(roundTrip(std::vector<uint8_t>(lz4::MAX_BLOCK_SIZE, 'z')) == std::vector<uint8_t>(lz4::MAX_BLOCK_SIZE, 'z'));
+            for (size_t size = 1; size < 40; size++)
+            {
+                REQUIRE(roundTrip(jsonLike(size)) == jsonLike(size));
+            }
+        }
+
+        THEN("Repetitive data shrinks a lot")
+        {
+            const auto data = jsonLike(lz4::MAX_BLOCK_SIZE);
+            std::vector<uint8_t> compressed(lz4::compressBound(data.size()));
+            REQUIRE(lz4::compress(data.data(), data.size(), compressed.data()) < data.size() / 3);
+        }
+    }
+
+    GIVEN("Malformed blocks")
+    {
+        const auto data = jsonLike(1000);
+        std::vector<uint8_t> compressed(lz4::compressBound(data.size()));
+        compressed.resize(lz4::compress(data.data(), data.size(), compressed.data()));
+        std::vector<uint8_t> out(lz4::MAX_BLOCK_SIZE);
+
+        THEN("Truncated input, references before the start and output overflow are errors")
+        {
+            REQUIRE(lz4::decompress(compressed.data(), compressed.size() - 3, out.data(), out.size()) < 0);
+            const uint8_t badOffset[] = {0x10, 'a', 0x10, 0x00, 0x00};
+            REQUIRE(lz4::decompress(badOffset, sizeof(badOffset), out.data(), out.size()) < 0);
+            REQUIRE(lz4::decompress(compressed.data(), compressed.size(), out.data(), 999) < 0);
+        }
+    }
+}
+
+SCENARIO("Compressing stream transform")
+{
+    BlockCompressor compressor;
+    BlockDecompressor decompressor;
+
+    GIVEN("Compressible data in reads of various sizes")
+    {
+        const auto data = jsonLike(300 * 1024);
+
+        THEN("It is smaller on the wire and decompresses whatever way the wire splits it")
+        {
+            const auto wire = transformAll(compressor, data, StreamTransform::MAX_READ);
+            REQUIRE(wire.size() < data.size() / 3);
+            for (size_t slice : {1, 3, 4, 5, 1000, 70000})
+            {
+                BlockDecompressor other;
+                REQUIRE(transformAll(other, wire, slice) == data);
+            }
+        }
+    }
+
+    GIVEN("Incompressible data")
+    {
+        const auto data = randomBytes(200 * 1024);
+
+        THEN("It goes stored, with a header per block")
+        {
+            const auto wire = transformAll(compressor, data, 16 * 1024);
+            const size_t blocks = (data.size() + 16 * 1024 - 1) / (16 * 1024);
+            REQUIRE(wire.size() == data.size() + blocks * BlockCompressor::FRAME_HEADER_SIZE);
+            REQUIRE(transformAll(decompressor, wire, 777) == data);
+        }
+    }
+
+    GIVEN("A read of many highly compressed frames")
+    {
+        const std::vector<uint8_t> data(240 * StreamTransform::MAX_READ, 0);
+        const auto wire = transformAll(compressor, data, StreamTransform::MAX_READ);
+        REQUIRE(wire.size() <= StreamTransform::MAX_READ);
+
+        THEN("At most a block of output is held back, the rest is decoded as it drains")
+        {
+            Buffer buffer(BufferLimits::fromBytes(4096, 4096));
+            REQUIRE(buffer.acquire() == Buffer::AcquireResult::Acquired);
+            REQUIRE(decompressor.process(wire.data(), wire.size(), buffer));
+            REQUIRE(decompressor.pending());
+            REQUIRE(decompressor.pendingBytes() <= StreamTransform::MAX_READ);
+
+            std::vector<uint8_t> out;
+            do
+            {
+                drain(buffer, out);
+                REQUIRE(decompressor.pendingBytes() <= StreamTransform::MAX_READ);
+            } while (!decompressor.drainTo(buffer));
+            drain(buffer, out);
+            REQUIRE(out == data);
+        }
+    }
+
+    GIVEN("Input that is not a compressed stream")
+    {
+        Buffer buffer;
+        REQUIRE(buffer.acquire() == Buffer::AcquireResult::Acquired);
+        const uint8_t garbage[] = {'G', 'E', 'T', ' ', '/'};
+
+        THEN("It is rejected")
+        {
+            REQUIRE(!decompressor.process(garbage, sizeof(garbage), buffer));
+        }
+    }
+}
+
+SCENARIO("Compressing services back to back")
+{
+    // the first service compresses towards its backend, which is the second one's client
+    ServiceOptions compressing;
+    compressing._compress = CompressSide::Connect;
+    ServiceContext first("compress-test", compressing);
+    ServiceOptions decompressing;
+    decompressing._compress = CompressSide::Listen;
+    ServiceContext second("decompress-test", decompressing);
+
+    EpollPollerFactory pollerFactory(16);
+    IOThread thread(0, pollerFactory);
+
+    int client[2], link[2], backend[2];
+    REQUIRE(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, client) == 0);
+    REQUIRE(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, link) == 0);
+    REQUIRE(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, backend) == 0);
+    addTestChannel(thread, first, client[1], link[0]);
+    addTestChannel(thread, second, link[1], backend[1]);
+
+    GIVEN("A large request and response")
+    {
+        const auto request = jsonLike(512 * 1024);
+        const auto response = jsonLike(256 * 1024);
+
+        THEN("Both arrive unchanged and the link carries less than was relayed")
+        {
+            std::thread writer([&] {
+                for (size_t sent = 0; sent < request.size();)
+                {
+                    const ssize_t n = write(client[0], request.data() + sent, request.size() - sent);
+                    if (n > 0) sent += n;
+                    else std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                }
+            });
+            const std::string received = readSome(backend[0], request.size());
+            writer.join();
+            REQUIRE(received == std::string(request.begin(), request.end()));
+
+            for (size_t sent = 0; sent < response.size();)
+            {
+                const ssize_t n = write(backend[0], response.data() + sent, response.size() - sent);
+                if (n > 0) sent += n;
+                else std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            REQUIRE(readSome(client[0], response.size()) == std::string(response.begin(), response.end()));
+
+            REQUIRE(first._compression._compressIn.value() == request.size());
+            REQUIRE(first._compression._compressOut.value() < request.size() / 3);
+            REQUIRE(second._compression._decompressOut.value() == request.size());
+            REQUIRE(first._compression._decompressOut.value() == response.size());
+        }
+    }
+
+    GIVEN("The client closing right after sending")
+    {
+        const auto request = jsonLike(100 * 1024);
+        REQUIRE(write(client[0], request.data(), 64 * 1024) == 64 * 1024);
+        const std::string head = readSome(backend[0], 1);
+        size_t sent = 64 * 1024;
+        while (sent < request.size())
+        {
+            const ssize_t n = write(client[0], request.data() + sent, request.size() - sent);
+            if (n > 0) sent += n;
+        }
+        close(client[0]);
+        client[0] = -1;
+
+        THEN("Everything still reaches the backend before the channels close")
+        {
+            const std::string rest = readSome(backend[0], request.size() - head.size());
+            REQUIRE(head + rest == std::string(request.begin(), request.end()));
+        }
+    }
+
+    if (client[0] >= 0) close(client[0]);
+    close(backend[0]);
+    for (int attempt = 0; attempt < 200 && (first._admission.channels() != 0 || second._admission.channels() != 0); attempt++)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    REQUIRE(first._admission.channels() == 0);
+    REQUIRE(second._admission.channels() == 0);
+}